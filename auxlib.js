@@ -7,23 +7,14 @@
  */
 
 mergeInto(LibraryManager.library, {
-	jspn_callJSFunc: function jspn_callJSFunc(funcIndex, argc, argv) {
+	jspn_callJSFunc: function jspn_callJSFunc(funcIndex, argvIndex) {
 		var wrappedFunctions = Sparkling['_wrappedFunctions'];
 		var valueAtIndex = Sparkling['_valueAtIndex'];
 		var addJSValue = Sparkling['_addJSValue'];
-		var getIntFromArray = Sparkling['_getIntFromArray'];
 
 		var fn = wrappedFunctions[funcIndex];
-		var i, index;
+		var args = valueAtIndex(argvIndex); // the whole array in one go
 		var retVal;
-		var arg;
-		var args = [];
-
-		for (i = 0; i < argc; i++) {
-			index = getIntFromArray(argv, i);
-			arg = valueAtIndex(index);
-			args.push(arg);
-		}
 
 		retVal = fn.apply(undefined, args);
 		return addJSValue(retVal);
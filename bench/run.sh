@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# Runs the benchmarks and prints their results as tab-separated values,
+# one line per benchmark, preceded by a header line (see harness.spn).
+#
+# usage: bench/run.sh [benchmark...]
+#
+# The benchmarks are given by their names (e. g. "micro/calls"), all of
+# them are run by default. The number of warmup and timed runs can be set
+# through the WARMUP and RUNS environment variables, and the interpreter
+# through SPN. Each benchmark runs in a process of its own, and from the
+# root of the repository, so that they can refer to its files.
+
+WARMUP=${WARMUP:-2}
+RUNS=${RUNS:-5}
+
+cd "$(dirname "$0")/.."
+
+SPN=${SPN:-bld/spn}
+RESULTS=$(mktemp)
+
+if [ $# -eq 0 ]; then
+	set -- $(cd bench && ls micro/*.spn macro/*.spn | sed 's/\.spn$//')
+fi
+
+printf "benchmark\tops\truns\tmedian_s\tmin_s\tops_per_s\tallocs_per_op\tmb_per_s\n"
+
+STATUS=0
+
+for NAME in "$@"; do
+	: > "$RESULTS"
+
+	if "$SPN" bench/harness.spn "bench/$NAME.spn" "$NAME" "$WARMUP" "$RUNS" "$RESULTS" >/dev/null 2>&1; then
+		cat "$RESULTS"
+	else
+		echo "$NAME: failed" >&2
+		STATUS=1
+	fi
+done
+
+rm -f "$RESULTS"
+exit $STATUS
@@ -79,13 +79,14 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 		}
 
 		switch (opcode) {
-		case SPN_INS_CALL: {
+		case SPN_INS_CALL:
+		case SPN_INS_TAILCALL: {
 			int retv = OPA(ins);
 			int func = OPB(ins);
 			int argc = OPC(ins);
 			int i;
 
-			printf("call\tr%d = r%d(", retv, func);
+			printf("%s\tr%d = r%d(", opcode == SPN_INS_TAILCALL ? "tailcall" : "call", retv, func);
 
 			for (i = 0; i < argc; i++) {
 				if (i > 0) {
@@ -219,6 +220,23 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 			printf("concat\tr%d, r%d, r%d\n", opa, opb, opc);
 			break;
 		}
+		case SPN_INS_CONCAT_ALL: {
+			int opa = OPA(ins), n = OPB(ins);
+			int i;
+
+			printf("concat\tr%d", opa);
+
+			for (i = 0; i < n; i++) {
+				printf(", r%d", (int)(OPCODE(ip[i])));
+			}
+
+			printf("\n");
+
+			/* skip operand words */
+			ip += n;
+
+			break;
+		}
 		case SPN_INS_LDCONST: {
 			int dest = OPA(ins);
 			int type = OPB(ins);
@@ -267,6 +285,12 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 			printf("ld\tr%d, symbol %d\n", regidx, symidx);
 			break;
 		}
+		case SPN_INS_LDGLB: {
+			int regidx = OPA(ins);
+			int slotidx = OPMID(ins);
+			printf("ldglb\tr%d, slot[%d]\n", regidx, slotidx);
+			break;
+		}
 		case SPN_INS_MOV: {
 			int opa = OPA(ins), opb = OPB(ins);
 			printf("mov\tr%d, r%d\n", opa, opb);
@@ -409,20 +433,94 @@ static int disasm_exec(spn_uword *bc, size_t textlen)
 		}
 		case SPN_INS_METHOD: {
 			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
-			printf("method\tr%d, r%d, r%d\t# r%d = classes[r%d][r%d]\n",
-				opa, opb, opc, opa, opb, opc);
+			unsigned long cacheidx = *ip++;
+			printf("method\tr%d, r%d, r%d, cache[%lu]\t# r%d = classes[r%d][r%d]\n",
+				opa, opb, opc, cacheidx, opa, opb, opc);
+			break;
+		}
+		case SPN_INS_CALLMETHOD: {
+			/* the following call is dumped as a separate instruction */
+			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+			unsigned long cacheidx = *ip++;
+			printf("callmethod\tr%d, r%d, r%d, cache[%lu]\t# r%d = classes[r%d][r%d]\n",
+				opa, opb, opc, cacheidx, opa, opb, opc);
+			break;
+		}
+		case SPN_INS_CMPJZE:
+		case SPN_INS_CMPJNZ: {
+			/* same order as the comparison instructions */
+			static const char *const relnames[] = {
+				"eq",
+				"ne",
+				"lt",
+				"le",
+				"gt",
+				"ge"
+			};
+
+			spn_sword offset = *ip++;
+			unsigned long dstaddr = ip + offset - bc;
+			int relop = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+
+			printf("%s.%s\tr%d, r%d, %+" SPN_SWORD_FMT "\t# target: %#08lx\n",
+				opcode == SPN_INS_CMPJZE ? "cmpjze" : "cmpjnz",
+				relnames[relop - SPN_INS_EQ],
+				opb,
+				opc,
+				offset,
+				dstaddr
+			);
+
 			break;
 		}
 		case SPN_INS_PROPGET: {
 			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
-			printf("getprop\tr%d, r%d, r%d\t# r%d = getter(r%d, r%d)\n",
-				opa, opb, opc, opa, opb, opc);
+			unsigned long cacheidx = *ip++;
+			printf("getprop\tr%d, r%d, r%d, cache[%lu]\t# r%d = getter(r%d, r%d)\n",
+				opa, opb, opc, cacheidx, opa, opb, opc);
 			break;
 		}
 		case SPN_INS_PROPSET: {
 			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
-			printf("setprop\t%d, r%d, r%d\t# setter(r%d, r%d, r%d)\n",
-				opa, opb, opc, opa, opb, opc);
+			unsigned long cacheidx = *ip++;
+			printf("setprop\tr%d, r%d, r%d, cache[%lu]\t# setter(r%d, r%d, r%d)\n",
+				opa, opb, opc, cacheidx, opa, opb, opc);
+			break;
+		}
+		case SPN_INS_EQ_II:
+		case SPN_INS_NE_II:
+		case SPN_INS_LT_II:
+		case SPN_INS_LE_II:
+		case SPN_INS_GT_II:
+		case SPN_INS_GE_II:
+		case SPN_INS_ADD_II:
+		case SPN_INS_SUB_II:
+		case SPN_INS_MUL_II:
+		case SPN_INS_DIV_II: {
+			/* same order as the generic instructions, see above */
+			static const char *const opnames[] = {
+				"eq.ii",
+				"ne.ii",
+				"lt.ii",
+				"le.ii",
+				"gt.ii",
+				"ge.ii",
+				"add.ii",
+				"sub.ii",
+				"mul.ii",
+				"div.ii"
+			};
+
+			int opidx = opcode - SPN_INS_EQ_II;
+			int opa = OPA(ins), opb = OPB(ins), opc = OPC(ins);
+			printf("%s\tr%d, r%d, r%d\n", opnames[opidx], opa, opb, opc);
+
+			break;
+		}
+		case SPN_INS_INC_I:
+		case SPN_INS_DEC_I: {
+			int opa = OPA(ins);
+			printf("%s\tr%d\n", opcode == SPN_INS_INC_I ? "inc.i" : "dec.i", opa);
 			break;
 		}
 		default:
@@ -74,6 +74,343 @@ static SpnValue value_by_index(int index)
 	return spn_array_get(get_global_values(), index);
 }
 
+// Serialization
+//
+// Arrays and hashmaps are transferred in either direction as a single
+// buffer on the Emscripten heap, instead of crossing the FFI for every
+// element. The buffer is a pre-order encoding of the tree of values;
+// each value starts with a one-byte tag, followed by its payload.
+// Multi-byte quantities are little-endian (as is Emscripten), unaligned
+// unless noted otherwise:
+//
+//	SER_NIL, SER_FALSE, SER_TRUE    no payload
+//	SER_INT                         int32_t
+//	SER_FLOAT                       double
+//	SER_STRING                      uint32_t length, then UTF-8 bytes
+//	SER_ARRAY                       uint32_t count, then the elements
+//	SER_HASHMAP                     uint32_t count, then keys and values
+//	SER_NUMBERS                     uint32_t count, padding up to an
+//	                                offset divisible by 8, then doubles
+//	SER_INDEX                       int32_t referencing index of a value
+//	                                which isn't copied: a function or
+//	                                user info
+//
+// SER_NUMBERS encodes arrays of numbers, so that they can be copied as
+// a whole through a Float64Array view of the heap. Offsets are relative
+// to the beginning of the buffer, which is allocated by malloc() and is
+// thus aligned suitably for doubles. The constants are duplicated in
+// jsapi.js.
+enum {
+	SER_NIL,
+	SER_FALSE,
+	SER_TRUE,
+	SER_INT,
+	SER_FLOAT,
+	SER_STRING,
+	SER_ARRAY,
+	SER_HASHMAP,
+	SER_NUMBERS,
+	SER_INDEX
+};
+
+// the size of the chunks in which numbers are appended to an array
+#define NUMBER_CHUNK 256
+
+// the buffer of the last value serialized by jspn_serializeValueAtIndex()
+static unsigned char *ser_buf = NULL;
+static size_t ser_len = 0;
+static size_t ser_cap = 0;
+
+static void free_serialization_buffer(void)
+{
+	free(ser_buf);
+	ser_buf = NULL;
+	ser_len = 0;
+	ser_cap = 0;
+}
+
+static void ser_append(const void *bytes, size_t n)
+{
+	if (ser_len + n > ser_cap) {
+		while (ser_len + n > ser_cap) {
+			ser_cap = ser_cap ? 2 * ser_cap : 256;
+		}
+
+		ser_buf = spn_realloc(ser_buf, ser_cap);
+	}
+
+	memcpy(ser_buf + ser_len, bytes, n);
+	ser_len += n;
+}
+
+static void ser_tag(unsigned char tag)
+{
+	ser_append(&tag, sizeof tag);
+}
+
+static void ser_u32(size_t n)
+{
+	uint32_t u = n;
+	ser_append(&u, sizeof u);
+}
+
+static void ser_double(double x)
+{
+	ser_append(&x, sizeof x);
+}
+
+static int is_number_array(SpnArray *arr)
+{
+	size_t i, n = spn_array_count(arr);
+
+	for (i = 0; i < n; i++) {
+		SpnValue val = spn_array_get(arr, i);
+		if (!isnum(&val)) {
+			return 0;
+		}
+	}
+
+	return n > 0;
+}
+
+static double number_to_double(const SpnValue *val)
+{
+	return isfloat(val) ? floatvalue(val) : intvalue(val);
+}
+
+static void ser_value(const SpnValue *val)
+{
+	if (isnil(val)) {
+		ser_tag(SER_NIL);
+	} else if (isbool(val)) {
+		ser_tag(boolvalue(val) ? SER_TRUE : SER_FALSE);
+	} else if (isint(val) && intvalue(val) >= INT32_MIN && intvalue(val) <= INT32_MAX) {
+		int32_t i = intvalue(val);
+		ser_tag(SER_INT);
+		ser_append(&i, sizeof i);
+	} else if (isnum(val)) {
+		ser_tag(SER_FLOAT);
+		ser_double(number_to_double(val));
+	} else if (isstring(val)) {
+		SpnString *str = stringvalue(val);
+		ser_tag(SER_STRING);
+		ser_u32(str->len);
+		ser_append(str->cstr, str->len);
+	} else if (isarray(val) && is_number_array(arrayvalue(val))) {
+		static const unsigned char padding[8] = { 0 };
+		SpnArray *arr = arrayvalue(val);
+		size_t i, n = spn_array_count(arr);
+
+		ser_tag(SER_NUMBERS);
+		ser_u32(n);
+		ser_append(padding, (8 - ser_len % 8) % 8);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+			ser_double(number_to_double(&elem));
+		}
+	} else if (isarray(val)) {
+		SpnArray *arr = arrayvalue(val);
+		size_t i, n = spn_array_count(arr);
+
+		ser_tag(SER_ARRAY);
+		ser_u32(n);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+			ser_value(&elem);
+		}
+	} else if (ishashmap(val)) {
+		SpnHashMap *hm = hashmapvalue(val);
+		size_t cursor = 0;
+		SpnValue key, value;
+
+		ser_tag(SER_HASHMAP);
+		ser_u32(spn_hashmap_count(hm));
+
+		while ((cursor = spn_hashmap_next(hm, cursor, &key, &value)) != 0) {
+			ser_value(&key);
+			ser_value(&value);
+		}
+	} else {
+		int32_t index = add_to_values(*val);
+		ser_tag(SER_INDEX);
+		ser_append(&index, sizeof index);
+	}
+}
+
+// the reading end of a serialized buffer. Values are added to the
+// global value array as they are read; an error means a malformed buffer
+typedef struct SerReader {
+	const unsigned char *base;
+	const unsigned char *cursor;
+	const unsigned char *end;
+} SerReader;
+
+static int deser_read(SerReader *r, void *dst, size_t n)
+{
+	if ((size_t)(r->end - r->cursor) < n) {
+		return -1;
+	}
+
+	memcpy(dst, r->cursor, n);
+	r->cursor += n;
+	return 0;
+}
+
+static SpnValue number_value(double x)
+{
+	return floor(x) == x ? makeint(x) : makefloat(x);
+}
+
+// on success, '*val' is owned by the caller
+static int deser_value(SerReader *r, SpnValue *val)
+{
+	unsigned char tag;
+	uint32_t n, i;
+	int32_t i32;
+	double x;
+
+	if (deser_read(r, &tag, sizeof tag) != 0) {
+		return -1;
+	}
+
+	switch (tag) {
+	case SER_NIL:
+		*val = spn_nilval;
+		return 0;
+	case SER_FALSE:
+		*val = spn_falseval;
+		return 0;
+	case SER_TRUE:
+		*val = spn_trueval;
+		return 0;
+	case SER_INT:
+		if (deser_read(r, &i32, sizeof i32) != 0) {
+			return -1;
+		}
+
+		*val = makeint(i32);
+		return 0;
+	case SER_FLOAT:
+		if (deser_read(r, &x, sizeof x) != 0) {
+			return -1;
+		}
+
+		*val = number_value(x);
+		return 0;
+	case SER_STRING:
+		if (deser_read(r, &n, sizeof n) != 0 || (size_t)(r->end - r->cursor) < n) {
+			return -1;
+		}
+
+		*val = makestring_len((const char *)(r->cursor), n);
+		r->cursor += n;
+		return 0;
+	case SER_NUMBERS: {
+		SpnValue chunk[NUMBER_CHUNK];
+		size_t pad;
+		SpnArray *arr;
+
+		if (deser_read(r, &n, sizeof n) != 0) {
+			return -1;
+		}
+
+		pad = (8 - (r->cursor - r->base) % 8) % 8;
+
+		if ((size_t)(r->end - r->cursor) < pad + (size_t)(n) * sizeof x) {
+			return -1;
+		}
+
+		r->cursor += pad;
+		arr = spn_array_new();
+
+		for (i = 0; i < n; i += NUMBER_CHUNK) {
+			size_t j, k = n - i < NUMBER_CHUNK ? n - i : NUMBER_CHUNK;
+
+			for (j = 0; j < k; j++) {
+				deser_read(r, &x, sizeof x);
+				chunk[j] = number_value(x);
+			}
+
+			spn_array_append(arr, chunk, k);
+		}
+
+		*val = makeobject(SPN_TYPE_ARRAY, arr);
+		return 0;
+	}
+	case SER_ARRAY: {
+		SpnArray *arr;
+
+		if (deser_read(r, &n, sizeof n) != 0) {
+			return -1;
+		}
+
+		arr = spn_array_new();
+		*val = makeobject(SPN_TYPE_ARRAY, arr);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem;
+
+			if (deser_value(r, &elem) != 0) {
+				spn_value_release(val);
+				return -1;
+			}
+
+			spn_array_push(arr, &elem);
+			spn_value_release(&elem);
+		}
+
+		return 0;
+	}
+	case SER_HASHMAP: {
+		SpnHashMap *hm;
+
+		if (deser_read(r, &n, sizeof n) != 0) {
+			return -1;
+		}
+
+		hm = spn_hashmap_new();
+		*val = makeobject(SPN_TYPE_HASHMAP, hm);
+
+		for (i = 0; i < n; i++) {
+			SpnValue key, value;
+
+			if (deser_value(r, &key) != 0) {
+				spn_value_release(val);
+				return -1;
+			}
+
+			if (deser_value(r, &value) != 0) {
+				spn_value_release(&key);
+				spn_value_release(val);
+				return -1;
+			}
+
+			spn_hashmap_set(hm, &key, &value);
+			spn_value_release(&key);
+			spn_value_release(&value);
+		}
+
+		return 0;
+	}
+	case SER_INDEX:
+		if (deser_read(r, &i32, sizeof i32) != 0) {
+			return -1;
+		}
+
+		if (i32 < FIRST_VALUE_INDEX || i32 >= next_value_index) {
+			return -1;
+		}
+
+		*val = value_by_index(i32);
+		spn_value_retain(val);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
 // Various 'static' variables that only need to be created once for
 // performance reasons.
 // As they're owned by a particular context, they need to be re-created
@@ -94,6 +431,8 @@ extern void jspn_reset(void)
 
 	wrapperGenerator = NULL;
 	next_value_index = FIRST_VALUE_INDEX;
+
+	free_serialization_buffer();
 }
 
 extern void jspn_freeAll(void)
@@ -110,7 +449,7 @@ extern int jspn_compile(const char *src)
 		return ERROR_INDEX;
 	}
 
-	return add_to_values((SpnValue){ .type = SPN_TYPE_FUNC, .v.o = fn });
+	return add_to_values(makeobject(SPN_TYPE_FUNC, fn));
 }
 
 extern int jspn_compileExpr(const char *src)
@@ -120,7 +459,7 @@ extern int jspn_compileExpr(const char *src)
 		return ERROR_INDEX;
 	}
 
-	return add_to_values((SpnValue){ .type = SPN_TYPE_FUNC, .v.o = fn });
+	return add_to_values(makeobject(SPN_TYPE_FUNC, fn));
 }
 
 extern int jspn_parse(const char *src)
@@ -130,7 +469,7 @@ extern int jspn_parse(const char *src)
 		return ERROR_INDEX;
 	}
 
-	SpnValue val = { .type = SPN_TYPE_HASHMAP, .v.o = ast };
+	SpnValue val = makeobject(SPN_TYPE_HASHMAP, ast);
 	int index = add_to_values(val);
 	spn_object_release(ast);
 	return index;
@@ -143,7 +482,7 @@ extern int jspn_parseExpr(const char *src)
 		return ERROR_INDEX;
 	}
 
-	SpnValue val = { .type = SPN_TYPE_HASHMAP, .v.o = ast };
+	SpnValue val = makeobject(SPN_TYPE_HASHMAP, ast);
 	int index = add_to_values(val);
 	spn_object_release(ast);
 	return index;
@@ -160,14 +499,14 @@ extern int jspn_compileAST(int astIndex)
 		return ERROR_INDEX;
 	}
 
-	return add_to_values((SpnValue){ .type = SPN_TYPE_FUNC, .v.o = fn });
+	return add_to_values(makeobject(SPN_TYPE_FUNC, fn));
 }
 
 extern int jspn_call(int func_index, int argv_index)
 {
 	SpnValue func_val = value_by_index(func_index);
 	if (!isfunc(&func_val)) {
-		const void *args[] = { spn_type_name(func_val.type) };
+		const void *args[] = { spn_type_name(fulltype(&func_val)) };
 		spn_ctx_runtime_error(get_global_context(), "attempt to call value of non-function type %s", args);
 		return ERROR_INDEX;
 	}
@@ -292,49 +631,82 @@ extern int jspn_addBool(int b)
 
 extern int jspn_addNumber(double x)
 {
-	return add_to_values(floor(x) == x ? makeint(x) : makefloat(x));
+	return add_to_values(number_value(x));
 }
 
-extern int jspn_addString(const char *str)
+// The following functions copy a whole buffer from the Emscripten heap
+// in a single call: a UTF-8 string of the given length (which may thus
+// contain NUL bytes), or the contents of a Float64Array or an Int32Array,
+// which become a Sparkling array of numbers.
+extern int jspn_addStringWithLength(const char *buf, size_t len)
 {
-	SpnValue val = makestring(str);
+	SpnValue val = makestring_len(buf, len);
 	int index = add_to_values(val);
 	spn_value_release(&val);
 	return index;
 }
 
-extern int jspn_addArrayWithIndexBuffer(int32_t *indexBuffer, size_t n_objects)
+extern int jspn_addFloat64Array(const double *buf, size_t n)
 {
 	SpnArray *array = spn_array_new();
+	SpnValue chunk[NUMBER_CHUNK];
+
+	for (size_t i = 0; i < n; i += NUMBER_CHUNK) {
+		size_t k = n - i < NUMBER_CHUNK ? n - i : NUMBER_CHUNK;
+
+		for (size_t j = 0; j < k; j++) {
+			chunk[j] = number_value(buf[i + j]);
+		}
 
-	for (size_t i = 0; i < n_objects; i++) {
-		int32_t index = indexBuffer[i];
-		SpnValue val = value_by_index(index);
-		spn_array_push(array, &val);
+		spn_array_append(array, chunk, k);
 	}
 
-	int result_index = add_to_values((SpnValue){ .type = SPN_TYPE_ARRAY, .v.o = array });
+	int result_index = add_to_values(makeobject(SPN_TYPE_ARRAY, array));
 	spn_object_release(array);
 	return result_index;
 }
 
-extern int jspn_addDictionaryWithIndexBuffer(int32_t *indexBuffer, size_t n_key_val_pairs)
+extern int jspn_addInt32Array(const int32_t *buf, size_t n)
 {
-	SpnHashMap *dict = spn_hashmap_new();
+	SpnArray *array = spn_array_new();
+	SpnValue chunk[NUMBER_CHUNK];
+
+	for (size_t i = 0; i < n; i += NUMBER_CHUNK) {
+		size_t k = n - i < NUMBER_CHUNK ? n - i : NUMBER_CHUNK;
+
+		for (size_t j = 0; j < k; j++) {
+			chunk[j] = makeint(buf[i + j]);
+		}
 
-	for (size_t i = 0; i < n_key_val_pairs; i++) {
-		int32_t key_index = indexBuffer[2 * i + 0];
-		int32_t val_index = indexBuffer[2 * i + 1];
-		SpnValue key = value_by_index(key_index);
-		SpnValue val = value_by_index(val_index);
-		spn_hashmap_set(dict, &key, &val);
+		spn_array_append(array, chunk, k);
 	}
 
-	int result_index = add_to_values((SpnValue){ .type = SPN_TYPE_HASHMAP, .v.o = dict });
-	spn_object_release(dict);
+	int result_index = add_to_values(makeobject(SPN_TYPE_ARRAY, array));
+	spn_object_release(array);
 	return result_index;
 }
 
+// Deserializes a value (see "Serialization" above) of 'len' bytes.
+// Returns its referencing index, or ERROR_INDEX if the buffer is malformed.
+extern int jspn_addSerializedValue(const unsigned char *buf, size_t len)
+{
+	SerReader reader = { buf, buf, buf + len };
+	SpnValue val;
+
+	if (deser_value(&reader, &val) != 0) {
+		return ERROR_INDEX;
+	}
+
+	if (reader.cursor != reader.end) {
+		spn_value_release(&val);
+		return ERROR_INDEX;
+	}
+
+	int index = add_to_values(val);
+	spn_value_release(&val);
+	return index;
+}
+
 // Getters (Sparkling/C -> JavaScript)
 extern int jspn_typeAtIndex(int index)
 {
@@ -363,6 +735,25 @@ extern const char *jspn_getString(int index)
 	return stringvalue(&val)->cstr;
 }
 
+// Serializes the value at 'index' (see "Serialization" above). The buffer
+// is valid until the next call; jspn_serializedLength() returns its size.
+// Functions and user info values in the tree are added to the global
+// value array, and the buffer contains their referencing indices.
+extern const unsigned char *jspn_serializeValueAtIndex(int index)
+{
+	SpnValue val = value_by_index(index);
+
+	ser_len = 0;
+	ser_value(&val);
+
+	return ser_buf;
+}
+
+extern size_t jspn_serializedLength(void)
+{
+	return ser_len;
+}
+
 // This is a terrible, ugly hack that makes
 // security enthusiasts cry and vomit.
 extern int jspn_addWrapperFunction(int funcIndex)
@@ -372,8 +763,7 @@ extern int jspn_addWrapperFunction(int funcIndex)
 			get_global_context(),
 			"let funcIndex = $[0];"
 			"return fn {"
-			"	let args = $.map(jspn_valueToIndex);"
-			"	return jspn_callWrappedFunc(funcIndex, args);"
+			"	return jspn_callWrappedFunc(funcIndex, jspn_valueToIndex($));"
 			"};",
 			0 /* no need to debug this function */
 		);
@@ -400,24 +790,25 @@ extern int jspn_addWrapperFunction(int funcIndex)
 // Helpers for addWrapperFunction
 static int jspn_valueToIndex(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
 {
-	assert(argc >= 1); // usually 2 because 'map' passes in the index too
+	assert(argc == 1);
 	int index = add_to_values(argv[0]);
 	*ret = makeint(index);
 	return 0;
 }
 
-extern int jspn_callJSFunc(int funcIndex, size_t argc, SpnArray *argv);
+// the arguments are passed as the index of a single array,
+// which is converted to JavaScript in one go
+extern int jspn_callJSFunc(int funcIndex, int argvIndex);
 
 static int jspn_callWrappedFunc(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
 {
 	assert(argc == 2);
 	assert(isint(&argv[0]));
-	assert(isarray(&argv[1]));
+	assert(isint(&argv[1]));
 
 	int funcIndex = intvalue(&argv[0]);
-	SpnArray *argIndices = arrayvalue(&argv[1]);
-	size_t count = spn_array_count(argIndices);
-	int retValIndex = jspn_callJSFunc(funcIndex, count, argIndices);
+	int argvIndex = intvalue(&argv[1]);
+	int retValIndex = jspn_callJSFunc(funcIndex, argvIndex);
 	*ret = spn_array_get(get_global_values(), retValIndex);
 	spn_value_retain(ret);
 
@@ -456,13 +847,6 @@ static int jspn_jseval(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
 	return 0;
 }
 
-extern int jspn_getIntFromArray(SpnArray *array, int index)
-{
-	SpnValue val = spn_array_get(array, index);
-	assert(isint(&val));
-	return intvalue(&val);
-}
-
 // it is simpler and less error-prone to do the pointer
 // arithmetic in C... although I could technically
 // do this right from JavaScript, but this way it's
@@ -472,47 +856,3 @@ extern int jspn_addValueFromArgv(SpnValue argv[], int index)
 {
 	return add_to_values(argv[index]);
 }
-
-extern size_t jspn_countOfArrayAtIndex(int index)
-{
-	SpnValue val = value_by_index(index);
-	assert(isarray(&val));
-	return spn_array_count(arrayvalue(&val));
-}
-
-extern size_t jspn_countOfHashMapAtIndex(int index)
-{
-	SpnValue val = value_by_index(index);
-	assert(ishashmap(&val));
-	return spn_hashmap_count(hashmapvalue(&val));
-}
-
-extern void jspn_getValueIndicesOfArrayAtIndex(int index, int32_t *indexBuffer)
-{
-	SpnValue arrayval = value_by_index(index);
-	assert(isarray(&arrayval));
-
-	SpnArray *arr = arrayvalue(&arrayval);
-	size_t n = spn_array_count(arr);
-
-	for (size_t i = 0; i < n; i++) {
-		SpnValue val = spn_array_get(arr, i);
-		indexBuffer[i] = add_to_values(val);
-	}
-}
-
-extern void jspn_getKeyAndValueIndicesOfHashMapAtIndex(int index, int32_t *indexBuffer)
-{
-	SpnValue hmval = value_by_index(index);
-	assert(ishashmap(&hmval));
-
-	SpnHashMap *hm = hashmapvalue(&hmval);
-	size_t i = 0, cursor = 0;
-
-	SpnValue key, value;
-	while ((cursor = spn_hashmap_next(hm, cursor, &key, &value)) != 0) {
-		indexBuffer[i * 2 + 0] = add_to_values(key);
-		indexBuffer[i * 2 + 1] = add_to_values(value);
-		i++;
-	}
-}
@@ -52,74 +52,301 @@
 	var addNil = Module.cwrap('jspn_addNil', 'number', []);
 	var addBool = Module.cwrap('jspn_addBool', 'number', ['number']);
 	var addNumber = Module.cwrap('jspn_addNumber', 'number', ['number']);
-	var addString = Module.cwrap('jspn_addString', 'number', ['string']);
+	var addStringWithLength = Module.cwrap('jspn_addStringWithLength', 'number', ['number', 'number']);
+
+	// Strings are transferred as UTF-8, with an explicit length
+	var addString = function (val) {
+		var bytes = utf8Encode(val);
+		var buf = Module._malloc(bytes.length || 1);
+		var result;
+
+		Module.HEAPU8.set(bytes, buf);
+		result = addStringWithLength(buf, bytes.length);
+		Module._free(buf);
+		return result;
+	};
 
 	var addObject = function (val) {
 		// unfortunately, typeof null === 'object'...
 		if (val === null) {
 			return addNil();
-		} else if (val instanceof Array) {
-			return addArray(val);
 		} else if (val instanceof SparklingUserInfo) {
 			return addUserInfo(val);
+		} else if (ArrayBuffer.isView(val)) {
+			return addTypedArray(val);
 		} else {
-			return addDictionary(val);
+			return addStructured(val);
 		}
 	};
 
-	var addArray = function (val) {
-		var length = val.length;
-		var i;
-		var index;
-		var indexBuffer = Module._malloc(length * 4);
+	var addUserInfo = function (val) {
+		return val.index;
+	};
+
+	// Parameters: (const double *buf, size_t n) and (const int32_t *buf, size_t n)
+	var addFloat64Array = Module.cwrap('jspn_addFloat64Array', 'number', ['number', 'number']);
+	var addInt32Array = Module.cwrap('jspn_addInt32Array', 'number', ['number', 'number']);
+
+	// Typed arrays are copied into the heap in one go, then converted
+	// to an array of numbers by a single call. Float64Array and Int32Array
+	// are copied as-is, every other kind of view goes through Float64Array.
+	var addTypedArray = function (val) {
+		var isInt = val instanceof Int32Array;
+		var elemSize = isInt ? 4 : 8;
+		var buf = Module._malloc(val.length * elemSize || 1);
 		var result;
 
-		for (i = 0; i < length; i++) {
-			index = addJSValue(val[i]);
-			Module.setValue(indexBuffer + i * 4, index, 'i32');
+		if (isInt) {
+			Module.HEAP32.set(val, buf / 4);
+			result = addInt32Array(buf, val.length);
+		} else {
+			Module.HEAPF64.set(val instanceof Float64Array ? val : new Float64Array(val), buf / 8);
+			result = addFloat64Array(buf, val.length);
 		}
 
-		result = addArrayWithIndexBuffer(indexBuffer, length);
-		Module._free(indexBuffer);
+		Module._free(buf);
 		return result;
 	};
 
-	var addDictionary = function (val) {
-		var keys = Object.keys(val);
-		var length = keys.length;
+	// Parameters: (const unsigned char *buf, size_t length)
+	var addSerializedValue = Module.cwrap('jspn_addSerializedValue', 'number', ['number', 'number']);
+
+	// Arrays and objects are serialized into a single buffer, which is
+	// then copied into the heap and deserialized by a single call. The
+	// format is described in jsapi.c; these tags must match the ones there.
+	var SER_NIL     = 0,
+	    SER_FALSE   = 1,
+	    SER_TRUE    = 2,
+	    SER_INT     = 3,
+	    SER_FLOAT   = 4,
+	    SER_STRING  = 5,
+	    SER_ARRAY   = 6,
+	    SER_HASHMAP = 7,
+	    SER_NUMBERS = 8,
+	    SER_INDEX   = 9;
+
+	var addStructured = function (val) {
+		var writer = new SerWriter();
+		var buf, result;
+
+		writer.value(val);
+
+		buf = Module._malloc(writer.length || 1);
+		Module.HEAPU8.set(writer.bytes.subarray(0, writer.length), buf);
+		result = addSerializedValue(buf, writer.length);
+		Module._free(buf);
+
+		if (result < 0) {
+			throw "malformed serialized value";
+		}
+
+		return result;
+	};
+
+	function SerWriter() {
+		this.bytes = new Uint8Array(256);
+		this.view = new DataView(this.bytes.buffer);
+		this.length = 0;
+	}
+
+	SerWriter.prototype.reserve = function (n) {
+		var bytes;
+
+		if (this.length + n <= this.bytes.length) {
+			return;
+		}
+
+		bytes = new Uint8Array(Math.max(2 * this.bytes.length, this.length + n));
+		bytes.set(this.bytes.subarray(0, this.length));
+		this.bytes = bytes;
+		this.view = new DataView(bytes.buffer);
+	};
+
+	SerWriter.prototype.tag = function (tag) {
+		this.reserve(1);
+		this.bytes[this.length++] = tag;
+	};
+
+	SerWriter.prototype.u32 = function (n) {
+		this.reserve(4);
+		this.view.setUint32(this.length, n, true);
+		this.length += 4;
+	};
+
+	SerWriter.prototype.i32 = function (n) {
+		this.reserve(4);
+		this.view.setInt32(this.length, n, true);
+		this.length += 4;
+	};
+
+	SerWriter.prototype.f64 = function (x) {
+		this.reserve(8);
+		this.view.setFloat64(this.length, x, true);
+		this.length += 8;
+	};
+
+	SerWriter.prototype.string = function (str) {
+		var bytes = utf8Encode(str);
+
+		this.tag(SER_STRING);
+		this.u32(bytes.length);
+		this.reserve(bytes.length);
+		this.bytes.set(bytes, this.length);
+		this.length += bytes.length;
+	};
+
+	// 'val' is an array or a typed array of numbers
+	SerWriter.prototype.numbers = function (val) {
 		var i;
-		var key;
-		var keyIndex, valIndex;
-		var indexBuffer = Module._malloc(length * 2 * 4);
-		var result;
 
-		for (i = 0; i < length; i++) {
-			key = keys[i];
-			keyIndex = addJSValue(key);
-			valIndex = addJSValue(val[key]);
-			Module.setValue(indexBuffer + (2 * i + 0) * 4, keyIndex, 'i32');
-			Module.setValue(indexBuffer + (2 * i + 1) * 4, valIndex, 'i32');
+		this.tag(SER_NUMBERS);
+		this.u32(val.length);
+		this.reserve(7 + val.length * 8);
+		this.length += (8 - this.length % 8) % 8;
+
+		for (i = 0; i < val.length; i++) {
+			this.view.setFloat64(this.length, val[i], true);
+			this.length += 8;
 		}
+	};
 
-		result = addDictionaryWithIndexBuffer(indexBuffer, length);
-		Module._free(indexBuffer);
-		return result;
+	SerWriter.prototype.value = function (val) {
+		var i, keys;
+
+		switch (typeof val) {
+		case 'undefined':
+			this.tag(SER_NIL);
+			break;
+		case 'boolean':
+			this.tag(val ? SER_TRUE : SER_FALSE);
+			break;
+		case 'number':
+			if ((val | 0) === val) {
+				this.tag(SER_INT);
+				this.i32(val);
+			} else {
+				this.tag(SER_FLOAT);
+				this.f64(val);
+			}
+			break;
+		case 'string':
+			this.string(val);
+			break;
+		case 'function':
+			this.tag(SER_INDEX);
+			this.i32(addFunction(val));
+			break;
+		case 'object':
+			if (val === null) {
+				this.tag(SER_NIL);
+			} else if (val instanceof SparklingUserInfo) {
+				this.tag(SER_INDEX);
+				this.i32(val.index);
+			} else if (ArrayBuffer.isView(val)) {
+				this.numbers(val);
+			} else if (val instanceof Array) {
+				if (isNumberArray(val)) {
+					this.numbers(val);
+				} else {
+					this.tag(SER_ARRAY);
+					this.u32(val.length);
+
+					for (i = 0; i < val.length; i++) {
+						this.value(val[i]);
+					}
+				}
+			} else {
+				keys = Object.keys(val);
+				this.tag(SER_HASHMAP);
+				this.u32(keys.length);
+
+				for (i = 0; i < keys.length; i++) {
+					this.string(keys[i]);
+					this.value(val[keys[i]]);
+				}
+			}
+			break;
+		default:
+			throw "Unrecognized type: " + typeof val;
+		}
 	};
 
-	var addUserInfo = function (val) {
-		return val.index;
+	var isNumberArray = function (val) {
+		var i;
+
+		for (i = 0; i < val.length; i++) {
+			if (typeof val[i] !== 'number') {
+				return false;
+			}
+		}
+
+		return val.length > 0;
 	};
 
-	// Adds a native array that contains the object at the
-	// specified referencing indices, then returns the
-	// referencing index of the newly created array.
-	// Parameters: (int32_t *indexBuffer, size_t numberOfObjects)
-	var addArrayWithIndexBuffer = Module.cwrap('jspn_addArrayWithIndexBuffer', 'number', ['number', 'number']);
+	// UTF-8 conversion, natively where TextEncoder and TextDecoder exist
+	var textEncoder = typeof TextEncoder !== 'undefined' ? new TextEncoder() : null;
+	var textDecoder = typeof TextDecoder !== 'undefined' ? new TextDecoder('utf-8') : null;
+
+	var utf8Encode = function (str) {
+		var bytes = [];
+		var i, c;
+
+		if (textEncoder) {
+			return textEncoder.encode(str);
+		}
 
-	// Similar to addArrayWithIndexBuffer, but also adds the keys
-	// and constructs a dictionary instead of an array.
-	// Parameters: (int32_t *indexBuffer, size_t numberOfKeyValuePairs)
-	var addDictionaryWithIndexBuffer = Module.cwrap('jspn_addDictionaryWithIndexBuffer', 'number', ['number', 'number']);
+		for (i = 0; i < str.length; i++) {
+			c = str.charCodeAt(i);
+
+			// combine surrogate pairs
+			if (c >= 0xd800 && c < 0xdc00 && i + 1 < str.length) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (str.charCodeAt(++i) - 0xdc00);
+			}
+
+			if (c < 0x80) {
+				bytes.push(c);
+			} else if (c < 0x800) {
+				bytes.push(0xc0 | c >> 6, 0x80 | c & 0x3f);
+			} else if (c < 0x10000) {
+				bytes.push(0xe0 | c >> 12, 0x80 | c >> 6 & 0x3f, 0x80 | c & 0x3f);
+			} else {
+				bytes.push(0xf0 | c >> 18, 0x80 | c >> 12 & 0x3f, 0x80 | c >> 6 & 0x3f, 0x80 | c & 0x3f);
+			}
+		}
+
+		return new Uint8Array(bytes);
+	};
+
+	// 'bytes' is a Uint8Array
+	var utf8Decode = function (bytes) {
+		var str = '';
+		var i = 0, c;
+
+		if (textDecoder) {
+			return textDecoder.decode(bytes);
+		}
+
+		while (i < bytes.length) {
+			c = bytes[i++];
+
+			if (c >= 0xf0) {
+				c = (c & 0x07) << 18 | (bytes[i++] & 0x3f) << 12 | (bytes[i++] & 0x3f) << 6 | bytes[i++] & 0x3f;
+			} else if (c >= 0xe0) {
+				c = (c & 0x0f) << 12 | (bytes[i++] & 0x3f) << 6 | bytes[i++] & 0x3f;
+			} else if (c >= 0xc0) {
+				c = (c & 0x1f) << 6 | bytes[i++] & 0x3f;
+			}
+
+			if (c >= 0x10000) {
+				c -= 0x10000;
+				str += String.fromCharCode(0xd800 + (c >> 10), 0xdc00 + (c & 0x3ff));
+			} else {
+				str += String.fromCharCode(c);
+			}
+		}
+
+		return str;
+	};
 
 	// this belongs to addFunction
 	var wrappedFunctions = [];
@@ -164,8 +391,8 @@
 			getBool,
 			getNumber,
 			getString,
-			getArray,
-			getHashmap,
+			getStructured,
+			getStructured,
 			getFunction,
 			getUserInfo
 		];
@@ -205,64 +432,94 @@
 		return new SparklingUserInfo(index);
 	};
 
-	var getArray = function (index) {
-		var i;
-		var values = [];
-		var length = countOfArrayAtIndex(index);
-		var indexBuffer = Module._malloc(length * 4);
-
-		getValueIndicesOfArrayAtIndex(index, indexBuffer);
-
-		for (i = 0; i < length; i++) {
-			valueIndex = Module.getValue(indexBuffer + i * 4, 'i32');
-			values[i] = valueAtIndex(valueIndex);
-		}
-
-		Module._free(indexBuffer);
+	// Parameter: (int index); returns a pointer to the serialized value,
+	// of which the length is returned by serializedLength()
+	var serializeValueAtIndex = Module.cwrap('jspn_serializeValueAtIndex', 'number', ['number']);
+	var serializedLength = Module.cwrap('jspn_serializedLength', 'number', []);
+
+	// Converts an array or a hashmap, serialized by a single call,
+	// so that the FFI isn't crossed for each element. (See addStructured.)
+	var getStructured = function (index) {
+		var ptr = serializeValueAtIndex(index);
+		var reader = {
+			heap: Module.HEAPU8,
+			view: new DataView(Module.HEAPU8.buffer),
+			base: ptr,
+			pos: ptr,
+			end: ptr + serializedLength()
+		};
 
-		return values;
+		return readSerialized(reader);
 	};
 
-	var getHashmap = function (index) {
-		var i;
-		var keyIndex, valueIndex, key, value;
-		var object = {};
-		var length = countOfHashMapAtIndex(index);
-		var indexBuffer = Module._malloc(length * 2 * 4);
+	var readSerialized = function (r) {
+		var tag = r.heap[r.pos++];
+		var n, i, key, result;
+
+		switch (tag) {
+		case SER_NIL:
+			return undefined;
+		case SER_FALSE:
+			return false;
+		case SER_TRUE:
+			return true;
+		case SER_INT:
+			r.pos += 4;
+			return r.view.getInt32(r.pos - 4, true);
+		case SER_FLOAT:
+			r.pos += 8;
+			return r.view.getFloat64(r.pos - 8, true);
+		case SER_STRING:
+			n = r.view.getUint32(r.pos, true);
+			r.pos += 4 + n;
+			return utf8Decode(r.heap.subarray(r.pos - n, r.pos));
+		case SER_NUMBERS:
+			n = r.view.getUint32(r.pos, true);
+			r.pos += 4;
+			r.pos += (8 - (r.pos - r.base) % 8) % 8;
+			result = Array.prototype.slice.call(new Float64Array(r.heap.buffer, r.pos, n));
+			r.pos += n * 8;
+			return result;
+		case SER_ARRAY:
+			n = r.view.getUint32(r.pos, true);
+			r.pos += 4;
+			result = [];
+
+			for (i = 0; i < n; i++) {
+				result.push(readSerialized(r));
+			}
 
-		getKeyAndValueIndicesOfHashMapAtIndex(index, indexBuffer);
+			return result;
+		case SER_HASHMAP:
+			n = r.view.getUint32(r.pos, true);
+			r.pos += 4;
+			result = {};
 
-		for (i = 0; i < length; i++) {
-			keyIndex = Module.getValue(indexBuffer + (2 * i + 0) * 4, 'i32');
-			key = valueAtIndex(keyIndex);
+			for (i = 0; i < n; i++) {
+				key = readSerialized(r);
 
-			valueIndex = Module.getValue(indexBuffer + (2 * i + 1) * 4, 'i32');
-			value = valueAtIndex(valueIndex);
+				if (typeof key !== 'string') {
+					throw "keys must be strings";
+				}
 
-			if (typeof key !== 'string') {
-				Module._free(indexBuffer);
-				throw "keys must be strings";
+				result[key] = readSerialized(r);
 			}
 
-			object[key] = value;
+			return result;
+		case SER_INDEX:
+			r.pos += 4;
+			return valueAtIndex(r.view.getInt32(r.pos - 4, true));
+		default:
+			throw "unknown serialization tag";
 		}
-
-		Module._free(indexBuffer);
-
-		return object;
 	};
 
-	var countOfArrayAtIndex = Module.cwrap('jspn_countOfArrayAtIndex', 'number', ['number']);
-	var countOfHashMapAtIndex = Module.cwrap('jspn_countOfHashMapAtIndex', 'number', ['number']);
-	var getValueIndicesOfArrayAtIndex = Module.cwrap('jspn_getValueIndicesOfArrayAtIndex', null, ['number', 'number']);
-	var getKeyAndValueIndicesOfHashMapAtIndex = Module.cwrap('jspn_getKeyAndValueIndicesOfHashMapAtIndex', null, ['number', 'number']);
-
 	var getFunction = function (fnIndex) {
 		// XXX: should we check if the value at given index is really a function?
 
 		var result = function () {
 			var argv = Array.prototype.slice.apply(arguments);
-			var argvIndex = addArray(argv); // returns the index of an SpnValue<SpnArray>
+			var argvIndex = addStructured(argv); // returns the index of an SpnValue<SpnArray>
 			var retIndex = call(fnIndex, argvIndex);
 
 			if (retIndex < 0) {
@@ -277,10 +534,6 @@
 		return result;
 	};
 
-	// Takes a pointer to SpnArray and an integer index,
-	// Returns the integer value of the array's element at that index.
-	var getIntFromArray = Module.cwrap('jspn_getIntFromArray', 'number', ['number', 'number']);
-
 	var backtrace = Module.cwrap('jspn_backtrace', 'string', []);
 
 	var lastErrorLine = Module.cwrap('jspn_lastErrorLine', 'number', []);
@@ -292,7 +545,6 @@
 		_wrappedFunctions: wrappedFunctions,
 		_valueAtIndex: valueAtIndex,
 		_addJSValue: addJSValue,
-		_getIntFromArray: getIntFromArray,
 
 		// Public API
 		compile: function (src) {
@@ -307,16 +559,16 @@
 
 		parse: function (src) {
 			var astIndex = parse(src);
-			return astIndex < 0 ? undefined : getHashmap(astIndex);
+			return astIndex < 0 ? undefined : getStructured(astIndex);
 		},
 
 		parseExpr: function (src) {
 			var astIndex = parseExpr(src);
-			return astIndex < 0 ? undefined : getHashmap(astIndex);
+			return astIndex < 0 ? undefined : getStructured(astIndex);
 		},
 
 		compileAST: function (ast) {
-			var astIndex = addDictionary(ast);
+			var astIndex = addStructured(ast);
 			var fnIndex = compileAST(astIndex);
 			return fnIndex < 0 ? undefined : getFunction(fnIndex);
 		},
@@ -0,0 +1,123 @@
+/*
+ * mkstdlib.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Build-time tool which compiles the modules of the script standard
+ * library and prints them as C arrays of object data, to be embedded
+ * into the library (see spn_ctx_load_script_stdlib()).
+ *
+ * Usage: mkstdlib module.spn... > stdmodules_bc.inc
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "api.h"
+#include "parser.h"
+#include "compiler.h"
+#include "func.h"
+
+
+#define BYTES_PER_LINE 12
+
+static const char *basename_of(const char *path)
+{
+	const char *slashp = strrchr(path, '/');
+	return slashp != NULL ? slashp + 1 : path;
+}
+
+static void print_bytes(const unsigned char *bytes, size_t n, size_t *col)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (*col % BYTES_PER_LINE == 0) {
+			printf("\n\t");
+		} else {
+			printf(" ");
+		}
+
+		printf("0x%02x,", bytes[i]);
+		++*col;
+	}
+}
+
+/* prints the object data of the module as 'stdmod_<idx>' */
+static int print_module(SpnParser *parser, SpnCompiler *cmp, const char *fname, int idx)
+{
+	unsigned char hdr[SPN_OBJHDR_LEN];
+	SpnAst *ast;
+	SpnFunction *fn;
+	size_t col = 0;
+
+	char *src = spn_read_text_file(fname);
+	if (src == NULL) {
+		fprintf(stderr, "mkstdlib: can't read '%s'\n", fname);
+		return -1;
+	}
+
+	ast = spn_parser_parse_ast(parser, src);
+	free(src);
+
+	if (ast == NULL) {
+		fprintf(stderr, "mkstdlib: %s: %s\n", fname, parser->errmsg);
+		return -1;
+	}
+
+	/* debug info can't be embedded, since it isn't part of the bytecode */
+	fn = spn_compiler_compile_ast(cmp, ast, 0);
+
+	if (fn == NULL) {
+		fprintf(stderr, "mkstdlib: %s: %s\n", fname, spn_compiler_errmsg(cmp));
+		return -1;
+	}
+
+	spn_objhdr_init(hdr);
+
+	printf("/* %s */\n", basename_of(fname));
+	printf("static const unsigned char stdmod_%d[] = {", idx);
+	print_bytes(hdr, sizeof hdr, &col);
+	print_bytes((const unsigned char *)(fn->repr.bc), fn->nwords * sizeof(spn_uword), &col);
+	printf("\n};\n\n");
+
+	spn_object_release(fn);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int status = EXIT_SUCCESS;
+	SpnParser parser;
+	SpnCompiler *cmp;
+	int i;
+
+	spn_parser_init(&parser);
+	cmp = spn_compiler_new();
+
+	printf("/* generated by mkstdlib, do not edit */\n\n");
+
+	for (i = 1; i < argc; i++) {
+		if (print_module(&parser, cmp, argv[i], i - 1) != 0) {
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	if (status == EXIT_SUCCESS) {
+		printf("static const StdModule stdmodules[] = {\n");
+
+		for (i = 1; i < argc; i++) {
+			printf("\t{ \"%s\", stdmod_%d, sizeof stdmod_%d },\n", basename_of(argv[i]), i - 1, i - 1);
+		}
+
+		printf("};\n");
+	}
+
+	spn_compiler_free(cmp);
+	spn_parser_free(&parser);
+
+	return status;
+}
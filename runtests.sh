@@ -44,6 +44,72 @@ function test_invalid {
 	}
 }
 
+# an invalid test may list lines of its expected error output (e. g. frames
+# of the stack trace), each one in a comment starting with '#> '; every one
+# of them must appear in the output, with the colors stripped
+function test_error_output {
+	PROGRAM=$1
+	FILE=$2
+
+	printf "Checking the errors of %s... " $FILE
+
+	OUTPUT=$($PROGRAM $FILE 2>&1 1>/dev/null | sed 's/\x1b\[[0-9;]*m//g')
+
+	while IFS= read -r LINE; do
+		case "$OUTPUT" in
+		*"$LINE"*)
+			;;
+		*)
+			echo "${CLR_ERR}missing from the error output: $LINE$CLR_RST"
+			FAILED=$((FAILED+1))
+			return
+			;;
+		esac
+	done <<< "$(sed -n 's/^#> //p' $FILE)"
+
+	echo "OK"
+	PASSED=$((PASSED+1))
+}
+
+# compiles a valid test to an object file, then runs the object file
+function test_valid_objfile {
+	FILE=$1
+	OBJFILE="${FILE%.*}.spo"
+
+	printf "Testing %s... " $OBJFILE
+
+	$WORKDIR/bld/spn --compile $FILE 1>/dev/null 2>/dev/null &&
+	$WORKDIR/bld/spn $OBJFILE 2>/dev/null 1>/dev/null && {
+		echo "OK"
+		PASSED=$((PASSED+1))
+	} || {
+		echo "${CLR_ERR}unexpectedly rejected valid input$CLR_RST";
+		FAILED=$((FAILED+1))
+	}
+
+	rm -f $OBJFILE
+}
+
+# runs a valid test under the profiler, which must write the sampled stacks
+function test_valid_profiled {
+	FILE=$1
+
+	printf "Profiling %s... " $FILE
+
+	rm -f sparkling.folded
+
+	$WORKDIR/bld/spn --profile $FILE 2>/dev/null 1>/dev/null &&
+	test -f sparkling.folded && {
+		echo "OK"
+		PASSED=$((PASSED+1))
+	} || {
+		echo "${CLR_ERR}failed under the profiler$CLR_RST";
+		FAILED=$((FAILED+1))
+	}
+
+	rm -f sparkling.folded
+}
+
 function run_tests_in_directory {
 	TESTDIR=$1
 	SPARKLING=$2
@@ -54,6 +120,10 @@ function run_tests_in_directory {
 
 	for f in $TESTDIR/f_*; do
 		test_invalid "$SPARKLING" "$f";
+
+		if grep -q '^#> ' "$f"; then
+			test_error_output "$SPARKLING" "$f";
+		fi
 	done
 }
 
@@ -72,7 +142,20 @@ run_tests_in_directory parser "$WORKDIR/bld/spn --dump-ast";
 # run_tests_in_directory compiler "$WORKDIR/bld/spn --compile";
 
 # Run unit tests for VM/runtime
-# run_tests_in_directory runtime "$WORKDIR/bld/spn";
+run_tests_in_directory runtime "$WORKDIR/bld/spn";
+
+# Run them again without optimizations
+run_tests_in_directory runtime "$WORKDIR/bld/spn --unoptimized";
+
+# Run them from precompiled object files too
+for f in runtime/p_*.spn; do
+	test_valid_objfile "$f";
+done
+
+# Run them with all the profiler hooks enabled
+for f in runtime/p_*.spn; do
+	test_valid_profiled "$f";
+done
 
 # Run unit tests for library functions
 # run_tests_in_directory stdlib "$WORKDIR/bld/spn";
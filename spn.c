@@ -38,7 +38,7 @@
 #include "dump.h"
 
 #define N_CMDS     6
-#define N_FLAGS    2
+#define N_FLAGS    4
 #define N_ARGS    (N_CMDS + N_FLAGS)
 
 #define CMDS_MASK  0x00ff
@@ -57,9 +57,14 @@ enum cmd_args {
 	CMD_DUMPAST   = 1 << 5,
 
 	FLAG_PRINTNIL = 1 << 8,
-	FLAG_PRINTRET = 1 << 9
+	FLAG_PRINTRET = 1 << 9,
+	FLAG_NOOPT    = 1 << 10,
+	FLAG_PROFILE  = 1 << 11
 };
 
+/* where 'spn --profile' writes the sampled stacks */
+#define PROFILE_OUTPUT "sparkling.folded"
+
 /* 'pos' is the index of the first non-option */
 static enum cmd_args process_args(int argc, char *argv[], int *pos)
 {
@@ -75,7 +80,9 @@ static enum cmd_args process_args(int argc, char *argv[], int *pos)
 		{ "-d", "--disasm",    CMD_DISASM    },
 		{ "-a", "--dump-ast",  CMD_DUMPAST   },
 		{ "-n", "--print-nil", FLAG_PRINTNIL },
-		{ "-t", "--print-ret", FLAG_PRINTRET }
+		{ "-t", "--print-ret", FLAG_PRINTRET },
+		{ "-u", "--unoptimized", FLAG_NOOPT  },
+		{ "-p", "--profile",   FLAG_PROFILE  }
 	};
 
 	enum cmd_args opts = 0;
@@ -120,7 +127,10 @@ static void show_help(const char *progname)
 	printf("\t-a, --dump-ast\tDump abstract syntax tree of files\n\n");
 	printf("Flags consist of zero or more of the following options:\n\n");
 	printf("\t-n, --print-nil\tPrint nil return values in REPL\n");
-	printf("\t-t, --print-ret\tPrint result of scripts passed as arguments\n\n");
+	printf("\t-t, --print-ret\tPrint result of scripts passed as arguments\n");
+	printf("\t-u, --unoptimized\tDo not optimize compiled code\n");
+	printf("\t-p, --profile\tProfile scripts: print the time spent in each\n");
+	printf("\t\t\tfunction and write sampled stacks to " PROFILE_OUTPUT "\n\n");
 	printf("Please send bug reports via GitHub:\n\n");
 	printf("\t<http://github.com/H2CO3/Sparkling>\n\n");
 }
@@ -246,12 +256,54 @@ static int run_script_file(SpnContext *ctx, const char *fname, int argc, char *a
 	return err;
 }
 
-static int run_file(const char *fname, int argc, char *argv[])
+/* collects everything while running with '--profile' */
+static SpnProfile profile;
+
+/* applies the flags that affect the context (and not only the driver) */
+static void apply_flags(SpnContext *ctx, enum cmd_args args)
+{
+	if (args & FLAG_NOOPT) {
+		spn_ctx_setoptlevel(ctx, SPN_OPT_NONE);
+	}
+
+	if (args & FLAG_PROFILE) {
+		spn_profile_init(&profile, SPN_PROF_CALLS | SPN_PROF_OPCODES | SPN_PROF_SAMPLE);
+		spn_ctx_setprofile(ctx, &profile);
+	}
+}
+
+/* detaches the profile and writes it out; call before freeing 'ctx' */
+static void finish_profile(SpnContext *ctx, enum cmd_args args)
+{
+	FILE *f;
+
+	if ((args & FLAG_PROFILE) == 0) {
+		return;
+	}
+
+	spn_ctx_setprofile(ctx, NULL);
+
+	fprintf(stderr, "\n");
+	spn_profile_write_report(&profile, stderr);
+
+	f = fopen(PROFILE_OUTPUT, "w");
+	if (f != NULL) {
+		spn_profile_write_folded(&profile, f);
+		fclose(f);
+	} else {
+		fprintf(stderr, "I/O error: can't write to file '%s'\n", PROFILE_OUTPUT);
+	}
+
+	spn_profile_free(&profile);
+}
+
+static int run_file(const char *fname, int argc, char *argv[], enum cmd_args args)
 {
 	int status = EXIT_SUCCESS;
 
 	SpnContext ctx;
 	spn_ctx_init(&ctx);
+	apply_flags(&ctx, args);
 
 	/* check if file is a binary object or source text */
 	if (endswith(fname, ".spo")) {
@@ -266,17 +318,19 @@ static int run_file(const char *fname, int argc, char *argv[])
 		}
 	}
 
+	finish_profile(&ctx, args);
 	spn_ctx_free(&ctx);
 	return status;
 }
 
-static int eval_args(int argc, char *argv[])
+static int eval_args(int argc, char *argv[], enum cmd_args args)
 {
 	int status = EXIT_SUCCESS;
 	int i;
 
 	SpnContext ctx;
 	spn_ctx_init(&ctx);
+	apply_flags(&ctx, args);
 
 	for (i = 0; i < argc; i++) {
 		SpnValue val;
@@ -303,6 +357,7 @@ static int eval_args(int argc, char *argv[])
 		printf("\n");
 	}
 
+	finish_profile(&ctx, args);
 	spn_ctx_free(&ctx);
 	return status;
 }
@@ -314,6 +369,7 @@ static int run_args(int argc, char *argv[], enum cmd_args args)
 
 	SpnContext ctx;
 	spn_ctx_init(&ctx);
+	apply_flags(&ctx, args);
 
 	for (i = 0; i < argc; i++) {
 		SpnValue val;
@@ -341,6 +397,7 @@ static int run_args(int argc, char *argv[], enum cmd_args args)
 		spn_value_release(&val);
 	}
 
+	finish_profile(&ctx, args);
 	spn_ctx_free(&ctx);
 	return status;
 }
@@ -382,6 +439,7 @@ static int enter_repl(enum cmd_args args)
 
 	SpnContext ctx;
 	spn_ctx_init(&ctx);
+	apply_flags(&ctx, args);
 
 #if USE_READLINE
 	/* try reading the history file */
@@ -491,6 +549,7 @@ static int enter_repl(enum cmd_args args)
 		session_no++;
 	}
 
+	finish_profile(&ctx, args);
 	spn_ctx_free(&ctx);
 
 #if USE_READLINE
@@ -502,21 +561,19 @@ static int enter_repl(enum cmd_args args)
 }
 
 /* XXX: this function modifies filenames in 'argv' */
-static int compile_files(int argc, char *argv[])
+static int compile_files(int argc, char *argv[], enum cmd_args args)
 {
 	int status = EXIT_SUCCESS;
 	int i;
 
 	SpnContext ctx;
 	spn_ctx_init(&ctx);
+	apply_flags(&ctx, args);
 
 	for (i = 0; i < argc; i++) {
 		static char outname[FILENAME_MAX];
 		char *dotp;
-		FILE *outfile;
 		SpnFunction *fn;
-		spn_uword *bc;
-		size_t nwords;
 
 		printf("compiling file '%s'...", argv[i]);
 		fflush(stdout);
@@ -541,29 +598,18 @@ static int compile_files(int argc, char *argv[])
 
 		sprintf(outname, "%s.spo", argv[i]);
 
-		outfile = fopen(outname, "wb");
-		if (outfile == NULL) {
-			fprintf(stderr, "\nI/O error: can't open file '%s'\n", outname);
-			status = EXIT_FAILURE;
-			break;
-		}
-
 		assert(fn->topprg);
-		bc = fn->repr.bc;
-		nwords = fn->nwords;
 
-		if (fwrite(bc, sizeof bc[0], nwords, outfile) < nwords) {
+		if (spn_write_objfile(outname, fn->repr.bc, fn->nwords) != 0) {
 			fprintf(stderr, "\nI/O error: can't write to file '%s'\n", outname);
-			fclose(outfile);
 			status = EXIT_FAILURE;
 			break;
 		}
 
-		fclose(outfile);
-
 		printf(" done.\n");
 	}
 
+	finish_profile(&ctx, args);
 	spn_ctx_free(&ctx);
 	return status;
 }
@@ -575,28 +621,37 @@ static int disassemble_files(int argc, char *argv[])
 	int i;
 
 	for (i = 0; i < argc; i++) {
+		char *objdata;
 		spn_uword *bc;
 		size_t fsz, bclen;
 
-		bc = spn_read_binary_file(argv[i], &fsz);
-		if (bc == NULL) {
+		objdata = spn_map_file(argv[i], &fsz);
+		if (objdata == NULL) {
 			fprintf(stderr, "I/O error: could not read file '%s'\n", argv[i]);
 			status = EXIT_FAILURE;
 			break;
 		}
 
+		if (spn_objhdr_check(objdata, fsz) != 0) {
+			fprintf(stderr, "error: '%s' is not a valid object file\n", argv[i]);
+			spn_unmap_file(objdata, fsz);
+			status = EXIT_FAILURE;
+			break;
+		}
+
 		printf("Assembly dump of file %s:\n\n", argv[i]);
 
-		bclen = fsz / sizeof(bc[0]);
+		bc = (spn_uword *)(objdata + SPN_OBJHDR_LEN);
+		bclen = (fsz - SPN_OBJHDR_LEN) / sizeof(bc[0]);
 		if (spn_dump_assembly(bc, bclen) != 0) {
-			free(bc);
+			spn_unmap_file(objdata, fsz);
 			status = EXIT_FAILURE;
 			break;
 		}
 
 		printf("--------\n\n");
 
-		free(bc);
+		spn_unmap_file(objdata, fsz);
 	}
 
 	return status;
@@ -632,8 +687,7 @@ static int dump_ast_of_files(int argc, char *argv[])
 			break;
 		}
 
-		astval.type = SPN_TYPE_HASHMAP;
-		astval.v.o = ast;
+		astval = makeobject(SPN_TYPE_HASHMAP, ast);
 		spn_repl_print(&astval);
 		spn_object_release(ast);
 
@@ -669,7 +723,7 @@ int main(int argc, char *argv[])
 			print_version();
 			status = enter_repl(args);
 		} else {
-			status = run_file(argv[pos], argc - pos, &argv[pos]);
+			status = run_file(argv[pos], argc - pos, &argv[pos], args);
 		}
 
 		break;
@@ -678,14 +732,14 @@ int main(int argc, char *argv[])
 		status = EXIT_SUCCESS;
 		break;
 	case CMD_EVAL:
-		status = eval_args(argc - pos, &argv[pos]);
+		status = eval_args(argc - pos, &argv[pos], args);
 		break;
 	case CMD_RUN:
 		status = run_args(argc - pos, &argv[pos], args);
 		break;
 	case CMD_COMPILE:
 		/* XXX: this function modifies filenames in 'argv' */
-		status = compile_files(argc - pos, &argv[pos]);
+		status = compile_files(argc - pos, &argv[pos], args);
 		break;
 	case CMD_DISASM:
 		status = disassemble_files(argc - pos, &argv[pos]);
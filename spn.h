@@ -0,0 +1 @@
+#define REPL_VERSION "cf81590"
@@ -10,10 +10,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <float.h>
 #include <assert.h>
 
+#if USE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif /* USE_MMAP */
+
 #include "api.h"
 #include "parser.h"
 #include "compiler.h"
@@ -23,6 +32,8 @@
 #include "array.h"
 #include "hashmap.h"
 #include "func.h"
+#include "pool.h"
+#include "gc.h"
 
 /*
  * Object API
@@ -66,10 +77,11 @@ int spn_object_cmp(void *lp, void *rp)
 
 void *spn_object_new(const SpnClass *isa)
 {
-	SpnObject *obj = spn_malloc(isa->instsz);
+	SpnObject *obj = spn_pool_allocobj(isa->UID, isa->instsz);
 
 	obj->isa = isa;
 	obj->refcnt = 1;
+	obj->gcinfo = 0;
 
 	return obj;
 }
@@ -88,8 +100,18 @@ void spn_object_release(void *o)
 			obj->isa->destructor(obj);
 		}
 
-		free(obj);
+		if (obj->gcinfo != 0) {
+			spn_gc_forget(obj);
+		}
+
+		spn_pool_freeobj(obj, obj->isa->UID, obj->isa->instsz);
 	}
+#if USE_CYCLE_COLLECTOR
+	else if (obj->isa->traverse != NULL && obj->gcinfo == 0) {
+		/* it may have lost a reference from outside of a cycle */
+		spn_gc_addroot(obj);
+	}
+#endif /* USE_CYCLE_COLLECTOR */
 }
 
 /*
@@ -113,6 +135,82 @@ double spn_floatvalue_f(SpnValue *val)
 	return spn_intvalue(val);
 }
 
+#if USE_NAN_BOXING
+
+const int spn_nb_typetab[8] = {
+	SPN_TYPE_NIL, /* SPN_NB_TAG_SPECIAL: never looked up */
+	SPN_TYPE_INT,
+	SPN_TYPE_WEAKUSERINFO,
+	SPN_TYPE_STRING,
+	SPN_TYPE_ARRAY,
+	SPN_TYPE_HASHMAP,
+	SPN_TYPE_FUNC,
+	SPN_TYPE_STRGUSERINFO
+};
+
+SpnValue spn_makebool(int b)
+{
+	SpnValue ret;
+	ret.v.u = b ? SPN_NB_TRUE : SPN_NB_FALSE;
+	return ret;
+}
+
+SpnValue spn_makeint(long i)
+{
+	SpnValue ret;
+	ret.v.u = SPN_NB_BOX(SPN_NB_TAG_INT, i);
+	return ret;
+}
+
+SpnValue spn_makefloat(double f)
+{
+	SpnValue ret;
+	ret.v.f = f;
+
+	/* canonicalize NaNs so that they can't be mistaken for a boxed value */
+	if (f != f) {
+		ret.v.u = 0x7ff8000000000000UL;
+	}
+
+	return ret;
+}
+
+SpnValue spn_makeweakuserinfo(void *p)
+{
+	SpnValue ret;
+	ret.v.u = SPN_NB_BOX(SPN_NB_TAG_WEAKUSERINFO, p);
+	return ret;
+}
+
+SpnValue spn_makeobject(int type, void *o)
+{
+	SpnValue ret;
+	int tag;
+
+	switch (type) {
+	case SPN_TYPE_STRING:       tag = SPN_NB_TAG_STRING;       break;
+	case SPN_TYPE_ARRAY:        tag = SPN_NB_TAG_ARRAY;        break;
+	case SPN_TYPE_HASHMAP:      tag = SPN_NB_TAG_HASHMAP;      break;
+	case SPN_TYPE_FUNC:         tag = SPN_NB_TAG_FUNC;         break;
+	case SPN_TYPE_STRGUSERINFO: tag = SPN_NB_TAG_STRGUSERINFO; break;
+	default:
+		SHANT_BE_REACHED();
+		tag = SPN_NB_TAG_STRGUSERINFO;
+	}
+
+	/* a pointer which does not fit into the payload would be truncated */
+	assert(((unsigned long)o & ~SPN_NB_PAYLOAD) == 0);
+
+	ret.v.u = SPN_NB_BOX(tag, o);
+	return ret;
+}
+
+const SpnValue spn_nilval   = { { SPN_NB_NIL   } };
+const SpnValue spn_falseval = { { SPN_NB_FALSE } };
+const SpnValue spn_trueval  = { { SPN_NB_TRUE  } };
+
+#else /* USE_NAN_BOXING */
+
 SpnValue spn_makebool(int b)
 {
 	SpnValue ret;
@@ -145,10 +243,11 @@ SpnValue spn_makeweakuserinfo(void *p)
 	return ret;
 }
 
-SpnValue spn_makestrguserinfo(void *o)
+SpnValue spn_makeobject(int type, void *o)
 {
 	SpnValue ret;
-	ret.type = SPN_TYPE_STRGUSERINFO;
+	assert(type & SPN_FLAG_OBJECT);
+	ret.type = type;
 	ret.v.o = o;
 	return ret;
 }
@@ -157,6 +256,13 @@ const SpnValue spn_nilval   = { SPN_TYPE_NIL,  { 0 } };
 const SpnValue spn_falseval = { SPN_TYPE_BOOL, { 0 } };
 const SpnValue spn_trueval  = { SPN_TYPE_BOOL, { 1 } };
 
+#endif /* USE_NAN_BOXING */
+
+SpnValue spn_makestrguserinfo(void *o)
+{
+	return spn_makeobject(SPN_TYPE_STRGUSERINFO, o);
+}
+
 
 void spn_value_retain(const SpnValue *val)
 {
@@ -298,17 +404,48 @@ int spn_values_comparable(const SpnValue *lhs, const SpnValue *rhs)
 	return 0;
 }
 
-/* The hash function is the SMDB hash */
+/* The hash function consumes its input a machine word at a time (words are
+ * loaded using memcpy(), so the data need not be aligned), mixing each one
+ * in with a multiply-xorshift step, then it runs the result through the
+ * finalizer of MurmurHash3, so that every output bit depends on every
+ * input bit. The hash of the same data may differ between platforms.
+ */
+#if ULONG_MAX > 0xffffffffUL
+#define HASH_MUL     0x9e3779b97f4a7c15UL
+#define HASH_SHIFT   32
+#define HASH_FMIX(h) ((h) ^= (h) >> 33, (h) *= 0xff51afd7ed558ccdUL, \
+                      (h) ^= (h) >> 33, (h) *= 0xc4ceb9fe1a85ec53UL, \
+                      (h) ^= (h) >> 33)
+#else /* 32-bit unsigned long */
+#define HASH_MUL     0x9e3779b1UL
+#define HASH_SHIFT   16
+#define HASH_FMIX(h) ((h) ^= (h) >> 16, (h) *= 0x85ebca6bUL, \
+                      (h) ^= (h) >> 13, (h) *= 0xc2b2ae35UL, \
+                      (h) ^= (h) >> 16)
+#endif /* ULONG_MAX */
+
 unsigned long spn_hash_bytes(const void *data, size_t n)
 {
-	unsigned long hash = 0;
 	const unsigned char *p = data;
+	unsigned long hash = n * HASH_MUL;
+	unsigned long word;
+
+	while (n >= sizeof word) {
+		memcpy(&word, p, sizeof word);
+		hash = (hash ^ word) * HASH_MUL;
+		hash ^= hash >> HASH_SHIFT;
+		p += sizeof word;
+		n -= sizeof word;
+	}
 
-	while (n--) {
-		hash *= 65599;
-		hash += *p++;
+	if (n > 0) {
+		word = 0;
+		memcpy(&word, p, n);
+		hash = (hash ^ word) * HASH_MUL;
+		hash ^= hash >> HASH_SHIFT;
 	}
 
+	HASH_FMIX(hash);
 	return hash;
 }
 
@@ -332,9 +469,9 @@ unsigned long spn_hash_value(const SpnValue *key)
 					 */
 					return i;
 				}
-			} else {
-				return spn_hash_bytes(&f, sizeof f);
 			}
+
+			return spn_hash_bytes(&f, sizeof f);
 		}
 
 		/* the hash value of an integer is itself */
@@ -572,6 +709,11 @@ static char *read_file2mem(const char *name, size_t *sz, int nulterm)
 		}
 
 		buf[0] = 0;
+
+		if (sz != NULL) {
+			*sz = 0;
+		}
+
 		return buf;
 	}
 
@@ -616,3 +758,146 @@ void *spn_read_binary_file(const char *name, size_t *sz)
 {
 	return read_file2mem(name, sz, 0);
 }
+
+#if USE_MMAP
+
+/* if 'nulterm' is nonzero, then the mapping must be followed by a
+ * zero byte. Bytes past the end of the file in its last page read as
+ * zero, so this only fails if the size is a multiple of the page size.
+ */
+static void *map_file_private(const char *name, size_t *sz, int nulterm)
+{
+	struct stat st;
+	void *ptr;
+
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	/* an empty file can't be mapped */
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (nulterm && st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* the mapping stays valid after closing the file descriptor */
+	ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+
+	*sz = st.st_size;
+	return ptr;
+}
+
+void *spn_map_file(const char *name, size_t *sz)
+{
+	return map_file_private(name, sz, 0);
+}
+
+char *spn_map_text_file(const char *name, size_t *sz)
+{
+	return map_file_private(name, sz, 1);
+}
+
+void spn_unmap_file(void *ptr, size_t sz)
+{
+	if (ptr != NULL) {
+		munmap(ptr, sz);
+	}
+}
+
+#else /* USE_MMAP */
+
+void *spn_map_file(const char *name, size_t *sz)
+{
+	return read_file2mem(name, sz, 0);
+}
+
+char *spn_map_text_file(const char *name, size_t *sz)
+{
+	return read_file2mem(name, sz, 1);
+}
+
+void spn_unmap_file(void *ptr, size_t sz)
+{
+	free(ptr);
+}
+
+#endif /* USE_MMAP */
+
+/* the magic number is followed by the version, the size of the word
+ * and a byte order marker; the rest of the header is zero (reserved).
+ */
+static const unsigned char objhdr_magic[4] = { 0x7f, 'S', 'P', 'O' };
+
+enum {
+	OBJHDR_IDX_VERSION = 4,
+	OBJHDR_IDX_WORDSIZE,
+	OBJHDR_IDX_BYTEORDER
+};
+
+/* the lowest-addressed byte of the word 1: 1 if little endian */
+static unsigned char byte_order(void)
+{
+	spn_uword one = 1;
+	return *(unsigned char *)(&one);
+}
+
+void spn_objhdr_init(unsigned char hdr[SPN_OBJHDR_LEN])
+{
+	memset(hdr, 0, SPN_OBJHDR_LEN);
+	memcpy(hdr, objhdr_magic, sizeof objhdr_magic);
+	hdr[OBJHDR_IDX_VERSION] = SPN_OBJHDR_VERSION;
+	hdr[OBJHDR_IDX_WORDSIZE] = sizeof(spn_uword);
+	hdr[OBJHDR_IDX_BYTEORDER] = byte_order();
+}
+
+int spn_objhdr_check(const void *data, size_t size)
+{
+	unsigned char expected[SPN_OBJHDR_LEN];
+
+	/* there must be at least a function header after the object header */
+	if (size < SPN_OBJHDR_LEN + SPN_FUNCHDR_LEN * sizeof(spn_uword)) {
+		return -1;
+	}
+
+	if ((size - SPN_OBJHDR_LEN) % sizeof(spn_uword) != 0) {
+		return -1;
+	}
+
+	spn_objhdr_init(expected);
+	return memcmp(data, expected, SPN_OBJHDR_LEN) != 0;
+}
+
+int spn_write_objfile(const char *name, const spn_uword *bc, size_t nwords)
+{
+	unsigned char hdr[SPN_OBJHDR_LEN];
+	int status = 0;
+
+	FILE *f = fopen(name, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+
+	spn_objhdr_init(hdr);
+
+	if (fwrite(hdr, sizeof hdr, 1, f) < 1
+	 || fwrite(bc, sizeof bc[0], nwords, f) < nwords) {
+		status = -1;
+	}
+
+	if (fclose(f) != 0) {
+		status = -1;
+	}
+
+	return status;
+}
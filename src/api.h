@@ -63,15 +63,27 @@ enum {
  * defined (and used) in the Sparkling core.
  */
 enum {
-	SPN_CLASS_UID_STRING      = 1,
-	SPN_CLASS_UID_ARRAY       = 2,
-	SPN_CLASS_UID_HASHMAP     = 3,
-	SPN_CLASS_UID_FUNCTION    = 4,
-	SPN_CLASS_UID_FILEHANDLE  = 5,
-	SPN_CLASS_UID_SYMTABENTRY = 6,
-	SPN_CLASS_UID_SYMBOLSTUB  = 7
+	SPN_CLASS_UID_STRING        = 1,
+	SPN_CLASS_UID_ARRAY         = 2,
+	SPN_CLASS_UID_HASHMAP       = 3,
+	SPN_CLASS_UID_FUNCTION      = 4,
+	SPN_CLASS_UID_FILEHANDLE    = 5,
+	SPN_CLASS_UID_SYMTABENTRY   = 6,
+	SPN_CLASS_UID_SYMBOLSTUB    = 7,
+	SPN_CLASS_UID_LINETABLE     = 8,
+	SPN_CLASS_UID_TYPEDARRAY    = 9,
+	SPN_CLASS_UID_STRINGBUILDER = 10,
+	SPN_CLASS_UID_COROUTINE     = 11,
+	SPN_CLASS_UID_ARRAYSTORE    = 12
 };
 
+/* 'traverse' is called by the cycle collector (see gc.h) on containers,
+ * i. e. objects which may be part of a reference cycle. It must call the
+ * function passed to it, along with the opaque pointer, on every object the
+ * container holds a strong reference to, exactly once per reference. It may
+ * be NULL, in which case the instances of the class are never collected as
+ * parts of a cycle (but they are freed as usual once they are unreferenced).
+ */
 typedef struct SpnClass {
 	size_t instsz;                   /* sizeof(instance)                    */
 	unsigned long UID;               /* unique identifier of the class      */
@@ -79,11 +91,13 @@ typedef struct SpnClass {
 	int (*compare)(void *, void *);  /* -1, +1, 0: lhs is <, >, == to rhs   */
 	unsigned long (*hashfn)(void *); /* cache the hash if immutable!        */
 	void (*destructor)(void *);      /* shouldn't call free on its argument */
+	void (*traverse)(void *, void (*)(void *, void *), void *); /* see above */
 } SpnClass;
 
 typedef struct SpnObject {
 	const SpnClass *isa;
 	unsigned refcnt;
+	unsigned gcinfo;                 /* private, used by the cycle collector */
 } SpnObject;
 
 /* class membership test */
@@ -170,6 +184,121 @@ enum {
 	SPN_TYPE_STRGUSERINFO       = SPN_TTAG_USERINFO | SPN_FLAG_OBJECT
 };
 
+/* Value representation
+ *
+ * By default, an SpnValue is a type tag followed by a union holding the
+ * actual value, which makes it 16 bytes large on most 64-bit platforms.
+ *
+ * If the library is built with 'USE_NAN_BOXING' defined to nonzero, then
+ * an SpnValue is a single 64-bit word instead: floating-point numbers are
+ * stored as-is, and every other value lives in the payload of a negative
+ * quiet NaN. The layout of such a boxed value is:
+ *
+ *   bits 63..51: all ones (negative quiet NaN)
+ *   bits 50..48: tag (SPN_NB_TAG_* below)
+ *   bits 47..0:  payload (Boolean, integer or pointer)
+ *
+ * NaNs produced by arithmetic are canonicalized by spn_makefloat() to the
+ * positive quiet NaN, so they never collide with a boxed value.
+ * This representation has some limitations:
+ *
+ *   1. it requires 'unsigned long' to be 64 bits wide (LP64);
+ *   2. pointers must fit into 48 bits (true for user-space pointers
+ *      on current x86-64 and AArch64 systems without pointer tagging);
+ *   3. integers are 48-bit signed numbers. spn_makeint() truncates its
+ *      argument to 48 bits, so integer arithmetic wraps around modulo 2^48.
+ *
+ * Client code must be compiled with the same setting as the library,
+ * and it must only access SpnValue through the macros and functions
+ * in this header (spn_isint(), spn_intvalue(), spn_makeint(), etc.).
+ */
+#ifndef USE_NAN_BOXING
+#define USE_NAN_BOXING 0
+#endif /* USE_NAN_BOXING */
+
+#if USE_NAN_BOXING
+
+#if ULONG_MAX != 0xffffffffffffffffUL
+#error "NaN-boxing requires a 64-bit 'unsigned long'"
+#endif /* ULONG_MAX */
+
+/* tags of boxed values. The order is significant: tags of all
+ * object types are greater than or equal to SPN_NB_TAG_STRING.
+ */
+enum {
+	SPN_NB_TAG_SPECIAL,  /* nil or Boolean */
+	SPN_NB_TAG_INT,
+	SPN_NB_TAG_WEAKUSERINFO,
+	SPN_NB_TAG_STRING,
+	SPN_NB_TAG_ARRAY,
+	SPN_NB_TAG_HASHMAP,
+	SPN_NB_TAG_FUNC,
+	SPN_NB_TAG_STRGUSERINFO
+};
+
+#define SPN_NB_BOXED        0xfff8000000000000UL
+#define SPN_NB_PAYLOAD      0x0000ffffffffffffUL
+#define SPN_NB_BOX(tag, p)  (SPN_NB_BOXED | ((unsigned long)(tag) << 48) | ((unsigned long)(p) & SPN_NB_PAYLOAD))
+
+/* payloads of the special tag: bit 1 is set for Booleans */
+#define SPN_NB_NIL          SPN_NB_BOX(SPN_NB_TAG_SPECIAL, 0)
+#define SPN_NB_FALSE        SPN_NB_BOX(SPN_NB_TAG_SPECIAL, 2)
+#define SPN_NB_TRUE         SPN_NB_BOX(SPN_NB_TAG_SPECIAL, 3)
+
+#define spn_nb_isboxed(val) ((val)->v.u >= SPN_NB_BOXED)
+#define spn_nb_tag(val)     ((int)(((val)->v.u >> 48) & 0x7))
+#define spn_nb_hastag(val, tag) (((val)->v.u >> 48) == ((SPN_NB_BOXED >> 48) | (tag)))
+
+/* maps boxed tags to complete type definitions (except SPN_NB_TAG_SPECIAL) */
+SPN_API const int spn_nb_typetab[8];
+
+/* complete type definition (SPN_TYPE_*) of a value */
+#define spn_fulltype(val)   (!spn_nb_isboxed(val) ? SPN_TYPE_FLOAT : \
+                             spn_nb_hastag(val, SPN_NB_TAG_SPECIAL) ? \
+                             (((val)->v.u & 2) ? SPN_TYPE_BOOL : SPN_TYPE_NIL) : \
+                             spn_nb_typetab[spn_nb_tag(val)])
+
+/* type checking */
+#define spn_isobject(val)   ((val)->v.u >= SPN_NB_BOX(SPN_NB_TAG_STRING, 0))
+#define spn_typetag(t)      ((t) & SPN_MASK_TTAG)
+#define spn_typeflag(t)     ((t) & SPN_MASK_FLAG)
+#define spn_valtype(val)    (spn_typetag(spn_fulltype(val)))
+#define spn_valflag(val)    (spn_typeflag(spn_fulltype(val)))
+
+#define spn_isnil(val)          ((val)->v.u == SPN_NB_NIL)
+#define spn_isbool(val)         (((val)->v.u | 1) == SPN_NB_TRUE)
+#define spn_isnumber(val)       (!spn_nb_isboxed(val) || spn_nb_hastag(val, SPN_NB_TAG_INT))
+#define spn_isstring(val)       (spn_nb_hastag(val, SPN_NB_TAG_STRING))
+#define spn_isarray(val)        (spn_nb_hastag(val, SPN_NB_TAG_ARRAY))
+#define spn_ishashmap(val)      (spn_nb_hastag(val, SPN_NB_TAG_HASHMAP))
+#define spn_isfunc(val)         (spn_nb_hastag(val, SPN_NB_TAG_FUNC))
+#define spn_isuserinfo(val)     (spn_isweakuserinfo(val) || spn_isstrguserinfo(val))
+
+#define spn_notnil(val)         (!spn_isnil(val))
+#define spn_isint(val)          (spn_nb_hastag(val, SPN_NB_TAG_INT))
+#define spn_isfloat(val)        (!spn_nb_isboxed(val))
+#define spn_isweakuserinfo(val) (spn_nb_hastag(val, SPN_NB_TAG_WEAKUSERINFO))
+#define spn_isstrguserinfo(val) (spn_nb_hastag(val, SPN_NB_TAG_STRGUSERINFO))
+
+/* getting the value of a boxed value. These do *not* check the type. */
+#define spn_boolvalue(val)  ((int)((val)->v.u & 1))
+#define spn_intvalue(val)   ((long)((val)->v.u << 16) >> 16)
+#define spn_floatvalue(val) ((val)->v.f)
+#define spn_ptrvalue(val)   ((void *)((val)->v.u & SPN_NB_PAYLOAD))
+#define spn_objvalue(val)   ((void *)((val)->v.u & SPN_NB_PAYLOAD))
+
+typedef struct SpnValue {
+	union {             /* NaN-boxed value */
+		unsigned long u;
+		double f;
+	} v;
+} SpnValue;
+
+#else /* USE_NAN_BOXING */
+
+/* complete type definition (SPN_TYPE_*) of a value */
+#define spn_fulltype(val)   ((val)->type)
+
 /* type checking */
 #define spn_isobject(val)   ((((val)->type) & SPN_FLAG_OBJECT) != 0)
 #define spn_typetag(t)      ((t) & SPN_MASK_TTAG)
@@ -213,6 +342,8 @@ typedef struct SpnValue {
 	} v;
 } SpnValue;
 
+#endif /* USE_NAN_BOXING */
+
 /* force integer or floating-point number out of an SpnValue.
  * These can potentially be unsafe: a double may not be
  * able to exactly represent all longs, and converting
@@ -232,6 +363,12 @@ SPN_API SpnValue spn_makefloat(double f);
 SPN_API SpnValue spn_makeweakuserinfo(void *p);
 SPN_API SpnValue spn_makestrguserinfo(void *o);
 
+/* low-level constructor for values of object type. 'type' must be one of
+ * the SPN_TYPE_* constants with the SPN_FLAG_OBJECT flag set.
+ * Does not retain 'o'.
+ */
+SPN_API SpnValue spn_makeobject(int type, void *o);
+
 /* 'nil' and Boolean constants */
 SPN_API const SpnValue spn_nilval;
 SPN_API const SpnValue spn_falseval;
@@ -283,4 +420,46 @@ SPN_API char *spn_read_text_file(const char *name);
  */
 SPN_API void *spn_read_binary_file(const char *name, size_t *sz);
 
+/* maps a file into memory and stores its size in bytes in 'sz'.
+ * The mapping is private and writable: modifications are never written
+ * back to the file, and pages which are not modified are shared with
+ * other processes mapping the same file. If the library was built
+ * without USE_MMAP, then the file is read into a buffer instead.
+ * Returns NULL on error. The mapping must be released by calling
+ * spn_unmap_file() with the same size.
+ */
+SPN_API void *spn_map_file(const char *name, size_t *sz);
+SPN_API void spn_unmap_file(void *ptr, size_t sz);
+
+/* like spn_map_file(), but the contents are followed by a terminating
+ * NUL byte, which is not included in 'sz'. Returns NULL if the file
+ * can't be mapped like this, e. g. because its size is a multiple of
+ * the page size; use spn_read_text_file() as a fallback in that case.
+ */
+SPN_API char *spn_map_text_file(const char *name, size_t *sz);
+
+/* Compiled Sparkling object files start with a header of SPN_OBJHDR_LEN
+ * bytes, followed by the bytecode. The header consists of a magic number,
+ * the version of the bytecode format and the size and byte order of the
+ * machine word; bytecode can only be loaded by a build on which all of
+ * these match. The size of the header is a multiple of the size of the
+ * word, so the bytecode is aligned if the object data itself is.
+ */
+#define SPN_OBJHDR_LEN     16
+#define SPN_OBJHDR_VERSION 2
+
+/* fills in the header of object files produced by this build */
+SPN_API void spn_objhdr_init(unsigned char hdr[SPN_OBJHDR_LEN]);
+
+/* returns 0 if the 'size' bytes of object data at 'data' start with a
+ * header compatible with this build, followed by a whole number of
+ * machine words. Returns nonzero otherwise.
+ */
+SPN_API int spn_objhdr_check(const void *data, size_t size);
+
+/* writes 'nwords' words of bytecode to a new object file, preceded by
+ * the header. Returns 0 on success, nonzero on error.
+ */
+SPN_API int spn_write_objfile(const char *name, const spn_uword *bc, size_t nwords);
+
 #endif /* SPN_API_H */
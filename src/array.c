@@ -19,14 +19,39 @@
 #include "str.h"
 
 
+/* Arrays share their elements copy-on-write. Copying or slicing an array
+ * (spn_array_copy(), spn_array_slice()) turns the vector of the original
+ * into a reference-counted store, and the new array becomes a view of a
+ * range of it. A view owns a reference to the store only, not to each
+ * element, so it's created in constant time. The first modification of
+ * either array materializes it, i. e. it gives it a vector of its own;
+ * if the array is the only one left which refers to the store, then it
+ * just takes over the vector of the store, otherwise it copies its range.
+ *
+ * The store is an object of its own (traversed by the cycle collector),
+ * so that each element is referenced exactly once, however many views
+ * of it there are.
+ */
+typedef struct ArrayStore {
+	SpnObject base;
+	SpnValue *values;      /* strong references to the elements */
+	size_t    count;       /* number of elements                */
+	size_t    allocsize;   /* allocation size of 'values'       */
+} ArrayStore;
+
 struct SpnArray {
 	SpnObject base;        /* for being a valid object          */
 	SpnValue *vector;      /* the actual raw array of values    */
 	size_t    count;       /* logical size                      */
 	size_t    allocsize;   /* allocation (actual) size          */
+	ArrayStore *shared;    /* if not NULL, 'vector' points into */
 };
 
 static void free_array(void *obj);
+static void traverse_array(void *obj, void (*visit)(void *, void *), void *ctx);
+
+static void free_store(void *obj);
+static void traverse_store(void *obj, void (*visit)(void *, void *), void *ctx);
 
 
 static const SpnClass spn_class_array = {
@@ -35,7 +60,18 @@ static const SpnClass spn_class_array = {
 	NULL,
 	NULL,
 	NULL,
-	free_array
+	free_array,
+	traverse_array
+};
+
+static const SpnClass spn_class_arraystore = {
+	sizeof(ArrayStore),
+	SPN_CLASS_UID_ARRAYSTORE,
+	NULL,
+	NULL,
+	NULL,
+	free_store,
+	traverse_store
 };
 
 SpnArray *spn_array_new(void)
@@ -44,6 +80,7 @@ SpnArray *spn_array_new(void)
 	array->vector = NULL;
 	array->count = 0;
 	array->allocsize = 0;
+	array->shared = NULL;
 	return array;
 }
 
@@ -52,6 +89,11 @@ static void free_array(void *obj)
 	SpnArray *arr = obj;
 	size_t i;
 
+	if (arr->shared != NULL) {
+		spn_object_release(arr->shared);
+		return;
+	}
+
 	for (i = 0; i < arr->count; i++) {
 		spn_value_release(&arr->vector[i]);
 	}
@@ -59,6 +101,160 @@ static void free_array(void *obj)
 	free(arr->vector);
 }
 
+static void traverse_array(void *obj, void (*visit)(void *, void *), void *ctx)
+{
+	SpnArray *arr = obj;
+	size_t i;
+
+	if (arr->shared != NULL) {
+		visit(arr->shared, ctx);
+		return;
+	}
+
+	for (i = 0; i < arr->count; i++) {
+		if (isobject(&arr->vector[i])) {
+			visit(objvalue(&arr->vector[i]), ctx);
+		}
+	}
+}
+
+static void free_store(void *obj)
+{
+	ArrayStore *store = obj;
+	size_t i;
+
+	for (i = 0; i < store->count; i++) {
+		spn_value_release(&store->values[i]);
+	}
+
+	free(store->values);
+}
+
+static void traverse_store(void *obj, void (*visit)(void *, void *), void *ctx)
+{
+	ArrayStore *store = obj;
+	size_t i;
+
+	for (i = 0; i < store->count; i++) {
+		if (isobject(&store->values[i])) {
+			visit(objvalue(&store->values[i]), ctx);
+		}
+	}
+}
+
+/* turns the vector of 'arr' into a store, if it isn't one already */
+static ArrayStore *share_vector(SpnArray *arr)
+{
+	ArrayStore *store;
+
+	if (arr->shared != NULL) {
+		return arr->shared;
+	}
+
+	store = spn_object_new(&spn_class_arraystore);
+	store->values = arr->vector;
+	store->count = arr->count;
+	store->allocsize = arr->allocsize;
+
+	arr->shared = store;
+	arr->allocsize = 0;
+
+	return store;
+}
+
+/* gives 'arr' a vector of its own; must be called before modifying it */
+static void materialize(SpnArray *arr)
+{
+	ArrayStore *store = arr->shared;
+	size_t offset, i;
+
+	if (store == NULL) {
+		return;
+	}
+
+	offset = arr->vector - store->values;
+
+	if (store->base.refcnt == 1) {
+		/* this is the only view: steal the vector of the store,
+		 * dropping the elements which are outside of the view
+		 */
+		for (i = 0; i < offset; i++) {
+			spn_value_release(&store->values[i]);
+		}
+
+		for (i = offset + arr->count; i < store->count; i++) {
+			spn_value_release(&store->values[i]);
+		}
+
+		if (offset > 0) {
+			memmove(store->values, arr->vector, arr->count * sizeof arr->vector[0]);
+		}
+
+		arr->vector = store->values;
+		arr->allocsize = store->allocsize;
+
+		store->values = NULL;
+		store->count = 0;
+	} else if (arr->count > 0) {
+		/* copy the range of the view, retaining each element */
+		SpnValue *vector = spn_malloc(arr->count * sizeof vector[0]);
+
+		for (i = 0; i < arr->count; i++) {
+			vector[i] = arr->vector[i];
+			spn_value_retain(&vector[i]);
+		}
+
+		arr->vector = vector;
+		arr->allocsize = arr->count;
+	} else {
+		arr->vector = NULL;
+		arr->allocsize = 0;
+	}
+
+	arr->shared = NULL;
+	spn_object_release(store);
+}
+
+SpnArray *spn_array_slice(SpnArray *arr, size_t index, size_t length)
+{
+	SpnArray *slice;
+
+	if (index > arr->count || length > arr->count - index) {
+		unsigned long ulindex = index, ulend = index + length, ulcount = arr->count;
+		spn_die("range [%lu, %lu) is out of bounds (size = %lu)\n", ulindex, ulend, ulcount);
+	}
+
+	slice = spn_array_new();
+
+	/* there's nothing to share */
+	if (length == 0) {
+		return slice;
+	}
+
+	slice->shared = share_vector(arr);
+	spn_object_retain(slice->shared);
+
+	slice->vector = arr->vector + index;
+	slice->count = length;
+
+	return slice;
+}
+
+SpnArray *spn_array_copy(SpnArray *arr)
+{
+	return spn_array_slice(arr, 0, arr->count);
+}
+
+void spn_array_reserve(SpnArray *arr, size_t n)
+{
+	materialize(arr);
+
+	if (n > arr->allocsize) {
+		arr->vector = spn_realloc(arr->vector, n * sizeof arr->vector[0]);
+		arr->allocsize = n;
+	}
+}
+
 size_t spn_array_count(SpnArray *arr)
 {
 	return arr->count;
@@ -81,6 +277,8 @@ void spn_array_set(SpnArray *arr, size_t index, const SpnValue *val)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
+	materialize(arr);
+
 	spn_value_retain(val);
 	spn_value_release(&arr->vector[index]);
 	arr->vector[index] = *val;
@@ -96,6 +294,8 @@ void spn_array_insert(SpnArray *arr, size_t index, const SpnValue *val)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
+	materialize(arr);
+
 	maxindex = arr->count++;
 
 	if (arr->allocsize == 0) {
@@ -125,6 +325,8 @@ void spn_array_remove(SpnArray *arr, size_t index)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
+	materialize(arr);
+
 	spn_value_release(&arr->vector[index]);
 	arr->count--;
 
@@ -135,7 +337,7 @@ void spn_array_remove(SpnArray *arr, size_t index)
 
 void spn_array_inject(SpnArray *arr, size_t index, SpnArray *other)
 {
-	size_t i, j;
+	size_t i;
 	size_t n_arr = arr->count, n_other = other->count;
 
 	if (index > n_arr) {
@@ -143,19 +345,51 @@ void spn_array_inject(SpnArray *arr, size_t index, SpnArray *other)
 		spn_die("array index %lu is too high (size = %lu)\n", ulindex, ulcount);
 	}
 
-	/* expand array */
-	spn_array_setsize(arr, n_arr + n_other);
+	if (n_other == 0) {
+		return;
+	}
 
-	/* shift elements at positions >= index towards end of array */
-	for (i = n_arr; i > index; i--) {
-		arr->vector[i - 1 + n_other] = arr->vector[i - 1];
+	/* injecting into an empty array without any room reserved
+	 * is copying, so the elements can be shared
+	 */
+	if (n_arr == 0 && arr->allocsize == 0 && arr->shared == NULL) {
+		arr->shared = share_vector(other);
+		spn_object_retain(arr->shared);
+
+		arr->vector = other->vector;
+		arr->count = n_other;
+		arr->allocsize = 0;
+		return;
 	}
 
-	/* take ownership of new elements, insert them at 'index' */
-	for (i = index, j = 0; j < n_other; i++, j++) {
-		spn_value_retain(&other->vector[j]);
-		arr->vector[i] = other->vector[j];
+	/* make room for the new elements */
+	if (n_arr + n_other > arr->allocsize || arr->shared != NULL) {
+		size_t newsize = arr->allocsize ? arr->allocsize : 8;
+
+		while (newsize < n_arr + n_other) {
+			newsize *= 2;
+		}
+
+		spn_array_reserve(arr, newsize);
+	}
+
+	/* shift elements at positions >= index towards end of array */
+	memmove(
+		arr->vector + index + n_other,
+		arr->vector + index,
+		(n_arr - index) * sizeof arr->vector[0]
+	);
+
+	/* take ownership of new elements, insert them at 'index'.
+	 * If 'other' is 'arr' itself, its elements are now split in two.
+	 */
+	for (i = 0; i < n_other; i++) {
+		size_t j = other != arr || i < index ? i : i + n_other;
+		arr->vector[index + i] = other->vector[j];
+		spn_value_retain(&arr->vector[index + i]);
 	}
+
+	arr->count = n_arr + n_other;
 }
 
 void spn_array_push(SpnArray *arr, const SpnValue *val)
@@ -163,6 +397,29 @@ void spn_array_push(SpnArray *arr, const SpnValue *val)
 	spn_array_insert(arr, arr->count, val);
 }
 
+void spn_array_append(SpnArray *arr, const SpnValue *vals, size_t n)
+{
+	size_t i;
+
+	materialize(arr);
+
+	if (arr->count + n > arr->allocsize) {
+		size_t newsize = arr->allocsize ? arr->allocsize : 8;
+
+		while (newsize < arr->count + n) {
+			newsize *= 2;
+		}
+
+		arr->vector = spn_realloc(arr->vector, newsize * sizeof arr->vector[0]);
+		arr->allocsize = newsize;
+	}
+
+	for (i = 0; i < n; i++) {
+		spn_value_retain(&vals[i]);
+		arr->vector[arr->count++] = vals[i];
+	}
+}
+
 /* removes an element from the end */
 void spn_array_pop(SpnArray *arr)
 {
@@ -192,11 +449,311 @@ void spn_array_setsize(SpnArray *arr, size_t newsize)
 	}
 }
 
+/* Sorting
+ * -------
+ *
+ * Arrays are sorted using introsort: quicksort with a median-of-three
+ * pivot, which falls back to heapsort once the recursion gets too deep
+ * (so that the worst case is O(n log n)), and which leaves short ranges
+ * to insertion sort. Elements are permuted within the vector directly,
+ * so sorting doesn't touch reference counts.
+ *
+ * When no comparison callback is given, the elements are examined
+ * up front, and homogeneous arrays of integers, floats or strings are
+ * compared using a specialized, inlined comparison instead of the
+ * generic spn_value_compare().
+ */
+
+#define SORT_CUTOFF 16
+
+enum sort_kind {
+	SORT_INT,     /* all integers                                 */
+	SORT_FLOAT,   /* all floats                                   */
+	SORT_NUMBER,  /* mixed integers and floats                    */
+	SORT_STRING,  /* all strings                                  */
+	SORT_OBJECT,  /* comparable objects, via spn_value_compare()  */
+	SORT_CUSTOM   /* user-supplied callback                       */
+};
+
+typedef struct SortCtx {
+	enum sort_kind kind;
+	int (*less)(void *, const SpnValue *, const SpnValue *);
+	void *ud;
+	int error;
+} SortCtx;
+
+static int sort_less(SortCtx *sc, const SpnValue *lhs, const SpnValue *rhs)
+{
+	switch (sc->kind) {
+	case SORT_INT:
+		return intvalue(lhs) < intvalue(rhs);
+	case SORT_FLOAT:
+		return floatvalue(lhs) < floatvalue(rhs);
+	case SORT_STRING: {
+		SpnString *ls = stringvalue(lhs), *rs = stringvalue(rhs);
+		size_t minlen = ls->len < rs->len ? ls->len : rs->len;
+		int res = memcmp(ls->cstr, rs->cstr, minlen);
+		return res != 0 ? res < 0 : ls->len < rs->len;
+	}
+	case SORT_NUMBER:
+	case SORT_OBJECT:
+		return spn_value_compare(lhs, rhs) < 0;
+	case SORT_CUSTOM: {
+		int res;
+
+		/* once the callback has failed, don't call it again,
+		 * just let the sort run to completion
+		 */
+		if (sc->error) {
+			return 0;
+		}
+
+		res = sc->less(sc->ud, lhs, rhs);
+		if (res < 0) {
+			sc->error = 1;
+			return 0;
+		}
+
+		return res;
+	}
+	default:
+		SHANT_BE_REACHED();
+	}
+
+	return 0;
+}
+
+static void sort_swap(SpnValue *v, size_t i, size_t j)
+{
+	SpnValue tmp = v[i];
+	v[i] = v[j];
+	v[j] = tmp;
+}
+
+static void insertion_sort(SortCtx *sc, SpnValue *v, size_t lo, size_t hi)
+{
+	size_t i;
+
+	for (i = lo + 1; i < hi; i++) {
+		SpnValue x = v[i];
+		size_t j = i;
+
+		while (j > lo && sort_less(sc, &x, &v[j - 1])) {
+			v[j] = v[j - 1];
+			j--;
+		}
+
+		v[j] = x;
+	}
+}
+
+/* sifts the element at 'root' down the heap v[lo..lo+n) */
+static void sift_down(SortCtx *sc, SpnValue *v, size_t lo, size_t root, size_t n)
+{
+	for (;;) {
+		size_t child = 2 * root + 1;
+
+		if (child >= n) {
+			break;
+		}
+
+		if (child + 1 < n && sort_less(sc, &v[lo + child], &v[lo + child + 1])) {
+			child++;
+		}
+
+		if (!sort_less(sc, &v[lo + root], &v[lo + child])) {
+			break;
+		}
+
+		sort_swap(v, lo + root, lo + child);
+		root = child;
+	}
+}
+
+static void heap_sort(SortCtx *sc, SpnValue *v, size_t lo, size_t hi)
+{
+	size_t n = hi - lo;
+	size_t i;
+
+	for (i = n / 2; i > 0; i--) {
+		sift_down(sc, v, lo, i - 1, n);
+	}
+
+	for (i = n - 1; i > 0; i--) {
+		sort_swap(v, lo, lo + i);
+		sift_down(sc, v, lo, 0, i);
+	}
+}
+
+/* Moves the median of the first, middle and last elements to v[lo], then
+ * partitions v[lo..hi) around it. Both scans stop at elements equal to
+ * the pivot, which keeps the partitions balanced when there are many
+ * duplicates. The scans are bounds-checked, so an inconsistent comparator
+ * can produce a wrong order but never run off the range.
+ */
+static size_t partition(SortCtx *sc, SpnValue *v, size_t lo, size_t hi)
+{
+	size_t mid = lo + (hi - lo) / 2;
+	size_t i = lo, j = hi;
+	SpnValue pivot;
+
+	if (sort_less(sc, &v[mid], &v[lo])) {
+		sort_swap(v, mid, lo);
+	}
+
+	if (sort_less(sc, &v[hi - 1], &v[mid])) {
+		sort_swap(v, hi - 1, mid);
+
+		if (sort_less(sc, &v[mid], &v[lo])) {
+			sort_swap(v, mid, lo);
+		}
+	}
+
+	sort_swap(v, lo, mid);
+	pivot = v[lo];
+
+	for (;;) {
+		do {
+			i++;
+		} while (i < hi && sort_less(sc, &v[i], &pivot));
+
+		do {
+			j--;
+		} while (j > lo && sort_less(sc, &pivot, &v[j]));
+
+		if (i >= j) {
+			break;
+		}
+
+		sort_swap(v, i, j);
+	}
+
+	sort_swap(v, lo, j);
+	return j;
+}
+
+static void intro_sort(SortCtx *sc, SpnValue *v, size_t lo, size_t hi, unsigned depth)
+{
+	while (hi - lo > SORT_CUTOFF) {
+		size_t p;
+
+		if (depth == 0) {
+			heap_sort(sc, v, lo, hi);
+			return;
+		}
+
+		depth--;
+		p = partition(sc, v, lo, hi);
+
+		/* recurse into the smaller half and loop on the larger one,
+		 * so that the stack never grows beyond O(log n) frames
+		 */
+		if (p - lo < hi - p - 1) {
+			intro_sort(sc, v, lo, p, depth);
+			lo = p + 1;
+		} else {
+			intro_sort(sc, v, p + 1, hi, depth);
+			hi = p;
+		}
+	}
+
+	insertion_sort(sc, v, lo, hi);
+}
+
+static enum sort_kind natural_sort_kind(const SpnValue *v, size_t n)
+{
+	int ints = 0, floats = 0, strings = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (isint(&v[i])) {
+			ints++;
+		} else if (isfloat(&v[i])) {
+			floats++;
+		} else if (isstring(&v[i])) {
+			strings++;
+		} else {
+			return SORT_OBJECT;
+		}
+
+		if (strings && (ints || floats)) {
+			/* not comparable; let spn_value_compare() deal with it */
+			return SORT_OBJECT;
+		}
+	}
+
+	return strings ? SORT_STRING
+	     : floats == 0 ? SORT_INT
+	     : ints == 0 ? SORT_FLOAT
+	     : SORT_NUMBER;
+}
+
+int spn_array_sort(
+	SpnArray *arr,
+	int (*less)(void *ud, const SpnValue *lhs, const SpnValue *rhs),
+	void *ud
+)
+{
+	size_t n = arr->count;
+	unsigned depth = 0;
+	SortCtx sc;
+	size_t k;
+
+	if (n < 2) {
+		return 0;
+	}
+
+	/* 2 * floor(log2(n)) */
+	for (k = n; k > 1; k >>= 1) {
+		depth += 2;
+	}
+
+	sc.less = less;
+	sc.ud = ud;
+	sc.error = 0;
+
+	materialize(arr);
+
+	if (less == NULL) {
+		sc.kind = natural_sort_kind(arr->vector, n);
+		intro_sort(&sc, arr->vector, 0, n, depth);
+	} else {
+		/* The callback may run arbitrary code, which could even modify
+		 * or resize the array being sorted. Therefore, the elements are
+		 * sorted in a separate buffer, with a reference held to each one,
+		 * and they are only written back afterwards.
+		 */
+		SpnValue *buf = spn_malloc(n * sizeof buf[0]);
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			buf[i] = arr->vector[i];
+			spn_value_retain(&buf[i]);
+		}
+
+		sc.kind = SORT_CUSTOM;
+		intro_sort(&sc, buf, 0, n, depth);
+
+		/* the callback may have shared the array, too */
+		materialize(arr);
+
+		for (i = 0; i < n; i++) {
+			if (!sc.error && i < arr->count) {
+				spn_value_release(&arr->vector[i]);
+				arr->vector[i] = buf[i];
+			} else {
+				spn_value_release(&buf[i]);
+			}
+		}
+
+		free(buf);
+	}
+
+	return sc.error ? -1 : 0;
+}
+
 /* convenience value constructor */
 SpnValue spn_makearray(void)
 {
-	SpnValue ret;
-	ret.type = SPN_TYPE_ARRAY;
-	ret.v.o = spn_array_new();
-	return ret;
+	return makeobject(SPN_TYPE_ARRAY, spn_array_new());
 }
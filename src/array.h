@@ -40,17 +40,44 @@ SPN_API void spn_array_inject(SpnArray *arr, size_t index, SpnArray *other);
 /* inserts an element at the end */
 SPN_API void spn_array_push(SpnArray *arr, const SpnValue *val);
 
+/* inserts 'n' elements at the end, growing the array only once */
+SPN_API void spn_array_append(SpnArray *arr, const SpnValue *vals, size_t n);
+
 /* removes an element from the end */
 SPN_API void spn_array_pop(SpnArray *arr);
 
+/* returns a new array of the 'length' elements of 'arr' starting at
+ * 'index', or of all of its elements. These take constant time: the two
+ * arrays share the elements until either of them is modified, at which
+ * point it's given a copy of its own (see the comment in array.c).
+ */
+SPN_API SpnArray *spn_array_slice(SpnArray *arr, size_t index, size_t length);
+SPN_API SpnArray *spn_array_copy(SpnArray *arr);
+
+/* makes room for at least 'n' elements, without changing the size */
+SPN_API void spn_array_reserve(SpnArray *arr, size_t n);
+
 /* expand or shrink the array
  * inserts nils to/removes elements from the end
  */
 SPN_API void spn_array_setsize(SpnArray *arr, size_t newsize);
 
+/* sorts the array in place, in ascending order. If 'less' is NULL,
+ * the elements are ordered as by the '<' operator, and they must be
+ * comparable. Otherwise, 'less' must return nonzero if 'lhs' is ordered
+ * before 'rhs', zero if it isn't, and a negative value on error, in
+ * which case sorting is abandoned, the array is left untouched, and
+ * spn_array_sort() returns nonzero. Returns zero on success.
+ */
+SPN_API int spn_array_sort(
+	SpnArray *arr,
+	int (*less)(void *ud, const SpnValue *lhs, const SpnValue *rhs),
+	void *ud
+);
+
 /* convenience value constructor and accessor */
 SPN_API SpnValue spn_makearray(void);
 
-#define spn_arrayvalue(val) ((SpnArray *)((val)->v.o))
+#define spn_arrayvalue(val) ((SpnArray *)(spn_objvalue(val)))
 
 #endif /* SPN_ARRAY_H */
@@ -0,0 +1,410 @@
+/*
+ * ast.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Native, arena-allocated abstract syntax tree
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ast.h"
+#include "str.h"
+#include "private.h"
+
+
+#define AST_CHUNKSIZE (16 * 1024)
+
+/* for aligning allocations */
+typedef union AstAlign {
+	long l;
+	double d;
+	void *p;
+} AstAlign;
+
+/* the head of the list is the chunk currently being carved up */
+typedef struct SpnAstChunk {
+	struct SpnAstChunk *next;
+	size_t size;
+	AstAlign data[1];
+} SpnAstChunk;
+
+static const char *const key_names[SPN_AST_NKEYS] = {
+	"left",
+	"right",
+	"cond",
+	"true",
+	"false",
+	"then",
+	"else",
+	"init",
+	"increment",
+	"body",
+	"expr",
+	"object",
+	"index",
+	"func",
+	"key",
+	"value"
+};
+
+static SpnAstChunk *new_chunk(size_t size)
+{
+	SpnAstChunk *chunk = spn_malloc(offsetof(SpnAstChunk, data) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+static void *arena_alloc(SpnAstArena *arena, size_t size)
+{
+	SpnAstChunk *chunk = arena->chunks;
+
+	size = ROUNDUP(size, sizeof(AstAlign)) * sizeof(AstAlign);
+
+	if (chunk == NULL || arena->used + size > chunk->size) {
+		/* big blocks get their own chunk, so that the rest
+		 * of the current one isn't thrown away
+		 */
+		if (chunk != NULL && size > AST_CHUNKSIZE / 4) {
+			SpnAstChunk *big = new_chunk(size);
+			big->next = chunk->next;
+			chunk->next = big;
+			return big->data;
+		}
+
+		chunk = new_chunk(size > AST_CHUNKSIZE ? size : AST_CHUNKSIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->used = 0;
+	}
+
+	arena->used += size;
+	return (char *)(chunk->data) + arena->used - size;
+}
+
+void spn_ast_arena_init(SpnAstArena *arena)
+{
+	arena->chunks = NULL;
+	arena->used = 0;
+	arena->nodes = NULL;
+}
+
+static void release_nodes(SpnAstArena *arena)
+{
+	SpnAst *node;
+
+	for (node = arena->nodes; node != NULL; node = node->next) {
+		spn_value_release(&node->value);
+		spn_value_release(&node->name);
+
+		if (node->declargs != NULL) {
+			spn_object_release(node->declargs);
+		}
+	}
+
+	arena->nodes = NULL;
+}
+
+void spn_ast_arena_reset(SpnAstArena *arena)
+{
+	SpnAstChunk *chunk;
+
+	release_nodes(arena);
+
+	if (arena->chunks == NULL) {
+		return;
+	}
+
+	/* keep the current chunk around for the next tree */
+	chunk = arena->chunks->next;
+	while (chunk != NULL) {
+		SpnAstChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	arena->chunks->next = NULL;
+	arena->used = 0;
+}
+
+void spn_ast_arena_free(SpnAstArena *arena)
+{
+	spn_ast_arena_reset(arena);
+	free(arena->chunks);
+	arena->chunks = NULL;
+}
+
+SpnAst *spn_ast_new(SpnAstArena *arena, const char *type, SpnSourceLocation loc)
+{
+	SpnAst *node = arena_alloc(arena, sizeof *node);
+
+	node->type = type;
+	node->loc = loc;
+	node->value = spn_nilval;
+	node->name = spn_nilval;
+	node->declargs = NULL;
+	node->children = NULL;
+	node->nchildren = 0;
+	node->capchildren = 0;
+	node->haschildren = 0;
+	node->nkids = 0;
+	node->namepos = 0;
+
+	node->next = arena->nodes;
+	arena->nodes = node;
+
+	return node;
+}
+
+void spn_ast_set_value(SpnAst *node, const SpnValue *value)
+{
+	spn_value_retain(value);
+	spn_value_release(&node->value);
+	node->value = *value;
+}
+
+void spn_ast_set_name(SpnAst *node, const SpnValue *name)
+{
+	assert(isstring(name) || isnil(name));
+
+	spn_value_retain(name);
+	spn_value_release(&node->name);
+	node->name = *name;
+	node->namepos = node->nkids;
+}
+
+void spn_ast_set_declargs(SpnAst *node, SpnArray *declargs)
+{
+	if (declargs != NULL) {
+		spn_object_retain(declargs);
+	}
+
+	if (node->declargs != NULL) {
+		spn_object_release(node->declargs);
+	}
+
+	node->declargs = declargs;
+}
+
+void spn_ast_set_child(SpnAst *node, enum spn_ast_key key, SpnAst *child)
+{
+	unsigned i;
+
+	for (i = 0; i < node->nkids; i++) {
+		if (node->kidkeys[i] == key) {
+			node->kids[i] = child;
+			return;
+		}
+	}
+
+	assert(node->nkids < SPN_AST_MAXKIDS);
+
+	node->kidkeys[node->nkids] = key;
+	node->kids[node->nkids] = child;
+	node->nkids++;
+}
+
+SpnAst *spn_ast_get_child(const SpnAst *node, enum spn_ast_key key)
+{
+	unsigned i;
+
+	for (i = 0; i < node->nkids; i++) {
+		if (node->kidkeys[i] == key) {
+			return node->kids[i];
+		}
+	}
+
+	return NULL;
+}
+
+void spn_ast_push_child(SpnAstArena *arena, SpnAst *node, SpnAst *child)
+{
+	if (node->nchildren >= node->capchildren) {
+		/* the old array is left to the arena */
+		size_t newcap = node->capchildren ? 2 * node->capchildren : 4;
+		SpnAst **children = arena_alloc(arena, newcap * sizeof children[0]);
+
+		if (node->nchildren > 0) {
+			memcpy(children, node->children, node->nchildren * sizeof children[0]);
+		}
+
+		node->children = children;
+		node->capchildren = newcap;
+	}
+
+	node->children[node->nchildren++] = child;
+	node->haschildren = 1;
+}
+
+/* Materializing hashmaps
+ * ----------------------
+ *
+ * Keys, like the node types, are string literals, so we use
+ * 'makestring_nocopy()' to avoid extraneous dynamic allocation.
+ */
+static void set_property(SpnHashMap *hm, const char *key, const SpnValue *val)
+{
+	SpnValue pname = makestring_nocopy(key);
+	spn_hashmap_set(hm, &pname, val);
+	spn_value_release(&pname);
+}
+
+SpnHashMap *spn_ast_to_hashmap(const SpnAst *node)
+{
+	SpnHashMap *hm = spn_hashmap_new();
+	SpnValue type = makestring_nocopy(node->type);
+	SpnValue line = makeint(node->loc.line);
+	SpnValue column = makeint(node->loc.column);
+	unsigned i;
+
+	set_property(hm, "type", &type);
+	set_property(hm, "line", &line);
+	set_property(hm, "column", &column);
+	spn_value_release(&type);
+
+	if (node->haschildren) {
+		SpnValue children = makearray();
+		size_t j;
+
+		for (j = 0; j < node->nchildren; j++) {
+			SpnValue child = makeobject(SPN_TYPE_HASHMAP, spn_ast_to_hashmap(node->children[j]));
+			spn_array_push(arrayvalue(&children), &child);
+			spn_value_release(&child);
+		}
+
+		set_property(hm, "children", &children);
+		spn_value_release(&children);
+	}
+
+	/* setting nil is a no-op here, just as in the parser */
+	set_property(hm, "value", &node->value);
+
+	if (node->declargs != NULL) {
+		SpnValue declargs = makeobject(SPN_TYPE_ARRAY, node->declargs);
+		set_property(hm, "declargs", &declargs);
+	}
+
+	/* the order of insertion is visible when iterating over the
+	 * hashmap, so the name goes where the parser has set it
+	 */
+	for (i = 0; i <= node->nkids; i++) {
+		SpnValue child;
+
+		if (i == node->namepos) {
+			set_property(hm, "name", &node->name);
+		}
+
+		if (i == node->nkids) {
+			break;
+		}
+
+		child = makeobject(SPN_TYPE_HASHMAP, spn_ast_to_hashmap(node->kids[i]));
+		set_property(hm, key_names[node->kidkeys[i]], &child);
+		spn_value_release(&child);
+	}
+
+	return hm;
+}
+
+/* Lowering hashmaps
+ * -----------------
+ */
+static long int_property(SpnHashMap *hm, const char *key)
+{
+	SpnValue val = spn_hashmap_get_strkey(hm, key);
+	return isint(&val) ? intvalue(&val) : 0;
+}
+
+SpnAst *spn_ast_from_hashmap(SpnAstArena *arena, SpnHashMap *hm)
+{
+	SpnAst *node;
+	SpnSourceLocation loc;
+	SpnValue type, name, declargs, children;
+	char *typebuf;
+	int is_kvpair;
+	int i;
+
+	type = spn_hashmap_get_strkey(hm, "type");
+	name = spn_hashmap_get_strkey(hm, "name");
+	declargs = spn_hashmap_get_strkey(hm, "declargs");
+	children = spn_hashmap_get_strkey(hm, "children");
+
+	if (!isstring(&type)
+	 || !(isstring(&name) || isnil(&name))
+	 || !(isarray(&declargs) || isnil(&declargs))
+	 || !(isarray(&children) || isnil(&children))) {
+		return NULL;
+	}
+
+	/* the hashmap may not outlive the arena, so copy the type */
+	typebuf = arena_alloc(arena, stringvalue(&type)->len + 1);
+	memcpy(typebuf, stringvalue(&type)->cstr, stringvalue(&type)->len + 1);
+
+	loc.line = int_property(hm, "line");
+	loc.column = int_property(hm, "column");
+
+	node = spn_ast_new(arena, typebuf, loc);
+	spn_ast_set_name(node, &name);
+
+	/* "value" is a child of key-value pairs, and a property otherwise */
+	is_kvpair = strcmp(typebuf, "kvpair") == 0;
+
+	if (!is_kvpair) {
+		SpnValue value = spn_hashmap_get_strkey(hm, "value");
+		spn_ast_set_value(node, &value);
+	}
+
+	if (isarray(&declargs)) {
+		spn_ast_set_declargs(node, arrayvalue(&declargs));
+	}
+
+	if (isarray(&children)) {
+		SpnArray *arr = arrayvalue(&children);
+		size_t n = spn_array_count(arr);
+		size_t j;
+
+		node->haschildren = 1;
+
+		for (j = 0; j < n; j++) {
+			SpnValue elem = spn_array_get(arr, j);
+			SpnAst *child;
+
+			if (!ishashmap(&elem)) {
+				return NULL;
+			}
+
+			child = spn_ast_from_hashmap(arena, hashmapvalue(&elem));
+			if (child == NULL) {
+				return NULL;
+			}
+
+			spn_ast_push_child(arena, node, child);
+		}
+	}
+
+	for (i = 0; i < SPN_AST_NKEYS; i++) {
+		SpnValue val = spn_hashmap_get_strkey(hm, key_names[i]);
+		SpnAst *child;
+
+		if (isnil(&val) || (i == SPN_AST_VALUE && !is_kvpair)) {
+			continue;
+		}
+
+		if (!ishashmap(&val) || node->nkids >= SPN_AST_MAXKIDS) {
+			return NULL;
+		}
+
+		child = spn_ast_from_hashmap(arena, hashmapvalue(&val));
+		if (child == NULL) {
+			return NULL;
+		}
+
+		spn_ast_set_child(node, i, child);
+	}
+
+	return node;
+}
@@ -0,0 +1,112 @@
+/*
+ * ast.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Native, arena-allocated abstract syntax tree
+ */
+
+#ifndef SPN_AST_H
+#define SPN_AST_H
+
+#include <stddef.h>
+
+#include "api.h"
+#include "array.h"
+#include "hashmap.h"
+#include "lex.h"
+
+/* The parser builds the AST out of these nodes, and the compiler walks
+ * them directly. The hashmap representation (nodes with a "type", "line",
+ * "column" and so on) is only materialized when it is requested by the
+ * user, e. g. via spn_parser_parse() or the 'parse()' library function.
+ */
+
+/* keys of named children, e. g. the "left" and "right" operands
+ * of a binary operator or the "cond" and "body" of a loop
+ */
+enum spn_ast_key {
+	SPN_AST_LEFT,
+	SPN_AST_RIGHT,
+	SPN_AST_COND,
+	SPN_AST_TRUE,
+	SPN_AST_FALSE,
+	SPN_AST_THEN,
+	SPN_AST_ELSE,
+	SPN_AST_INIT,
+	SPN_AST_INCREMENT,
+	SPN_AST_BODY,
+	SPN_AST_EXPR,
+	SPN_AST_OBJECT,
+	SPN_AST_INDEX,
+	SPN_AST_FUNC,
+	SPN_AST_KEY,
+	SPN_AST_VALUE,
+	SPN_AST_NKEYS
+};
+
+/* no node has more named children than a 'for' loop */
+#define SPN_AST_MAXKIDS 4
+
+typedef struct SpnAst {
+	const char *type;             /* node type, e. g. "literal" or "while"  */
+	SpnSourceLocation loc;        /* location of the node in the source     */
+	SpnValue value;               /* value of literals, nil otherwise       */
+	SpnValue name;                /* string or nil; identifiers etc.        */
+	SpnArray *declargs;           /* parameter names of functions, or NULL  */
+	struct SpnAst **children;     /* statements, elements, call arguments   */
+	size_t nchildren;
+	size_t capchildren;
+	int haschildren;              /* nonzero if "children" is materialized  */
+	unsigned nkids;               /* number of named children               */
+	unsigned namepos;             /* private: nkids when the name was set   */
+	unsigned char kidkeys[SPN_AST_MAXKIDS];
+	struct SpnAst *kids[SPN_AST_MAXKIDS];
+	struct SpnAst *next;          /* private: nodes of the same arena       */
+} SpnAst;
+
+/* An arena owns all the nodes allocated from it (including their values
+ * and children arrays); they are freed together by a single call to
+ * spn_ast_arena_reset() or spn_ast_arena_free().
+ */
+typedef struct SpnAstArena {
+	struct SpnAstChunk *chunks;   /* private */
+	size_t used;                  /* private */
+	SpnAst *nodes;                /* private */
+} SpnAstArena;
+
+SPN_API void spn_ast_arena_init(SpnAstArena *arena);
+
+/* frees every node; the arena can then be reused */
+SPN_API void spn_ast_arena_reset(SpnAstArena *arena);
+SPN_API void spn_ast_arena_free(SpnAstArena *arena);
+
+/* 'type' is not copied, so it must outlive the arena (the parser always
+ * passes string literals). The new node has no value, name or children.
+ */
+SPN_API SpnAst *spn_ast_new(SpnAstArena *arena, const char *type, SpnSourceLocation loc);
+
+/* these retain the new value and release the old one */
+SPN_API void spn_ast_set_value(SpnAst *node, const SpnValue *value);
+SPN_API void spn_ast_set_name(SpnAst *node, const SpnValue *name);
+SPN_API void spn_ast_set_declargs(SpnAst *node, SpnArray *declargs);
+
+/* named children. spn_ast_get_child() returns NULL if there's no such child */
+SPN_API void spn_ast_set_child(SpnAst *node, enum spn_ast_key key, SpnAst *child);
+SPN_API SpnAst *spn_ast_get_child(const SpnAst *node, enum spn_ast_key key);
+
+/* appends 'child' to the "children" of 'node' */
+SPN_API void spn_ast_push_child(SpnAstArena *arena, SpnAst *node, SpnAst *child);
+
+/* builds the hashmap representation of the tree rooted at 'node' */
+SPN_API SpnHashMap *spn_ast_to_hashmap(const SpnAst *node);
+
+/* converts a hashmap AST (for instance, one that was constructed by a
+ * script) into native nodes allocated from 'arena'. Returns NULL if
+ * the tree is malformed, e. g. if a node has no type, or a named child
+ * is not a hashmap.
+ */
+SPN_API SpnAst *spn_ast_from_hashmap(SpnAstArena *arena, SpnHashMap *hm);
+
+#endif /* SPN_AST_H */
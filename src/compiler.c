@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "compiler.h"
 #include "parser.h"
@@ -21,6 +22,7 @@
 #include "private.h"
 #include "func.h"
 #include "debug.h"
+#include "ast.h"
 
 
 typedef struct Bytecode {
@@ -76,6 +78,9 @@ struct SpnCompiler {
 	UpvalChain            *upval_chain; /* (VII)  */
 	SpnSourceLocation      error_loc;   /* (VIII) */
 	SpnHashMap            *debug_info;  /* (IX)   */
+	spn_uword              ncaches;     /* (X)    */
+	int                    optlevel;    /* (XI)   */
+	int                    tailcall;    /* (XII)  */
 };
 
 /* Remarks:
@@ -117,6 +122,17 @@ struct SpnCompiler {
  * (IX): the debug information maps bytecode addresses to line and character
  * numbers, and register numbers to variable names.
  * This member may be NULL, in which case no debug information is emitted.
+ *
+ * (X): the number of member lookup inline caches allocated so far in the
+ * program being compiled. Each member lookup instruction gets its own one.
+ *
+ * (XI): the optimization level (see 'enum spn_opt_level' in compiler.h).
+ * It is a setting of the compiler object rather than that of a single
+ * compilation, so it is preserved across calls to spn_compiler_compile().
+ *
+ * (XII): nonzero while compiling the expression of a 'return' statement
+ * which is a function call, until compile_call() picks it up and emits
+ * SPN_INS_TAILCALL instead of SPN_INS_CALL (see Remark (XVI) in vm.h).
  */
 
 /* information describing the state of the global scope or a function scope.
@@ -239,7 +255,8 @@ static const SpnClass SymtabEntry_class = {
 	symtabentry_equal,
 	NULL,
 	symtabentry_hash,
-	symtabentry_free
+	symtabentry_free,
+	NULL
 };
 
 static SymtabEntry *symtabentry_new_global(SpnString *name)
@@ -271,32 +288,36 @@ static SymtabEntry *symtabentry_new_function(ptrdiff_t offset, SpnString *name)
 /****************************************/
 
 /* compile_*() functions return nonzero on success, 0 on error */
-static int compile(SpnCompiler *cmp, SpnHashMap *ast);
-
-static int compile_program(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_block(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_funcdef(SpnCompiler *cmp, SpnHashMap *ast, int *symidx, SpnArray *upvalues);
-static int compile_while(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_do(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_for(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_if(SpnCompiler *cmp, SpnHashMap *ast);
-
-static int compile_break(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_continue(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_vardecl(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_const(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_return(SpnCompiler *cmp, SpnHashMap *ast);
-static int compile_empty(SpnCompiler *cmp, SpnHashMap *ast);
+static int compile(SpnCompiler *cmp, SpnAst *ast);
+
+static int compile_program(SpnCompiler *cmp, SpnAst *ast);
+static int compile_block(SpnCompiler *cmp, SpnAst *ast);
+static int compile_funcdef(SpnCompiler *cmp, SpnAst *ast, int *symidx, SpnArray *upvalues);
+static int compile_while(SpnCompiler *cmp, SpnAst *ast);
+static int compile_do(SpnCompiler *cmp, SpnAst *ast);
+static int compile_for(SpnCompiler *cmp, SpnAst *ast);
+static int compile_if(SpnCompiler *cmp, SpnAst *ast);
+
+static int compile_break(SpnCompiler *cmp, SpnAst *ast);
+static int compile_continue(SpnCompiler *cmp, SpnAst *ast);
+static int compile_vardecl(SpnCompiler *cmp, SpnAst *ast);
+static int compile_const(SpnCompiler *cmp, SpnAst *ast);
+static int compile_return(SpnCompiler *cmp, SpnAst *ast);
+static int compile_empty(SpnCompiler *cmp, SpnAst *ast);
 
 /* compile and load string literal */
 static void compile_string_literal(SpnCompiler *cmp, SpnValue str, int *dst);
 
+/* optimizations */
+static int fold_constant(SpnAst *ast, SpnValue *result);
+static int ast_mentions_name(SpnAst *node, const SpnValue *name);
+
 /* 'dst' is a pointer to 'int' that will be filled with the index of the
  * destination register (i. e. the one holding the result of the expression)
  * pass 'NULL' if you don't need this information (e. g. when an expression
  * is merely evaluated for its side effects)
  */
-static int compile_expr_toplevel(SpnCompiler *cmp, SpnHashMap *ast, int *dst);
+static int compile_expr_toplevel(SpnCompiler *cmp, SpnAst *ast, int *dst);
 
 /* dst is the preferred destination register index. Pass a pointer to
  * a non-negative 'int' to force the function to emit an instruction
@@ -304,10 +325,10 @@ static int compile_expr_toplevel(SpnCompiler *cmp, SpnHashMap *ast, int *dst);
  * to by 'dst' is initially negative, then the function decides which
  * register to use as the destination, then sets '*dst' accordingly.
  */
-static int compile_expr(SpnCompiler *cmp, SpnHashMap *ast, int *dst);
+static int compile_expr(SpnCompiler *cmp, SpnAst *ast, int *dst);
 
 /* takes a printf-like format string */
-static void compiler_error(SpnCompiler *cmp, SpnHashMap *ast, const char *fmt, const void *args[]);
+static void compiler_error(SpnCompiler *cmp, SpnAst *ast, const char *fmt, const void *args[]);
 
 /* quick and dirty integer maximum function */
 static int max(int x, int y)
@@ -318,34 +339,13 @@ static int max(int x, int y)
 /* Helper functions for walking the AST and
  * obtaining various properties thereof along the way
  */
-static SpnString *ast_get_string(SpnHashMap *ast, const char *key)
-{
-	SpnValue value = spn_hashmap_get_strkey(ast, key);
-	assert(isstring(&value));
-	return stringvalue(&value);
-}
-
-static SpnString *ast_get_string_optional(SpnHashMap *ast, const char *key)
-{
-	SpnValue value = spn_hashmap_get_strkey(ast, key);
-	assert(isstring(&value) || isnil(&value));
-	return isstring(&value) ? stringvalue(&value) : NULL;
-}
-
-static SpnArray *ast_get_array(SpnHashMap *ast, const char *key)
-{
-	SpnValue value = spn_hashmap_get_strkey(ast, key);
-	assert(isarray(&value));
-	return arrayvalue(&value);
-}
 
 /* used for getting the type of an AST node.
  * Returns a (non-owning) pointer to the type string inside the AST node.
  */
-static const char *ast_get_type(SpnHashMap *ast)
+static const char *ast_get_type(SpnAst *ast)
 {
-	SpnString *typestr = ast_get_string(ast, "type");
-	return typestr->cstr;
+	return ast->type;
 }
 
 /* returns nonzero if the two node type strings are equal, and zero otherwise */
@@ -354,43 +354,16 @@ static int type_equal(const char *p, const char *q)
 	return strcmp(p, q) == 0;
 }
 
-static SpnArray *ast_get_children(SpnHashMap *ast)
+static SpnAst *ast_get_child_byname(SpnAst *ast, enum spn_ast_key key)
 {
-	return ast_get_array(ast, "children");
+	SpnAst *child = spn_ast_get_child(ast, key);
+	assert(child != NULL);
+	return child;
 }
 
-static SpnHashMap *ast_get_nth_child(SpnArray *children, size_t index)
+static SpnAst *ast_get_child_byname_optional(SpnAst *ast, enum spn_ast_key key)
 {
-	SpnValue child_val = spn_array_get(children, index);
-	assert(ishashmap(&child_val));
-	return hashmapvalue(&child_val);
-}
-
-static SpnHashMap *ast_get_child_byname(SpnHashMap *ast, const char *key)
-{
-	SpnValue child = spn_hashmap_get_strkey(ast, key);
-	assert(ishashmap(&child));
-	return hashmapvalue(&child);
-}
-
-static SpnHashMap *ast_get_child_byname_optional(SpnHashMap *ast, const char *key)
-{
-	SpnValue child = spn_hashmap_get_strkey(ast, key);
-	assert(ishashmap(&child) || isnil(&child));
-	return ishashmap(&child) ? hashmapvalue(&child) : NULL;
-}
-
-static SpnHashMap *ast_shallow_copy(SpnHashMap *ast)
-{
-	size_t cursor = 0;
-	SpnValue key, val;
-	SpnHashMap *dup = spn_hashmap_new();
-
-	while ((cursor = spn_hashmap_next(ast, cursor, &key, &val)) != 0) {
-		spn_hashmap_set(dup, &key, &val);
-	}
-
-	return dup;
+	return spn_ast_get_child(ast, key);
 }
 
 /* these functions execute "push" and "pop" operations on the operand stack
@@ -440,6 +413,8 @@ SpnCompiler *spn_compiler_new(void)
 	cmp->upval_chain = NULL;
 	cmp->error_loc.line = 0;
 	cmp->error_loc.column = 0;
+	cmp->optlevel = SPN_OPT_DEFAULT;
+	cmp->tailcall = 0;
 
 	return cmp;
 }
@@ -451,9 +426,30 @@ void spn_compiler_free(SpnCompiler *cmp)
 }
 
 SpnFunction *spn_compiler_compile(SpnCompiler *cmp, SpnHashMap *ast, int debug)
+{
+	SpnFunction *fn;
+	SpnAstArena arena;
+	SpnAst *root;
+
+	spn_ast_arena_init(&arena);
+	root = spn_ast_from_hashmap(&arena, ast);
+
+	if (root != NULL) {
+		fn = spn_compiler_compile_ast(cmp, root, debug);
+	} else {
+		compiler_error(cmp, NULL, "malformed AST", NULL);
+		fn = NULL;
+	}
+
+	spn_ast_arena_free(&arena);
+	return fn;
+}
+
+SpnFunction *spn_compiler_compile_ast(SpnCompiler *cmp, SpnAst *ast, int debug)
 {
 	bytecode_init(&cmp->bc);
 	cmp->debug_info = debug ? spn_dbg_new() : NULL;
+	cmp->ncaches = 0;
 
 	if (compile_program(cmp, ast)) {
 		/* should be at global scope when compilation is done */
@@ -462,6 +458,7 @@ SpnFunction *spn_compiler_compile(SpnCompiler *cmp, SpnHashMap *ast, int debug)
 		/* success. transfer ownership of cmp->bc.insns
 		 * and that of cmp->debug_info to the result.
 		 */
+		spn_dbg_finish(cmp->debug_info);
 		return spn_func_new_topprg(SPN_TOPFN, cmp->bc.insns, cmp->bc.len, cmp->debug_info);
 	}
 
@@ -485,6 +482,16 @@ SpnSourceLocation spn_compiler_errloc(SpnCompiler *cmp)
 	return cmp->error_loc;
 }
 
+void spn_compiler_setoptlevel(SpnCompiler *cmp, int level)
+{
+	cmp->optlevel = level;
+}
+
+int spn_compiler_getoptlevel(SpnCompiler *cmp)
+{
+	return cmp->optlevel;
+}
+
 /* Map AST node types to virtual machine instruction opcodes */
 typedef struct NodeAndOpcode {
 	const char *type;
@@ -699,6 +706,25 @@ static void emit_ins_long(SpnCompiler *cmp, enum spn_vm_ins opcode,
 	bytecode_append(&cmp->bc, &ins, 1);
 }
 
+/* Emits an instruction that indexes into an array or an object.
+ * The member lookup instructions (SPN_INS_METHOD, SPN_INS_PROPGET and
+ * SPN_INS_PROPSET) are followed by the index of their inline cache
+ * (see Remark (XII) in vm.h); the rest is emitted as a plain ABC-type
+ * instruction.
+ */
+static void emit_ins_member(SpnCompiler *cmp, enum spn_vm_ins opcode,
+	unsigned char a, unsigned char b, unsigned char c)
+{
+	emit_ins_ABC(cmp, opcode, a, b, c);
+
+	if (opcode == SPN_INS_METHOD
+	 || opcode == SPN_INS_PROPGET
+	 || opcode == SPN_INS_PROPSET) {
+		spn_uword cacheidx = cmp->ncaches++;
+		bytecode_append(&cmp->bc, &cacheidx, 1);
+	}
+}
+
 /* These are overloads with opcode of type 'enum spn_local_symbol',
  * so that the compiler leaves us alone.
  * Also, it is clearer that we are messing around with the local symbol table
@@ -796,16 +822,15 @@ static void rts_free(RoundTripStore *rts)
 }
 
 
-static void compiler_error(SpnCompiler *cmp, SpnHashMap *ast, const char *fmt, const void *args[])
+static void compiler_error(SpnCompiler *cmp, SpnAst *ast, const char *fmt, const void *args[])
 {
-	SpnValue line = spn_hashmap_get_strkey(ast, "line");
-	SpnValue column = spn_hashmap_get_strkey(ast, "column");
-
-	assert(isint(&line));
-	assert(isint(&column));
-
-	cmp->error_loc.line = intvalue(&line);
-	cmp->error_loc.column = intvalue(&column);
+	/* some errors are not associated with a node */
+	if (ast != NULL) {
+		cmp->error_loc = ast->loc;
+	} else {
+		cmp->error_loc.line = 0;
+		cmp->error_loc.column = 0;
+	}
 
 	free(cmp->errmsg);
 	cmp->errmsg = spn_string_format_cstr(fmt, NULL, args);
@@ -815,14 +840,14 @@ static void compiler_error(SpnCompiler *cmp, SpnHashMap *ast, const char *fmt, c
  * so it doesn't return the destination register index. DO NOT use this
  * if the resut of an expression shall be known.
  */
-static int compile(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile(SpnCompiler *cmp, SpnAst *ast)
 {
 	size_t i;
 	const char *nodetype = ast_get_type(ast);
 
 	static const struct {
 		const char *node;
-		int (*fn)(SpnCompiler *, SpnHashMap *);
+		int (*fn)(SpnCompiler *, SpnAst *);
 	} compilers[] = {
 		{ "block",     compile_block    },
 		{ "if",        compile_if       },
@@ -944,14 +969,14 @@ static void append_return_nil(SpnCompiler *cmp)
 	}
 }
 
-static int compile_children(SpnCompiler *cmp, SpnHashMap *root)
+static int compile_children(SpnCompiler *cmp, SpnAst *root)
 {
-	SpnArray *children = ast_get_children(root);
-	size_t n_children = spn_array_count(children);
+	SpnAst **children = root->children;
+	size_t n_children = root->nchildren;
 
 	size_t i;
 	for (i = 0; i < n_children; i++) {
-		SpnHashMap *child = ast_get_nth_child(children, i);
+		SpnAst *child = children[i];
 
 		if (compile(cmp, child) == 0) {
 			return 0;
@@ -961,7 +986,7 @@ static int compile_children(SpnCompiler *cmp, SpnHashMap *root)
 	return 1;
 }
 
-static int compile_program(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_program(SpnCompiler *cmp, SpnAst *ast)
 {
 	int regcnt;
 	RoundTripStore symtab, glbvars;
@@ -1031,7 +1056,7 @@ static int compile_program(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_block(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_block(SpnCompiler *cmp, SpnAst *ast)
 {
 	/* block -> new lexical scope, "push" a new set of variable names on
 	 * the stack. This is done by keeping track of the current length of
@@ -1050,7 +1075,7 @@ static int compile_block(SpnCompiler *cmp, SpnHashMap *ast)
 	return success;
 }
 
-static int compile_funcdef(SpnCompiler *cmp, SpnHashMap *ast, int *symidx, SpnArray *upvalues)
+static int compile_funcdef(SpnCompiler *cmp, SpnAst *ast, int *symidx, SpnArray *upvalues)
 {
 	int regcount;
 	spn_uword fnhdr[SPN_FUNCHDR_LEN] = { 0 };
@@ -1062,9 +1087,9 @@ static int compile_funcdef(SpnCompiler *cmp, SpnHashMap *ast, int *symidx, SpnAr
 	SpnValue offval;
 
 	/* obtain argument list, (optional) function name and body */
-	SpnArray *declargs = ast_get_array(ast, "declargs");
-	SpnString *funcname = ast_get_string_optional(ast, "name");
-	SpnHashMap *body = ast_get_child_byname(ast, "body");
+	SpnArray *declargs = ast->declargs;
+	SpnString *funcname = isstring(&ast->name) ? stringvalue(&ast->name) : NULL;
+	SpnAst *body = ast_get_child_byname(ast, SPN_AST_BODY);
 
 	/* self-examination (transitions are hard) */
 	assert(type_equal(ast_get_type(ast), "function"));
@@ -1107,7 +1132,7 @@ static int compile_funcdef(SpnCompiler *cmp, SpnHashMap *ast, int *symidx, SpnAr
 	spn_object_release(entry);
 
 	/* bring each declared argument in scope */
-	argc = spn_array_count(declargs);
+	argc = declargs != NULL ? spn_array_count(declargs) : 0;
 
 	for (i = 0; i < argc; i++) {
 		SpnValue argname = spn_array_get(declargs, i);
@@ -1173,6 +1198,96 @@ static int compile_funcdef(SpnCompiler *cmp, SpnHashMap *ast, int *symidx, SpnAr
 	return 1;
 }
 
+/* Compiles the condition of a loop or an 'if' statement, followed by a
+ * stub for the conditional jump. The jump is taken if the condition is
+ * false, or if it's true in case 'jump_if_true' is nonzero. On success,
+ * '*off_stub' is the offset of the stub, and '*jmpins' is the instruction
+ * word of the jump; the caller fills in the stub once the offset of the
+ * target is known. If the condition is a constant and the jump is never
+ * taken, then no stub is emitted, and '*off_stub' is set to -1.
+ */
+static int compile_condjump(SpnCompiler *cmp, SpnAst *cond,
+	int jump_if_true, spn_sword *off_stub, spn_uword *jmpins)
+{
+	static const NodeAndOpcode comparisons[] = {
+		{ "==", SPN_INS_EQ },
+		{ "!=", SPN_INS_NE },
+		{ "<",  SPN_INS_LT },
+		{ "<=", SPN_INS_LE },
+		{ ">",  SPN_INS_GT },
+		{ ">=", SPN_INS_GE }
+	};
+
+	spn_uword stub[2] = { 0 };
+	int reg = -1;
+
+	if (cmp->optlevel > SPN_OPT_NONE) {
+		const char *type = ast_get_type(cond);
+		SpnValue value;
+		size_t i;
+
+		/* constant condition: the jump is either always or never taken */
+		if (fold_constant(cond, &value)) {
+			int is_bool = isbool(&value);
+			int truth = is_bool && boolvalue(&value);
+			spn_value_release(&value);
+
+			if (is_bool) {
+				if (truth == (jump_if_true != 0)) {
+					*off_stub = cmp->bc.len;
+					*jmpins = SPN_MKINS_VOID(SPN_INS_JMP);
+					bytecode_append(&cmp->bc, stub, COUNT(stub));
+				} else {
+					*off_stub = -1;
+				}
+
+				return 1;
+			}
+		}
+
+		/* comparison: fuse it with the jump */
+		for (i = 0; i < COUNT(comparisons); i++) {
+			if (type_equal(type, comparisons[i].type)) {
+				SpnAst *left = ast_get_child_byname(cond, SPN_AST_LEFT);
+				SpnAst *right = ast_get_child_byname(cond, SPN_AST_RIGHT);
+				size_t begin = cmp->bc.len;
+				int lreg = -1, rreg = -1;
+
+				cmp->tmpidx = rts_count(cmp->varstack);
+
+				if (compile_expr(cmp, left, &lreg) == 0
+				 || compile_expr(cmp, right, &rreg) == 0) {
+					return 0;
+				}
+
+				*off_stub = cmp->bc.len;
+				*jmpins = SPN_MKINS_ABC(
+					jump_if_true ? SPN_INS_CMPJNZ : SPN_INS_CMPJZE,
+					comparisons[i].opcode,
+					lreg,
+					rreg
+				);
+				bytecode_append(&cmp->bc, stub, COUNT(stub));
+
+				/* errors of the comparison map back to the condition */
+				spn_dbg_emit_source_location(cmp->debug_info, begin, cmp->bc.len, cond->loc, -1);
+
+				return 1;
+			}
+		}
+	}
+
+	if (compile_expr_toplevel(cmp, cond, &reg) == 0) {
+		return 0;
+	}
+
+	*off_stub = cmp->bc.len;
+	*jmpins = SPN_MKINS_A(jump_if_true ? SPN_INS_JNZ : SPN_INS_JZE, reg);
+	bytecode_append(&cmp->bc, stub, COUNT(stub));
+
+	return 1;
+}
+
 /* helper function for filling in jump list (list of 'break' and 'continue'
  * statements) in a while, do-while or for loop.
  *
@@ -1204,18 +1319,18 @@ static void fix_and_free_jump_list(SpnCompiler *cmp, spn_sword off_end, spn_swor
 	}
 }
 
-static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_while(SpnCompiler *cmp, SpnAst *ast)
 {
-	int cndidx = -1;
 	spn_uword ins[2] = { 0 }; /* stub */
+	spn_uword cndjmp;
 	spn_sword off_cond, off_cndjmp, off_body, off_jmpback, off_end;
 
 	/* save old loop state */
 	int is_in_loop = cmp->is_in_loop;
 	struct jump_stmt_list *orig_jumplist = cmp->jumplist;
 
-	SpnHashMap *condition = ast_get_child_byname(ast, "cond");
-	SpnHashMap *body = ast_get_child_byname(ast, "body");
+	SpnAst *condition = ast_get_child_byname(ast, SPN_AST_COND);
+	SpnAst *body = ast_get_child_byname(ast, SPN_AST_BODY);
 
 	/* set up new loop state */
 	cmp->is_in_loop = 1;
@@ -1224,21 +1339,16 @@ static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 	/* save offset of condition */
 	off_cond = cmp->bc.len;
 
-	/* compile condition
+	/* compile condition and jump over the loop body if it is false
 	 * on error, clean up, restore jumplist
 	 * no need to free it -- it's empty so far
 	 */
-	if (compile_expr_toplevel(cmp, condition, &cndidx) == 0) {
+	if (compile_condjump(cmp, condition, 0, &off_cndjmp, &cndjmp) == 0) {
 		cmp->jumplist = orig_jumplist;
 		cmp->is_in_loop = is_in_loop;
 		return 0;
 	}
 
-	off_cndjmp = cmp->bc.len;
-
-	/* append jump over the loop body if condition is false (stub) */
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_body = cmp->bc.len;
 
 	/* compile loop body */
@@ -1257,8 +1367,10 @@ static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 
 	off_end = cmp->bc.len;
 
-	cmp->bc.insns[off_cndjmp + 0] = SPN_MKINS_A(SPN_INS_JZE, cndidx);
-	cmp->bc.insns[off_cndjmp + 1] = off_end - off_body;
+	if (off_cndjmp >= 0) {
+		cmp->bc.insns[off_cndjmp + 0] = cndjmp;
+		cmp->bc.insns[off_cndjmp + 1] = off_end - off_body;
+	}
 
 	cmp->bc.insns[off_jmpback + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
 	cmp->bc.insns[off_jmpback + 1] = off_cond - off_end;
@@ -1273,19 +1385,18 @@ static int compile_while(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_do(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_do(SpnCompiler *cmp, SpnAst *ast)
 {
 	spn_sword off_body = cmp->bc.len;
-	spn_sword off_jmp, off_cond, off_end, diff;
-	spn_uword ins[2];
-	int reg = -1;
+	spn_sword off_jmp, off_cond, off_end;
+	spn_uword jmpins;
 
 	/* save old loop state */
 	int is_in_loop = cmp->is_in_loop;
 	struct jump_stmt_list *orig_jumplist = cmp->jumplist;
 
-	SpnHashMap *condition = ast_get_child_byname(ast, "cond");
-	SpnHashMap *body = ast_get_child_byname(ast, "body");
+	SpnAst *condition = ast_get_child_byname(ast, SPN_AST_COND);
+	SpnAst *body = ast_get_child_byname(ast, SPN_AST_BODY);
 
 	/* set up new loop state */
 	cmp->is_in_loop = 1;
@@ -1301,24 +1412,23 @@ static int compile_do(SpnCompiler *cmp, SpnHashMap *ast)
 
 	off_cond = cmp->bc.len;
 
-	/* compile condition, clean up jump list on error */
-	if (compile_expr_toplevel(cmp, condition, &reg) == 0) {
+	/* compile condition and jump back to body if it is true,
+	 * clean up jump list on error
+	 */
+	if (compile_condjump(cmp, condition, 1, &off_jmp, &jmpins) == 0) {
 		free_jumplist(cmp->jumplist);
 		cmp->jumplist = orig_jumplist;
 		cmp->is_in_loop = is_in_loop;
 		return 0;
 	}
 
-	off_jmp = cmp->bc.len + COUNT(ins);
-	diff = off_body - off_jmp;
-
-	/* jump back to body if condition is true */
-	ins[0] = SPN_MKINS_A(SPN_INS_JNZ, reg);
-	ins[1] = diff;
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_end = cmp->bc.len;
 
+	if (off_jmp >= 0) {
+		cmp->bc.insns[off_jmp + 0] = jmpins;
+		cmp->bc.insns[off_jmp + 1] = off_body - off_end;
+	}
+
 	/* fix up continue and break statements, free jump list on the fly */
 	fix_and_free_jump_list(cmp, off_end, off_cond);
 
@@ -1329,17 +1439,17 @@ static int compile_do(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_for(SpnCompiler *cmp, SpnAst *ast)
 {
-	int regidx = -1;
 	int old_stack_size;
 	spn_sword off_cond, off_incmt, off_body_begin, off_body_end, off_cond_jmp, off_uncd_jmp;
 	spn_uword jmpins[2] = { 0 }; /* dummy */
+	spn_uword condjmp;
 
-	SpnHashMap *init = ast_get_child_byname(ast, "init");
-	SpnHashMap *cond = ast_get_child_byname(ast, "cond");
-	SpnHashMap *icmt = ast_get_child_byname(ast, "increment");
-	SpnHashMap *body = ast_get_child_byname(ast, "body");
+	SpnAst *init = ast_get_child_byname(ast, SPN_AST_INIT);
+	SpnAst *cond = ast_get_child_byname(ast, SPN_AST_COND);
+	SpnAst *icmt = ast_get_child_byname(ast, SPN_AST_INCREMENT);
+	SpnAst *body = ast_get_child_byname(ast, SPN_AST_BODY);
 
 	/* save old loop state */
 	int is_in_loop = cmp->is_in_loop;
@@ -1365,18 +1475,16 @@ static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
 		return 0;
 	}
 
-	/* compile condition, clean up on error likewise */
+	/* compile condition and "skip body if condition is false"
+	 * jump, clean up on error likewise
+	 */
 	off_cond = cmp->bc.len;
-	if (compile_expr_toplevel(cmp, cond, &regidx) == 0) {
+	if (compile_condjump(cmp, cond, 0, &off_cond_jmp, &condjmp) == 0) {
 		cmp->jumplist = orig_jumplist;
 		cmp->is_in_loop = is_in_loop;
 		return 0;
 	}
 
-	/* compile "skip body if condition is false" jump */
-	off_cond_jmp = cmp->bc.len;
-	bytecode_append(&cmp->bc, jmpins, COUNT(jmpins));
-
 	/* compile body */
 	off_body_begin = cmp->bc.len;
 	if (compile(cmp, body) == 0) {
@@ -1404,8 +1512,10 @@ static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
 	/* fill in stub jump instructions
 	 * 1. jump over body if condition not met
 	 */
-	cmp->bc.insns[off_cond_jmp + 0] = SPN_MKINS_A(SPN_INS_JZE, regidx);
-	cmp->bc.insns[off_cond_jmp + 1] = off_body_end - off_body_begin;
+	if (off_cond_jmp >= 0) {
+		cmp->bc.insns[off_cond_jmp + 0] = condjmp;
+		cmp->bc.insns[off_cond_jmp + 1] = off_body_end - off_body_begin;
+	}
 
 	/* 2. always jump back to beginning and check condition */
 	cmp->bc.insns[off_uncd_jmp + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
@@ -1424,28 +1534,23 @@ static int compile_for(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_if(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_if(SpnCompiler *cmp, SpnAst *ast)
 {
 	spn_sword off_then, off_else, off_jze_b4_then, off_jmp_b4_else;
 	spn_sword len_then, len_else;
 	spn_uword ins[2] = { 0 };
-	int condidx = -1;
+	spn_uword condjmp;
 
 	/* the else-branch might not exist, hence 'ast_get_child_byname_optional' */
-	SpnHashMap *cond = ast_get_child_byname(ast, "cond");
-	SpnHashMap *br_then = ast_get_child_byname(ast, "then");
-	SpnHashMap *br_else = ast_get_child_byname_optional(ast, "else");
+	SpnAst *cond = ast_get_child_byname(ast, SPN_AST_COND);
+	SpnAst *br_then = ast_get_child_byname(ast, SPN_AST_THEN);
+	SpnAst *br_else = ast_get_child_byname_optional(ast, SPN_AST_ELSE);
 
-	/* compile condition */
-	if (compile_expr_toplevel(cmp, cond, &condidx) == 0) {
+	/* compile condition and stub "jump if zero" instruction */
+	if (compile_condjump(cmp, cond, 0, &off_jze_b4_then, &condjmp) == 0) {
 		return 0;
 	}
 
-	off_jze_b4_then = cmp->bc.len;
-
-	/* append stub "jump if zero" instruction */
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
-
 	off_then = cmp->bc.len;
 
 	/* compile "then" branch */
@@ -1469,8 +1574,10 @@ static int compile_if(SpnCompiler *cmp, SpnHashMap *ast)
 	len_then = off_else - off_then;
 	len_else = cmp->bc.len - off_else;
 
-	cmp->bc.insns[off_jze_b4_then + 0] = SPN_MKINS_A(SPN_INS_JZE, condidx);
-	cmp->bc.insns[off_jze_b4_then + 1] = len_then;
+	if (off_jze_b4_then >= 0) {
+		cmp->bc.insns[off_jze_b4_then + 0] = condjmp;
+		cmp->bc.insns[off_jze_b4_then + 1] = len_then;
+	}
 
 	cmp->bc.insns[off_jmp_b4_else + 0] = SPN_MKINS_VOID(SPN_INS_JMP);
 	cmp->bc.insns[off_jmp_b4_else + 1] = len_else;
@@ -1498,7 +1605,7 @@ static void free_jumplist(struct jump_stmt_list *hdr)
 	}
 }
 
-static int compile_break(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_break(SpnCompiler *cmp, SpnAst *ast)
 {
 	/* dummy jump instruction */
 	spn_uword ins[2] = { 0 };
@@ -1518,7 +1625,7 @@ static int compile_break(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_continue(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_continue(SpnCompiler *cmp, SpnAst *ast)
 {
 	spn_uword ins[2] = { 0 };
 
@@ -1537,10 +1644,10 @@ static int compile_continue(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_vardecl(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_vardecl(SpnCompiler *cmp, SpnAst *ast)
 {
-	SpnArray *children = ast_get_children(ast);
-	size_t n = spn_array_count(children);
+	SpnAst **children = ast->children;
+	size_t n = ast->nchildren;
 	size_t i;
 
 	/* bring all variables in scope (each child represents a variable) */
@@ -1548,11 +1655,11 @@ static int compile_vardecl(SpnCompiler *cmp, SpnHashMap *ast)
 		int idx;
 
 		/* the child representing a variable declaration */
-		SpnHashMap *child = ast_get_nth_child(children, i);
+		SpnAst *child = children[i];
 
 		/* the name of the variable and the initializer expression */
-		SpnHashMap *init = ast_get_child_byname_optional(child, "init");
-		SpnValue name = spn_hashmap_get_strkey(child, "name");
+		SpnAst *init = ast_get_child_byname_optional(child, SPN_AST_INIT);
+		SpnValue name = child->name;
 		assert(isstring(&name));
 
 		/* check for erroneous re-declaration - the name must not yet be
@@ -1570,9 +1677,15 @@ static int compile_vardecl(SpnCompiler *cmp, SpnHashMap *ast)
 
 		/* always load nil into register before compiling initializer
 		 * expression, in order to avoid garbage when one initializes
-		 * a variable with an expression that refers to itself
+		 * a variable with an expression that refers to itself. If it
+		 * doesn't, the initializer overwrites the register anyway, so
+		 * the store is dead and it is omitted when optimizing.
 		 */
-		emit_ins_AB(cmp, SPN_INS_LDCONST, idx, SPN_CONST_NIL);
+		if (cmp->optlevel == SPN_OPT_NONE
+		 || init == NULL
+		 || ast_mentions_name(init, &name)) {
+			emit_ins_AB(cmp, SPN_INS_LDCONST, idx, SPN_CONST_NIL);
+		}
 
 		/* only compile initializer expression if exists */
 		if (init != NULL) {
@@ -1585,21 +1698,21 @@ static int compile_vardecl(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_const(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_const(SpnCompiler *cmp, SpnAst *ast)
 {
-	SpnArray *children = ast_get_children(ast);
-	size_t n = spn_array_count(children);
+	SpnAst **children = ast->children;
+	size_t n = ast->nchildren;
 	size_t i;
 
 	for (i = 0; i < n; i++) {
 		int regidx = -1;
 
 		/* constant declaration descriptor */
-		SpnHashMap *child = ast_get_nth_child(children, i);
+		SpnAst *child = children[i];
 
 		/* name and initializer expression of constant */
-		SpnString *name = ast_get_string(child, "name");
-		SpnHashMap *init = ast_get_child_byname(child, "init");
+		SpnString *name = stringvalue(&child->name);
+		SpnAst *init = ast_get_child_byname(child, SPN_AST_INIT);
 
 		if (compile_expr_toplevel(cmp, init, &regidx) == 0) {
 			return 0;
@@ -1615,13 +1728,21 @@ static int compile_const(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_return(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_return(SpnCompiler *cmp, SpnAst *ast)
 {
 	/* compile expression (left child) if any; else return nil */
-	SpnHashMap *expression = ast_get_child_byname_optional(ast, "expr");
+	SpnAst *expression = ast_get_child_byname_optional(ast, SPN_AST_EXPR);
 	if (expression != NULL) {
 		int dst = -1;
+
+		/* 'return f(...)' is a tail call */
+		if (cmp->optlevel > SPN_OPT_NONE
+		 && type_equal(ast_get_type(expression), "call")) {
+			cmp->tailcall = 1;
+		}
+
 		if (compile_expr_toplevel(cmp, expression, &dst) == 0) {
+			cmp->tailcall = 0;
 			return 0;
 		}
 
@@ -1633,7 +1754,7 @@ static int compile_return(SpnCompiler *cmp, SpnHashMap *ast)
 	return 1;
 }
 
-static int compile_empty(SpnCompiler *cmp, SpnHashMap *ast)
+static int compile_empty(SpnCompiler *cmp, SpnAst *ast)
 {
 	return 1;
 }
@@ -1644,7 +1765,7 @@ static int compile_empty(SpnCompiler *cmp, SpnHashMap *ast)
  * statement, or an expression which is part of the the header of a for
  * statement.
  */
-static int compile_expr_toplevel(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_expr_toplevel(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	int reg = dst != NULL ? *dst : -1;
 
@@ -1686,10 +1807,455 @@ static void compile_string_literal(SpnCompiler *cmp, SpnValue str, int *dst)
 	emit_ins_mid(cmp, SPN_INS_LDSYM, *dst, idx);
 }
 
+/* Constant folding. These functions evaluate an expression at compile
+ * time if all of its operands are constants, and if evaluating it cannot
+ * possibly fail. Whenever the virtual machine would raise a runtime error
+ * (or the C operation would be undefined, e. g. on integer overflow), the
+ * expression is not folded, so that it is reported at run time as usual.
+ * They return nonzero on success, in which case the value is stored in
+ * '*result', and it must be released by the caller.
+ */
+
+static int fold_int_arith(const char *type, long a, long b, long *result)
+{
+	if (type_equal(type, "+")) {
+		if (b > 0 ? a > LONG_MAX - b : a < LONG_MIN - b) {
+			return 0;
+		}
+
+		*result = a + b;
+	} else if (type_equal(type, "-")) {
+		if (b < 0 ? a > LONG_MAX + b : a < LONG_MIN + b) {
+			return 0;
+		}
+
+		*result = a - b;
+	} else if (type_equal(type, "*")) {
+		if (a != 0 && b != 0) {
+			if (a == LONG_MIN || b == LONG_MIN) {
+				return 0;
+			}
+
+			if (labs(a) > LONG_MAX / labs(b)) {
+				return 0;
+			}
+		}
+
+		*result = a * b;
+	} else if (type_equal(type, "/") || type_equal(type, "mod")) {
+		if (b == 0 || (a == LONG_MIN && b == -1)) {
+			return 0;
+		}
+
+		*result = type_equal(type, "/") ? a / b : a % b;
+	} else if (type_equal(type, "bit_and")) {
+		*result = a & b;
+	} else if (type_equal(type, "bit_or")) {
+		*result = a | b;
+	} else if (type_equal(type, "bit_xor")) {
+		*result = a ^ b;
+	} else if (type_equal(type, "<<") || type_equal(type, ">>")) {
+		/* only shifts of non-negative numbers that lose no bits */
+		if (a < 0 || b < 0 || b >= (long)(sizeof(long) * CHAR_BIT)) {
+			return 0;
+		}
+
+		if (type_equal(type, "<<")) {
+			if (a > (LONG_MAX >> b)) {
+				return 0;
+			}
+
+			*result = a << b;
+		} else {
+			*result = a >> b;
+		}
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+static int fold_binop(const char *type, SpnValue *lhs, SpnValue *rhs, SpnValue *result)
+{
+	static const NodeAndOpcode comparisons[] = {
+		{ "<",  SPN_INS_LT },
+		{ "<=", SPN_INS_LE },
+		{ ">",  SPN_INS_GT },
+		{ ">=", SPN_INS_GE }
+	};
+
+	size_t i;
+
+	if (type_equal(type, "==")) {
+		*result = makebool(spn_value_equal(lhs, rhs));
+		return 1;
+	}
+
+	if (type_equal(type, "!=")) {
+		*result = makebool(spn_value_noteq(lhs, rhs));
+		return 1;
+	}
+
+	for (i = 0; i < COUNT(comparisons); i++) {
+		if (type_equal(type, comparisons[i].type)) {
+			int cmpres;
+
+			if (!spn_values_comparable(lhs, rhs)) {
+				return 0;
+			}
+
+			cmpres = spn_value_compare(lhs, rhs);
+
+			switch (comparisons[i].opcode) {
+			case SPN_INS_LT: *result = makebool(cmpres <  0); break;
+			case SPN_INS_LE: *result = makebool(cmpres <= 0); break;
+			case SPN_INS_GT: *result = makebool(cmpres >  0); break;
+			default:         *result = makebool(cmpres >= 0); break;
+			}
+
+			return 1;
+		}
+	}
+
+	if (type_equal(type, "concat")) {
+		if (!isstring(lhs) || !isstring(rhs)) {
+			return 0;
+		}
+
+		*result = makeobject(SPN_TYPE_STRING, spn_string_concat(stringvalue(lhs), stringvalue(rhs)));
+		return 1;
+	}
+
+	if (isint(lhs) && isint(rhs)) {
+		long res;
+
+		if (fold_int_arith(type, intvalue(lhs), intvalue(rhs), &res) == 0) {
+			return 0;
+		}
+
+		*result = makeint(res);
+		return 1;
+	}
+
+	/* only the four basic arithmetic operations apply to floats */
+	if (isnum(lhs) && isnum(rhs)) {
+		double a = isfloat(lhs) ? floatvalue(lhs) : intvalue(lhs);
+		double b = isfloat(rhs) ? floatvalue(rhs) : intvalue(rhs);
+
+		if (type_equal(type, "+")) {
+			*result = makefloat(a + b);
+		} else if (type_equal(type, "-")) {
+			*result = makefloat(a - b);
+		} else if (type_equal(type, "*")) {
+			*result = makefloat(a * b);
+		} else if (type_equal(type, "/")) {
+			*result = makefloat(a / b);
+		} else {
+			return 0;
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static int fold_constant(SpnAst *ast, SpnValue *result)
+{
+	const char *type = ast_get_type(ast);
+	SpnAst *left, *right;
+	SpnValue lhs, rhs;
+	int success;
+
+	if (type_equal(type, "literal")) {
+		*result = ast->value;
+		spn_value_retain(result);
+		return 1;
+	}
+
+	/* unary operators */
+	if (type_equal(type, "un_plus")
+	 || type_equal(type, "un_minus")
+	 || type_equal(type, "not")
+	 || type_equal(type, "bit_not")) {
+		if (fold_constant(ast_get_child_byname(ast, SPN_AST_RIGHT), &rhs) == 0) {
+			return 0;
+		}
+
+		success = 1;
+
+		if (type_equal(type, "un_plus")) {
+			/* no type checking here; see compile_unplus() */
+			*result = rhs;
+			return 1;
+		} else if (type_equal(type, "un_minus") && isfloat(&rhs)) {
+			*result = makefloat(-floatvalue(&rhs));
+		} else if (type_equal(type, "un_minus") && isint(&rhs) && intvalue(&rhs) != LONG_MIN) {
+			*result = makeint(-intvalue(&rhs));
+		} else if (type_equal(type, "not") && isbool(&rhs)) {
+			*result = makebool(!boolvalue(&rhs));
+		} else if (type_equal(type, "bit_not") && isint(&rhs)) {
+			*result = makeint(~intvalue(&rhs));
+		} else {
+			success = 0;
+		}
+
+		spn_value_release(&rhs);
+		return success;
+	}
+
+	/* short-circuiting logical operators yield the left-hand side if it
+	 * determines the result, otherwise the right-hand side, unchecked
+	 */
+	if (type_equal(type, "and") || type_equal(type, "or")) {
+		int is_and = type_equal(type, "and");
+
+		if (fold_constant(ast_get_child_byname(ast, SPN_AST_LEFT), &lhs) == 0) {
+			return 0;
+		}
+
+		if (!isbool(&lhs)) {
+			spn_value_release(&lhs);
+			return 0;
+		}
+
+		if (boolvalue(&lhs) != is_and) {
+			*result = lhs;
+			return 1;
+		}
+
+		return fold_constant(ast_get_child_byname(ast, SPN_AST_RIGHT), result);
+	}
+
+	/* conditional expression with a constant Boolean condition */
+	if (type_equal(type, "condexpr")) {
+		if (fold_constant(ast_get_child_byname(ast, SPN_AST_COND), &lhs) == 0) {
+			return 0;
+		}
+
+		if (!isbool(&lhs)) {
+			spn_value_release(&lhs);
+			return 0;
+		}
+
+		return fold_constant(ast_get_child_byname(ast, boolvalue(&lhs) ? SPN_AST_TRUE : SPN_AST_FALSE), result);
+	}
+
+	/* only binary operators remain; others have no "left" child */
+	left = ast_get_child_byname_optional(ast, SPN_AST_LEFT);
+	right = ast_get_child_byname_optional(ast, SPN_AST_RIGHT);
+
+	if (left == NULL || right == NULL || type_equal(type, "assign")) {
+		return 0;
+	}
+
+	if (fold_constant(left, &lhs) == 0) {
+		return 0;
+	}
+
+	if (fold_constant(right, &rhs) == 0) {
+		spn_value_release(&lhs);
+		return 0;
+	}
+
+	success = fold_binop(type, &lhs, &rhs, result);
+
+	spn_value_release(&lhs);
+	spn_value_release(&rhs);
+
+	return success;
+}
+
+/* returns nonzero if the AST 'node' contains a reference to 'name' (an
+ * identifier, a declaration, or anything else named so, conservatively)
+ */
+static int ast_mentions_name(SpnAst *node, const SpnValue *name)
+{
+	size_t i;
+
+	if (spn_value_equal(&node->name, name)) {
+		return 1;
+	}
+
+	for (i = 0; i < node->nkids; i++) {
+		if (ast_mentions_name(node->kids[i], name)) {
+			return 1;
+		}
+	}
+
+	for (i = 0; i < node->nchildren; i++) {
+		if (ast_mentions_name(node->children[i], name)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Chains of concatenations, e. g. 'a .. b .. c .. d', are flattened into
+ * a single SPN_INS_CONCAT_ALL instruction, so that the result is built in
+ * one step instead of creating a temporary string for each link.
+ * Operands are collected left to right; since concatenation is associative,
+ * parenthesized sub-chains on the right-hand side are flattened too.
+ * 'regs' holds the register indices of the operands collected so far.
+ *
+ * A non-string operand must be reported where the unflattened chain would
+ * have failed: at the concatenation node ('parents') which has it as a
+ * direct child and which would have run first. 'ranks' numbers the nodes
+ * in the order they complete, i. e. their post-order, and 0 means that the
+ * node isn't complete yet; 'nranked' is the number of complete nodes.
+ */
+#define MAX_CONCAT_OPERANDS (MAX_REG_FRAME - 1)
+
+/* Operands are held in temporaries until the chain is concatenated, so
+ * a long chain is also split once this many registers are in use, leaving
+ * the rest to the operands themselves and to the enclosing expressions.
+ */
+#define MAX_CONCAT_REGS (MAX_REG_FRAME - MAX_REG_FRAME / 4)
+
+typedef struct ConcatChain {
+	int regs[MAX_CONCAT_OPERANDS];
+	SpnAst *parents[MAX_CONCAT_OPERANDS];
+	unsigned long ranks[MAX_CONCAT_OPERANDS];
+	unsigned long nranked;
+	int n;
+} ConcatChain;
+
+/* pops the temporaries holding the operands of the chain */
+static void concat_pop_operands(SpnCompiler *cmp, ConcatChain *chain)
+{
+	int nvars = rts_count(cmp->varstack);
+	int i;
+
+	for (i = 0; i < chain->n; i++) {
+		if (chain->regs[i] >= nvars) {
+			tmp_pop(cmp);
+		}
+	}
+}
+
+/* Each operand word carries the rank of its node next to its register
+ * index. Nodes which aren't complete yet (only when a long chain is split)
+ * complete after all others, and the ones enclosing later operands first.
+ * Each word is also mapped to the location of the node in the debug info.
+ */
+static void emit_concat(SpnCompiler *cmp, int dst, ConcatChain *chain)
+{
+	spn_uword operands[MAX_CONCAT_OPERANDS];
+	size_t begin;
+	int i;
+
+	if (chain->n == 2) {
+		begin = cmp->bc.len;
+		emit_ins_ABC(cmp, SPN_INS_CONCAT, dst, chain->regs[0], chain->regs[1]);
+
+		/* the first operand is the result of a split chain if it
+		 * has no node, so only the second one can be a non-string
+		 */
+		spn_dbg_emit_source_location(cmp->debug_info, begin, cmp->bc.len, chain->parents[1]->loc, -1);
+		return;
+	}
+
+	for (i = 0; i < chain->n; i++) {
+		unsigned long rank = chain->ranks[i];
+
+		if (rank == 0) {
+			rank = chain->nranked + (chain->n - i);
+		}
+
+		operands[i] = SPN_MKINS_LONG(chain->regs[i], rank);
+	}
+
+	emit_ins_AB(cmp, SPN_INS_CONCAT_ALL, dst, chain->n);
+	begin = cmp->bc.len;
+	bytecode_append(&cmp->bc, operands, chain->n);
+
+	for (i = 0; i < chain->n; i++) {
+		if (chain->parents[i] != NULL) {
+			spn_dbg_emit_source_location(cmp->debug_info, begin + i, begin + i + 1, chain->parents[i]->loc, -1);
+		}
+	}
+}
+
+static int collect_concat_operands(SpnCompiler *cmp, SpnAst *ast, SpnAst *parent, ConcatChain *chain)
+{
+	int reg = -1;
+
+	if (type_equal(ast_get_type(ast), "concat")) {
+		int i;
+
+		if (collect_concat_operands(cmp, ast_get_child_byname(ast, SPN_AST_LEFT), ast, chain) == 0
+		 || collect_concat_operands(cmp, ast_get_child_byname(ast, SPN_AST_RIGHT), ast, chain) == 0) {
+			return 0;
+		}
+
+		/* this is where the node would run if it wasn't flattened */
+		chain->nranked++;
+
+		for (i = 0; i < chain->n; i++) {
+			if (chain->parents[i] == ast) {
+				chain->ranks[i] = chain->nranked;
+			}
+		}
+
+		return 1;
+	}
+
+	/* if the instruction is full or the registers are running out, then
+	 * concatenate what we have so far, and continue with the result as
+	 * the first operand
+	 */
+	if (chain->n == MAX_CONCAT_OPERANDS
+	 || (chain->n >= 2 && cmp->tmpidx >= MAX_CONCAT_REGS)) {
+		int acc;
+
+		concat_pop_operands(cmp, chain);
+		acc = tmp_push(cmp);
+		emit_concat(cmp, acc, chain);
+
+		chain->regs[0] = acc;
+		chain->parents[0] = NULL;
+		chain->ranks[0] = 0;
+		chain->n = 1;
+	}
+
+	if (compile_expr(cmp, ast, &reg) == 0) {
+		return 0;
+	}
+
+	chain->regs[chain->n] = reg;
+	chain->parents[chain->n] = parent;
+	chain->ranks[chain->n] = 0;
+	chain->n++;
+	return 1;
+}
+
+static int compile_concat(SpnCompiler *cmp, SpnAst *ast, int *dst)
+{
+	ConcatChain chain;
+	chain.n = 0;
+	chain.nranked = 0;
+
+	if (collect_concat_operands(cmp, ast, NULL, &chain) == 0) {
+		return 0;
+	}
+
+	assert(chain.n >= 2);
+	concat_pop_operands(cmp, &chain);
+
+	if (*dst < 0) {
+		*dst = tmp_push(cmp);
+	}
+
+	emit_concat(cmp, *dst, &chain);
+	return 1;
+}
+
 /* simple (non short-circuiting) binary operators: arithmetic, bitwise ops,
  * comparison and equality tests, string concatenation
  */
-static int compile_simple_binop(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_simple_binop(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	int dst_left  = -1;
 	int dst_right = -1;
@@ -1716,12 +2282,16 @@ static int compile_simple_binop(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 		{ "mod",     SPN_INS_MOD    }
 	};
 
-	SpnHashMap *left = ast_get_child_byname(ast, "left");
-	SpnHashMap *right = ast_get_child_byname(ast, "right");
+	SpnAst *left = ast_get_child_byname(ast, SPN_AST_LEFT);
+	SpnAst *right = ast_get_child_byname(ast, SPN_AST_RIGHT);
 
 	const char *type = ast_get_type(ast);
 	enum spn_vm_ins opcode = node_to_opcode(opcode_map, COUNT(opcode_map), type);
 
+	if (opcode == SPN_INS_CONCAT) {
+		return compile_concat(cmp, ast, dst);
+	}
+
 	/* compile children */
 	if (compile_expr(cmp, left,  &dst_left)  == 0
 	 || compile_expr(cmp, right, &dst_right) == 0) {
@@ -1748,13 +2318,13 @@ static int compile_simple_binop(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_assignment_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_assignment_var(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
-	SpnHashMap *left  = ast_get_child_byname(ast, "left");
-	SpnHashMap *right = ast_get_child_byname(ast, "right");
+	SpnAst *left  = ast_get_child_byname(ast, SPN_AST_LEFT);
+	SpnAst *right = ast_get_child_byname(ast, SPN_AST_RIGHT);
 
 	/* get register index of variable using its name */
-	SpnValue varname = spn_hashmap_get_strkey(left, "name");
+	SpnValue varname = left->name;
 	int idx = rts_getidx(cmp->varstack, varname);
 
 	if (idx < 0) {
@@ -1789,16 +2359,16 @@ static int compile_assignment_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_assignment_array(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_assignment_array(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	int nvars;
 
 	/* array and subscript indices: just like in 'compile_subscript()' */
 	int arridx = -1, subidx = -1;
 
-	SpnHashMap *lhs = ast_get_child_byname(ast, "left");
-	SpnHashMap *rhs = ast_get_child_byname(ast, "right");
-	SpnHashMap *object = ast_get_child_byname(lhs, "object");
+	SpnAst *lhs = ast_get_child_byname(ast, SPN_AST_LEFT);
+	SpnAst *rhs = ast_get_child_byname(ast, SPN_AST_RIGHT);
+	SpnAst *object = ast_get_child_byname(lhs, SPN_AST_OBJECT);
 
 	const char *nodetype = ast_get_type(lhs);
 	int is_subscript = type_equal(nodetype, "subscript");
@@ -1821,19 +2391,19 @@ static int compile_assignment_array(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	/* compile subscript */
 	if (is_subscript) {
 		/* indexing with brackets */
-		SpnHashMap *index = ast_get_child_byname(lhs, "index");
+		SpnAst *index = ast_get_child_byname(lhs, SPN_AST_INDEX);
 		if (compile_expr(cmp, index, &subidx) == 0) {
 			return 0;
 		}
 	} else {
 		/* memberof */
-		SpnValue nameval = spn_hashmap_get_strkey(lhs, "name");
+		SpnValue nameval = lhs->name;
 		assert(type_equal(nodetype, "memberof"));
 		compile_string_literal(cmp, nameval, &subidx);
 	}
 
 	/* emit "indexed setter" or "property setter" instruction */
-	emit_ins_ABC(cmp, opcode, arridx, subidx, *dst);
+	emit_ins_member(cmp, opcode, arridx, subidx, *dst);
 
 	/* XXX: is this correct? since we need neither the value of the
 	 * array nor the value of the subscripting expression, we can
@@ -1852,9 +2422,9 @@ static int compile_assignment_array(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_assignment(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_assignment(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
-	SpnHashMap *lhs = ast_get_child_byname(ast, "left");
+	SpnAst *lhs = ast_get_child_byname(ast, SPN_AST_LEFT);
 	const char *nodetype = ast_get_type(lhs);
 
 	/* assignment to a variable */
@@ -1878,16 +2448,16 @@ static int compile_assignment(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 0;
 }
 
-static int compile_cmpd_assgmt_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst, enum spn_vm_ins opcode)
+static int compile_cmpd_assgmt_var(SpnCompiler *cmp, SpnAst *ast, int *dst, enum spn_vm_ins opcode)
 {
 	int nvars;
 	int rhs = -1;
 
-	SpnHashMap *left  = ast_get_child_byname(ast, "left");
-	SpnHashMap *right = ast_get_child_byname(ast, "right");
+	SpnAst *left  = ast_get_child_byname(ast, SPN_AST_LEFT);
+	SpnAst *right = ast_get_child_byname(ast, SPN_AST_RIGHT);
 
 	/* get register index of variable using its name */
-	SpnValue varname = spn_hashmap_get_strkey(left, "name");
+	SpnValue varname = left->name;
 	int idx = rts_getidx(cmp->varstack, varname);
 
 	if (idx < 0) {
@@ -1929,9 +2499,8 @@ static int compile_cmpd_assgmt_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 	return 1;
 }
 
-static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst, enum spn_vm_ins opcode)
+static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnAst *ast, int *dst, enum spn_vm_ins opcode)
 {
-	spn_uword ins[3];
 	int nvars;
 
 	/* VM register indices of:
@@ -1941,9 +2510,9 @@ static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 	 */
 	int arridx = -1, subidx = -1, rhsidx = -1;
 
-	SpnHashMap *lhs = ast_get_child_byname(ast, "left");
-	SpnHashMap *rhs = ast_get_child_byname(ast, "right");
-	SpnHashMap *object = ast_get_child_byname(lhs, "object");
+	SpnAst *lhs = ast_get_child_byname(ast, SPN_AST_LEFT);
+	SpnAst *rhs = ast_get_child_byname(ast, SPN_AST_RIGHT);
+	SpnAst *object = ast_get_child_byname(lhs, SPN_AST_OBJECT);
 
 	const char *nodetype = ast_get_type(lhs);
 	int is_subscript = type_equal(nodetype, "subscript");
@@ -1969,27 +2538,25 @@ static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 	/* compile subscript */
 	if (is_subscript) {
 		/* indexing with brackets */
-		SpnHashMap *index = ast_get_child_byname(lhs, "index");
+		SpnAst *index = ast_get_child_byname(lhs, SPN_AST_INDEX);
 		if (compile_expr(cmp, index, &subidx) == 0) {
 			return 0;
 		}
 	} else {
 		/* memberof */
-		SpnValue nameval = spn_hashmap_get_strkey(lhs, "name");
+		SpnValue nameval = lhs->name;
 		assert(type_equal(nodetype, "memberof"));
 		compile_string_literal(cmp, nameval, &subidx);
 	}
 
 	/* load LHS into destination register */
-	ins[0] = SPN_MKINS_ABC(getter_opcode, *dst, arridx, subidx);
+	emit_ins_member(cmp, getter_opcode, *dst, arridx, subidx);
 
 	/* evaluate "LHS = LHS <op> RHS" */
-	ins[1] = SPN_MKINS_ABC(opcode, *dst, *dst, rhsidx);
+	emit_ins_ABC(cmp, opcode, *dst, *dst, rhsidx);
 
 	/* store value of updated destination register into array */
-	ins[2] = SPN_MKINS_ABC(setter_opcode, arridx, subidx, *dst);
-
-	bytecode_append(&cmp->bc, ins, COUNT(ins));
+	emit_ins_member(cmp, setter_opcode, arridx, subidx, *dst);
 
 	/* pop as many times as we used a temporary register (XXX: correct?) */
 	nvars = rts_count(cmp->varstack);
@@ -2009,10 +2576,10 @@ static int compile_cmpd_assgmt_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 	return 1;
 }
 
-static int compile_compound_assignment(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_compound_assignment(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	const char *type = ast_get_type(ast);
-	SpnHashMap *lhs = ast_get_child_byname(ast, "left");
+	SpnAst *lhs = ast_get_child_byname(ast, SPN_AST_LEFT);
 	const char *lhs_type = ast_get_type(lhs);
 
 	static const NodeAndOpcode opcode_map[] = {
@@ -2049,17 +2616,48 @@ static int compile_compound_assignment(SpnCompiler *cmp, SpnHashMap *ast, int *d
 	return 0;
 }
 
-static int compile_logical(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+/* evaluates a logical operator into register 'idx' */
+static int compile_logical_into(SpnCompiler *cmp, SpnAst *lhs, SpnAst *rhs,
+	enum spn_vm_ins opcode, int idx)
 {
 	spn_sword off_rhs, off_jump, end_rhs;
 	spn_uword jumpins[2] = { 0 }; /* dummy */
 
+	/* compile left-hand side */
+	if (compile_expr(cmp, lhs, &idx) == 0) {
+		return 0;
+	}
+
+	/* if it evaluates to false (AND) or true (OR),
+	 * then we short-circuit and yield the LHS
+	 */
+	off_jump = cmp->bc.len;
+	bytecode_append(&cmp->bc, jumpins, COUNT(jumpins));
+
+	off_rhs = cmp->bc.len;
+
+	/* compile right-hand side */
+	if (compile_expr(cmp, rhs, &idx) == 0) {
+		return 0;
+	}
+
+	end_rhs = cmp->bc.len;
+
+	/* fill in stub jump instruction */
+	cmp->bc.insns[off_jump + 0] = SPN_MKINS_A(opcode, idx);
+	cmp->bc.insns[off_jump + 1] = end_rhs - off_rhs;
+
+	return 1;
+}
+
+static int compile_logical(SpnCompiler *cmp, SpnAst *ast, int *dst)
+{
 	const char *nodetype = ast_get_type(ast);
 	int is_and = type_equal(nodetype, "and");
 	enum spn_vm_ins opcode = is_and ? SPN_INS_JZE : SPN_INS_JNZ;
 
-	SpnHashMap *lhs = ast_get_child_byname(ast, "left");
-	SpnHashMap *rhs = ast_get_child_byname(ast, "right");
+	SpnAst *lhs = ast_get_child_byname(ast, SPN_AST_LEFT);
+	SpnAst *rhs = ast_get_child_byname(ast, SPN_AST_RIGHT);
 
 	/* we can't compile the result directly into the destination register,
 	 * because if the destination is a variable which will be examined in
@@ -2068,6 +2666,20 @@ static int compile_logical(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	 * register in which the value of the two sides will be stored.
 	 */
 	int idx;
+	SpnValue lhsval;
+
+	/* if the left-hand side is a constant which doesn't short-circuit,
+	 * then the result is just the right-hand side. (if it does, then
+	 * the whole expression has been folded by compile_expr() already.)
+	 */
+	if (cmp->optlevel > SPN_OPT_NONE && fold_constant(lhs, &lhsval)) {
+		int is_bool = isbool(&lhsval);
+		spn_value_release(&lhsval);
+
+		if (is_bool) {
+			return compile_expr(cmp, rhs, dst);
+		}
+	}
 
 	/* this needs to be done before 'idx = tmp_push()', because the
 	 * temporary register will be gone when the logical expression has
@@ -2075,37 +2687,24 @@ static int compile_logical(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	 * accessible. If I did this in the wrong order, then the result
 	 * register could be (ab)used as a temporary in a higher-level
 	 * expression and it could be overwritten.
+	 *
+	 * If the destination is a new temporary, then nothing else can
+	 * refer to it, so the result can be computed into it directly.
 	 */
 	if (*dst < 0) {
 		*dst = tmp_push(cmp);
-	}
 
-	idx = tmp_push(cmp);
-
-	/* compile left-hand side */
-	if (compile_expr(cmp, lhs, &idx) == 0) {
-		return 0;
+		if (cmp->optlevel > SPN_OPT_NONE) {
+			return compile_logical_into(cmp, lhs, rhs, opcode, *dst);
+		}
 	}
 
-	/* if it evaluates to false (AND) or true (OR),
-	 * then we short-circuit and yield the LHS
-	 */
-	off_jump = cmp->bc.len;
-	bytecode_append(&cmp->bc, jumpins, COUNT(jumpins));
-
-	off_rhs = cmp->bc.len;
+	idx = tmp_push(cmp);
 
-	/* compile right-hand side */
-	if (compile_expr(cmp, rhs, &idx) == 0) {
+	if (compile_logical_into(cmp, lhs, rhs, opcode, idx) == 0) {
 		return 0;
 	}
 
-	end_rhs = cmp->bc.len;
-
-	/* fill in stub jump instruction */
-	cmp->bc.insns[off_jump + 0] = SPN_MKINS_A(opcode, idx);
-	cmp->bc.insns[off_jump + 1] = end_rhs - off_rhs;
-
 	/* move result into destination, then get rid of temporary */
 	emit_ins_AB(cmp, SPN_INS_MOV, *dst, idx);
 	tmp_pop(cmp);
@@ -2113,17 +2712,18 @@ static int compile_logical(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
+
 /* ternary conditional expression */
-static int compile_condexpr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_condexpr(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	spn_sword off_then, off_else, off_jze_b4_then, off_jmp_b4_else;
 	spn_sword len_then, len_else;
 	spn_uword ins[2] = { 0 }; /* stub */
 	int condidx = -1;
 
-	SpnHashMap *cond = ast_get_child_byname(ast, "cond");
-	SpnHashMap *val_then = ast_get_child_byname(ast, "true");
-	SpnHashMap *val_else = ast_get_child_byname(ast, "false");
+	SpnAst *cond = ast_get_child_byname(ast, SPN_AST_COND);
+	SpnAst *val_then = ast_get_child_byname(ast, SPN_AST_TRUE);
+	SpnAst *val_else = ast_get_child_byname(ast, SPN_AST_FALSE);
 
 	if (*dst < 0) {
 		*dst = tmp_push(cmp);
@@ -2175,9 +2775,9 @@ static int compile_condexpr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_ident(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_ident(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
-	SpnValue varname = spn_hashmap_get_strkey(ast, "name");
+	SpnValue varname = ast->name;
 	int idx = rts_getidx(cmp->varstack, varname);
 
 	/* if 'rts_getidx()' returns -1, then the variable is not in the
@@ -2242,10 +2842,9 @@ static int compile_ident(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+/* emits an instruction that loads a constant 'value' into '*dst' */
+static int compile_constant(SpnCompiler *cmp, SpnAst *ast, SpnValue value, int *dst)
 {
-	SpnValue value = spn_hashmap_get_strkey(ast, "value");
-
 	if (*dst < 0) {
 		*dst = tmp_push(cmp);
 	}
@@ -2292,7 +2891,13 @@ static int compile_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_argv(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_literal(SpnCompiler *cmp, SpnAst *ast, int *dst)
+{
+	SpnValue value = ast->value;
+	return compile_constant(cmp, ast, value, dst);
+}
+
+static int compile_argv(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	if (*dst < 0) {
 		*dst = tmp_push(cmp);
@@ -2304,7 +2909,7 @@ static int compile_argv(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_funcexpr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_funcexpr(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	int symidx;
 	int upval_count;
@@ -2352,10 +2957,10 @@ static int compile_funcexpr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_array_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_array_literal(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
-	SpnArray *children = ast_get_children(ast);
-	size_t n = spn_array_count(children);
+	SpnAst **children = ast->children;
+	size_t n = ast->nchildren;
 	size_t i;
 
 	int validx;
@@ -2371,7 +2976,7 @@ static int compile_array_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	emit_ins_A(cmp, SPN_INS_NEWARR, *dst);
 
 	for (i = 0; i < n; i++) {
-		SpnHashMap *expr = ast_get_nth_child(children, i);
+		SpnAst *expr = children[i];
 
 		if (compile_expr(cmp, expr, &validx) == 0) {
 			return 0;
@@ -2387,10 +2992,10 @@ static int compile_array_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_hashmap_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_hashmap_literal(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
-	SpnArray *children = ast_get_children(ast);
-	size_t n = spn_array_count(children);
+	SpnAst **children = ast->children;
+	size_t n = ast->nchildren;
 	size_t i;
 
 	int keyidx, validx;
@@ -2408,9 +3013,9 @@ static int compile_hashmap_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 
 	/* then, compile keys and values */
 	for (i = 0; i < n; i++) {
-		SpnHashMap *kvpair = ast_get_nth_child(children, i);
-		SpnHashMap *key = ast_get_child_byname(kvpair, "key");
-		SpnHashMap *value = ast_get_child_byname(kvpair, "value");
+		SpnAst *kvpair = children[i];
+		SpnAst *key = ast_get_child_byname(kvpair, SPN_AST_KEY);
+		SpnAst *value = ast_get_child_byname(kvpair, SPN_AST_VALUE);
 
 		/* compile the key */
 		if (compile_expr(cmp, key, &keyidx) == 0) {
@@ -2433,7 +3038,7 @@ static int compile_hashmap_literal(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_subscript_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
+static int compile_subscript_ex(SpnCompiler *cmp, SpnAst *ast, int *dst,
 	int is_method_call, int *reg_array, int *reg_subsc)
 {
 	enum spn_vm_ins opcode;
@@ -2447,7 +3052,7 @@ static int compile_subscript_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 	int is_subscript = type_equal(nodetype, "subscript");
 	int is_memberof = type_equal(nodetype, "memberof");
 
-	SpnHashMap *object = ast_get_child_byname(ast, "object");
+	SpnAst *object = ast_get_child_byname(ast, SPN_AST_OBJECT);
 
 	if (*dst < 0) {
 		*dst = tmp_push(cmp);
@@ -2461,13 +3066,13 @@ static int compile_subscript_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 	/* compile subscripting expression */
 	if (is_subscript) {
 		/* normal subscripting with brackets */
-		SpnHashMap *index = ast_get_child_byname(ast, "index");
+		SpnAst *index = ast_get_child_byname(ast, SPN_AST_INDEX);
 		if (compile_expr(cmp, index, &subidx) == 0) {
 			return 0;
 		}
 	} else {
 		/* memberof, dot/arrow notation */
-		SpnValue nameval = spn_hashmap_get_strkey(ast, "name");
+		SpnValue nameval = ast->name;
 		compile_string_literal(cmp, nameval, &subidx);
 	}
 
@@ -2511,12 +3116,12 @@ static int compile_subscript_ex(SpnCompiler *cmp, SpnHashMap *ast, int *dst,
 		opcode = SPN_INS_IDX_GET;
 	}
 
-	emit_ins_ABC(cmp, opcode, *dst, arridx, subidx);
+	emit_ins_member(cmp, opcode, *dst, arridx, subidx);
 
 	return 1;
 }
 
-static int compile_subscript(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_subscript(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	/* Compile array subscript expression.
 	 * Keep the result only, throw away array
@@ -2525,7 +3130,7 @@ static int compile_subscript(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return compile_subscript_ex(cmp, ast, dst, 0, NULL, NULL);
 }
 
-static int compile_subscript_method_call(SpnCompiler *cmp, SpnHashMap *ast,
+static int compile_subscript_method_call(SpnCompiler *cmp, SpnAst *ast,
 	int *dst, int *reg_array, int *reg_subsc)
 {
 	/* Compile memberof expression. Keep the register index of
@@ -2536,9 +3141,9 @@ static int compile_subscript_method_call(SpnCompiler *cmp, SpnHashMap *ast,
 }
 
 /* returns an array of register indices where the call arguments are stored. */
-static spn_uword *compile_callargs(SpnCompiler *cmp, SpnArray *arguments, int is_method_call, int self_reg)
+static spn_uword *compile_callargs(SpnCompiler *cmp, SpnAst *call, int is_method_call, int self_reg)
 {
-	size_t explicit_argc = spn_array_count(arguments);
+	size_t explicit_argc = call->nchildren;
 	size_t total_argc = is_method_call ? explicit_argc + 1 : explicit_argc;
 	size_t nelem = ROUNDUP(total_argc, SPN_WORD_OCTETS);
 	size_t i;
@@ -2568,7 +3173,7 @@ static spn_uword *compile_callargs(SpnCompiler *cmp, SpnArray *arguments, int is
 		size_t wordidx = j / SPN_WORD_OCTETS;
 		size_t shift = 8 * (j % SPN_WORD_OCTETS);
 
-		SpnHashMap *argexpr = ast_get_nth_child(arguments, i);
+		SpnAst *argexpr = call->children[i];
 		int dst = -1;
 
 		if (compile_expr(cmp, argexpr, &dst) == 0) {
@@ -2583,16 +3188,21 @@ static spn_uword *compile_callargs(SpnCompiler *cmp, SpnArray *arguments, int is
 	return indices;
 }
 
-static int compile_call(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_call(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	int fnreg = -1, self_reg = -1, method_name_reg = -1;
 	spn_uword *arg_register_indices;
+	size_t off_method = 0;
 
-	SpnHashMap *funcexpr = ast_get_child_byname(ast, "func");
+	/* calls in the callee or argument expressions aren't in tail position */
+	int tailcall = cmp->tailcall;
+
+	SpnAst *funcexpr = ast_get_child_byname(ast, SPN_AST_FUNC);
 	int is_method_call = type_equal(ast_get_type(funcexpr), "memberof");
 
-	SpnArray *children = ast_get_children(ast);
-	size_t argc = spn_array_count(children);
+	size_t argc = ast->nchildren;
+
+	cmp->tailcall = 0;
 
 	/* if the call is a method call (as opposed to a free function call),
 	 * then there's one extra call-time argument, 'self'.
@@ -2612,6 +3222,9 @@ static int compile_call(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 		   &fnreg, &self_reg, &method_name_reg) == 0) {
 			return 0;
 		}
+
+		/* SPN_INS_METHOD and its inline cache index are 2 words */
+		off_method = cmp->bc.len - 2;
 	} else {
 		if (compile_expr(cmp, funcexpr, &fnreg) == 0) {
 			return 0;
@@ -2626,13 +3239,24 @@ static int compile_call(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	 * (i. e. the omission of error reporting), since if there are
 	 * no arguments to compile, then nothing could possibly fail.
 	 */
-	arg_register_indices = compile_callargs(cmp, children, is_method_call, self_reg);
+	arg_register_indices = compile_callargs(cmp, ast, is_method_call, self_reg);
 	if (argc > 0 && arg_register_indices == NULL) {
 		return 0;
 	}
 
+	/* if computing the arguments took no code, then the method lookup
+	 * is immediately followed by the call, so they can be fused.
+	 */
+	if (is_method_call
+	 && cmp->optlevel > SPN_OPT_NONE
+	 && cmp->bc.len == off_method + 2) {
+		spn_uword *ins = &cmp->bc.insns[off_method];
+		assert(OPCODE(*ins) == SPN_INS_METHOD);
+		*ins = (*ins & ~(spn_uword)(0xff)) | SPN_INS_CALLMETHOD;
+	}
+
 	/* actually emit call instruction */
-	emit_ins_ABC(cmp, SPN_INS_CALL, *dst, fnreg, argc);
+	emit_ins_ABC(cmp, tailcall ? SPN_INS_TAILCALL : SPN_INS_CALL, *dst, fnreg, argc);
 	bytecode_append(&cmp->bc, arg_register_indices, ROUNDUP(argc, SPN_WORD_OCTETS));
 
 	/* 'arg_register_indices' has been 'malloc()'ed, so free it */
@@ -2642,7 +3266,7 @@ static int compile_call(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 }
 
 /* compiles unary prefix operators that have no side effects */
-static int compile_unary(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_unary(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	int idx = -1, nvars;
 
@@ -2656,7 +3280,7 @@ static int compile_unary(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	const char *type = ast_get_type(ast);
 	enum spn_vm_ins opcode = node_to_opcode(opcode_map, COUNT(opcode_map), type);
 
-	SpnHashMap *child = ast_get_child_byname(ast, "right");
+	SpnAst *child = ast_get_child_byname(ast, SPN_AST_RIGHT);
 
 	if (*dst < 0) {
 		*dst = tmp_push(cmp);
@@ -2676,25 +3300,23 @@ static int compile_unary(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_unplus(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_unplus(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
-	SpnHashMap *child = ast_get_child_byname(ast, "right");
+	SpnAst *child = ast_get_child_byname(ast, SPN_AST_RIGHT);
 	return compile_expr(cmp, child, dst);
 }
 
-static int compile_unminus(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_unminus(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	/* if the operand is a literal, check if it's actually a number,
 	 * and if it is, directly emit its negated value.
 	 */
-	SpnHashMap *op = ast_get_child_byname(ast, "right");
+	SpnAst *op = ast_get_child_byname(ast, SPN_AST_RIGHT);
 	const char *op_type = ast_get_type(op);
 
 	if (type_equal(op_type, "literal")) {
-		SpnValue value = spn_hashmap_get_strkey(op, "value");
+		SpnValue value = op->value;
 		SpnValue negated_value;
-		SpnHashMap *negated;
-		int success;
 
 		if (!isnum(&value)) {
 			compiler_error(
@@ -2712,13 +3334,8 @@ static int compile_unminus(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 			negated_value = makeint(-1 * intvalue(&value));
 		}
 
-		/* clone the entire operand as-is, except negate its value */
-		negated = ast_shallow_copy(op);
-		spn_hashmap_set_strkey(negated, "value", &negated_value);
-
-		success = compile_literal(cmp, negated, dst);
-		spn_object_release(negated);
-		return success;
+		/* compile the operand as-is, except negate its value */
+		return compile_constant(cmp, op, negated_value, dst);
 	}
 
 	/* Else fall back to treating it just like all
@@ -2727,17 +3344,17 @@ static int compile_unminus(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return compile_unary(cmp, ast, dst);
 }
 
-static int compile_incdec_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_incdec_var(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	const char *nodetype = ast_get_type(ast);
 
 	int is_prefix = type_equal(nodetype, "pre_inc") || type_equal(nodetype, "pre_dec");
 	int is_incrmt = type_equal(nodetype, "pre_inc") || type_equal(nodetype, "post_inc");
 
-	SpnHashMap *op = ast_get_child_byname(ast, is_prefix ? "right" : "left");
+	SpnAst *op = ast_get_child_byname(ast, is_prefix ? SPN_AST_RIGHT : SPN_AST_LEFT);
 	enum spn_vm_ins opcode = is_incrmt ? SPN_INS_INC : SPN_INS_DEC;
 
-	SpnValue varname = spn_hashmap_get_strkey(op, "name");
+	SpnValue varname = op->name;
 	int idx = rts_getidx(cmp->varstack, varname);
 
 	if (idx < 0) {
@@ -2778,14 +3395,14 @@ static int compile_incdec_var(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_incdec_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_incdec_arr(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	const char *nodetype = ast_get_type(ast);
 
 	int is_prefix = type_equal(nodetype, "pre_inc") || type_equal(nodetype, "pre_dec");
 	int is_incrmt = type_equal(nodetype, "pre_inc") || type_equal(nodetype, "post_inc");
 
-	SpnHashMap *op = ast_get_child_byname(ast, is_prefix ? "right" : "left");
+	SpnAst *op = ast_get_child_byname(ast, is_prefix ? SPN_AST_RIGHT : SPN_AST_LEFT);
 	const char *op_type = ast_get_type(op);
 	int is_subscript = type_equal(op_type, "subscript");
 
@@ -2797,7 +3414,7 @@ static int compile_incdec_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	enum spn_vm_ins setter_opcode = is_subscript ? SPN_INS_IDX_SET : SPN_INS_PROPSET;
 
 	/* the subscripted object */
-	SpnHashMap *object = ast_get_child_byname(op, "object");
+	SpnAst *object = ast_get_child_byname(op, SPN_AST_OBJECT);
 
 	/* register index of subscripted object ("array")
 	 * and indexing expression, respectively
@@ -2817,22 +3434,19 @@ static int compile_incdec_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 
 	/* compile indexing expression */
 	if (is_subscript) { /* operator [] */
-		SpnHashMap *index = ast_get_child_byname(op, "index");
+		SpnAst *index = ast_get_child_byname(op, SPN_AST_INDEX);
 		if (compile_expr(cmp, index, &subidx) == 0) {
 			return 0;
 		}
 	} else { /* member-of, '.' */
-		SpnValue nameval = spn_hashmap_get_strkey(op, "name");
+		SpnValue nameval = op->name;
 		compile_string_literal(cmp, nameval, &subidx);
 	}
 
 	if (is_prefix) { /* these yield the already incremented/decremented value */
-		spn_uword insns[3];
-		insns[0] = SPN_MKINS_ABC(getter_opcode, *dst, arridx, subidx);
-		insns[1] = SPN_MKINS_A(arith_opcode, *dst);
-		insns[2] = SPN_MKINS_ABC(setter_opcode, arridx, subidx, *dst);
-
-		bytecode_append(&cmp->bc, insns, COUNT(insns));
+		emit_ins_member(cmp, getter_opcode, *dst, arridx, subidx);
+		emit_ins_A(cmp, arith_opcode, *dst);
+		emit_ins_member(cmp, setter_opcode, arridx, subidx, *dst);
 	} else {
 		/* on the other hand, these operators yield the original
 		 * (yet unmodified) value. For this, we need a temporary
@@ -2840,13 +3454,10 @@ static int compile_incdec_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 		 */
 		int tmpidx = tmp_push(cmp);
 
-		spn_uword insns[4];
-		insns[0] = SPN_MKINS_ABC(getter_opcode, *dst, arridx, subidx);
-		insns[1] = SPN_MKINS_AB(SPN_INS_MOV, tmpidx, *dst);
-		insns[2] = SPN_MKINS_A(arith_opcode, tmpidx);
-		insns[3] = SPN_MKINS_ABC(setter_opcode, arridx, subidx, tmpidx);
-
-		bytecode_append(&cmp->bc, insns, COUNT(insns));
+		emit_ins_member(cmp, getter_opcode, *dst, arridx, subidx);
+		emit_ins_AB(cmp, SPN_INS_MOV, tmpidx, *dst);
+		emit_ins_A(cmp, arith_opcode, tmpidx);
+		emit_ins_member(cmp, setter_opcode, arridx, subidx, tmpidx);
 		tmp_pop(cmp);
 	}
 
@@ -2864,12 +3475,12 @@ static int compile_incdec_arr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 1;
 }
 
-static int compile_incdec(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_incdec(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	const char *type = ast_get_type(ast);
 	int is_prefix = type_equal(type, "pre_inc") || type_equal(type, "pre_dec");
 
-	SpnHashMap *op = ast_get_child_byname(ast, is_prefix ? "right" : "left");
+	SpnAst *op = ast_get_child_byname(ast, is_prefix ? SPN_AST_RIGHT : SPN_AST_LEFT);
 	const char *op_type = ast_get_type(op);
 
 	if (type_equal(op_type, "ident")) {
@@ -2890,7 +3501,7 @@ static int compile_incdec(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	return 0;
 }
 
-static int compile_expr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
+static int compile_expr(SpnCompiler *cmp, SpnAst *ast, int *dst)
 {
 	const void *args[1]; /* for error reporting */
 
@@ -2899,7 +3510,7 @@ static int compile_expr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	 */
 	static const struct {
 		const char *node;
-		int (*fn)(SpnCompiler *, SpnHashMap *, int *);
+		int (*fn)(SpnCompiler *, SpnAst *, int *);
 	} compilers[] = {
 		/* terms and most postfix operators */
 		{ "literal",   compile_literal             },
@@ -2974,13 +3585,26 @@ static int compile_expr(SpnCompiler *cmp, SpnHashMap *ast, int *dst)
 	for (i = 0; i < COUNT(compilers); i++) {
 		if (type_equal(compilers[i].node, type)) {
 			size_t begin = cmp->bc.len;
-			int status = compilers[i].fn(cmp, ast, dst);
-			size_t end = cmp->bc.len;
+			size_t end;
+			int status;
+			SpnValue folded;
+
+			/* if the expression is constant, only load its value */
+			if (cmp->optlevel > SPN_OPT_NONE
+			 && compilers[i].fn != compile_literal
+			 && fold_constant(ast, &folded)) {
+				status = compile_constant(cmp, ast, folded, dst);
+				spn_value_release(&folded);
+			} else {
+				status = compilers[i].fn(cmp, ast, dst);
+			}
+
+			end = cmp->bc.len;
 
 			/* add debug info mapping bytecode addresses to source
 			 * lines, columns and registers.
 			 */
-			spn_dbg_emit_source_location(cmp->debug_info, begin, end, ast, *dst);
+			spn_dbg_emit_source_location(cmp->debug_info, begin, end, ast->loc, *dst);
 
 			return status;
 		}
@@ -17,6 +17,7 @@
 #include "vm.h"
 #include "func.h"
 #include "parser.h"
+#include "ast.h"
 
 /* name of the function containing the top-level program */
 #define SPN_TOPFN "<main program>"
@@ -24,6 +25,29 @@
 /* a compiler object takes an AST and outputs bytecode */
 typedef struct SpnCompiler SpnCompiler;
 
+/* Optimization levels. At SPN_OPT_NONE, the compiler translates the AST
+ * as written. SPN_OPT_DEFAULT, which is the level of new compilers, and
+ * higher levels additionally:
+ *
+ *  - fold constant expressions (unless evaluating them would result in
+ *    a runtime error, e. g. division by zero or adding a string to a
+ *    number; those are left for the virtual machine to report);
+ *  - omit the nil-initialization of variables whose initializer does
+ *    not refer to them, and the temporary register (and the copy out of
+ *    it) of logical operators whose result goes into a new temporary;
+ *  - emit superinstructions: a comparison used as the condition of an
+ *    'if', 'while', 'do' or 'for' statement is fused with the branch
+ *    (see SPN_INS_CMPJZE), and a method lookup which is immediately
+ *    followed by the call is fused with it (see SPN_INS_CALLMETHOD).
+ *    Constant conditions are resolved at compile time;
+ *  - compile 'return f(...)' to a tail call (see SPN_INS_TAILCALL), so
+ *    that the frame of the caller is reused by the callee.
+ */
+enum spn_opt_level {
+	SPN_OPT_NONE,
+	SPN_OPT_DEFAULT
+};
+
 SPN_API SpnCompiler *spn_compiler_new(void);
 SPN_API void         spn_compiler_free(SpnCompiler *cmp);
 
@@ -33,6 +57,15 @@ SPN_API void         spn_compiler_free(SpnCompiler *cmp);
  */
 SPN_API SpnFunction *spn_compiler_compile(SpnCompiler *cmp, SpnHashMap *ast, int debug);
 
+/* the same, but it compiles a native AST (e. g. one that has been returned
+ * by spn_parser_parse_ast()), so the tree need not be converted first.
+ */
+SPN_API SpnFunction *spn_compiler_compile_ast(SpnCompiler *cmp, SpnAst *ast, int debug);
+
+/* get and set the optimization level used by subsequent compilations */
+SPN_API void spn_compiler_setoptlevel(SpnCompiler *cmp, int level);
+SPN_API int  spn_compiler_getoptlevel(SpnCompiler *cmp);
+
 /* obtain the most recent error message */
 SPN_API	const char  *spn_compiler_errmsg(SpnCompiler *cmp);
 
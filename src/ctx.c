@@ -8,22 +8,88 @@
  * A convenience context API
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else /* _WIN32 */
+#include <unistd.h>
+#endif /* _WIN32 */
+
+#if USE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif /* USE_THREADS */
+
 #include "ctx.h"
 #include "func.h"
+#include "str.h"
+#include "typedarr.h"
 #include "private.h"
 #include "debug.h"
 
 
-void spn_ctx_init(SpnContext *ctx)
+static void free_pool(SpnWorkerPool *pool);
+
+/* the pool arena and the cycle collector which are current on a thread */
+typedef struct Binding {
+	SpnPoolArena *arena;
+	SpnGC *gc;
+} Binding;
+
+static void set_binding(const Binding *b)
+{
+	spn_pool_setarena(b->arena);
+	spn_gc_setcurrent(b->gc);
+}
+
+/* makes the arena and the collector of the context current while code
+ * runs on it, and saves the previous ones in 'prev' for leave()
+ */
+static void enter(SpnContext *ctx, Binding *prev)
+{
+	prev->arena = spn_pool_getarena();
+	prev->gc = spn_gc_getcurrent();
+
+	if (prev->arena != ctx->arena) {
+		spn_pool_setarena(ctx->arena);
+		spn_gc_setcurrent(ctx->gc);
+	}
+}
+
+static void leave(SpnContext *ctx, const Binding *prev)
+{
+	if (prev->arena != ctx->arena) {
+		set_binding(prev);
+	}
+}
+
+static void init_context(SpnContext *ctx, const SpnAllocator *allocator, int isworker)
 {
+	ctx->arena = spn_pool_newarena(allocator);
+	ctx->allocator = spn_pool_allocator(ctx->arena);
+	ctx->gc = spn_gc_new();
+
+	/* everything below is allocated from the arena of the context */
+	spn_pool_setarena(ctx->arena);
+	spn_gc_setcurrent(ctx->gc);
+
 	spn_parser_init(&ctx->parser);
 
 	ctx->cmp      = spn_compiler_new();
 	ctx->vm       = spn_vm_new();
 	ctx->programs = spn_array_new();
+	ctx->modules  = spn_hashmap_new();
+	ctx->modcache = 0;
 	ctx->errtype  = SPN_ERROR_OK;
 	ctx->errmsg   = NULL;
 	ctx->info     = NULL;
+	ctx->workers  = NULL;
+	ctx->isworker = isworker;
 
 #if USE_DYNAMIC_LOADING
 	ctx->dynmods  = spn_array_new();
@@ -32,6 +98,7 @@ void spn_ctx_init(SpnContext *ctx)
 #endif /* USE_DYNAMIC_LOADING */
 
 	spn_vm_setcontext(ctx->vm, ctx);
+	spn_vm_setgc(ctx->vm, ctx->gc);
 
 	/* load part of stdlib that is implemented in C */
 	spn_load_native_stdlib(ctx->vm);
@@ -40,6 +107,16 @@ void spn_ctx_init(SpnContext *ctx)
 	spn_ctx_load_script_stdlib(ctx);
 }
 
+void spn_ctx_init(SpnContext *ctx)
+{
+	init_context(ctx, NULL, 0);
+}
+
+void spn_ctx_init_allocator(SpnContext *ctx, const SpnAllocator *allocator)
+{
+	init_context(ctx, allocator, 0);
+}
+
 #if USE_DYNAMIC_LOADING
 static void close_dynmod_handles(SpnContext *ctx)
 {
@@ -67,15 +144,40 @@ static void close_dynmod_handles(SpnContext *ctx)
 
 void spn_ctx_free(SpnContext *ctx)
 {
+	Binding prev;
+	enter(ctx, &prev);
+
+	if (ctx->workers != NULL) {
+		free_pool(ctx->workers);
+	}
+
 	spn_parser_free(&ctx->parser);
 	spn_compiler_free(ctx->cmp);
 	spn_vm_free(ctx->vm);
 
+	spn_object_release(ctx->modules);
 	spn_object_release(ctx->programs);
 
+	/* before the destructors of dynamic modules are unloaded */
+	spn_gc_collect(ctx->gc);
+
 #if USE_DYNAMIC_LOADING
 	close_dynmod_handles(ctx);
 #endif /* USE_DYNAMIC_LOADING */
+
+	/* if the context was current, the thread falls back to the shared
+	 * pool (where objects which outlive the context are freed) and to
+	 * no collector at all
+	 */
+	if (prev.arena == ctx->arena) {
+		prev.arena = NULL;
+		prev.gc = NULL;
+	}
+
+	set_binding(&prev);
+
+	spn_gc_free(ctx->gc);
+	spn_pool_freearena(ctx->arena);
 }
 
 enum spn_error_type spn_ctx_geterrtype(SpnContext *ctx)
@@ -121,34 +223,79 @@ void spn_ctx_setuserinfo(SpnContext *ctx, void *info)
 	ctx->info = info;
 }
 
+void spn_ctx_setoptlevel(SpnContext *ctx, int level)
+{
+	spn_compiler_setoptlevel(ctx->cmp, level);
+}
+
+void spn_ctx_setprofile(SpnContext *ctx, SpnProfile *prof)
+{
+	spn_vm_setprofile(ctx->vm, prof);
+}
+
+size_t spn_ctx_gc(SpnContext *ctx)
+{
+	return spn_gc_collect(ctx->gc);
+}
+
+SpnHeapStat *spn_ctx_heapstats(SpnContext *ctx, size_t *n)
+{
+	return spn_pool_heapstats(ctx->arena, n);
+}
+
 /* private helper function for adding a program to
  * the list of compiled programs in a context
  */
 static void add_to_programs(SpnContext *ctx, SpnFunction *fn)
 {
-	SpnValue val;
-	val.type = SPN_TYPE_FUNC;
-	val.v.o = fn;
+	SpnValue val = makeobject(SPN_TYPE_FUNC, fn);
 	spn_array_push(ctx->programs, &val);
 }
 
-/* the essence */
+/* private helper function: sets the error type according to
+ * the result of the compilation, and adds the program to the context
+ */
+static SpnFunction *add_compiled_program(SpnContext *ctx, SpnFunction *fn)
+{
+	if (fn == NULL) {
+		ctx->errtype = SPN_ERROR_SEMANTIC;
+		return NULL;
+	}
 
-SpnFunction *spn_ctx_compile_string(SpnContext *ctx, const char *str, int debug)
+	ctx->errtype = SPN_ERROR_OK;
+
+	/* add program to list of programs, balance reference count */
+	add_to_programs(ctx, fn);
+	spn_object_release(fn);
+
+	return fn;
+}
+
+/* compiles a native AST, which is owned by the parser of the context */
+static SpnFunction *compile_native_ast(SpnContext *ctx, SpnAst *ast, int debug)
 {
-	SpnFunction *result;
+	SpnFunction *fn;
 
-	/* attempt parsing, handle error */
-	SpnHashMap *ast = spn_ctx_parse(ctx, str);
 	if (ast == NULL) {
+		ctx->errtype = SPN_ERROR_SYNTAX;
 		return NULL;
 	}
 
-	/* attempt compilation, add function to context */
-	result = spn_ctx_compile_ast(ctx, ast, debug);
-	spn_object_release(ast);
+	fn = spn_compiler_compile_ast(ctx->cmp, ast, debug);
 
-	return result;
+	/* the tree is not needed anymore, free it right away */
+	spn_ast_arena_reset(&ctx->parser.arena);
+
+	return add_compiled_program(ctx, fn);
+}
+
+/* the essence */
+
+SpnFunction *spn_ctx_compile_string(SpnContext *ctx, const char *str, int debug)
+{
+	/* parse directly to the native AST; no hashmaps are built */
+	SpnAst *ast = spn_parser_parse_ast(&ctx->parser, str);
+	return compile_native_ast(ctx, ast, debug);
 }
 
 SpnFunction *spn_ctx_compile_srcfile(SpnContext *ctx, const char *fname, int debug)
@@ -175,26 +322,50 @@ SpnFunction *spn_ctx_compile_srcfile(SpnContext *ctx, const char *fname, int deb
 	return result;
 }
 
+/* private helper for validating the header of object data */
+static int check_objhdr(SpnContext *ctx, const void *objdata, size_t objsize)
+{
+	if (spn_objhdr_check(objdata, objsize) != 0) {
+		ctx->errtype = SPN_ERROR_GENERIC;
+		ctx->errmsg = "invalid or incompatible object file";
+		return -1;
+	}
+
+	return 0;
+}
+
 SpnFunction *spn_ctx_loadobjfile(SpnContext *ctx, const char *fname)
 {
+	void *mapping;
 	spn_uword *bc;
 	size_t filesize, nwords;
 	SpnFunction *result;
 
 	ctx->errtype = SPN_ERROR_OK;
 
-	bc = spn_read_binary_file(fname, &filesize);
-	if (bc == NULL) {
+	/* The bytecode is used in place, directly from the mapping.
+	 * It is mapped privately, since the virtual machine rewrites
+	 * some instructions while executing them (so that only the
+	 * pages containing those are copied).
+	 */
+	mapping = spn_map_file(fname, &filesize);
+	if (mapping == NULL) {
 		ctx->errtype = SPN_ERROR_GENERIC;
 		ctx->errmsg = "I/O error: could not read object file";
 		return NULL;
 	}
 
+	if (check_objhdr(ctx, mapping, filesize) != 0) {
+		spn_unmap_file(mapping, filesize);
+		return NULL;
+	}
+
 	/* the size of the object file is not the same
 	 * as the number of machine words in the bytecode
 	 */
-	nwords = filesize / sizeof bc[0];
-	result = spn_func_new_topprg(SPN_TOPFN, bc, nwords, NULL);
+	bc = (spn_uword *)((char *)(mapping) + SPN_OBJHDR_LEN);
+	nwords = (filesize - SPN_OBJHDR_LEN) / sizeof bc[0];
+	result = spn_func_new_mapped(SPN_TOPFN, bc, nwords, mapping, filesize);
 
 	add_to_programs(ctx, result);
 	spn_object_release(result); /* still alive, retained by array */
@@ -203,17 +374,27 @@ SpnFunction *spn_ctx_loadobjfile(SpnContext *ctx, const char *fname)
 
 SpnFunction *spn_ctx_loadobjdata(SpnContext *ctx, const void *objdata, size_t objsize)
 {
-	size_t nwords;
-	spn_uword *bc = spn_malloc(objsize);
+	size_t nwords, bcsize;
+	spn_uword *bc;
 	SpnFunction *result;
 
-	memcpy(bc, objdata, objsize);
 	ctx->errtype = SPN_ERROR_OK;
 
+	if (check_objhdr(ctx, objdata, objsize) != 0) {
+		return NULL;
+	}
+
+	/* the bytecode is copied, because the virtual machine modifies
+	 * it, while 'objdata' may be read-only (or even misaligned)
+	 */
+	bcsize = objsize - SPN_OBJHDR_LEN;
+	bc = spn_malloc(bcsize);
+	memcpy(bc, (const char *)(objdata) + SPN_OBJHDR_LEN, bcsize);
+
 	/* the size of the object file is not the same
 	 * as the number of machine words in the bytecode
 	 */
-	nwords = objsize / sizeof bc[0];
+	nwords = bcsize / sizeof bc[0];
 	result = spn_func_new_topprg(SPN_TOPFN, bc, nwords, NULL);
 
 	add_to_programs(ctx, result);
@@ -265,12 +446,218 @@ int spn_ctx_execobjdata(SpnContext *ctx, const void *objdata, size_t objsize, Sp
 	return spn_ctx_callfunc(ctx, fn, ret, 0, NULL);
 }
 
+/* The module cache maps file names to hashmaps describing the module:
+ * "mtime", "mtimens" and "size" are the modification time (seconds and
+ * nanoseconds) and the size of the source file at the time of compilation,
+ * "program" is the compiled program, and if the result of the module is
+ * memoized, "result" is its return value, with "ran" being true once it
+ * has been stored.
+ */
+
+/* the sub-second part of the modification time, where available */
+#if defined(__APPLE__)
+#define MTIME_NSEC(st) ((long)((st)->st_mtimespec.tv_nsec))
+#elif defined(_WIN32)
+#define MTIME_NSEC(st) 0L
+#else
+#define MTIME_NSEC(st) ((long)((st)->st_mtim.tv_nsec))
+#endif
+
+/* true if 'lhs' has been modified strictly later than 'rhs' */
+static int is_newer(const struct stat *lhs, const struct stat *rhs)
+{
+	if (lhs->st_mtime != rhs->st_mtime) {
+		return lhs->st_mtime > rhs->st_mtime;
+	}
+
+	return MTIME_NSEC(lhs) > MTIME_NSEC(rhs);
+}
+
+/* true if the source file described by 'st' is the one 'entry' was
+ * compiled from. The size catches most of the changes which happen
+ * within the resolution of the file system's timestamps.
+ */
+static int is_unchanged(SpnHashMap *entry, const struct stat *st)
+{
+	SpnValue mtime = spn_hashmap_get_strkey(entry, "mtime");
+	SpnValue mtimens = spn_hashmap_get_strkey(entry, "mtimens");
+	SpnValue size = spn_hashmap_get_strkey(entry, "size");
+
+	return intvalue(&mtime) == (long)(st->st_mtime)
+	    && intvalue(&mtimens) == MTIME_NSEC(st)
+	    && intvalue(&size) == (long)(st->st_size);
+}
+
+/* "foo/bar.spn" -> "foo/bar.spo"; the result must be free()'d */
+static char *module_objfile_name(const char *fname)
+{
+	const char *dotp = strrchr(fname, '.');
+	const char *slashp = strrchr(fname, '/');
+	size_t stemlen;
+	char *objname;
+
+	if (dotp == NULL || (slashp != NULL && dotp < slashp)) {
+		stemlen = strlen(fname);
+	} else {
+		stemlen = dotp - fname;
+	}
+
+	objname = spn_malloc(stemlen + sizeof ".spo");
+	memcpy(objname, fname, stemlen);
+	strcpy(objname + stemlen, ".spo");
+
+	return objname;
+}
+
+/* writes a temporary file first, so that other processes never see a
+ * partially written object file. The name of the temporary file contains
+ * the process ID and the address of the module, so that processes and
+ * threads which persist the same module at the same time don't write to
+ * the same file. Failure is not an error: the temporary file is removed,
+ * and the module will just be compiled again next time.
+ */
+static void persist_module(SpnFunction *fn, const char *objname)
+{
+	/* 64 bytes are plenty for ".<pid>.<address>.tmp" */
+	char *tmpname = spn_malloc(strlen(objname) + 64);
+	sprintf(tmpname, "%s.%ld.%p.tmp", objname, (long)getpid(), (void *)fn);
+
+	if (spn_write_objfile(tmpname, fn->repr.bc, fn->nwords) != 0
+	 || rename(tmpname, objname) != 0) {
+		remove(tmpname);
+	}
+
+	free(tmpname);
+}
+
+static SpnFunction *load_module(SpnContext *ctx, const char *fname, const struct stat *srcstat)
+{
+	SpnFunction *fn;
+	char *objname = NULL;
+
+	if (ctx->modcache & SPN_MODCACHE_PERSIST) {
+		struct stat objstat;
+		objname = module_objfile_name(fname);
+
+		/* an outdated, unreadable or incompatible object
+		 * file is simply replaced by a fresh one
+		 */
+		if (stat(objname, &objstat) == 0 && is_newer(&objstat, srcstat)) {
+			fn = spn_ctx_loadobjfile(ctx, objname);
+
+			if (fn != NULL) {
+				free(objname);
+				return fn;
+			}
+		}
+	}
+
+	/* the bytecode must be written before it is run for the first time,
+	 * since the virtual machine rewrites some of the instructions
+	 */
+	fn = spn_ctx_compile_srcfile(ctx, fname, 1);
+
+	if (fn != NULL && objname != NULL) {
+		persist_module(fn, objname);
+	}
+
+	free(objname);
+	return fn;
+}
+
+int spn_ctx_require(SpnContext *ctx, const char *fname, SpnValue *ret)
+{
+	struct stat st;
+	SpnValue entryval, result;
+	SpnHashMap *entry;
+	SpnFunction *fn = NULL;
+
+	/* let the regular path report the I/O error */
+	if (stat(fname, &st) != 0) {
+		return spn_ctx_execsrcfile(ctx, fname, ret);
+	}
+
+	entryval = spn_hashmap_get_strkey(ctx->modules, fname);
+
+	if (ishashmap(&entryval)) {
+		entry = hashmapvalue(&entryval);
+
+		if (is_unchanged(entry, &st)) {
+			SpnValue ran = spn_hashmap_get_strkey(entry, "ran");
+			SpnValue prog = spn_hashmap_get_strkey(entry, "program");
+
+			if ((ctx->modcache & SPN_MODCACHE_RESULT) && isbool(&ran)) {
+				ctx->errtype = SPN_ERROR_OK;
+
+				if (ret != NULL) {
+					*ret = spn_hashmap_get_strkey(entry, "result");
+					spn_value_retain(ret);
+				}
+
+				return 0;
+			}
+
+			fn = funcvalue(&prog);
+		}
+	}
+
+	/* not cached yet, or the file has changed since */
+	if (fn == NULL) {
+		SpnValue mtime = makeint(st.st_mtime);
+		SpnValue mtimens = makeint(MTIME_NSEC(&st));
+		SpnValue size = makeint(st.st_size);
+		SpnValue prog;
+
+		fn = load_module(ctx, fname, &st);
+		if (fn == NULL) {
+			return -1;
+		}
+
+		entry = spn_hashmap_new();
+		prog = makeobject(SPN_TYPE_FUNC, fn);
+		spn_hashmap_set_strkey(entry, "mtime", &mtime);
+		spn_hashmap_set_strkey(entry, "mtimens", &mtimens);
+		spn_hashmap_set_strkey(entry, "size", &size);
+		spn_hashmap_set_strkey(entry, "program", &prog);
+
+		entryval = makeobject(SPN_TYPE_HASHMAP, entry);
+		spn_hashmap_set_strkey(ctx->modules, fname, &entryval);
+		spn_object_release(entry);
+	}
+
+	if (spn_ctx_callfunc(ctx, fn, &result, 0, NULL) != 0) {
+		return -1;
+	}
+
+	if (ctx->modcache & SPN_MODCACHE_RESULT) {
+		SpnValue ran = spn_trueval;
+		spn_hashmap_set_strkey(entry, "result", &result);
+		spn_hashmap_set_strkey(entry, "ran", &ran);
+	}
+
+	if (ret != NULL) {
+		*ret = result;
+	} else {
+		spn_value_release(&result);
+	}
+
+	return 0;
+}
+
+void spn_ctx_setmodcache(SpnContext *ctx, int flags)
+{
+	ctx->modcache = flags;
+}
+
 /* abstraction (well, sort of) of the virtual machine API */
 
 int spn_ctx_callfunc(SpnContext *ctx, SpnFunction *func, SpnValue *ret, int argc, SpnValue argv[])
 {
+	Binding prev;
 	int status;
 
+	enter(ctx, &prev);
+
 	ctx->errtype = SPN_ERROR_OK;
 
 	status = spn_vm_callfunc(ctx->vm, func, ret, argc, argv);
@@ -278,9 +665,33 @@ int spn_ctx_callfunc(SpnContext *ctx, SpnFunction *func, SpnValue *ret, int argc
 		ctx->errtype = SPN_ERROR_RUNTIME;
 	}
 
+	leave(ctx, &prev);
+	return status;
+}
+
+int spn_ctx_resume(SpnContext *ctx, SpnCoroutine *co, SpnValue *ret, int argc, SpnValue argv[])
+{
+	Binding prev;
+	int status;
+
+	enter(ctx, &prev);
+
+	ctx->errtype = SPN_ERROR_OK;
+
+	status = spn_vm_resume(ctx->vm, co, ret, argc, argv);
+	if (status != 0) {
+		ctx->errtype = SPN_ERROR_RUNTIME;
+	}
+
+	leave(ctx, &prev);
 	return status;
 }
 
+int spn_ctx_yield(SpnContext *ctx, const SpnValue *val)
+{
+	return spn_vm_yield(ctx->vm, val);
+}
+
 void spn_ctx_runtime_error(SpnContext *ctx, const char *fmt, const void *args[])
 {
 	spn_vm_seterrmsg(ctx->vm, fmt, args);
@@ -288,19 +699,9 @@ void spn_ctx_runtime_error(SpnContext *ctx, const char *fmt, const void *args[])
 
 SpnFunction *spn_ctx_compile_expr(SpnContext *ctx, const char *expr, int debug)
 {
-	SpnFunction *result;
-
 	/* parse as expression */
-	SpnHashMap *ast = spn_ctx_parse_expr(ctx, expr);
-	if (ast == NULL) {
-		return NULL;
-	}
-
-	/* compile AST and add resulting function to context */
-	result = spn_ctx_compile_ast(ctx, ast, debug);
-	spn_object_release(ast);
-
-	return result;
+	SpnAst *ast = spn_parser_parse_expression_ast(&ctx->parser, expr);
+	return compile_native_ast(ctx, ast, debug);
 }
 
 SpnHashMap *spn_ctx_parse(SpnContext *ctx, const char *src)
@@ -332,19 +733,7 @@ SpnHashMap *spn_ctx_parse_expr(SpnContext *ctx, const char *src)
 SpnFunction *spn_ctx_compile_ast(SpnContext *ctx, SpnHashMap *ast, int debug)
 {
 	SpnFunction *fn = spn_compiler_compile(ctx->cmp, ast, debug);
-
-	if (fn == NULL) {
-		ctx->errtype = SPN_ERROR_SEMANTIC;
-		return NULL;
-	}
-
-	ctx->errtype = SPN_ERROR_OK;
-
-	/* add program to list of programs, balance reference count */
-	add_to_programs(ctx, fn);
-	spn_object_release(fn);
-
-	return fn;
+	return add_compiled_program(ctx, fn);
 }
 
 
@@ -364,6 +753,11 @@ void spn_ctx_addlib_cfuncs(SpnContext *ctx, const char *libname, const SpnExtFun
 	spn_vm_addlib_cfuncs(ctx->vm, libname, fns, n);
 }
 
+void spn_ctx_addlib_cfuncs_ex(SpnContext *ctx, const char *libname, const SpnExtFuncEx fns[], size_t n)
+{
+	spn_vm_addlib_cfuncs_ex(ctx->vm, libname, fns, n);
+}
+
 void spn_ctx_addlib_values(SpnContext *ctx, const char *libname, const SpnExtValue vals[], size_t n)
 {
 	spn_vm_addlib_values(ctx->vm, libname, vals, n);
@@ -379,28 +773,997 @@ SpnHashMap *spn_ctx_getclasses(SpnContext *ctx)
 	return spn_vm_getclasses(ctx->vm);
 }
 
-/* Load non-native parts of the standard library */
-void spn_ctx_load_script_stdlib(SpnContext *ctx)
+/*
+ * Parallel map and filter
+ */
+
+/* calls the function on the virtual machine of the context, just like the
+ * map() and filter() methods; used by workers, which have no workers of
+ * their own
+ */
+static int sequential_map(SpnContext *ctx, SpnArray *arr, SpnFunction *fn, int filter, SpnValue *ret)
 {
-	static const char *const modules[] = {
-#include "stdmodules.inc"
-	};
+	size_t i, n = spn_array_count(arr);
+	SpnArray *res = spn_array_new();
 
-	size_t i;
-	for (i = 0; i < COUNT(modules); i++) {
-		int error = spn_ctx_execsrcfile(ctx, modules[i], NULL);
+	for (i = 0; i < n; i++) {
+		SpnValue args[2];
+		SpnValue result;
 
-		/* being unable to load a standard module is a fatal error */
-		if (error != 0) {
-			spn_die(
-				"cannot load stdlib module %s: %s\n",
-				modules[i],
-				spn_ctx_geterrmsg(ctx)
-			);
+		args[0] = spn_array_get(arr, i);
+		args[1] = makeint(i);
+
+		if (spn_ctx_callfunc(ctx, fn, &result, COUNT(args), args) != 0) {
+			spn_object_release(res);
+			return -1;
+		}
+
+		if (!filter) {
+			spn_array_push(res, &result);
+			spn_value_release(&result);
+		} else if (isbool(&result)) {
+			if (boolvalue(&result)) {
+				spn_array_push(res, &args[0]);
+			}
+		} else {
+			spn_value_release(&result);
+			spn_object_release(res);
+			spn_ctx_runtime_error(ctx, "predicate must return a boolean", NULL);
+			ctx->errtype = SPN_ERROR_RUNTIME;
+			return -1;
 		}
 	}
+
+	*ret = makeobject(SPN_TYPE_ARRAY, res);
+	return 0;
+}
+
+/* A worker is a context of its own, running on a separate thread (or on
+ * the thread of the host, without USE_THREADS), with a separate pool
+ * arena. Objects are never shared between the heap of the host (the
+ * context which owns the pool) and those of the workers, since reference
+ * counts aren't atomic. Instead, the arguments of a job
+ * are copied by the workers while the host waits for them, so the heap
+ * of the host is effectively immutable, and can be read concurrently.
+ * Results are copied (or moved, see 'Marshal') into objects owned by the
+ * host, before the worker signals that it has finished the job.
+ *
+ * Compiled programs can't be shared either, so every worker runs a copy
+ * of the programs of the host (see spn_vm_import_program()). 'imports'
+ * maps the programs of the host to the corresponding copies, 'exports'
+ * maps them the other way around. Both of them consist of weak user info
+ * values only, so neither touches the reference count of any object;
+ * the copies are owned by the context of the worker, and the originals
+ * are kept alive by the pool (see 'sources').
+ */
+typedef struct Worker {
+	SpnContext ctx;
+	SpnHashMap *imports;
+	SpnHashMap *exports;
+	size_t index;            /* index in the array of workers     */
+	unsigned long jobid;     /* ID of the last job it has seen    */
+#if USE_THREADS
+	pthread_t thread;
+#endif /* USE_THREADS */
+	struct SpnWorkerPool *pool;
+} Worker;
+
+struct SpnWorkerPool {
+	Worker **workers;
+	size_t nworkers;
+	SpnArray *sources;       /* imported programs of the host     */
+	SpnHashMap *imported;    /* the same, as a set of weak values */
+
+#if USE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t start;    /* broadcast when a job is posted    */
+	pthread_cond_t finish;   /* signalled when the job is done    */
+#endif /* USE_THREADS */
+	unsigned long jobid;     /* incremented for every job         */
+	size_t nparticipants;    /* workers [0, n) take part in a job */
+	size_t nbusy;            /* number of workers still working   */
+	int quit;
+
+	/* the current job; everything below is protected by 'lock',
+	 * except for the elements of 'results', of which each one
+	 * is written by the worker that claimed it only
+	 */
+	SpnFunction *fn;
+	SpnArray *input;
+	int filter;
+	SpnValue *results;
+	size_t next;             /* index of the next unclaimed element */
+	size_t count;
+	size_t chunk;            /* number of elements claimed at once  */
+	char *errmsg;            /* error message of the first failure  */
+};
+
+/* State of copying a value from one heap into another one. 'memo' maps
+ * the containers and closures already copied to their copies (it's only
+ * created when needed), which preserves sharing and makes cyclic values
+ * possible to copy. If 'move' is set, strings which are only referenced
+ * by the value being copied (which is about to be released) are moved
+ * instead of copied.
+ */
+typedef struct Marshal {
+	SpnHashMap *programs;    /* programs of the source -> copies */
+	SpnHashMap *memo;
+	int move;
+	const char *errfmt;      /* error message with a '%s' in it  */
+	const char *errarg;
+} Marshal;
+
+static int marshal_value(Marshal *m, const SpnValue *src, SpnValue *dst, int exclusive);
+
+static void init_marshal(Marshal *m, SpnHashMap *programs, int move)
+{
+	m->programs = programs;
+	m->memo = NULL;
+	m->move = move;
+	m->errfmt = NULL;
+	m->errarg = NULL;
+}
+
+static void reset_marshal(Marshal *m)
+{
+	if (m->memo != NULL) {
+		spn_object_release(m->memo);
+		m->memo = NULL;
+	}
+}
+
+static int memo_get(Marshal *m, void *obj, SpnValue *dst)
+{
+	SpnValue key, copy;
+
+	if (m->memo == NULL) {
+		return 0;
+	}
+
+	key = makeweakuserinfo(obj);
+	copy = spn_hashmap_get(m->memo, &key);
+
+	if (isnil(&copy)) {
+		return 0;
+	}
+
+	spn_value_retain(&copy);
+	*dst = copy;
+	return 1;
+}
+
+static void memo_set(Marshal *m, void *obj, const SpnValue *copy)
+{
+	SpnValue key = makeweakuserinfo(obj);
+
+	if (m->memo == NULL) {
+		m->memo = spn_hashmap_new();
+	}
+
+	spn_hashmap_set(m->memo, &key, copy);
 }
 
+static int marshal_array(Marshal *m, const SpnValue *src, SpnValue *dst, int exclusive)
+{
+	SpnArray *orig = arrayvalue(src);
+	SpnArray *copy = spn_array_new();
+	size_t i, n = spn_array_count(orig);
+
+	*dst = makeobject(SPN_TYPE_ARRAY, copy);
+	memo_set(m, orig, dst);
+
+	for (i = 0; i < n; i++) {
+		SpnValue elem = spn_array_get(orig, i);
+		SpnValue elemcopy;
+
+		if (marshal_value(m, &elem, &elemcopy, exclusive) != 0) {
+			spn_value_release(dst);
+			return -1;
+		}
+
+		spn_array_push(copy, &elemcopy);
+		spn_value_release(&elemcopy);
+	}
+
+	return 0;
+}
+
+static int marshal_hashmap(Marshal *m, const SpnValue *src, SpnValue *dst, int exclusive)
+{
+	SpnHashMap *orig = hashmapvalue(src);
+	SpnHashMap *copy = spn_hashmap_new();
+	size_t cursor = 0;
+	SpnValue key, val;
+
+	*dst = makeobject(SPN_TYPE_HASHMAP, copy);
+	memo_set(m, orig, dst);
+
+	while ((cursor = spn_hashmap_next(orig, cursor, &key, &val)) != 0) {
+		SpnValue keycopy, valcopy;
+
+		if (marshal_value(m, &key, &keycopy, exclusive) != 0) {
+			spn_value_release(dst);
+			return -1;
+		}
+
+		if (marshal_value(m, &val, &valcopy, exclusive) != 0) {
+			spn_value_release(&keycopy);
+			spn_value_release(dst);
+			return -1;
+		}
+
+		spn_hashmap_set(copy, &keycopy, &valcopy);
+		spn_value_release(&keycopy);
+		spn_value_release(&valcopy);
+	}
+
+	return 0;
+}
+
+/* a script function is copied by pointing into the copy of its program */
+static int marshal_func(Marshal *m, const SpnValue *src, SpnValue *dst)
+{
+	SpnFunction *fn = funcvalue(src);
+	SpnFunction *env, *copy;
+	SpnValue key, envval;
+	const char *origbc, *name;
+	size_t i;
+
+	if (fn->native) {
+		*dst = spn_makenativefunc(fn->name, fn->repr.fn);
+		return 0;
+	}
+
+	key = makeweakuserinfo(fn->env);
+	envval = spn_hashmap_get(m->programs, &key);
+
+	if (isnil(&envval)) {
+		m->errfmt = "function '%s' can't be passed to a worker";
+		m->errarg = fn->name;
+		return -1;
+	}
+
+	env = ptrvalue(&envval);
+
+	if (fn->topprg) {
+		spn_object_retain(env);
+		*dst = makeobject(SPN_TYPE_FUNC, env);
+		return 0;
+	}
+
+	/* the names of script functions point into the bytecode too */
+	origbc = (const char *)(fn->env->repr.bc);
+	name = fn->name;
+
+	if (name >= origbc && name < origbc + fn->env->nwords * sizeof(spn_uword)) {
+		name = (const char *)(env->repr.bc) + (name - origbc);
+	}
+
+	copy = spn_func_new_script(name, env->repr.bc + (fn->repr.bc - fn->env->repr.bc), env);
+
+	if (!fn->is_closure) {
+		*dst = makeobject(SPN_TYPE_FUNC, copy);
+		return 0;
+	}
+
+	*dst = spn_makeclosure(copy, fn->nupvals);
+	spn_object_release(copy);
+	copy = funcvalue(dst);
+	memo_set(m, fn, dst);
+
+	/* the copies are moved into the closure, which owns them */
+	for (i = 0; i < fn->nupvals; i++) {
+		if (marshal_value(m, &fn->upvalues[i], &copy->upvalues[i], 0) != 0) {
+			spn_value_release(dst);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void marshal_typedarray(Marshal *m, const SpnValue *src, SpnValue *dst)
+{
+	SpnTypedArray *orig = typedarrayvalue(src);
+	enum spn_typedarray_kind kind = spn_typedarray_kind(orig);
+	size_t count = spn_typedarray_count(orig);
+	SpnTypedArray *copy = spn_typedarray_new(kind, count);
+
+	memcpy(
+		spn_typedarray_data(copy),
+		spn_typedarray_data(orig),
+		count * spn_typedarray_elemsize(kind)
+	);
+
+	*dst = makeobject(SPN_TYPE_STRGUSERINFO, copy);
+	memo_set(m, orig, dst);
+}
+
+/* 'exclusive' is true if 'src' can only be reached through the value
+ * being copied (i. e. if all objects on the way have a single reference)
+ */
+static int marshal_value(Marshal *m, const SpnValue *src, SpnValue *dst, int exclusive)
+{
+	SpnObject *obj;
+
+	/* nil, Booleans, numbers and weak user info are copied bitwise */
+	if (!isobject(src)) {
+		*dst = *src;
+		return 0;
+	}
+
+	obj = objvalue(src);
+	exclusive = exclusive && m->move && obj->refcnt == 1;
+
+	if (isstring(src)) {
+		SpnString *str = stringvalue(src);
+
+		if (exclusive) {
+			spn_object_retain(str);
+			*dst = *src;
+		} else {
+			*dst = makestring_len(str->cstr, str->len);
+		}
+
+		return 0;
+	}
+
+	if (memo_get(m, obj, dst)) {
+		return 0;
+	}
+
+	if (isarray(src)) {
+		return marshal_array(m, src, dst, exclusive);
+	}
+
+	if (ishashmap(src)) {
+		return marshal_hashmap(m, src, dst, exclusive);
+	}
+
+	if (isfunc(src)) {
+		return marshal_func(m, src, dst);
+	}
+
+	if (spn_istypedarray(src)) {
+		marshal_typedarray(m, src, dst);
+		return 0;
+	}
+
+	m->errfmt = "values of type %s can't be passed to a worker";
+	m->errarg = spn_type_name(fulltype(src));
+	return -1;
+}
+
+static void lock_pool(SpnWorkerPool *pool)
+{
+#if USE_THREADS
+	pthread_mutex_lock(&pool->lock);
+#endif /* USE_THREADS */
+}
+
+static void unlock_pool(SpnWorkerPool *pool)
+{
+#if USE_THREADS
+	pthread_mutex_unlock(&pool->lock);
+#endif /* USE_THREADS */
+}
+
+/* only the first error of a job is reported */
+static void fail_job(SpnWorkerPool *pool, const char *fmt, const char *arg)
+{
+	const void *args[1];
+	args[0] = arg;
+
+	lock_pool(pool);
+
+	if (pool->errmsg == NULL) {
+		pool->errmsg = spn_string_format_cstr(fmt, NULL, args);
+	}
+
+	unlock_pool(pool);
+}
+
+static int claim_chunk(SpnWorkerPool *pool, size_t *begin, size_t *end)
+{
+	int found;
+
+	lock_pool(pool);
+
+	found = pool->errmsg == NULL && pool->next < pool->count;
+
+	if (found) {
+		*begin = pool->next;
+		*end = pool->count - pool->next > pool->chunk ? pool->next + pool->chunk : pool->count;
+		pool->next = *end;
+	}
+
+	unlock_pool(pool);
+
+	return found;
+}
+
+/* runs the calls in the chunks claimed by the worker */
+static void run_job(Worker *w)
+{
+	SpnWorkerPool *pool = w->pool;
+	Marshal setup, in, out;
+	SpnValue fnval, fncopy;
+	size_t begin, end, i;
+
+	/* the copies of upvalues are shared by all calls of the worker */
+	init_marshal(&setup, w->imports, 0);
+	fnval = makeobject(SPN_TYPE_FUNC, pool->fn);
+
+	if (marshal_value(&setup, &fnval, &fncopy, 0) != 0) {
+		fail_job(pool, setup.errfmt, setup.errarg);
+		reset_marshal(&setup);
+		return;
+	}
+
+	init_marshal(&in, w->imports, 0);
+	init_marshal(&out, w->exports, 1);
+
+	while (claim_chunk(pool, &begin, &end)) {
+		for (i = begin; i < end; i++) {
+			SpnValue elem = spn_array_get(pool->input, i);
+			SpnValue args[2];
+			SpnValue result;
+			int status;
+
+			status = marshal_value(&in, &elem, &args[0], 0);
+			reset_marshal(&in);
+
+			if (status != 0) {
+				fail_job(pool, in.errfmt, in.errarg);
+				goto done;
+			}
+
+			args[1] = makeint(i);
+			status = spn_ctx_callfunc(&w->ctx, funcvalue(&fncopy), &result, COUNT(args), args);
+			spn_value_release(&args[0]);
+
+			if (status != 0) {
+				fail_job(pool, "%s", spn_ctx_geterrmsg(&w->ctx));
+				goto done;
+			}
+
+			if (pool->filter) {
+				if (!isbool(&result)) {
+					spn_value_release(&result);
+					fail_job(pool, "%s", "predicate must return a boolean");
+					goto done;
+				}
+
+				pool->results[i] = result;
+				continue;
+			}
+
+			/* the copy belongs to the host, so it must not be
+			 * buffered by the collector of the worker
+			 */
+			spn_gc_setcurrent(NULL);
+			status = marshal_value(&out, &result, &pool->results[i], 1);
+			reset_marshal(&out);
+			spn_gc_setcurrent(w->ctx.gc);
+
+			spn_value_release(&result);
+
+			if (status != 0) {
+				pool->results[i] = spn_nilval;
+				fail_job(pool, out.errfmt, out.errarg);
+				goto done;
+			}
+		}
+	}
+
+done:
+	spn_value_release(&fncopy);
+	reset_marshal(&setup);
+}
+
+#if USE_THREADS
+
+static void *worker_main(void *arg)
+{
+	Worker *w = arg;
+	SpnWorkerPool *pool = w->pool;
+	Binding own;
+
+	own.arena = w->ctx.arena;
+	own.gc = w->ctx.gc;
+	set_binding(&own);
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (pool->jobid == w->jobid && !pool->quit) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+
+		if (pool->quit) {
+			break;
+		}
+
+		w->jobid = pool->jobid;
+
+		if (w->index >= pool->nparticipants) {
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		run_job(w);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->nbusy == 0) {
+			pthread_cond_signal(&pool->finish);
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+#endif /* USE_THREADS */
+
+static void free_worker(Worker *w)
+{
+	spn_ctx_free(&w->ctx);
+	spn_object_release(w->imports);
+	spn_object_release(w->exports);
+	free(w);
+}
+
+/* returns NULL if the thread can't be created */
+static Worker *new_worker(SpnWorkerPool *pool, const SpnAllocator *allocator)
+{
+	Worker *w = spn_malloc(sizeof *w);
+	Binding host;
+#if USE_THREADS
+	sigset_t allsigs, oldsigs;
+	int status;
+#endif /* USE_THREADS */
+
+	/* the context of the worker is set up in its own arena, which
+	 * the host gives up before the thread of the worker is started
+	 */
+	host.arena = spn_pool_getarena();
+	host.gc = spn_gc_getcurrent();
+
+	init_context(&w->ctx, allocator, 1);
+
+	w->imports = spn_hashmap_new();
+	w->exports = spn_hashmap_new();
+	set_binding(&host);
+
+	w->index = pool->nworkers;
+	w->jobid = pool->jobid;
+	w->pool = pool;
+
+#if USE_THREADS
+	/* workers block every signal (the new thread inherits the mask),
+	 * so that signals, e. g. the ticks of the profiler, go to the host
+	 */
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+	status = pthread_create(&w->thread, NULL, worker_main, w);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	if (status != 0) {
+		free_worker(w);
+		return NULL;
+	}
+#endif /* USE_THREADS */
+
+	return w;
+}
+
+static SpnWorkerPool *new_pool(void)
+{
+	SpnWorkerPool *pool = spn_malloc(sizeof *pool);
+
+	pool->workers = NULL;
+	pool->nworkers = 0;
+	pool->sources = spn_array_new();
+	pool->imported = spn_hashmap_new();
+
+#if USE_THREADS
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->finish, NULL);
+#endif /* USE_THREADS */
+
+	pool->jobid = 0;
+	pool->nparticipants = 0;
+	pool->nbusy = 0;
+	pool->quit = 0;
+
+	return pool;
+}
+
+/* must only be called between jobs, like everything that touches the
+ * contexts of the workers from the host thread
+ */
+static void grow_pool(SpnWorkerPool *pool, size_t nworkers, const SpnAllocator *allocator)
+{
+	if (pool->nworkers >= nworkers) {
+		return;
+	}
+
+	pool->workers = spn_realloc(pool->workers, nworkers * sizeof pool->workers[0]);
+
+	while (pool->nworkers < nworkers) {
+		Worker *w = new_worker(pool, allocator);
+
+		if (w == NULL) {
+			break;
+		}
+
+		pool->workers[pool->nworkers++] = w;
+	}
+}
+
+static void free_pool(SpnWorkerPool *pool)
+{
+	size_t i;
+
+#if USE_THREADS
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pthread_join(pool->workers[i]->thread, NULL);
+	}
+#endif /* USE_THREADS */
+
+	for (i = 0; i < pool->nworkers; i++) {
+		free_worker(pool->workers[i]);
+	}
+
+	free(pool->workers);
+	spn_object_release(pool->sources);
+	spn_object_release(pool->imported);
+
+#if USE_THREADS
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->finish);
+#endif /* USE_THREADS */
+
+	free(pool);
+}
+
+static int hashmap_contains(SpnHashMap *hm, const SpnValue *key)
+{
+	SpnValue val = spn_hashmap_get(hm, key);
+	return notnil(&val);
+}
+
+/* finds the programs of the script functions reachable from 'val' */
+static void collect_programs(const SpnValue *val, SpnHashMap *seen, SpnArray *progs)
+{
+	SpnValue key;
+
+	if (!isobject(val)) {
+		return;
+	}
+
+	key = makeweakuserinfo(objvalue(val));
+	if (hashmap_contains(seen, &key)) {
+		return;
+	}
+
+	spn_hashmap_set(seen, &key, &spn_trueval);
+
+	if (isarray(val)) {
+		SpnArray *arr = arrayvalue(val);
+		size_t i, n = spn_array_count(arr);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+			collect_programs(&elem, seen, progs);
+		}
+	} else if (ishashmap(val)) {
+		size_t cursor = 0;
+		SpnValue k, v;
+
+		while ((cursor = spn_hashmap_next(hashmapvalue(val), cursor, &k, &v)) != 0) {
+			collect_programs(&k, seen, progs);
+			collect_programs(&v, seen, progs);
+		}
+	} else if (isfunc(val)) {
+		SpnFunction *fn = funcvalue(val);
+		SpnValue env;
+
+		if (fn->native) {
+			return;
+		}
+
+		env = makeobject(SPN_TYPE_FUNC, fn->env);
+		key = makeweakuserinfo(fn->env);
+
+		if (!hashmap_contains(seen, &key)) {
+			spn_hashmap_set(seen, &key, &spn_trueval);
+			spn_array_push(progs, &env);
+		}
+
+		if (fn->is_closure) {
+			size_t i;
+
+			for (i = 0; i < fn->nupvals; i++) {
+				collect_programs(&fn->upvalues[i], seen, progs);
+			}
+		}
+	}
+}
+
+/* makes sure that the first 'nworkers' workers have a copy of every
+ * program the function needs; returns nonzero if that's not possible
+ */
+static int import_programs(SpnContext *ctx, SpnWorkerPool *pool, SpnFunction *fn, size_t nworkers)
+{
+	SpnHashMap *seen = spn_hashmap_new();
+	SpnArray *progs = spn_array_new();
+	SpnValue fnval = makeobject(SPN_TYPE_FUNC, fn);
+	size_t i, j, n;
+	int status = 0;
+
+	collect_programs(&fnval, seen, progs);
+	n = spn_array_count(progs);
+
+	for (i = 0; i < n && status == 0; i++) {
+		SpnValue prog = spn_array_get(progs, i);
+		SpnValue key = makeweakuserinfo(funcvalue(&prog));
+
+		if (!hashmap_contains(pool->imported, &key)) {
+			spn_array_push(pool->sources, &prog);
+			spn_hashmap_set(pool->imported, &key, &spn_trueval);
+		}
+
+		for (j = 0; j < nworkers; j++) {
+			Worker *w = pool->workers[j];
+			SpnFunction *copy;
+			SpnValue copyval, copykey;
+
+			if (hashmap_contains(w->imports, &key)) {
+				continue;
+			}
+
+			copy = spn_vm_import_program(w->ctx.vm, ctx->vm, funcvalue(&prog));
+
+			if (copy == NULL) {
+				status = -1;
+				break;
+			}
+
+			copyval = makeobject(SPN_TYPE_FUNC, copy);
+			spn_array_push(w->ctx.programs, &copyval);
+			spn_object_release(copy);
+
+			copykey = makeweakuserinfo(copy);
+			copyval = makeweakuserinfo(funcvalue(&prog));
+			spn_hashmap_set(w->imports, &key, &copykey);
+			spn_hashmap_set(w->exports, &copykey, &copyval);
+		}
+	}
+
+	spn_object_release(seen);
+	spn_object_release(progs);
+
+	return status;
+}
+
+static size_t default_nworkers(void)
+{
+#if USE_THREADS && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#else /* USE_THREADS && _SC_NPROCESSORS_ONLN */
+	return 1;
+#endif /* USE_THREADS && _SC_NPROCESSORS_ONLN */
+}
+
+/* Runs the job on the first 'nworkers' workers. Without USE_THREADS,
+ * there's a single worker, and the thread of the host runs the job on
+ * its behalf, in the arena and with the collector of the worker.
+ */
+static void run_workers(SpnWorkerPool *pool, size_t nworkers)
+{
+#if USE_THREADS
+	pthread_mutex_lock(&pool->lock);
+
+	pool->jobid++;
+	pool->nparticipants = nworkers;
+	pool->nbusy = nworkers;
+	pthread_cond_broadcast(&pool->start);
+
+	while (pool->nbusy > 0) {
+		pthread_cond_wait(&pool->finish, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+#else /* USE_THREADS */
+	Worker *w = pool->workers[0];
+	Binding host, own;
+
+	host.arena = spn_pool_getarena();
+	host.gc = spn_gc_getcurrent();
+	own.arena = w->ctx.arena;
+	own.gc = w->ctx.gc;
+
+	set_binding(&own);
+	run_job(w);
+	set_binding(&host);
+#endif /* USE_THREADS */
+}
+
+static int parallel_map(SpnContext *ctx, SpnArray *arr, SpnFunction *fn, int filter, size_t nworkers, SpnValue *ret)
+{
+	SpnWorkerPool *pool;
+	SpnArray *res;
+	size_t i, n = spn_array_count(arr);
+
+	if (ctx->workers == NULL) {
+		ctx->workers = new_pool();
+	}
+
+	pool = ctx->workers;
+	grow_pool(pool, nworkers, ctx->allocator);
+
+	if (nworkers > pool->nworkers) {
+		nworkers = pool->nworkers;
+	}
+
+	if (nworkers == 0) {
+		spn_ctx_runtime_error(ctx, "cannot start worker threads", NULL);
+		ctx->errtype = SPN_ERROR_RUNTIME;
+		return -1;
+	}
+
+	if (import_programs(ctx, pool, fn, nworkers) != 0) {
+		spn_ctx_runtime_error(ctx, "cannot pass the programs of the function to the workers", NULL);
+		ctx->errtype = SPN_ERROR_RUNTIME;
+		return -1;
+	}
+
+	pool->results = spn_malloc(n * sizeof pool->results[0]);
+
+	for (i = 0; i < n; i++) {
+		pool->results[i] = spn_nilval;
+	}
+
+	/* a few chunks per worker balance the load reasonably well */
+	pool->fn = fn;
+	pool->input = arr;
+	pool->filter = filter;
+	pool->next = 0;
+	pool->count = n;
+	pool->chunk = n / (nworkers * 8) > 0 ? n / (nworkers * 8) : 1;
+	pool->errmsg = NULL;
+
+	run_workers(pool, nworkers);
+
+	if (pool->errmsg != NULL) {
+		const void *args[1];
+		args[0] = pool->errmsg;
+		spn_ctx_runtime_error(ctx, "in worker: %s", args);
+		ctx->errtype = SPN_ERROR_RUNTIME;
+
+		free(pool->errmsg);
+
+		for (i = 0; i < n; i++) {
+			spn_value_release(&pool->results[i]);
+		}
+
+		free(pool->results);
+		return -1;
+	}
+
+	res = spn_array_new();
+
+	for (i = 0; i < n; i++) {
+		if (!filter) {
+			spn_array_push(res, &pool->results[i]);
+			spn_value_release(&pool->results[i]);
+		} else if (boolvalue(&pool->results[i])) {
+			SpnValue elem = spn_array_get(arr, i);
+			spn_array_push(res, &elem);
+		}
+	}
+
+	free(pool->results);
+
+	*ret = makeobject(SPN_TYPE_ARRAY, res);
+	return 0;
+}
+
+int spn_ctx_pmap(SpnContext *ctx, SpnArray *arr, SpnFunction *fn, int filter, int nworkers, SpnValue *ret)
+{
+	size_t n = spn_array_count(arr);
+	size_t maxworkers = nworkers > 0 ? (size_t)(nworkers) : default_nworkers();
+
+#if !USE_THREADS
+	maxworkers = 1;
+#endif /* !USE_THREADS */
+
+	if (maxworkers > n) {
+		maxworkers = n;
+	}
+
+	ctx->errtype = SPN_ERROR_OK;
+
+	/* workers don't have workers of their own: their nested calls
+	 * run on their own virtual machine, which is isolated already
+	 */
+	if (n == 0 || ctx->isworker) {
+		return sequential_map(ctx, arr, fn, filter, ret);
+	}
+
+	return parallel_map(ctx, arr, fn, filter, maxworkers, ret);
+}
+
+#if USE_EMBEDDED_STDLIB
+
+/* object data of a module of the script standard library,
+ * compiled at build time by mkstdlib
+ */
+typedef struct StdModule {
+	const char *name;
+	const unsigned char *objdata;
+	size_t objsize;
+} StdModule;
+
+#include "stdmodules_bc.inc"
+
+/* Load non-native parts of the standard library. The object data is
+ * copied, since each context must have its own copy of the bytecode.
+ */
+void spn_ctx_load_script_stdlib(SpnContext *ctx)
+{
+	size_t i;
+	for (i = 0; i < COUNT(stdmodules); i++) {
+		const StdModule *mod = &stdmodules[i];
+		int error = spn_ctx_execobjdata(ctx, mod->objdata, mod->objsize, NULL);
+
+		/* being unable to load a standard module is a fatal error */
+		if (error != 0) {
+			spn_die(
+				"cannot load stdlib module %s: %s\n",
+				mod->name,
+				spn_ctx_geterrmsg(ctx)
+			);
+		}
+	}
+}
+
+#else /* USE_EMBEDDED_STDLIB */
+
+/* Load non-native parts of the standard library */
+void spn_ctx_load_script_stdlib(SpnContext *ctx)
+{
+	static const char *const modules[] = {
+#include "stdmodules.inc"
+	};
+
+	size_t i;
+	for (i = 0; i < COUNT(modules); i++) {
+		int error = spn_ctx_execsrcfile(ctx, modules[i], NULL);
+
+		/* being unable to load a standard module is a fatal error */
+		if (error != 0) {
+			spn_die(
+				"cannot load stdlib module %s: %s\n",
+				modules[i],
+				spn_ctx_geterrmsg(ctx)
+			);
+		}
+	}
+}
+
+#endif /* USE_EMBEDDED_STDLIB */
+
 #if USE_DYNAMIC_LOADING
 void spn_ctx_add_dynmod(SpnContext *ctx, void *handle)
 {
@@ -17,6 +17,9 @@
 #include "compiler.h"
 #include "hashmap.h"
 #include "vm.h"
+#include "prof.h"
+#include "pool.h"
+#include "gc.h"
 
 
 enum spn_error_type {
@@ -27,20 +30,50 @@ enum spn_error_type {
 	SPN_ERROR_GENERIC   /* some other kind of error  */
 };
 
+typedef struct SpnWorkerPool SpnWorkerPool;
+
 typedef struct SpnContext {
 	SpnParser parser;
 	SpnCompiler *cmp;
 	SpnVMachine *vm;
 	SpnArray *programs; /* holds all programs ever compiled */
 	SpnArray *dynmods;  /* dynamically loaded modules */
+	SpnHashMap *modules; /* cache of spn_ctx_require(), by file name */
+	int modcache;        /* flags of the module cache */
 
 	enum spn_error_type errtype; /* type of the last error */
 	const char *errmsg; /* last error message */
 
 	void *info; /* context info initialized to NULL, use freely */
+
+	SpnPoolArena *arena;           /* pool of objects, see pool.h     */
+	const SpnAllocator *allocator; /* allocator of 'arena', read-only */
+	SpnGC *gc;                     /* cycle collector, or NULL        */
+
+	SpnWorkerPool *workers; /* created on demand by spn_ctx_pmap() */
+	int isworker;           /* is this the context of a worker?    */
 } SpnContext;
 
+/* Each context, and each worker of spn_ctx_pmap(), gets a cycle collector,
+ * and at most SPN_GC_MAXCOLLECTORS (see gc.h) can exist at the same time.
+ * A context initialized beyond that limit works normally, but its 'gc'
+ * member is NULL, so the garbage cycles created on it are never freed.
+ */
 SPN_API void spn_ctx_init(SpnContext *ctx);
+
+/* initializes the context with a pool arena of its own, which obtains
+ * objects and string buffers from 'allocator' (NULL means the built-in
+ * one). Like the cycle collector of the context (see below), the arena is
+ * made current on the calling thread (see pool.h), and it's made current
+ * again while code runs on the context. When the context is freed, the
+ * thread falls back to the shared pool if the arena was still current.
+ *
+ * Each context may thus be used from a different thread, but a context
+ * must only be used by one thread at a time. Objects can be passed between
+ * contexts which use the built-in allocator; with a custom allocator, the
+ * restrictions of spn_pool_newarena() apply.
+ */
+SPN_API void spn_ctx_init_allocator(SpnContext *ctx, const SpnAllocator *allocator);
 SPN_API void spn_ctx_free(SpnContext *ctx);
 
 SPN_API enum spn_error_type spn_ctx_geterrtype(SpnContext *ctx);
@@ -51,6 +84,59 @@ SPN_API SpnArray *spn_ctx_getprograms(SpnContext *ctx); /* read-only array! */
 SPN_API void *spn_ctx_getuserinfo(SpnContext *ctx);
 SPN_API void spn_ctx_setuserinfo(SpnContext *ctx, void *info);
 
+/* sets the optimization level of the compiler of the context (one of
+ * the constants of 'enum spn_opt_level'). See spn_compiler_setoptlevel().
+ */
+SPN_API void spn_ctx_setoptlevel(SpnContext *ctx, int level);
+
+/* attaches a profile to the virtual machine; see spn_vm_setprofile() */
+SPN_API void spn_ctx_setprofile(SpnContext *ctx, SpnProfile *prof);
+
+/* Memory. Every context has a cycle collector of its own (see gc.h),
+ * which is made current on the calling thread by spn_ctx_init(), and for
+ * the duration of spn_ctx_callfunc() and spn_ctx_resume() (and the
+ * functions which call them). spn_ctx_gc() runs it to completion, and
+ * returns the number of objects it freed. It's also run when the context
+ * is freed. If the library was built without USE_CYCLE_COLLECTOR, it
+ * does nothing.
+ *
+ * spn_ctx_heapstats() returns the number of live objects and their total
+ * size for each class (see spn_pool_heapstats()). The statistics cover
+ * the objects allocated and freed while the arena of the context was
+ * current. The array must be free()'d by the caller.
+ */
+SPN_API size_t spn_ctx_gc(SpnContext *ctx);
+SPN_API SpnHeapStat *spn_ctx_heapstats(SpnContext *ctx, size_t *n);
+
+/* Parallel map and filter. Calls 'fn' with each element of 'arr' and its
+ * index, and returns the array of results (or, if 'filter' is nonzero, the
+ * array of elements for which 'fn' returned true) in '*ret', just like the
+ * map() and filter() methods of arrays. The calls are distributed among at
+ * most 'nworkers' worker threads (or as many as there are processors, if
+ * 'nworkers' is not positive).
+ *
+ * Each worker is a separate context with a virtual machine of its own,
+ * running copies of the programs of this context. The function, its
+ * upvalues, the elements and the results are deep copied between the
+ * workers and the context, so the workers don't see the globals defined
+ * by the programs of this context (only the standard library), and the
+ * changes they make to their arguments or upvalues aren't visible either.
+ * Strong user info values, except typed arrays, can't be copied.
+ * The workers are created on the first call and they are kept until the
+ * context is freed. The context is blocked while the workers are running.
+ *
+ * The calls are isolated like this even if there's only a single worker.
+ * If the library was built without USE_THREADS, there's a single worker,
+ * which runs on the calling thread. If this context is a worker itself,
+ * the function is called on its own virtual machine, one element after
+ * the other. Returns nonzero on error, in which case the error message of
+ * the first failed call is available via spn_ctx_geterrmsg().
+ *
+ * Every worker has an arena of its own, with the allocator of this
+ * context, so a custom allocator must be thread-safe.
+ */
+SPN_API int spn_ctx_pmap(SpnContext *ctx, SpnArray *arr, SpnFunction *fn, int filter, int nworkers, SpnValue *ret);
+
 /* the returned function is owned by the context, you _must not_ release it.
  * It will be deallocated automatically when you free the context.
  * These functions return NULL on error.
@@ -69,8 +155,33 @@ SPN_API int spn_ctx_execsrcfile(SpnContext *ctx, const char *fname, SpnValue *re
 SPN_API int spn_ctx_execobjfile(SpnContext *ctx, const char *fname, SpnValue *ret);
 SPN_API int spn_ctx_execobjdata(SpnContext *ctx, const void *objdata, size_t objsize, SpnValue *ret);
 
+/* Runs the source file of a module, like spn_ctx_execsrcfile(), but the
+ * compiled program is cached by file name, so the module is only compiled
+ * again if the modification time of the file has changed since. This is
+ * what the require() library function uses.
+ *
+ * The behavior of the cache can be adjusted using spn_ctx_setmodcache():
+ * with SPN_MODCACHE_RESULT, the value returned by the module is memoized
+ * too, so the module is only run once (until it is modified). With
+ * SPN_MODCACHE_PERSIST, modules are compiled into object files next to
+ * their source (the extension is replaced by ".spo", just like with
+ * `spn --compile`), which are loaded instead of the source file if they
+ * are not older than it. Object files contain no debug information, so
+ * errors in modules loaded from them are reported without line numbers.
+ * Both are off by default.
+ */
+enum spn_modcache_flags {
+	SPN_MODCACHE_RESULT  = 1 << 0,
+	SPN_MODCACHE_PERSIST = 1 << 1
+};
+
+SPN_API int spn_ctx_require(SpnContext *ctx, const char *fname, SpnValue *ret);
+SPN_API void spn_ctx_setmodcache(SpnContext *ctx, int flags);
+
 /* direct access to the virtual machine */
 SPN_API int spn_ctx_callfunc(SpnContext *ctx, SpnFunction *func, SpnValue *ret, int argc, SpnValue argv[]);
+SPN_API int spn_ctx_resume(SpnContext *ctx, SpnCoroutine *co, SpnValue *ret, int argc, SpnValue argv[]);
+SPN_API int spn_ctx_yield(SpnContext *ctx, const SpnValue *val);
 SPN_API void spn_ctx_runtime_error(SpnContext *ctx, const char *fmt, const void *args[]);
 SPN_API SpnStackFrame *spn_ctx_stacktrace(SpnContext *ctx, size_t *size);
 SPN_API ptrdiff_t spn_ctx_exception_addr(SpnContext *ctx);
@@ -100,6 +211,7 @@ SPN_API SpnFunction *spn_ctx_compile_ast(SpnContext *ctx, SpnHashMap *ast, int d
 
 /* accessors for library functions, other globals and class descriptors */
 SPN_API void        spn_ctx_addlib_cfuncs(SpnContext *ctx, const char *libname, const SpnExtFunc  fns[],  size_t n);
+SPN_API void        spn_ctx_addlib_cfuncs_ex(SpnContext *ctx, const char *libname, const SpnExtFuncEx fns[], size_t n);
 SPN_API void        spn_ctx_addlib_values(SpnContext *ctx, const char *libname, const SpnExtValue vals[], size_t n);
 SPN_API SpnHashMap *spn_ctx_getglobals(SpnContext *ctx);
 SPN_API SpnHashMap *spn_ctx_getclasses(SpnContext *ctx);
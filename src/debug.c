@@ -8,34 +8,168 @@
  * Emitting debugging information
  */
 
+#include <stdlib.h>
+#include <assert.h>
+
 #include "debug.h"
 #include "array.h"
 #include "private.h"
 
+
+/* The line table is the compact form of the "insns" array: a sorted
+ * array of bytecode ranges, so that the source location of an address
+ * can be found using binary search instead of walking all AST nodes.
+ * It is stored in the debug info hashmap (as strong user info, under
+ * the key "lines") next to the array, which is kept for scripts and
+ * tools that inspect the debug info directly.
+ */
+typedef struct LineTabEntry {
+	size_t begin;    /* bytecode start, inclusive                 */
+	size_t end;      /* bytecode end, exclusive                   */
+	size_t parent;   /* enclosing entry + 1, or 0 if outermost    */
+	size_t seqno;    /* order of emission (for breaking ties)     */
+	unsigned line;
+	unsigned column;
+} LineTabEntry;
+
+typedef struct LineTable {
+	SpnObject base;
+	LineTabEntry *entries;
+	size_t count;
+	size_t allocsize;
+	int sorted;      /* entries are sorted and 'parent' is valid  */
+} LineTable;
+
+static void free_linetab(void *obj)
+{
+	LineTable *tab = obj;
+	free(tab->entries);
+}
+
+static const SpnClass LineTable_class = {
+	sizeof(LineTable),
+	SPN_CLASS_UID_LINETABLE,
+	NULL,
+	NULL,
+	NULL,
+	free_linetab,
+	NULL
+};
+
+static LineTable *get_linetab(SpnHashMap *debug_info)
+{
+	SpnValue vtab = spn_hashmap_get_strkey(debug_info, "lines");
+
+	if (isstrguserinfo(&vtab)
+	 && spn_object_member_of_class(objvalue(&vtab), &LineTable_class)) {
+		return objvalue(&vtab);
+	}
+
+	return NULL;
+}
+
+/* Entries are sorted by start address; of those starting at the
+ * same address, enclosing ranges come before the ones they contain.
+ * Identical ranges are ordered so that the one emitted first (i. e.
+ * the innermost AST node, since nodes are emitted after their
+ * children) comes last, which is what lookups find first.
+ */
+static int compare_entries(const void *lp, const void *rp)
+{
+	const LineTabEntry *lhs = lp;
+	const LineTabEntry *rhs = rp;
+
+	if (lhs->begin != rhs->begin) {
+		return lhs->begin < rhs->begin ? -1 : +1;
+	}
+
+	if (lhs->end != rhs->end) {
+		return lhs->end > rhs->end ? -1 : +1;
+	}
+
+	return lhs->seqno > rhs->seqno ? -1 : lhs->seqno < rhs->seqno;
+}
+
+/* sorts the entries and links each one to the innermost entry
+ * enclosing it. Since the ranges come from nested AST nodes, they
+ * are either disjoint or nested, so a stack of open ranges suffices.
+ */
+static void linetab_sort(LineTable *tab)
+{
+	size_t *stack;
+	size_t depth = 0;
+	size_t i;
+
+	qsort(tab->entries, tab->count, sizeof tab->entries[0], compare_entries);
+
+	stack = spn_malloc(tab->count * sizeof stack[0]);
+
+	for (i = 0; i < tab->count; i++) {
+		LineTabEntry *entry = &tab->entries[i];
+
+		while (depth > 0 && tab->entries[stack[depth - 1]].end <= entry->begin) {
+			depth--;
+		}
+
+		entry->parent = depth > 0 ? stack[depth - 1] + 1 : 0;
+		stack[depth++] = i;
+	}
+
+	free(stack);
+	tab->sorted = 1;
+}
+
 SpnHashMap *spn_dbg_new(void)
 {
 	SpnHashMap *debug_info = spn_hashmap_new();
 
 	/* insns: maps bytecode address to source location
 	 * vars: maps address and variable name to register number
+	 * lines: the contents of 'insns', sorted for fast lookup
 	 */
 	SpnValue insns = makearray();
 	SpnValue vars = makearray();
+	SpnValue lines;
+
+	LineTable *tab = spn_object_new(&LineTable_class);
+	tab->entries = NULL;
+	tab->count = 0;
+	tab->allocsize = 0;
+	tab->sorted = 1;
+
+	lines = spn_makestrguserinfo(tab);
 
 	spn_hashmap_set_strkey(debug_info, "insns", &insns);
 	spn_hashmap_set_strkey(debug_info, "vars", &vars);
+	spn_hashmap_set_strkey(debug_info, "lines", &lines);
 
 	spn_value_release(&insns);
 	spn_value_release(&vars);
+	spn_value_release(&lines);
 
 	return debug_info;
 }
 
+void spn_dbg_finish(SpnHashMap *debug_info)
+{
+	LineTable *tab;
+
+	if (debug_info == NULL) {
+		return;
+	}
+
+	tab = get_linetab(debug_info);
+
+	if (tab && !tab->sorted) {
+		linetab_sort(tab);
+	}
+}
+
 void spn_dbg_emit_source_location(
 	SpnHashMap *debug_info,
 	size_t begin,
 	size_t end,
-	SpnHashMap *ast,
+	SpnSourceLocation loc,
 	int regno
 )
 {
@@ -46,6 +180,7 @@ void spn_dbg_emit_source_location(
 	SpnValue vbegin, vend;
 	SpnValue vregno;
 	SpnHashMap *expr;
+	LineTable *tab;
 
 	/* if we are not asked to emit debug info, give up */
 	if (debug_info == NULL) {
@@ -58,8 +193,8 @@ void spn_dbg_emit_source_location(
 	vexpr = makehashmap();
 	expr = hashmapvalue(&vexpr);
 
-	line = spn_hashmap_get_strkey(ast, "line");
-	column = spn_hashmap_get_strkey(ast, "column");
+	line = makeint(loc.line);
+	column = makeint(loc.column);
 
 	vbegin = makeint(begin);
 	vend = makeint(end);
@@ -73,6 +208,28 @@ void spn_dbg_emit_source_location(
 
 	spn_array_push(insns, &vexpr);
 	spn_value_release(&vexpr);
+
+	tab = get_linetab(debug_info);
+
+	if (tab) {
+		LineTabEntry *entry;
+
+		if (tab->count >= tab->allocsize) {
+			tab->allocsize = tab->allocsize ? 2 * tab->allocsize : 64;
+			tab->entries = spn_realloc(tab->entries, tab->allocsize * sizeof tab->entries[0]);
+		}
+
+		entry = &tab->entries[tab->count];
+		entry->begin = begin;
+		entry->end = end;
+		entry->parent = 0;
+		entry->seqno = tab->count;
+		entry->line = intvalue(&line);
+		entry->column = intvalue(&column);
+
+		tab->count++;
+		tab->sorted = 0;
+	}
 }
 
 void spn_dbg_set_filename(SpnHashMap *debug_info, const char *fname)
@@ -108,50 +265,95 @@ SpnSourceLocation spn_dbg_get_frame_source_location(SpnStackFrame frame)
 	return spn_dbg_get_raw_source_location(debug_info, frame.exc_address);
 }
 
+/* fallback for debug info objects without a line table */
+static SpnSourceLocation linear_source_location(SpnHashMap *debug_info, ptrdiff_t address)
+{
+	SpnSourceLocation loc = { 0, 0 };
+	SpnValue vinsns = spn_hashmap_get_strkey(debug_info, "insns");
+	SpnArray *insns = arrayvalue(&vinsns);
+
+	size_t n = spn_array_count(insns);
+	size_t i;
+
+	/* this is a 'long', because there's no PTRDIFF_MAX in C89 */
+	long address_window_width = LONG_MAX;
+
+	/* search for narrowest bytecode range containing 'address' */
+	for (i = 0; i < n; i++) {
+		SpnValue vexpression = spn_array_get(insns, i);
+		SpnHashMap *expression = hashmapvalue(&vexpression);
+
+		SpnValue vline = spn_hashmap_get_strkey(expression, "line");
+		SpnValue vcolumn = spn_hashmap_get_strkey(expression, "column");
+		SpnValue vbegin = spn_hashmap_get_strkey(expression, "begin");
+		SpnValue vend = spn_hashmap_get_strkey(expression, "end");
+
+		unsigned line = intvalue(&vline);
+		unsigned column = intvalue(&vcolumn);
+		ptrdiff_t begin = intvalue(&vbegin);
+		ptrdiff_t end = intvalue(&vend);
+
+		if (begin <= address && address < end
+		 && end - begin < address_window_width) {
+			/* if the range contains the target address, and it
+			 * is narrower than the previous one, then memoize it
+			 */
+			loc.line = line;
+			loc.column = column;
+
+			address_window_width = end - begin;
+		}
+	}
+
+	return loc;
+}
+
 SpnSourceLocation spn_dbg_get_raw_source_location(SpnHashMap *debug_info, ptrdiff_t address)
 {
 	SpnSourceLocation loc = { 0, 0 };
+	LineTable *tab;
+	size_t lo, hi;
 
-	if (debug_info) {
-		SpnValue vinsns = spn_hashmap_get_strkey(debug_info, "insns");
-		SpnArray *insns = arrayvalue(&vinsns);
-
-		size_t n = spn_array_count(insns);
-		size_t i;
-
-		/* this is a 'long', because there's no PTRDIFF_MAX in C89 */
-		long address_window_width = LONG_MAX;
-
-		/* search for narrowest bytecode range containing 'address'.
-		 * XXX: TODO: this may potentially be slow for large files;
-		 * benchmark it and use binary search instead, if necessary.
-		 */
-		for (i = 0; i < n; i++) {
-			SpnValue vexpression = spn_array_get(insns, i);
-			SpnHashMap *expression = hashmapvalue(&vexpression);
-
-			SpnValue vline = spn_hashmap_get_strkey(expression, "line");
-			SpnValue vcolumn = spn_hashmap_get_strkey(expression, "column");
-			SpnValue vbegin = spn_hashmap_get_strkey(expression, "begin");
-			SpnValue vend = spn_hashmap_get_strkey(expression, "end");
-
-			unsigned line = intvalue(&vline);
-			unsigned column = intvalue(&vcolumn);
-			ptrdiff_t begin = intvalue(&vbegin);
-			ptrdiff_t end = intvalue(&vend);
-
-			if (begin <= address && address < end
-			 && end - begin < address_window_width) {
-				/* if the range contains the target address, and it
-				 * is narrower than the previous one, then memoize it
-				 */
-				loc.line = line;
-				loc.column = column;
-
-				address_window_width = end - begin;
-			}
+	if (debug_info == NULL || address < 0) {
+		return loc;
+	}
+
+	tab = get_linetab(debug_info);
+
+	if (tab == NULL) {
+		return linear_source_location(debug_info, address);
+	}
+
+	if (!tab->sorted) {
+		linetab_sort(tab);
+	}
+
+	/* find the number of entries starting at or before 'address' */
+	lo = 0;
+	hi = tab->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (tab->entries[mid].begin <= (size_t)(address)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
 
+	/* The last of them is the innermost range that can contain the
+	 * address. If it ends before the address, then the narrowest
+	 * range containing the address is one of its ancestors.
+	 */
+	while (lo > 0 && tab->entries[lo - 1].end <= (size_t)(address)) {
+		lo = tab->entries[lo - 1].parent;
+	}
+
+	if (lo > 0) {
+		loc.line = tab->entries[lo - 1].line;
+		loc.column = tab->entries[lo - 1].column;
+	}
+
 	return loc;
 }
@@ -30,10 +30,16 @@ SPN_API void spn_dbg_emit_source_location(
 	SpnHashMap *debug_info, /* the debug info object                   */
 	size_t begin,           /* bytecode start, inclusive (begin <= IP) */
 	size_t end,             /* bytecode end, exclusive (IP < end)      */
-	SpnHashMap *ast,        /* AST node to get info from               */
+	SpnSourceLocation loc,  /* source location of the AST node         */
 	int regno               /* register number of expression result    */
 );
 
+/* sorts the line table of 'debug_info' once all source locations
+ * have been emitted. Called by the compiler; lookups work (but sort
+ * the table first) even if this has not been called.
+ */
+SPN_API void spn_dbg_finish(SpnHashMap *debug_info);
+
 /* use these liberally. getter returns "???" if no filename found.
  * if there's no 'debug_info', you may safely pass NULL.
  */
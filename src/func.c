@@ -8,9 +8,11 @@
  * Reference-counted function objects
  */
 
+#include <stdlib.h>
 #include <assert.h>
 
 #include "func.h"
+#include "pool.h"
 
 
 static int equal_func(void *lp, void *rp)
@@ -72,8 +74,21 @@ static void free_func(void *obj)
 	 * the bytecode buffer and the optional debug information.
 	 */
 	if (func->topprg) {
-		free(func->repr.bc);
+		size_t i;
+
+		if (func->mapping != NULL) {
+			spn_unmap_file(func->mapping, func->mapsize);
+		} else {
+			free(func->repr.bc);
+		}
+
 		spn_object_release(func->symtab);
+
+		for (i = 0; i < func->ncaches; i++) {
+			spn_member_cache_clear(&func->caches[i]);
+		}
+
+		free(func->caches);
 	}
 
 	if (func->debug_info) {
@@ -83,11 +98,34 @@ static void free_func(void *obj)
 	}
 
 	/* if the function is a closure,
-	 * then free the array of upvalues
+	 * then free its upvalues
 	 */
 	if (func->is_closure) {
-		assert(func->upvalues);
-		spn_object_release(func->upvalues);
+		size_t i;
+
+		for (i = 0; i < func->nupvals; i++) {
+			spn_value_release(&func->upvalues[i]);
+		}
+
+		spn_pool_free(func->upvalues, func->nupvals * sizeof func->upvalues[0]);
+	}
+}
+
+/* only the upvalues of closures can form cycles; the symbol table of a
+ * top-level program is never part of one that the collector could break
+ */
+static void traverse_func(void *obj, void (*visit)(void *, void *), void *ctx)
+{
+	SpnFunction *func = obj;
+
+	if (func->is_closure) {
+		size_t i;
+
+		for (i = 0; i < func->nupvals; i++) {
+			if (spn_isobject(&func->upvalues[i])) {
+				visit(spn_objvalue(&func->upvalues[i]), ctx);
+			}
+		}
 	}
 }
 
@@ -97,7 +135,8 @@ static const SpnClass spn_class_func = {
 	equal_func,
 	NULL,
 	hash_func,
-	free_func
+	free_func,
+	traverse_func
 };
 
 SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, SpnFunction *env)
@@ -110,6 +149,8 @@ SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, SpnFunction *e
 	func->native = 0;
 	func->topprg = 0;
 	func->is_closure = 0;
+	func->leaf = 0;          /* unused */
+	func->arity = -1;        /* unused */
 	func->nwords = 0; /* unused */
 
 	func->name = name;
@@ -117,8 +158,13 @@ SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, SpnFunction *e
 	func->readsymtab = 0;       /* unused       */
 	func->symtab = env->symtab; /* weak pointer */
 	func->upvalues = NULL;      /* unused       */
+	func->nupvals = 0;          /* unused       */
 	func->repr.bc = bc;         /* weak pointer */
 	func->debug_info = NULL;    /* unused       */
+	func->caches = NULL;        /* unused       */
+	func->ncaches = 0;          /* unused       */
+	func->mapping = NULL;       /* unused       */
+	func->mapsize = 0;          /* unused       */
 
 	return func;
 }
@@ -130,6 +176,8 @@ SpnFunction *spn_func_new_topprg(const char *name, spn_uword *bc, size_t nwords,
 	func->native = 0;
 	func->topprg = 1;
 	func->is_closure = 0;
+	func->leaf = 0;          /* unused */
+	func->arity = -1;        /* unused */
 	func->nwords = nwords;
 
 	func->name = name;
@@ -137,8 +185,23 @@ SpnFunction *spn_func_new_topprg(const char *name, spn_uword *bc, size_t nwords,
 	func->readsymtab = 0;
 	func->symtab = spn_array_new();
 	func->upvalues = NULL; /* unused */
+	func->nupvals = 0;     /* unused */
 	func->repr.bc = bc; /* strong pointer */
 	func->debug_info = debug; /* strong pointer */
+	func->caches = NULL; /* allocated on demand */
+	func->ncaches = 0;
+	func->mapping = NULL; /* bytecode is a separate buffer */
+	func->mapsize = 0;
+
+	return func;
+}
+
+SpnFunction *spn_func_new_mapped(const char *name, spn_uword *bc, size_t nwords, void *mapping, size_t mapsize)
+{
+	SpnFunction *func = spn_func_new_topprg(name, bc, nwords, NULL);
+
+	func->mapping = mapping; /* strong pointer */
+	func->mapsize = mapsize;
 
 	return func;
 }
@@ -150,6 +213,8 @@ SpnFunction *spn_func_new_native(const char *name, int (*fn)(SpnValue *, int, Sp
 	func->native = 1;
 	func->topprg = 0;
 	func->is_closure = 0;
+	func->leaf = 0;
+	func->arity = -1;
 	func->nwords = 0;        /* unused */
 
 	func->name = name;
@@ -157,15 +222,33 @@ SpnFunction *spn_func_new_native(const char *name, int (*fn)(SpnValue *, int, Sp
 	func->readsymtab = 0;    /* unused */
 	func->symtab = NULL;     /* unused */
 	func->upvalues = NULL;   /* unused */
+	func->nupvals = 0;       /* unused */
 	func->repr.fn = fn;
 	func->debug_info = NULL; /* unused */
+	func->caches = NULL;     /* unused */
+	func->ncaches = 0;       /* unused */
+	func->mapping = NULL;    /* unused */
+	func->mapsize = 0;       /* unused */
 
 	return func;
 }
 
-SpnFunction *spn_func_new_closure(SpnFunction *prototype)
+SpnFunction *spn_func_new_native_ex(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *), int arity, unsigned flags)
+{
+	SpnFunction *func = spn_func_new_native(name, fn);
+
+	func->arity = arity;
+
+	/* the arguments of a leaf function are gathered into a fixed-size array */
+	func->leaf = (flags & SPN_FUNC_LEAF) != 0 && arity >= 0 && arity <= SPN_LEAF_MAX_ARGC;
+
+	return func;
+}
+
+SpnFunction *spn_func_new_closure(SpnFunction *prototype, size_t nupvals)
 {
 	SpnFunction *func = spn_object_new(&spn_class_func);
+	size_t i;
 
 	/* only a Sparkling function can be used as the prototype
 	 * of a closure, native ones can't. A top-level program
@@ -178,6 +261,8 @@ SpnFunction *spn_func_new_closure(SpnFunction *prototype)
 	func->native = 0;
 	func->topprg = 0;
 	func->is_closure = 1;
+	func->leaf = 0;          /* unused */
+	func->arity = -1;        /* unused */
 	func->nwords = 0; /* unused */
 
 	/* func->symtab is always a weak pointer for closures,
@@ -190,21 +275,50 @@ SpnFunction *spn_func_new_closure(SpnFunction *prototype)
 	func->env = prototype->env;         /* weak pointer */
 	func->readsymtab = 0;               /* unused       */
 	func->symtab = prototype->symtab;   /* weak pointer */
-	func->upvalues = spn_array_new();
+	func->upvalues = NULL;
+	func->nupvals = nupvals;
 	func->repr = prototype->repr;
 	func->debug_info = NULL;            /* unused       */
+	func->caches = NULL;                /* unused       */
+	func->ncaches = 0;                  /* unused       */
+	func->mapping = NULL;               /* unused       */
+	func->mapsize = 0;                  /* unused       */
+
+	/* the number of upvalues is known upfront (it's encoded in the
+	 * SPN_INS_CLOSURE instruction), so they are stored in a single
+	 * block that is never resized
+	 */
+	if (nupvals > 0) {
+		func->upvalues = spn_pool_alloc(nupvals * sizeof func->upvalues[0]);
+
+		for (i = 0; i < nupvals; i++) {
+			func->upvalues[i] = spn_nilval;
+		}
+	}
 
 	return func;
 }
 
+void spn_member_cache_clear(SpnMemberCache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->depth; i++) {
+		spn_object_release(cache->maps[i]);
+	}
+
+	if (cache->depth > 0) {
+		spn_value_release(&cache->name);
+	}
+
+	cache->depth = 0;
+}
+
 /* convenience value constructors */
 
 static SpnValue func_to_val(SpnFunction *func)
 {
-	SpnValue ret;
-	ret.type = SPN_TYPE_FUNC;
-	ret.v.o = func;
-	return ret;
+	return spn_makeobject(SPN_TYPE_FUNC, func);
 }
 
 SpnValue spn_makescriptfunc(const char *name, spn_uword *bc, SpnFunction *env)
@@ -225,8 +339,14 @@ SpnValue spn_makenativefunc(const char *name, int (*fn)(SpnValue *, int, SpnValu
 	return func_to_val(func);
 }
 
-SpnValue spn_makeclosure(SpnFunction *prototype)
+SpnValue spn_makenativefunc_ex(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *), int arity, unsigned flags)
+{
+	SpnFunction *func = spn_func_new_native_ex(name, fn, arity, flags);
+	return func_to_val(func);
+}
+
+SpnValue spn_makeclosure(SpnFunction *prototype, size_t nupvals)
 {
-	SpnFunction *func = spn_func_new_closure(prototype);
+	SpnFunction *func = spn_func_new_closure(prototype, nupvals);
 	return func_to_val(func);
 }
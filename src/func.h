@@ -15,22 +15,61 @@
 #include "array.h"
 #include "hashmap.h"
 
+/* maximal number of class descriptors an inline cache can depend on */
+#define SPN_MEMBER_CACHE_DEPTH 8
+
+/* Inline cache of a member lookup instruction (see Remark (XII) in vm.h).
+ * 'depth' is the number of hashmaps consulted during the lookup; the
+ * cached result is valid as long as none of them has been modified since.
+ * An empty cache has a depth of 0.
+ */
+typedef struct SpnMemberCache {
+	int            typetag;  /* type of the receiver                  */
+	const void    *entry;    /* super object or user info of receiver */
+	SpnValue       name;     /* name of the member (strong)           */
+	SpnValue       result;   /* the member itself (weak)              */
+	int            depth;    /* number of valid entries in 'maps'     */
+	SpnHashMap    *maps[SPN_MEMBER_CACHE_DEPTH];     /* strong        */
+	unsigned long  versions[SPN_MEMBER_CACHE_DEPTH];
+} SpnMemberCache;
+
+/* Flags of native functions. A leaf function is called by the VM without
+ * pushing a stack frame for it, with its arguments gathered straight from
+ * the registers of the caller and its return value written directly into
+ * the destination register, if it is called from Sparkling code with as
+ * many arguments as its declared arity (at most SPN_LEAF_MAX_ARGC) and no
+ * profile is attached to the VM. Leaf functions must therefore not call
+ * back into the virtual machine (e. g. through spn_ctx_callfunc()) and
+ * must not yield. They may report errors as usual; the frame for the
+ * stack trace is pushed after they returned.
+ */
+#define SPN_FUNC_LEAF (1 << 0)
+
+#define SPN_LEAF_MAX_ARGC 4
+
 typedef struct SpnFunction {
 	SpnObject base;
 	const char *name;        /* name of the function                */
 	int native;              /* boolean flag, is native?            */
 	int topprg;              /* is top-level program?               */
 	int is_closure;          /* is closure?                         */
+	int leaf;                /* native only: is leaf function?      */
+	int arity;               /* native only: arity, -1 if variadic  */
 	size_t nwords;           /* only if top-level                   */
 	struct SpnFunction *env; /* program in which function resides   */
 	int readsymtab;          /* top-level only: parsed symtab yet?  */
 	SpnArray *symtab;        /* symtab to look for local symbols in */
-	SpnArray *upvalues;      /* upvalues if function is a closure   */
+	SpnValue *upvalues;      /* upvalues if function is a closure   */
+	size_t nupvals;          /* closure only: number of upvalues    */
 	union {
 		spn_uword *bc;
 		int (*fn)(SpnValue *, int, SpnValue *, void *);
 	} repr;                  /* representation                      */
 	SpnHashMap *debug_info;  /* optional debug info if top-level    */
+	SpnMemberCache *caches;  /* top-level only: inline caches       */
+	size_t ncaches;          /* top-level only: number of caches    */
+	void *mapping;           /* top-level only: mapped object file  */
+	size_t mapsize;          /* top-level only: size of 'mapping'   */
 } SpnFunction;
 
 /* 'name' is always a weak pointer, regardless of whether
@@ -55,13 +94,27 @@ typedef struct SpnFunction {
  *
  * 'upvalues' is always a strong pointer, since it's tied
  * to a specific instance of a closure (i. e. it belongs
- * to the closure only and nothing else). It is freed if
- * the closure object is deallocated.
+ * to the closure only and nothing else). It is a block of
+ * exactly 'nupvals' values, allocated from the pool when the
+ * closure is created, and it is freed (along with the values
+ * in it) when the closure object is deallocated. It is NULL
+ * if the closure doesn't capture anything.
+ *
+ * 'caches' is owned by the top-level program. It is allocated
+ * lazily by the virtual machine, when a member lookup instruction
+ * is first executed, and every SPN_INS_METHOD, SPN_INS_PROPGET or
+ * SPN_INS_PROPSET instruction in the program refers to one of its
+ * entries by index.
  *
  * 'repr.bc' is a strong pointer if the function object
  * designates a top-level program; otherwise (when the
  * function object represents a free script function or
  * a closure) it is a weak pointer.
+ *
+ * If the bytecode of a top-level program was loaded from a
+ * memory-mapped object file, then 'repr.bc' points into the
+ * mapping, which is owned by the program, instead of being
+ * a separately allocated buffer. 'mapping' is NULL otherwise.
  */
 
 SPN_API SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, SpnFunction *env);
@@ -69,8 +122,24 @@ SPN_API SpnFunction *spn_func_new_script(const char *name, spn_uword *bc, SpnFun
 /* transfers ownership of both bytecode and debug information */
 SPN_API SpnFunction *spn_func_new_topprg(const char *name, spn_uword *bc, size_t nwords, SpnHashMap *debug);
 
+/* 'bc' points into 'mapping', which was obtained from spn_map_file().
+ * Transfers ownership of the mapping.
+ */
+SPN_API SpnFunction *spn_func_new_mapped(const char *name, spn_uword *bc, size_t nwords, void *mapping, size_t mapsize);
+
 SPN_API SpnFunction *spn_func_new_native(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *));
-SPN_API SpnFunction *spn_func_new_closure(SpnFunction *prototype);
+
+/* 'arity' is the number of arguments the function expects, or -1 if it
+ * takes a variable number of them, and 'flags' is a combination of the
+ * SPN_FUNC_* flags above (0 makes it equivalent to spn_func_new_native()).
+ */
+SPN_API SpnFunction *spn_func_new_native_ex(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *), int arity, unsigned flags);
+
+/* the 'nupvals' upvalues of the new closure are initialized to nil */
+SPN_API SpnFunction *spn_func_new_closure(SpnFunction *prototype, size_t nupvals);
+
+/* releases the contents of an inline cache and marks it as empty */
+SPN_API void spn_member_cache_clear(SpnMemberCache *cache);
 
 /* convenience value constructors and an accessor */
 SPN_API SpnValue spn_makescriptfunc(const char *name, spn_uword *bc, SpnFunction *env);
@@ -78,8 +147,9 @@ SPN_API SpnValue spn_makescriptfunc(const char *name, spn_uword *bc, SpnFunction
  /* this one transfers ownerships too */
 SPN_API SpnValue spn_maketopprgfunc(const char *name, spn_uword *bc, size_t nwords, SpnHashMap *debug);
 SPN_API SpnValue spn_makenativefunc(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *));
-SPN_API SpnValue spn_makeclosure(SpnFunction *prototype);
+SPN_API SpnValue spn_makenativefunc_ex(const char *name, int (*fn)(SpnValue *, int, SpnValue *, void *), int arity, unsigned flags);
+SPN_API SpnValue spn_makeclosure(SpnFunction *prototype, size_t nupvals);
 
-#define spn_funcvalue(val) ((SpnFunction *)((val)->v.o))
+#define spn_funcvalue(val) ((SpnFunction *)(spn_objvalue(val)))
 
 #endif /* SPN_FUNC_H */
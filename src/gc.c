@@ -0,0 +1,518 @@
+/*
+ * gc.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Cycle collector for reference-counted containers
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+
+#if USE_THREADS
+#include <pthread.h>
+#endif /* USE_THREADS */
+
+#include "gc.h"
+#include "pool.h"
+#include "private.h"
+
+
+#if USE_CYCLE_COLLECTOR
+
+/* The 'gcinfo' member of an object holds its color in the low bits, its
+ * 1-based index in the buffer of possible roots (or 0 if it isn't buffered)
+ * in the next GC_INDEXBITS bits, and the ID of the collector which buffered
+ * it in the remaining 12 bits (an 'unsigned' is assumed to have at least
+ * 32 bits, see SPN_GC_MAXCOLLECTORS).
+ * Objects are black unless they are being examined by a step, so 'gcinfo'
+ * is zero for every object which is neither buffered nor part of a step.
+ */
+enum {
+	GC_BLACK = 0, /* in use, or not examined yet   */
+	GC_GRAY  = 1, /* possible member of a cycle    */
+	GC_WHITE = 2  /* member of a garbage cycle     */
+};
+
+#define GC_COLORMASK  3u
+#define GC_COLORBITS  2
+#define GC_INDEXBITS  18
+#define GC_MAXINDEX   ((1u << GC_INDEXBITS) - 1)
+#define GC_IDSHIFT    (GC_COLORBITS + GC_INDEXBITS)
+
+#define color_of(obj)   ((obj)->gcinfo & GC_COLORMASK)
+#define index_of(obj)   (((obj)->gcinfo >> GC_COLORBITS) & GC_MAXINDEX)
+#define id_of(obj)      ((obj)->gcinfo >> GC_IDSHIFT)
+
+#define set_color(obj, c) ((obj)->gcinfo = ((obj)->gcinfo & ~GC_COLORMASK) | (c))
+#define set_slot(obj, id, i) ((obj)->gcinfo = ((unsigned)(id) << GC_IDSHIFT) | ((unsigned)(i) << GC_COLORBITS) | color_of(obj))
+
+#define is_container(obj) ((obj)->isa->traverse != NULL)
+
+/* the live collectors by ID; slot 0 is never used. Slots are only
+ * written when a collector is created or freed, under 'collectors_lock'.
+ */
+static SpnGC *collectors[SPN_GC_MAXCOLLECTORS + 1];
+
+#if USE_THREADS
+
+static pthread_mutex_t collectors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the current collector of a thread is thread-specific data; until
+ * the first collector is made current, there's none on any thread
+ */
+static int threaded = 0;
+static pthread_key_t current_key;
+static pthread_once_t current_key_once = PTHREAD_ONCE_INIT;
+
+static void create_current_key(void)
+{
+	if (pthread_key_create(&current_key, NULL) != 0) {
+		spn_die("cannot create the thread-specific key of collectors");
+	}
+
+	threaded = 1;
+}
+
+#else /* USE_THREADS */
+
+static SpnGC *current = NULL;
+
+#endif /* USE_THREADS */
+
+static SpnGC *current_gc(void)
+{
+#if USE_THREADS
+	return threaded ? pthread_getspecific(current_key) : NULL;
+#else /* USE_THREADS */
+	return current;
+#endif /* USE_THREADS */
+}
+
+static void list_push(SpnObjList *list, SpnObject *obj)
+{
+	if (list->n >= list->cap) {
+		list->cap = list->cap ? 2 * list->cap : 256;
+		list->objs = spn_realloc(list->objs, list->cap * sizeof list->objs[0]);
+	}
+
+	list->objs[list->n++] = obj;
+}
+
+static void list_init(SpnObjList *list)
+{
+	list->objs = NULL;
+	list->n = 0;
+	list->cap = 0;
+}
+
+static void list_free(SpnObjList *list)
+{
+	free(list->objs);
+	list_init(list);
+}
+
+SpnGC *spn_gc_new(void)
+{
+	SpnGC *gc;
+	unsigned id;
+
+#if USE_THREADS
+	pthread_mutex_lock(&collectors_lock);
+#endif /* USE_THREADS */
+
+	for (id = 1; id <= SPN_GC_MAXCOLLECTORS; id++) {
+		if (collectors[id] == NULL) {
+			break;
+		}
+	}
+
+	if (id > SPN_GC_MAXCOLLECTORS) {
+#if USE_THREADS
+		pthread_mutex_unlock(&collectors_lock);
+#endif /* USE_THREADS */
+		return NULL;
+	}
+
+	gc = spn_malloc(sizeof *gc);
+	gc->pending = 0;
+	gc->id = id;
+	gc->collecting = 0;
+	list_init(&gc->roots);
+	list_init(&gc->batch);
+	list_init(&gc->stack);
+	list_init(&gc->blacks);
+	list_init(&gc->whites);
+
+	collectors[id] = gc;
+
+#if USE_THREADS
+	pthread_mutex_unlock(&collectors_lock);
+#endif /* USE_THREADS */
+
+	return gc;
+}
+
+void spn_gc_free(SpnGC *gc)
+{
+	size_t i;
+
+	if (gc == NULL) {
+		return;
+	}
+
+	assert(!gc->collecting);
+
+	if (current_gc() == gc) {
+		spn_gc_setcurrent(NULL);
+	}
+
+	for (i = 0; i < gc->roots.n; i++) {
+		if (gc->roots.objs[i] != NULL) {
+			set_slot(gc->roots.objs[i], 0, 0);
+		}
+	}
+
+	list_free(&gc->roots);
+	list_free(&gc->batch);
+	list_free(&gc->stack);
+	list_free(&gc->blacks);
+	list_free(&gc->whites);
+
+#if USE_THREADS
+	pthread_mutex_lock(&collectors_lock);
+#endif /* USE_THREADS */
+
+	collectors[gc->id] = NULL;
+
+#if USE_THREADS
+	pthread_mutex_unlock(&collectors_lock);
+#endif /* USE_THREADS */
+
+	free(gc);
+}
+
+void spn_gc_setcurrent(SpnGC *gc)
+{
+#if USE_THREADS
+	if (gc == NULL && !threaded) {
+		return;
+	}
+
+	pthread_once(&current_key_once, create_current_key);
+	pthread_setspecific(current_key, gc);
+#else /* USE_THREADS */
+	current = gc;
+#endif /* USE_THREADS */
+}
+
+SpnGC *spn_gc_getcurrent(void)
+{
+	return current_gc();
+}
+
+static void update_pending(SpnGC *gc)
+{
+	gc->pending = gc->roots.n >= SPN_GC_THRESHOLD;
+}
+
+void spn_gc_addroot(SpnObject *obj)
+{
+	SpnGC *gc = current_gc();
+
+	assert(obj->gcinfo == 0);
+
+	if (gc == NULL || gc->roots.n >= GC_MAXINDEX) {
+		return;
+	}
+
+	list_push(&gc->roots, obj);
+	set_slot(obj, gc->id, gc->roots.n);
+	update_pending(gc);
+}
+
+void spn_gc_forget(SpnObject *obj)
+{
+	size_t idx = index_of(obj);
+	SpnGC *gc;
+
+	if (idx == 0) {
+		return;
+	}
+
+	/* not necessarily the current collector */
+	gc = collectors[id_of(obj)];
+
+	assert(gc != NULL && idx <= gc->roots.n && gc->roots.objs[idx - 1] == obj);
+
+	gc->roots.objs[idx - 1] = NULL;
+	set_slot(obj, 0, 0);
+
+	while (gc->roots.n > 0 && gc->roots.objs[gc->roots.n - 1] == NULL) {
+		gc->roots.n--;
+	}
+
+	update_pending(gc);
+}
+
+/* Marking: subtract the references from within the subgraph reachable
+ * from the roots, making every object in it gray. Only the references
+ * between containers are counted; other objects can't refer back.
+ */
+static void visit_gray(void *o, void *ctx)
+{
+	SpnObject *obj = o;
+	SpnGC *gc = ctx;
+
+	if (!is_container(obj)) {
+		return;
+	}
+
+	assert(obj->refcnt > 0);
+	obj->refcnt--;
+
+	if (color_of(obj) != GC_GRAY) {
+		set_color(obj, GC_GRAY);
+		list_push(&gc->stack, obj);
+	}
+}
+
+/* returns the number of objects visited */
+static size_t mark_gray(SpnGC *gc, SpnObject *root)
+{
+	size_t work = 0;
+
+	if (color_of(root) == GC_GRAY) {
+		return 0;
+	}
+
+	set_color(root, GC_GRAY);
+	list_push(&gc->stack, root);
+
+	while (gc->stack.n > 0) {
+		SpnObject *obj = gc->stack.objs[--gc->stack.n];
+		obj->isa->traverse(obj, visit_gray, gc);
+		work++;
+	}
+
+	return work;
+}
+
+/* Scanning: a gray object which is still referenced from outside of the
+ * subgraph is in use, and so is everything reachable from it; their
+ * references are restored. The rest of the gray objects become white.
+ */
+static void visit_black(void *o, void *ctx)
+{
+	SpnObject *obj = o;
+	SpnGC *gc = ctx;
+
+	if (!is_container(obj)) {
+		return;
+	}
+
+	obj->refcnt++;
+
+	if (color_of(obj) != GC_BLACK) {
+		set_color(obj, GC_BLACK);
+		list_push(&gc->blacks, obj);
+	}
+}
+
+static void scan_black(SpnGC *gc, SpnObject *root)
+{
+	set_color(root, GC_BLACK);
+	list_push(&gc->blacks, root);
+
+	while (gc->blacks.n > 0) {
+		SpnObject *obj = gc->blacks.objs[--gc->blacks.n];
+		obj->isa->traverse(obj, visit_black, gc);
+	}
+}
+
+static void visit_scan(void *o, void *ctx)
+{
+	SpnObject *obj = o;
+	SpnGC *gc = ctx;
+
+	if (is_container(obj)) {
+		list_push(&gc->stack, obj);
+	}
+}
+
+static void scan(SpnGC *gc, SpnObject *root)
+{
+	list_push(&gc->stack, root);
+
+	while (gc->stack.n > 0) {
+		SpnObject *obj = gc->stack.objs[--gc->stack.n];
+
+		if (color_of(obj) != GC_GRAY) {
+			continue;
+		}
+
+		if (obj->refcnt > 0) {
+			scan_black(gc, obj);
+		} else {
+			set_color(obj, GC_WHITE);
+			list_push(&gc->whites, obj);
+			obj->isa->traverse(obj, visit_scan, gc);
+		}
+	}
+}
+
+/* Collecting: the references of white objects are restored first, so
+ * that their destructors can release them as usual. Every white object
+ * is retained for the duration, so that only this function frees them.
+ */
+static void visit_restore(void *o, void *ctx)
+{
+	SpnObject *obj = o;
+
+	if (is_container(obj)) {
+		obj->refcnt++;
+	}
+}
+
+static size_t collect_whites(SpnGC *gc)
+{
+	SpnObjList *whites = &gc->whites;
+	size_t i, n = 0;
+
+	/* some white objects may have been blackened later during the scan */
+	for (i = 0; i < whites->n; i++) {
+		if (color_of(whites->objs[i]) == GC_WHITE) {
+			whites->objs[n++] = whites->objs[i];
+		}
+	}
+
+	whites->n = n;
+
+	for (i = 0; i < n; i++) {
+		SpnObject *obj = whites->objs[i];
+		obj->isa->traverse(obj, visit_restore, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		whites->objs[i]->refcnt++;
+	}
+
+	for (i = 0; i < n; i++) {
+		SpnObject *obj = whites->objs[i];
+
+		if (obj->isa->destructor) {
+			obj->isa->destructor(obj);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		SpnObject *obj = whites->objs[i];
+
+		assert(obj->refcnt == 1);
+
+		spn_gc_forget(obj);
+		spn_pool_freeobj(obj, obj->isa->UID, obj->isa->instsz);
+	}
+
+	whites->n = 0;
+	return n;
+}
+
+size_t spn_gc_step(SpnGC *gc, size_t budget)
+{
+	size_t i, work = 0, nfreed;
+
+	if (gc == NULL || gc->collecting) {
+		return 0;
+	}
+
+	gc->collecting = 1;
+
+	while (gc->roots.n > 0 && (budget == 0 || work < budget)) {
+		SpnObject *root = gc->roots.objs[--gc->roots.n];
+
+		if (root == NULL) {
+			continue;
+		}
+
+		set_slot(root, 0, 0);
+		list_push(&gc->batch, root);
+		work += mark_gray(gc, root);
+	}
+
+	for (i = 0; i < gc->batch.n; i++) {
+		scan(gc, gc->batch.objs[i]);
+	}
+
+	gc->batch.n = 0;
+
+	nfreed = collect_whites(gc);
+
+	update_pending(gc);
+	gc->collecting = 0;
+
+	return nfreed;
+}
+
+size_t spn_gc_collect(SpnGC *gc)
+{
+	size_t nfreed = 0;
+
+	if (gc == NULL || gc->collecting) {
+		return 0;
+	}
+
+	/* destructors may release objects which then become possible roots */
+	while (gc->roots.n > 0) {
+		nfreed += spn_gc_step(gc, 0);
+	}
+
+	list_free(&gc->roots);
+	list_free(&gc->batch);
+	list_free(&gc->stack);
+	list_free(&gc->blacks);
+	list_free(&gc->whites);
+
+	return nfreed;
+}
+
+#else /* USE_CYCLE_COLLECTOR */
+
+SpnGC *spn_gc_new(void)
+{
+	return NULL;
+}
+
+void spn_gc_free(SpnGC *gc)
+{
+}
+
+void spn_gc_setcurrent(SpnGC *gc)
+{
+}
+
+SpnGC *spn_gc_getcurrent(void)
+{
+	return NULL;
+}
+
+size_t spn_gc_step(SpnGC *gc, size_t budget)
+{
+	return 0;
+}
+
+size_t spn_gc_collect(SpnGC *gc)
+{
+	return 0;
+}
+
+void spn_gc_addroot(SpnObject *obj)
+{
+}
+
+void spn_gc_forget(SpnObject *obj)
+{
+}
+
+#endif /* USE_CYCLE_COLLECTOR */
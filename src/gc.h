@@ -0,0 +1,104 @@
+/*
+ * gc.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Cycle collector for reference-counted containers
+ */
+
+#ifndef SPN_GC_H
+#define SPN_GC_H
+
+#include <stddef.h>
+
+#include "api.h"
+
+/* Reference counting alone can't free objects which are part of a cycle,
+ * e. g. an array that contains itself, or a closure that captures itself.
+ * The cycle collector frees these using trial deletion (Bacon and Rajan,
+ * "Concurrent Cycle Collection in Reference Counted Systems", 2001).
+ *
+ * When the reference count of a container (an instance of a class with
+ * a 'traverse' member function) is decremented but doesn't reach zero,
+ * the object is buffered as a possible root of a garbage cycle. Once
+ * there are SPN_GC_THRESHOLD possible roots, the 'pending' flag of the
+ * collector is set, and the virtual machine which uses the collector (see
+ * spn_vm_setgc()) calls spn_gc_step() with a budget of SPN_GC_BUDGET the
+ * next time it calls a function. A step examines possible roots until
+ * as many objects as the budget have been visited, and frees the ones
+ * which turn out to be reachable only from each other.
+ *
+ * Every context has a collector of its own, which is made current on the
+ * thread that runs code on the context, along with the pool arena of the
+ * context (see ctx.h and pool.h). Containers are buffered by the current
+ * collector of the thread that releases them; threads without a collector
+ * buffer nothing, so their cycles are never collected. The workers of
+ * spn_ctx_pmap() have collectors too, which they put aside while they
+ * build results for the host. A buffered object is found again by its
+ * collector when it's freed, whichever collector is current at that point.
+ *
+ * If the library was built without USE_CYCLE_COLLECTOR, then nothing is
+ * ever buffered, spn_gc_new() returns NULL, and the rest of these
+ * functions do nothing.
+ */
+#define SPN_GC_THRESHOLD 4096
+#define SPN_GC_BUDGET    4096
+
+/* a growable array of object pointers */
+typedef struct SpnObjList {
+	SpnObject **objs;
+	size_t n;
+	size_t cap;
+} SpnObjList;
+
+/* the state of a collector. Only 'pending' is public: it's nonzero if
+ * enough possible roots have been buffered for a step.
+ */
+typedef struct SpnGC {
+	int pending;
+	unsigned id;       /* index in the table of collectors       */
+	int collecting;    /* is a step running?                     */
+	SpnObjList roots;  /* possible roots; freed slots are NULL   */
+	SpnObjList batch;  /* the roots examined by the current step */
+	SpnObjList stack;  /* explicit stack of the traversals       */
+	SpnObjList blacks; /* stack of scan_black(), run by scan()   */
+	SpnObjList whites; /* the members of garbage cycles          */
+} SpnGC;
+
+/* At most SPN_GC_MAXCOLLECTORS collectors can exist at the same time
+ * (the ID of a collector is stored in the 'gcinfo' bits of the objects it
+ * buffered); spn_gc_new() returns NULL if there are that many already.
+ * Every context owns one, and so does each worker of spn_ctx_pmap().
+ * spn_gc_free() doesn't collect anything, it only forgets the possible
+ * roots that are still buffered.
+ */
+#define SPN_GC_MAXCOLLECTORS 4095
+
+SPN_API SpnGC *spn_gc_new(void);
+SPN_API void spn_gc_free(SpnGC *gc);
+
+/* sets or returns the current collector of the calling thread */
+SPN_API void spn_gc_setcurrent(SpnGC *gc);
+SPN_API SpnGC *spn_gc_getcurrent(void);
+
+/* runs one step of the collector, visiting at least 'budget' objects
+ * (unless there are fewer possible roots), or all possible roots if
+ * 'budget' is 0. Returns the number of objects freed. 'gc' may be NULL.
+ */
+SPN_API size_t spn_gc_step(SpnGC *gc, size_t budget);
+
+/* runs steps until the buffer of possible roots is empty, freeing every
+ * garbage cycle. Returns the number of objects freed.
+ */
+SPN_API size_t spn_gc_collect(SpnGC *gc);
+
+/* The rest of the API is used by spn_object_release(). */
+
+/* buffers 'obj' as a possible root in the current collector */
+SPN_API void spn_gc_addroot(SpnObject *obj);
+
+/* removes 'obj', which is about to be freed, from the buffer */
+SPN_API void spn_gc_forget(SpnObject *obj);
+
+#endif /* SPN_GC_H */
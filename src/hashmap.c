@@ -19,70 +19,58 @@
 #include "private.h"
 
 
-typedef struct Bucket {
-	SpnValue key;
-	SpnValue value;
-} Bucket;
-
-static int bucket_is_used(const Bucket *bucket)
-{
-	/* nil key with non-nil val (or vice versa) is not allowed */
-	assert(isnil(&bucket->key) == isnil(&bucket->value));
-	return notnil(&bucket->key);
-}
-
-static int bucket_is_empty(const Bucket *bucket)
-{
-	assert(isnil(&bucket->key) == isnil(&bucket->value));
-	return isnil(&bucket->key);
-}
-
-/* retains key and value */
-static void insert_into_bucket(
-	Bucket *bucket,
-	const SpnValue *key,
-	const SpnValue *value,
-	int should_retain
-)
-{
-	assert(bucket_is_empty(bucket));
-	assert(notnil(key));
-	assert(notnil(value));
-
-	if (should_retain) {
-		spn_value_retain(key);
-		spn_value_retain(value);
-	}
+/* The hash map is an open addressing table in the style of Google's
+ * "Swiss table". Next to the buckets, there is one control byte for each
+ * bucket, which tells whether the bucket is empty, deleted (a tombstone)
+ * or full; in the latter case, it also holds 7 bits of the hash of the key.
+ * Lookups scan the control bytes of a group of GROUP_WIDTH buckets at once
+ * (using SSE2 or NEON if available), and only compare keys in buckets of
+ * which the control byte matches. They stop at the first group containing
+ * an empty bucket, and subsequent groups are probed quadratically.
+ *
+ * The control byte array has GROUP_WIDTH extra bytes at the end, which
+ * mirror the first ones, so that a group can be loaded at any position
+ * without wrapping around. Deleted buckets become tombstones (unless no
+ * probe sequence can have passed them), which are recycled upon insertion
+ * and discarded when the table is rehashed.
+ */
+#define GROUP_WIDTH   16
 
-	bucket->key = *key;
-	bucket->value = *value;
-}
+#define CTRL_EMPTY    0x80
+#define CTRL_DELETED  0xfe
+#define ctrl_is_full(c) (((c) & 0x80) == 0)
 
-static void erase_bucket(Bucket *bucket)
-{
-	assert(bucket_is_used(bucket));
+/* vectorized group scanning can be disabled by defining this to 0 */
+#ifndef USE_SIMD_PROBING
+#define USE_SIMD_PROBING 1
+#endif
 
-	/* relinquish ownership of key and value (RAII/DIRR),
-	 * then clean them by setting them to nil.
-	 */
-	spn_value_release(&bucket->key);
-	spn_value_release(&bucket->value);
+#if USE_SIMD_PROBING && (defined(__SSE2__) || defined(_M_X64))
+#define USE_SSE2_PROBING 1
+#include <emmintrin.h>
+#elif USE_SIMD_PROBING && defined(__ARM_NEON) && defined(__aarch64__)
+#define USE_NEON_PROBING 1
+#include <arm_neon.h>
+#endif
 
-	bucket->key = spn_nilval;
-	bucket->value = spn_nilval;
-}
+typedef struct Bucket {
+	SpnValue key;
+	SpnValue value;
+} Bucket;
 
 struct SpnHashMap {
 	SpnObject  base;
-	Bucket    *buckets;         /* actual array for key-value pairs           */
-	size_t     allocsize;       /* number of buckets                          */
-	size_t     count;           /* number of key-value pairs                  */
-	size_t     max_hash_offset; /* global upper bound on number of collisions */
+	Bucket    *buckets;   /* key-value pairs, valid where control is full */
+	unsigned char *ctrl;  /* allocsize + GROUP_WIDTH control bytes        */
+	size_t     allocsize; /* number of buckets, a power of two            */
+	size_t     count;     /* number of key-value pairs                    */
+	size_t     ndeleted;  /* number of tombstones                         */
+	unsigned long version; /* incremented upon every modification          */
 };
 
 static void free_hashmap(void *obj);
-static void free_bucket_array(Bucket *buckets, size_t n);
-static void expand_and_rehash(SpnHashMap *hm);
+static void traverse_hashmap(void *obj, void (*visit)(void *, void *), void *ctx);
+static void rehash(SpnHashMap *hm, size_t newsize);
 
 
 static const SpnClass spn_class_hashmap = {
@@ -91,7 +79,8 @@ static const SpnClass spn_class_hashmap = {
 	NULL,
 	NULL,
 	NULL,
-	free_hashmap
+	free_hashmap,
+	traverse_hashmap
 };
 
 
@@ -100,9 +89,11 @@ SpnHashMap *spn_hashmap_new()
 	SpnHashMap *hm = spn_object_new(&spn_class_hashmap);
 
 	hm->buckets = NULL;
+	hm->ctrl = NULL;
 	hm->allocsize = 0;
 	hm->count = 0;
-	hm->max_hash_offset = 0;
+	hm->ndeleted = 0;
+	hm->version = 0;
 
 	return hm;
 }
@@ -110,7 +101,34 @@ SpnHashMap *spn_hashmap_new()
 static void free_hashmap(void *obj)
 {
 	SpnHashMap *hm = obj;
-	free_bucket_array(hm->buckets, hm->allocsize);
+	size_t i;
+
+	for (i = 0; i < hm->allocsize; i++) {
+		if (ctrl_is_full(hm->ctrl[i])) {
+			spn_value_release(&hm->buckets[i].key);
+			spn_value_release(&hm->buckets[i].value);
+		}
+	}
+
+	free(hm->buckets);
+}
+
+static void traverse_hashmap(void *obj, void (*visit)(void *, void *), void *ctx)
+{
+	SpnHashMap *hm = obj;
+	size_t i;
+
+	for (i = 0; i < hm->allocsize; i++) {
+		if (ctrl_is_full(hm->ctrl[i])) {
+			if (isobject(&hm->buckets[i].key)) {
+				visit(objvalue(&hm->buckets[i].key), ctx);
+			}
+
+			if (isobject(&hm->buckets[i].value)) {
+				visit(objvalue(&hm->buckets[i].value), ctx);
+			}
+		}
+	}
 }
 
 size_t spn_hashmap_count(SpnHashMap *hm)
@@ -118,17 +136,156 @@ size_t spn_hashmap_count(SpnHashMap *hm)
 	return hm->count;
 }
 
+unsigned long spn_hashmap_version(SpnHashMap *hm)
+{
+	return hm->version;
+}
+
 SpnValue spn_makehashmap(void)
 {
-	SpnValue val;
-	val.type = SPN_TYPE_HASHMAP;
-	val.v.o = spn_hashmap_new();
-	return val;
+	return makeobject(SPN_TYPE_HASHMAP, spn_hashmap_new());
 }
 
 
 /* Internal functions */
 
+/* Scanning a group of control bytes. Each function returns a bit mask
+ * in which bit #i is set if the i-th control byte of the group matches.
+ */
+#if USE_SSE2_PROBING
+
+static unsigned group_match(const unsigned char *group, unsigned char h2)
+{
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)(group));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)(h2))));
+}
+
+static unsigned group_match_empty(const unsigned char *group)
+{
+	return group_match(group, CTRL_EMPTY);
+}
+
+/* empty or deleted buckets are the ones with the high bit set */
+static unsigned group_match_free(const unsigned char *group)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(group)));
+}
+
+#elif USE_NEON_PROBING
+
+/* 'v' must consist of 0x00 or 0xff bytes */
+static unsigned neon_movemask(uint8x16_t v)
+{
+	static const unsigned char bits[GROUP_WIDTH] = {
+		1, 2, 4, 8, 16, 32, 64, 128,
+		1, 2, 4, 8, 16, 32, 64, 128
+	};
+
+	uint8x16_t m = vandq_u8(v, vld1q_u8(bits));
+	return vaddv_u8(vget_low_u8(m)) | (unsigned)(vaddv_u8(vget_high_u8(m))) << 8;
+}
+
+static unsigned group_match(const unsigned char *group, unsigned char h2)
+{
+	return neon_movemask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(h2)));
+}
+
+static unsigned group_match_empty(const unsigned char *group)
+{
+	return group_match(group, CTRL_EMPTY);
+}
+
+static unsigned group_match_free(const unsigned char *group)
+{
+	return neon_movemask(vcgeq_u8(vld1q_u8(group), vdupq_n_u8(0x80)));
+}
+
+#else /* portable */
+
+static unsigned group_match(const unsigned char *group, unsigned char h2)
+{
+	unsigned mask = 0;
+	int i;
+
+	for (i = 0; i < GROUP_WIDTH; i++) {
+		mask |= (unsigned)(group[i] == h2) << i;
+	}
+
+	return mask;
+}
+
+static unsigned group_match_empty(const unsigned char *group)
+{
+	return group_match(group, CTRL_EMPTY);
+}
+
+static unsigned group_match_free(const unsigned char *group)
+{
+	unsigned mask = 0;
+	int i;
+
+	for (i = 0; i < GROUP_WIDTH; i++) {
+		mask |= (unsigned)(group[i] >> 7) << i;
+	}
+
+	return mask;
+}
+
+#endif /* USE_SSE2_PROBING, USE_NEON_PROBING */
+
+/* number of trailing (low) and leading (high) zero bits of a group mask */
+static int trailing_zeros(unsigned mask)
+{
+	int n = 0;
+
+	if (mask == 0) {
+		return GROUP_WIDTH;
+	}
+
+#ifdef __GNUC__
+	n = __builtin_ctz(mask);
+#else
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		n++;
+	}
+#endif
+
+	return n;
+}
+
+static int leading_zeros(unsigned mask)
+{
+	int n = 0;
+
+	while (n < GROUP_WIDTH && (mask & (1u << (GROUP_WIDTH - 1 - n))) == 0) {
+		n++;
+	}
+
+	return n;
+}
+
+/* The hash of a key is scrambled so that integers, which are their own
+ * hash values, get spread out. The low 7 bits ("H2") are stored in the
+ * control byte, the rest ("H1") determines the start of the probe sequence.
+ */
+#if ULONG_MAX > 0xffffffffUL
+#define SCRAMBLE_MUL   0x9e3779b97f4a7c15UL
+#define SCRAMBLE_SHIFT 32
+#else
+#define SCRAMBLE_MUL   0x9e3779b1UL
+#define SCRAMBLE_SHIFT 16
+#endif
+
+static unsigned long key_hash(const SpnValue *key)
+{
+	unsigned long hash = spn_hash_value(key) * SCRAMBLE_MUL;
+	return hash ^ (hash >> SCRAMBLE_SHIFT);
+}
+
+#define HASH_H1(h) ((size_t)((h) >> 7))
+#define HASH_H2(h) ((unsigned char)((h) & 0x7f))
+
 static size_t modulo_mask(SpnHashMap *hm)
 {
 	/* cannot index into empty table; allocsize must be a power of two */
@@ -136,15 +293,24 @@ static size_t modulo_mask(SpnHashMap *hm)
 	return hm->allocsize - 1;
 }
 
-static size_t hash_index(SpnHashMap *hm, const SpnValue *key)
+/* maximal number of full and deleted buckets (load factor 7/8).
+ * There's always at least one empty bucket, which terminates probing.
+ */
+static size_t max_load(size_t allocsize)
 {
-	return spn_hash_value(key) & modulo_mask(hm);
+	return allocsize - allocsize / 8;
 }
 
-static int should_rehash(SpnHashMap *hm)
+/* sets a control byte along with its mirrored copies */
+static void set_ctrl(SpnHashMap *hm, size_t i, unsigned char c)
 {
-	/* keep load factor below 0.75 */
-	return hm->allocsize == 0 || hm->count > hm->allocsize * 3 / 4;
+	size_t j;
+
+	hm->ctrl[i] = c;
+
+	for (j = i + hm->allocsize; j < hm->allocsize + GROUP_WIDTH; j += hm->allocsize) {
+		hm->ctrl[j] = c;
+	}
 }
 
 /* Returns a pointer to the bucket containing 'key',
@@ -152,65 +318,130 @@ static int should_rehash(SpnHashMap *hm)
  */
 static Bucket *find_key(SpnHashMap *hm, const SpnValue *key)
 {
-	size_t h, hash_offset;
+	unsigned long hash;
+	size_t mask, pos, stride;
+	unsigned char h2;
 
-	/* do not try dividing by zero;
-	 * there are no entries in an empty table.
-	 */
+	/* there are no entries in an empty table */
 	if (hm->allocsize == 0) {
 		return NULL;
 	}
 
-	/* linear probing */
-	h = hash_index(hm, key);
-	hash_offset = 0;
+	hash = key_hash(key);
+	h2 = HASH_H2(hash);
+	mask = modulo_mask(hm);
+	pos = HASH_H1(hash) & mask;
+	stride = 0;
+
+	for (;;) {
+		const unsigned char *group = hm->ctrl + pos;
+		unsigned match = group_match(group, h2);
+
+		while (match != 0) {
+			size_t i = (pos + trailing_zeros(match)) & mask;
 
-	do {
-		/* only occupied buckets may contain a key-value pair */
-		if (bucket_is_used(&hm->buckets[h])
-		 && spn_value_equal(&hm->buckets[h].key, key)) {
-			return &hm->buckets[h];
+			if (spn_value_equal(&hm->buckets[i].key, key)) {
+				return &hm->buckets[i];
+			}
+
+			match &= match - 1;
+		}
+
+		/* if the key were in the table, it would be in this group */
+		if (group_match_empty(group) != 0) {
+			return NULL;
 		}
 
-		/* wrap around end of bucket array if necessary */
-		h = (h + 1) & modulo_mask(hm);
-		hash_offset++;
-	} while (hash_offset <= hm->max_hash_offset);
+		/* quadratic (triangular) probing visits every group */
+		stride += GROUP_WIDTH;
+		pos = (pos + stride) & mask;
+	}
+}
+
+/* returns the index of the first empty or deleted
+ * bucket in the probe sequence of 'hash'
+ */
+static size_t find_free_bucket(SpnHashMap *hm, unsigned long hash)
+{
+	size_t mask = modulo_mask(hm);
+	size_t pos = HASH_H1(hash) & mask;
+	size_t stride = 0;
+
+	for (;;) {
+		unsigned match = group_match_free(hm->ctrl + pos);
+
+		if (match != 0) {
+			return (pos + trailing_zeros(match)) & mask;
+		}
 
-	/* key was not found */
-	return NULL;
+		stride += GROUP_WIDTH;
+		pos = (pos + stride) & mask;
+	}
 }
 
-void insert_nonexistent_norehash(
+/* inserts a key which is known not to be in the table yet.
+ * Retains the key and the value if 'should_retain' is nonzero.
+ */
+static void insert_nonexistent_norehash(
 	SpnHashMap *hm,
 	const SpnValue *key,
 	const SpnValue *value,
 	int should_retain
 )
 {
-	size_t h, hash_offset;
+	unsigned long hash = key_hash(key);
+	size_t i = find_free_bucket(hm, hash);
 
-	assert(should_rehash(hm) == 0);    /* table must be large enough  */
-	assert(hm->count < hm->allocsize); /* there must be empty buckets */
-	assert(find_key(hm, key) == NULL); /* the key must not exist yet  */
+	assert(notnil(key));
+	assert(notnil(value));
 
-	h = hash_index(hm, key);
-	hash_offset = 0;
+	if (hm->ctrl[i] == CTRL_DELETED) {
+		hm->ndeleted--;
+	}
 
-	/* find an empty bucket */
-	while (bucket_is_used(&hm->buckets[h])) {
-		h = (h + 1) & modulo_mask(hm);
-		hash_offset++;
+	if (should_retain) {
+		spn_value_retain(key);
+		spn_value_retain(value);
 	}
 
-	insert_into_bucket(&hm->buckets[h], key, value, should_retain);
-	assert(bucket_is_used(&hm->buckets[h]));
+	hm->buckets[i].key = *key;
+	hm->buckets[i].value = *value;
+	set_ctrl(hm, i, HASH_H2(hash));
 
 	hm->count++;
+}
+
+static void erase_bucket(SpnHashMap *hm, Bucket *bucket)
+{
+	size_t i = bucket - hm->buckets;
+	size_t mask = modulo_mask(hm);
+
+	assert(ctrl_is_full(hm->ctrl[i]));
+
+	/* relinquish ownership of key and value (RAII/DIRR) */
+	spn_value_release(&bucket->key);
+	spn_value_release(&bucket->value);
+
+	hm->count--;
 
-	if (hash_offset > hm->max_hash_offset) {
-		hm->max_hash_offset = hash_offset;
+	/* If the run of non-empty buckets around this one is shorter than a
+	 * group, then every group containing it also contains an empty bucket,
+	 * so no probe sequence has ever continued past it; in this case, it
+	 * can be marked as empty instead of leaving a tombstone behind.
+	 */
+	if (hm->allocsize >= GROUP_WIDTH) {
+		unsigned empty_before = group_match_empty(hm->ctrl + ((i - GROUP_WIDTH) & mask));
+		unsigned empty_after = group_match_empty(hm->ctrl + i);
+
+		if (empty_before != 0 && empty_after != 0
+		 && leading_zeros(empty_before) + trailing_zeros(empty_after) < GROUP_WIDTH) {
+			set_ctrl(hm, i, CTRL_EMPTY);
+			return;
+		}
 	}
+
+	set_ctrl(hm, i, CTRL_DELETED);
+	hm->ndeleted++;
 }
 
 /* key public getter function */
@@ -225,13 +456,13 @@ void spn_hashmap_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val)
 {
 	Bucket *bucket = find_key(hm, key);
 
-	/* If key is already found in the table,
-	 * its corresponding value MUST be non-nil!
-	 * (since assigning nil to a value recycles its bucket.)
+	/* conservatively assume that something changes */
+	hm->version++;
+
+	/* If key is already found in the table, then
+	 * its value is either replaced or deleted.
 	 */
 	if (bucket != NULL) {
-		assert(bucket_is_used(bucket));
-
 		if (notnil(val)) {
 			/* retain new before releasing old to ensure memory safety. */
 			spn_value_retain(val);
@@ -239,9 +470,7 @@ void spn_hashmap_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val)
 			bucket->value = *val;
 		} else {
 			/* assigning nil to a previously non-nil value: deletion */
-			hm->count--;
-			erase_bucket(bucket);
-			assert(bucket_is_empty(bucket));
+			erase_bucket(hm, bucket);
 		}
 
 		/* I'm outta here! */
@@ -255,80 +484,59 @@ void spn_hashmap_set(SpnHashMap *hm, const SpnValue *key, const SpnValue *val)
 		return;
 	}
 
-	/* Step 3: Otherwise we'll need to insert it.
-	 * When the load factor crosses 3/4, we perform a complete rehash.
+	/* Step 3: Otherwise we'll need to insert it. If there is no room
+	 * left, then the table is rehashed: its size is doubled if it is
+	 * at least half full, otherwise only the tombstones are cleaned up.
 	 * This operation invalidates 'hm->buckets'.
 	 */
-	if (should_rehash(hm)) {
-		expand_and_rehash(hm);
-	}
-
-	/* Finally, the new key is inserted */
-	insert_nonexistent_norehash(hm, key, val, 1);
-}
-
-/* a helper for 'expand_and_rehash()' which
- * allocates and initializes a bucket array.
- */
-static Bucket *alloc_bucket_array(size_t n)
-{
-	Bucket *buckets = spn_malloc(n * sizeof buckets[0]);
-
-	size_t i;
-	for (i = 0; i < n; i++) {
-		buckets[i].key = spn_nilval;
-		buckets[i].value = spn_nilval;
-	}
+	if (hm->count + hm->ndeleted + 1 > max_load(hm->allocsize)) {
+		size_t newsize = hm->allocsize;
 
-	return buckets;
-}
+		if (newsize == 0) {
+			newsize = 8;
+		} else if ((hm->count + 1) * 2 > max_load(newsize)) {
+			newsize *= 2;
+		}
 
-static void free_bucket_array(Bucket *buckets, size_t n)
-{
-	size_t i;
-	for (i = 0; i < n; i++) {
-		spn_value_release(&buckets[i].key);
-		spn_value_release(&buckets[i].value);
+		rehash(hm, newsize);
 	}
 
-	free(buckets);
+	/* Finally, the new key is inserted */
+	insert_nonexistent_norehash(hm, key, val, 1);
 }
 
-static void expand_and_rehash(SpnHashMap *hm)
+static void rehash(SpnHashMap *hm, size_t newsize)
 {
 	Bucket *oldbuckets = hm->buckets;
+	unsigned char *oldctrl = hm->ctrl;
 	size_t oldsize = hm->allocsize;
 	size_t i;
 
-	/* Allocation size needs to be a power of two,
-	 * since masking is used for modulo division.
+	/* Allocation size needs to be a power of two, since masking is used
+	 * for modulo division. Buckets and control bytes share one block.
 	 */
-	hm->allocsize = oldsize ? oldsize * 2 : 8;
-	hm->buckets = alloc_bucket_array(hm->allocsize);
+	assert(newsize > 0 && !(newsize & (newsize - 1)));
+
+	hm->allocsize = newsize;
+	hm->buckets = spn_malloc(newsize * sizeof hm->buckets[0] + newsize + GROUP_WIDTH);
+	hm->ctrl = (unsigned char *)(hm->buckets + newsize);
+	memset(hm->ctrl, CTRL_EMPTY, newsize + GROUP_WIDTH);
 
 	/* Reset internal state */
 	hm->count = 0;
-	hm->max_hash_offset = 0;
-
-	/* When expanding, our situation is a little bit better
-	 * than a full-fledged insert, since we know that we are
-	 * inserting into an empty table. Consequently, we don't
-	 * have to check for already-existing keys, since we
-	 * explicitly disallow duplicates during the insertion.
-	 * We don't need to check for nils either, because they
-	 * are trivially filtered out right within the loop.
+	hm->ndeleted = 0;
+
+	/* When rehashing, we know that the keys are all different,
+	 * and that none of them are nil, so they can be moved
+	 * (without retaining them) into the new table directly.
 	 */
 	for (i = 0; i < oldsize; i++) {
-		/* only re-insert non-empty (used) buckets */
-		if (bucket_is_used(&oldbuckets[i])) {
-			/* do not retain - ownership transfer (move) is performed */
+		if (ctrl_is_full(oldctrl[i])) {
 			insert_nonexistent_norehash(hm, &oldbuckets[i].key, &oldbuckets[i].value, 0);
 		}
 	}
 
-	/* no retains were caused by insert_nonexistent_norehash(),
-	 * so we don't need to explicitly release the keys and values.
-	 */
+	/* the control bytes are in the same allocation as the buckets */
 	free(oldbuckets);
 }
 
@@ -341,9 +549,7 @@ SpnValue spn_hashmap_get_strkey(SpnHashMap *hm, const char *key)
 {
 	SpnString key_str = spn_string_emplace_nonretained_for_hashmap(key);
 
-	SpnValue key_val;
-	key_val.type = SPN_TYPE_STRING;
-	key_val.v.o = &key_str;
+	SpnValue key_val = makeobject(SPN_TYPE_STRING, &key_str);
 
 	return spn_hashmap_get(hm, &key_val);
 }
@@ -361,11 +567,9 @@ size_t spn_hashmap_next(SpnHashMap *hm, size_t cursor, SpnValue *key, SpnValue *
 	size_t i;
 
 	for (i = cursor; i < size; i++) {
-		Bucket *bucket = &hm->buckets[i];
-
-		if (bucket_is_used(bucket)) {
-			*key = bucket->key;
-			*val = bucket->value;
+		if (ctrl_is_full(hm->ctrl[i])) {
+			*key = hm->buckets[i].key;
+			*val = hm->buckets[i].value;
 			return i + 1;
 		}
 	}
@@ -41,8 +41,14 @@ SPN_API void spn_hashmap_set_strkey(SpnHashMap *hm, const char *key, const SpnVa
  */
 SPN_API size_t spn_hashmap_next(SpnHashMap *hm, size_t cursor, SpnValue *key, SpnValue *val);
 
+/* The version number of a hash map changes every time a key is inserted,
+ * modified or deleted. It can be used for detecting modifications without
+ * actually comparing contents (e. g. for invalidating caches).
+ */
+SPN_API unsigned long spn_hashmap_version(SpnHashMap *hm);
+
 SPN_API SpnValue spn_makehashmap(void);
 
-#define spn_hashmapvalue(val) ((SpnHashMap *)((val)->v.o))
+#define spn_hashmapvalue(val) ((SpnHashMap *)(spn_objvalue(val)))
 
 #endif /* SPN_HASHMAP_H */
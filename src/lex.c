@@ -166,21 +166,6 @@ static int is_at_eof(SpnLexer *lexer)
 	return lexer->cursor[0] == 0;
 }
 
-/* Because not every system may have this in libc */
-static char *spn_strndup(const char *s, size_t n)
-{
-	const char *t = s;
-	char *r = spn_malloc(n + 1);
-	char *p = r;
-
-	while (*t && t < s + n) {
-		*p++ = *t++;
-	}
-
-	*p = 0;
-	return r;
-}
-
 /* Returns 0 if the escape sequence at the cursor is valid,
  * and non-zero if it is incorrect
  */
@@ -347,7 +332,6 @@ static int lex_space(SpnLexer *lexer, SpnToken *token)
 	}
 
 	token->type = SPN_TOKEN_WSPACE;
-	token->value = NULL;
 
 	return 1;
 }
@@ -355,7 +339,8 @@ static int lex_space(SpnLexer *lexer, SpnToken *token)
 static int lex_op(SpnLexer *lexer, SpnToken *token)
 {
 	/* The order of entries in this array matters because linear search is
-	 * performed on it, and if '+' gets caught before '++', we're in trouble
+	 * performed on it, and if '+' gets caught before '++', we're in trouble.
+	 * Comparing the first character first skips most of the entries.
 	 */
 	static const Reserved ops[] = {
 		RESERVED_ENTRY("("),
@@ -411,9 +396,10 @@ static int lex_op(SpnLexer *lexer, SpnToken *token)
 
 	size_t i;
 	for (i = 0; i < COUNT(ops); i++) {
-		if (strncmp(lexer->cursor, ops[i].str, ops[i].len) == 0) {
+		if (lexer->cursor[0] == ops[i].str[0]
+		 && strncmp(lexer->cursor, ops[i].str, ops[i].len) == 0) {
 			token->type = SPN_TOKEN_PUNCT;
-			token->value = spn_strndup(lexer->cursor, ops[i].len);
+			token->len = ops[i].len;
 			lexer->cursor += ops[i].len;
 			return 1;
 		}
@@ -461,7 +447,7 @@ static int lex_number(SpnLexer *lexer, SpnToken *token)
 		}
 
 		token->type = SPN_TOKEN_INT;
-		token->value = spn_strndup(lexer->cursor, end - lexer->cursor);
+		token->len = end - lexer->cursor;
 		lexer->cursor = end;
 
 		return 1;
@@ -504,7 +490,7 @@ static int lex_number(SpnLexer *lexer, SpnToken *token)
 	}
 
 	token->type = isfloat ? SPN_TOKEN_FLOAT : SPN_TOKEN_INT;
-	token->value = spn_strndup(lexer->cursor, end - lexer->cursor);
+	token->len = end - lexer->cursor;
 	lexer->cursor = end;
 
 	return 1;
@@ -519,7 +505,7 @@ static int lex_word(SpnLexer *lexer, SpnToken *token)
 	}
 
 	token->type = SPN_TOKEN_WORD;
-	token->value = spn_strndup(lexer->cursor, end - lexer->cursor);
+	token->len = end - lexer->cursor;
 	lexer->cursor = end;
 
 	return 1;
@@ -572,7 +558,7 @@ static int lex_char(SpnLexer *lexer, SpnToken *token)
 	}
 
 	token->type = SPN_TOKEN_CHAR;
-	token->value = spn_strndup(begin, lexer->cursor - begin);
+	token->len = lexer->cursor - begin;
 
 	return 1;
 }
@@ -608,7 +594,7 @@ static int lex_string(SpnLexer *lexer, SpnToken *token)
 	lexer->cursor++;
 
 	token->type = SPN_TOKEN_STRING;
-	token->value = spn_strndup(begin, lexer->cursor - begin);
+	token->len = lexer->cursor - begin;
 
 	return 1;
 }
@@ -639,6 +625,8 @@ static int next_token(SpnLexer *lexer, SpnToken *token)
 	lexer->location.column = lexer->cursor - lexer->lastline + 1;
 	token->location = lexer->location;
 	token->offset = lexer->cursor - lexer->source;
+	token->value = lexer->cursor;
+	token->len = 0;
 
 	/* try each lexer function in order */
 	for (i = 0; i < COUNT(fns); i++) {
@@ -726,48 +714,73 @@ char *spn_lexer_steal_errmsg(SpnLexer *lexer)
 	return errmsg;
 }
 
-int spn_token_is_reserved(const char *str)
-{
-	static const char *const kwds[] = {
-		"and",
-		"break",
-		"continue",
-		"do",
-		"else",
-		"extern",
-		"false",
-		"fn",
-		"for",
-		"if",
-		"let",
-		"nil",
-		"not",
-		"null",
-		"or",
-		"return",
-		"true",
-		"typeof",
-		"var",
-		"while"
+/* Keywords are looked up in a perfect hash table: the hash of a word is
+ * computed from its first two characters, and it's different for every
+ * keyword, so a word is a keyword if and only if it's equal to the one
+ * in its slot. (Every keyword is at least two characters long.) The
+ * table must be regenerated whenever a keyword is added or removed.
+ */
+#define KEYWORD_HASH(s) ((6 * (unsigned char)(s)[0] + (unsigned char)(s)[1]) & 63)
+
+int spn_token_is_reserved_len(const char *str, size_t len)
+{
+	static const Reserved kwds[] = {
+		RESERVED_ENTRY("and"),
+		RESERVED_ENTRY("break"),
+		RESERVED_ENTRY("continue"),
+		RESERVED_ENTRY("do"),
+		RESERVED_ENTRY("else"),
+		RESERVED_ENTRY("extern"),
+		RESERVED_ENTRY("false"),
+		RESERVED_ENTRY("fn"),
+		RESERVED_ENTRY("for"),
+		RESERVED_ENTRY("if"),
+		RESERVED_ENTRY("let"),
+		RESERVED_ENTRY("nil"),
+		RESERVED_ENTRY("not"),
+		RESERVED_ENTRY("null"),
+		RESERVED_ENTRY("or"),
+		RESERVED_ENTRY("return"),
+		RESERVED_ENTRY("true"),
+		RESERVED_ENTRY("typeof"),
+		RESERVED_ENTRY("var"),
+		RESERVED_ENTRY("while")
 	};
 
-	size_t i;
-	for (i = 0; i < COUNT(kwds); i++) {
-		if (strcmp(str, kwds[i]) == 0) {
-			return 1;
-		}
+	/* indices into 'kwds' by hash, -1 for empty slots */
+	static const signed char slots[64] = {
+		-1,  2, -1, 12, -1,  6, -1,  3, -1, 13,  4, -1, 14, -1, -1, -1,
+		-1, 15,  7,  8, -1, -1,  5, -1, -1, -1, -1, -1,  9, -1, -1, -1,
+		-1, -1, -1, -1, -1, 18, -1, -1, -1, -1, 16, -1, -1, 10, -1, -1,
+		-1, 17, 19, -1,  0, -1, -1, -1, -1, -1, -1, -1, -1, 11,  1, -1
+	};
+
+	int slot;
+
+	if (len < 2) {
+		return 0;
 	}
 
-	return 0;
+	slot = slots[KEYWORD_HASH(str)];
+
+	return slot >= 0
+	    && kwds[slot].len == len
+	    && memcmp(kwds[slot].str, str, len) == 0;
 }
 
-void spn_free_tokens(SpnToken *buf, size_t n)
+int spn_token_is_reserved(const char *str)
 {
-	size_t i;
-	for (i = 0; i < n; i++) {
-		free(buf[i].value);
-	}
+	return spn_token_is_reserved_len(str, strlen(str));
+}
 
+int spn_token_equals(const SpnToken *token, const char *str)
+{
+	return strncmp(token->value, str, token->len) == 0 && str[token->len] == 0;
+}
+
+void spn_free_tokens(SpnToken *buf, size_t n)
+{
+	/* the tokens themselves don't own any memory */
 	free(buf);
 }
 
@@ -799,10 +812,19 @@ char *spn_unescape_string_literal(const char *str, size_t *outlen)
 {
 	/* since each escape sequence is more than one character long, it is guaranteed
 	 * that the unescaped string will not be longer than the escaped one.
+	 * The end of the literal is found first, skipping escaped characters.
 	 */
-	size_t maxlen = strlen(str);
-	char *buf = spn_malloc(maxlen + 1);
-	char *p = buf;
+	const char *end = str + 1;
+	size_t maxlen;
+	char *buf, *p;
+
+	while (*end != '"') {
+		end += *end == '\\' ? 2 : 1;
+	}
+
+	maxlen = end - str - 1;
+	buf = spn_malloc(maxlen + 1);
+	p = buf;
 
 	/* skip leading double quotation mark */
 	assert(*str == '"');
@@ -830,7 +852,7 @@ long spn_token_to_integer(SpnToken *token)
 {
 	enum spn_token_type type = token->type;
 	const char *value = token->value;
-	size_t len = strlen(value);
+	size_t len = token->len;
 	int base;
 
 	assert(type == SPN_TOKEN_INT || type == SPN_TOKEN_CHAR);
@@ -839,7 +861,10 @@ long spn_token_to_integer(SpnToken *token)
 		return spn_char_literal_toint(value);
 	}
 
-	/* if we got here, the token must be an integer literal */
+	/* if we got here, the token must be an integer literal.
+	 * strtol() stops at the first character after the token,
+	 * since the lexer consumed every digit the token can have.
+	 */
 	if (len < 2) {
 		/* can only be a single digit - assume decimal */
 		return strtol(value, NULL, 10);
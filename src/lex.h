@@ -37,11 +37,16 @@ typedef struct SpnSourceLocation {
 	unsigned column;
 } SpnSourceLocation;
 
+/* Tokens aren't copied; 'value' points to the first character of the
+ * token in the source (so it is *not* NUL-terminated), and 'len' is its
+ * length in bytes. Tokens are thus only valid as long as the source is.
+ */
 typedef struct SpnToken {
 	enum spn_token_type type;
 	SpnSourceLocation location;
 	ptrdiff_t offset;
-	char *value;
+	const char *value;
+	size_t len;
 } SpnToken;
 
 typedef struct SpnLexer {
@@ -69,8 +74,16 @@ SPN_API SpnToken *spn_lexer_lex(SpnLexer *lexer, const char *src, size_t *count)
 SPN_API char *spn_lexer_steal_errmsg(SpnLexer *lexer);
 
 SPN_API int spn_token_is_reserved(const char *str);
+SPN_API int spn_token_is_reserved_len(const char *str, size_t len);
 SPN_API void spn_free_tokens(SpnToken *buf, size_t n);
 
+/* returns nonzero if the text of 'token' is the NUL-terminated 'str' */
+SPN_API int spn_token_equals(const SpnToken *token, const char *str);
+
+/* these two functions take a pointer to the opening quotation mark
+ * of a valid literal; it need not be NUL-terminated after its closing
+ * quotation mark, so they work on the value of a token too.
+ */
 SPN_API long spn_char_literal_toint(const char *chr);
 SPN_API char *spn_unescape_string_literal(const char *str, size_t *outlen);
 
@@ -18,81 +18,82 @@
 #include "str.h"
 #include "private.h"
 #include "array.h"
+#include "ast.h"
 
 /* for 'accept_multi()' */
 typedef struct TokenAndNode {
 	const char *token;
 	const char *node;
-	int (*fn)(SpnParser *, SpnHashMap *, SpnHashMap *); /* for parse_postfix() */
+	int (*fn)(SpnParser *, SpnAst *, SpnAst *); /* for parse_postfix() */
 } TokenAndNode;
 
 /* Parsers (productions/nonterminals, terminals) */
 
-static SpnHashMap *parse_program(SpnParser *p);
-static SpnHashMap *parse_stmt(SpnParser *p, int is_global);
-static SpnHashMap *parse_function(SpnParser *p);
-static SpnHashMap *parse_expr(SpnParser *p);
+static SpnAst *parse_program(SpnParser *p);
+static SpnAst *parse_stmt(SpnParser *p, int is_global);
+static SpnAst *parse_function(SpnParser *p);
+static SpnAst *parse_expr(SpnParser *p);
 
-static SpnHashMap *parse_assignment(SpnParser *p);
-static SpnHashMap *parse_concat(SpnParser *p);
-static SpnHashMap *parse_condexpr(SpnParser *p);
+static SpnAst *parse_assignment(SpnParser *p);
+static SpnAst *parse_concat(SpnParser *p);
+static SpnAst *parse_condexpr(SpnParser *p);
 
-static SpnHashMap *parse_logical_or(SpnParser *p);
-static SpnHashMap *parse_logical_and(SpnParser *p);
-static SpnHashMap *parse_bitwise_or(SpnParser *p);
-static SpnHashMap *parse_bitwise_xor(SpnParser *p);
-static SpnHashMap *parse_bitwise_and(SpnParser *p);
+static SpnAst *parse_logical_or(SpnParser *p);
+static SpnAst *parse_logical_and(SpnParser *p);
+static SpnAst *parse_bitwise_or(SpnParser *p);
+static SpnAst *parse_bitwise_xor(SpnParser *p);
+static SpnAst *parse_bitwise_and(SpnParser *p);
 
-static SpnHashMap *parse_comparison(SpnParser *p);
-static SpnHashMap *parse_shift(SpnParser *p);
-static SpnHashMap *parse_additive(SpnParser *p);
-static SpnHashMap *parse_multiplicative(SpnParser *p);
+static SpnAst *parse_comparison(SpnParser *p);
+static SpnAst *parse_shift(SpnParser *p);
+static SpnAst *parse_additive(SpnParser *p);
+static SpnAst *parse_multiplicative(SpnParser *p);
 
-static SpnHashMap *parse_prefix(SpnParser *p);
-static SpnHashMap *parse_postfix(SpnParser *p);
-static SpnHashMap *parse_term(SpnParser *p);
+static SpnAst *parse_prefix(SpnParser *p);
+static SpnAst *parse_postfix(SpnParser *p);
+static SpnAst *parse_term(SpnParser *p);
 
-static SpnHashMap *parse_array_literal(SpnParser *p);
-static SpnHashMap *parse_hashmap_literal(SpnParser *p);
+static SpnAst *parse_array_literal(SpnParser *p);
+static SpnAst *parse_hashmap_literal(SpnParser *p);
 static SpnArray *parse_decl_args(SpnParser *p);
 static SpnArray *parse_decl_args_oldstyle(SpnParser *p);
 static SpnArray *parse_decl_args_newstyle(SpnParser *p);
 
-static SpnHashMap *parse_fnstmt(SpnParser *p);
-static SpnHashMap *parse_if(SpnParser *p);
-static SpnHashMap *parse_while(SpnParser *p);
-static SpnHashMap *parse_do(SpnParser *p);
-static SpnHashMap *parse_for(SpnParser *p);
-static SpnHashMap *parse_break(SpnParser *p);
-static SpnHashMap *parse_continue(SpnParser *p);
-static SpnHashMap *parse_return(SpnParser *p);
-static SpnHashMap *parse_vardecl(SpnParser *p);
-static SpnHashMap *parse_extern(SpnParser *p);
-static SpnHashMap *parse_expr_stmt(SpnParser *p);
-static SpnHashMap *parse_empty(SpnParser *p);
-static SpnHashMap *parse_block(SpnParser *p);
-static SpnHashMap *parse_block_expecting(SpnParser *p, const char *where);
-
-
-static SpnHashMap *parse_binexpr_rightassoc(
+static SpnAst *parse_fnstmt(SpnParser *p);
+static SpnAst *parse_if(SpnParser *p);
+static SpnAst *parse_while(SpnParser *p);
+static SpnAst *parse_do(SpnParser *p);
+static SpnAst *parse_for(SpnParser *p);
+static SpnAst *parse_break(SpnParser *p);
+static SpnAst *parse_continue(SpnParser *p);
+static SpnAst *parse_return(SpnParser *p);
+static SpnAst *parse_vardecl(SpnParser *p);
+static SpnAst *parse_extern(SpnParser *p);
+static SpnAst *parse_expr_stmt(SpnParser *p);
+static SpnAst *parse_empty(SpnParser *p);
+static SpnAst *parse_block(SpnParser *p);
+static SpnAst *parse_block_expecting(SpnParser *p, const char *where);
+
+
+static SpnAst *parse_binexpr_rightassoc(
 	SpnParser *p,
 	const TokenAndNode tokens[],
 	size_t n,
-	SpnHashMap *(*subexpr)(SpnParser *)
+	SpnAst *(*subexpr)(SpnParser *)
 );
 
-static SpnHashMap *parse_binexpr_leftassoc(
+static SpnAst *parse_binexpr_leftassoc(
 	SpnParser *p,
 	const TokenAndNode tokens[],
 	size_t n,
-	SpnHashMap *(*subexpr)(SpnParser *)
+	SpnAst *(*subexpr)(SpnParser *)
 );
 
-static SpnHashMap *parse_binexpr_noassoc(
+static SpnAst *parse_binexpr_noassoc(
 	SpnParser *p,
 	const TokenAndNode tokens[],
 	size_t n,
-	SpnHashMap *(*subexpr)(SpnParser *)
+	SpnAst *(*subexpr)(SpnParser *)
 );
 
 /* Miscellaneous helpers */
@@ -108,7 +109,22 @@ static int is_at_token(SpnParser *p, const char *str)
 		return 0;
 	}
 
-	return strcmp(p->tokens[p->cursor].value, str) == 0;
+	return spn_token_equals(&p->tokens[p->cursor], str);
+}
+
+static int is_reserved(SpnToken *token)
+{
+	return spn_token_is_reserved_len(token->value, token->len);
+}
+
+/* Tokens only refer to the source, so names are materialized here.
+ * Names are interned, so that every occurrence of the same identifier
+ * in a program shares one string object (and its precomputed hash).
+ */
+static SpnValue token_to_name(SpnParser *p, SpnToken *token)
+{
+	SpnString *name = spn_string_intern(&p->names, token->value, token->len);
+	return makeobject(SPN_TYPE_STRING, name);
 }
 
 static SpnToken *lookahead(SpnParser *p, size_t offset)
@@ -174,12 +190,16 @@ void spn_parser_init(SpnParser *p)
 	p->cursor = 0;
 	p->error = 0;
 	p->errmsg = NULL;
+	spn_ast_arena_init(&p->arena);
+	spn_interntab_init(&p->names);
 }
 
 void spn_parser_free(SpnParser *p)
 {
 	spn_lexer_free(&p->lexer);
 	spn_free_tokens(p->tokens, p->num_toks);
+	spn_ast_arena_free(&p->arena);
+	spn_interntab_free(&p->names);
 	free(p->errmsg);
 }
 
@@ -211,6 +231,22 @@ static void parser_error(SpnParser *p, const char *fmt, const void *args[])
 	p->error = 1;
 }
 
+/* 'fmt' must contain exactly one '%s', which is replaced by the token */
+static void token_error(SpnParser *p, const char *fmt, SpnToken *token)
+{
+	const void *args[1];
+	SpnString *text;
+
+	if (p->error) {
+		return;
+	}
+
+	text = spn_string_new_len(token->value, token->len);
+	args[0] = text->cstr;
+	parser_error(p, fmt, args);
+	spn_object_release(text);
+}
+
 /* returns 0 if the lexing was successful.
  * Returns non-zero and sets the error if an error occurred.
  */
@@ -222,6 +258,11 @@ static int setup_parser(SpnParser *p, const char *src)
 	 */
 	spn_free_tokens(p->tokens, p->num_toks);
 
+	/* the previous tree is not needed anymore either */
+	spn_ast_arena_reset(&p->arena);
+	spn_interntab_free(&p->names);
+	spn_interntab_init(&p->names);
+
 	p->tokens = spn_lexer_lex(&p->lexer, src, &p->num_toks);
 
 	if (p->tokens) {
@@ -245,91 +286,40 @@ static int setup_parser(SpnParser *p, const char *src)
 /* returns non-zero if nodes of type 'type' need a child array */
 static int ast_type_needs_children(const char *type);
 
-/*
- * The set of possible keys, node types etc. is generally known at
- * compile time (if one is messing around with generating ASTs at runtime,
- * that is memory-safe anyway so the warning below doesn't concern him.)
- * Hence, we mostly use 'makestring_nocopy()' so as to avoid extraneous
- * dynamic allocation. This, however, means that we need to use string
- * literals (that have static storage duration) so the strings are not
- * deallocated (or otherwise invalidated) prematurely.
+/* The nodes are allocated from the arena of the parser, so they need
+ * not (and must not) be freed individually; if an error occurs, the
+ * partially built tree is simply abandoned. The set of node types is
+ * known at compile time, so 'type' must be a string literal (that has
+ * static storage duration), since it is not copied.
  */
-static void ast_set_property(SpnHashMap *node, const char *key, const SpnValue *val)
-{
-	SpnValue pname = makestring_nocopy(key);
-	spn_hashmap_set(node, &pname, val);
-	spn_value_release(&pname);
-}
-
-/* Similarly, 'type' must also be a string literal in this function */
-static SpnHashMap *ast_new(const char *type, SpnSourceLocation loc)
+static SpnAst *ast_new(SpnParser *p, const char *type, SpnSourceLocation loc)
 {
-	SpnHashMap *node = spn_hashmap_new();
+	SpnAst *node = spn_ast_new(&p->arena, type, loc);
 
-	SpnValue vtype = makestring_nocopy(type);
-	SpnValue line = makeint(loc.line);
-	SpnValue col = makeint(loc.column);
-
-	ast_set_property(node, "type", &vtype);
-	ast_set_property(node, "line", &line);
-	ast_set_property(node, "column", &col);
-
-	spn_value_release(&vtype);
-
-	/* if the node an explicit 'children' array, add it */
-	if (ast_type_needs_children(type)) {
-		SpnValue children = makearray();
-		ast_set_property(node, "children", &children);
-		spn_value_release(&children);
-	}
+	/* if the node needs an explicit 'children' array, flag it */
+	node->haschildren = ast_type_needs_children(type);
 
 	return node;
 }
 
-/* Sets 'child' as the child of parent 'node'.
- * This transfers ownership ("xfer"), releases 'child'!
- * 'key' must be a string literal too.
- */
-static void ast_set_child_xfer(SpnHashMap *node, const char *key, SpnHashMap *child)
+/* Sets 'child' as the child of parent 'node' */
+static void ast_set_child(SpnAst *node, enum spn_ast_key key, SpnAst *child)
 {
-	SpnValue val;
-	val.type = SPN_TYPE_HASHMAP;
-	val.v.o = child;
-
-	ast_set_property(node, key, &val);
-	spn_object_release(child);
+	spn_ast_set_child(node, key, child);
 }
 
-/* Returns the 'children' array of 'node'.
- * Naturally, the returned pointer is *non-owning*.
- */
-static SpnArray *ast_get_children(SpnHashMap *node)
+/* Adds 'child' to the children array of 'node' */
+static void ast_push_child(SpnParser *p, SpnAst *node, SpnAst *child)
 {
-	SpnValue val = spn_hashmap_get_strkey(node, "children");
-	assert(isarray(&val));
-	return arrayvalue(&val);
+	assert(node->haschildren);
+	spn_ast_push_child(&p->arena, node, child);
 }
 
-/* Adds 'child' to the children array of 'node'.
- * Transfers ownership - releases 'child'!
- */
-static void ast_push_child_xfer(SpnHashMap *node, SpnHashMap *child)
+/* This returns a pointer to a newly appended child */
+static SpnAst *ast_append_child(SpnParser *p, SpnAst *node, const char *type, SpnSourceLocation loc)
 {
-	SpnArray *children = ast_get_children(node);
-
-	SpnValue vchild;
-	vchild.type = SPN_TYPE_HASHMAP;
-	vchild.v.o = child;
-
-	spn_array_push(children, &vchild);
-	spn_object_release(child);
-}
-
-/* This returns a *non-owning* pointer to a newly appended child */
-static SpnHashMap *ast_append_child(SpnHashMap *node, const char *type, SpnSourceLocation loc)
-{
-	SpnHashMap *child = ast_new(type, loc);
-	ast_push_child_xfer(node, child);
+	SpnAst *child = ast_new(p, type, loc);
+	ast_push_child(p, node, child);
 	return child;
 }
 
@@ -360,35 +350,29 @@ static int ast_type_needs_children(const char *type)
 }
 
 /* If 'expr' is a function expression, then sets its name to 'name'. */
-static void set_name_if_is_function(SpnHashMap *expr, SpnValue name)
+static void set_name_if_is_function(SpnAst *expr, SpnValue name)
 {
-	SpnString *type;
-	SpnValue typeval = spn_hashmap_get_strkey(expr, "type");
-
-	assert(isstring(&typeval));
-	type = stringvalue(&typeval);
-
 	assert(isstring(&name));
 
-	if (strcmp(type->cstr, "function") == 0) {
-		ast_set_property(expr, "name", &name);
+	if (strcmp(expr->type, "function") == 0) {
+		spn_ast_set_name(expr, &name);
 	}
 }
 
 /* returns a string literal with the name
  * of the identifier token as its value.
  */
-static SpnHashMap *ident_to_string(SpnToken *ident)
+static SpnAst *ident_to_string(SpnParser *p, SpnToken *ident)
 {
 	SpnValue namestring;
-	SpnHashMap *ast;
+	SpnAst *ast;
 
 	assert(ident != NULL);
 	assert(ident->type == SPN_TOKEN_WORD);
 
-	ast = ast_new("literal", ident->location);
-	namestring = makestring(ident->value);
-	ast_set_property(ast, "value", &namestring);
+	ast = ast_new(p, "literal", ident->location);
+	namestring = token_to_name(p, ident);
+	spn_ast_set_value(ast, &namestring);
 	spn_value_release(&namestring);
 
 	return ast;
@@ -399,7 +383,7 @@ static SpnHashMap *ident_to_string(SpnToken *ident)
  * multiple translation units), then kick off the actual recursive descent
  * parser to process the source text
  */
-SpnHashMap *spn_parser_parse(SpnParser *p, const char *src)
+SpnAst *spn_parser_parse_ast(SpnParser *p, const char *src)
 {
 	/* return NULL on error */
 	if (setup_parser(p, src)) {
@@ -409,9 +393,9 @@ SpnHashMap *spn_parser_parse(SpnParser *p, const char *src)
 	return parse_program(p);
 }
 
-SpnHashMap *spn_parser_parse_expression(SpnParser *p, const char *src)
+SpnAst *spn_parser_parse_expression_ast(SpnParser *p, const char *src)
 {
-	SpnHashMap *expr;
+	SpnAst *expr;
 
 	/* check for lexing errors */
 	if (setup_parser(p, src)) {
@@ -430,43 +414,59 @@ SpnHashMap *spn_parser_parse_expression(SpnParser *p, const char *src)
 		 */
 		SpnSourceLocation zeroloc = { 0, 0 };
 
-		SpnHashMap *program = ast_new("program", zeroloc);
-		SpnHashMap *return_stmt = ast_append_child(program, "return", zeroloc);
-		ast_set_child_xfer(return_stmt, "expr", expr);
+		SpnAst *program = ast_new(p, "program", zeroloc);
+		SpnAst *return_stmt = ast_append_child(p, program, "return", zeroloc);
+		ast_set_child(return_stmt, SPN_AST_EXPR, expr);
 
 		return program;
 	}
 
 	/* it is an error if we are not at the end of the source */
-	spn_object_release(expr);
 	parser_error(p, "garbage after input", NULL);
 	return NULL;
 }
 
-static SpnHashMap *parse_program(SpnParser *p)
+/* materializes the native AST, then frees it right away */
+static SpnHashMap *ast_to_hashmap(SpnParser *p, SpnAst *root)
+{
+	SpnHashMap *ast = root != NULL ? spn_ast_to_hashmap(root) : NULL;
+	spn_ast_arena_reset(&p->arena);
+	return ast;
+}
+
+SpnHashMap *spn_parser_parse(SpnParser *p, const char *src)
+{
+	return ast_to_hashmap(p, spn_parser_parse_ast(p, src));
+}
+
+SpnHashMap *spn_parser_parse_expression(SpnParser *p, const char *src)
+{
+	return ast_to_hashmap(p, spn_parser_parse_expression_ast(p, src));
+}
+
+static SpnAst *parse_program(SpnParser *p)
 {
 	SpnSourceLocation begin = { 1, 1 };
-	SpnHashMap *program = ast_new("program", begin);
+	SpnAst *program = ast_new(p, "program", begin);
 
 	while (is_at_eof(p) == 0) {
-		SpnHashMap *stmt = parse_stmt(p, 1);
+		SpnAst *stmt = parse_stmt(p, 1);
 
 		if (stmt == NULL) {
-			spn_object_release(program);
 			return NULL;
 		}
 
-		ast_push_child_xfer(program, stmt);
+		ast_push_child(p, program, stmt);
 	}
 
 	return program;
 }
 
-static SpnHashMap *parse_stmt(SpnParser *p, int is_global)
+static SpnAst *parse_stmt(SpnParser *p, int is_global)
 {
 	static const struct {
 		const char *token;              /* a token corresponding to a production... */
-		SpnHashMap *(*fn)(SpnParser *); /* ...and a parser function that implements it */
+		SpnAst *(*fn)(SpnParser *); /* ...and a parser function that implements it */
 	} parsers[] = {
 		{ "var",      parse_vardecl  },
 		{ "let",      parse_vardecl  },
@@ -509,28 +509,27 @@ static SpnHashMap *parse_stmt(SpnParser *p, int is_global)
  * a return statement which returns that expression.
  * Hence, this block statement will be a valid function body.
  */
-static SpnHashMap *parse_function_body_expression(SpnParser *p, SpnSourceLocation loc)
+static SpnAst *parse_function_body_expression(SpnParser *p, SpnSourceLocation loc)
 {
-	SpnHashMap *return_stmt;
-	SpnHashMap *block;
-	SpnHashMap *expr = parse_expr(p);
+	SpnAst *return_stmt;
+	SpnAst *block;
+	SpnAst *expr = parse_expr(p);
 
 	if (expr == NULL) {
 		return NULL;
 	}
 
-	block = ast_new("block", loc);
-	return_stmt = ast_append_child(block, "return", loc);
-	ast_set_child_xfer(return_stmt, "expr", expr);
+	block = ast_new(p, "block", loc);
+	return_stmt = ast_append_child(p, block, "return", loc);
+	ast_set_child(return_stmt, SPN_AST_EXPR, expr);
 
 	return block;
 }
 
-static SpnHashMap *parse_function(SpnParser *p)
+static SpnAst *parse_function(SpnParser *p)
 {
-	SpnHashMap *ast, *body;
+	SpnAst *ast, *body;
 	SpnArray *declargs;
-	SpnValue declargsval;
 	SpnToken *token = accept_token_string(p, "fn");
 	SpnToken *arrow; /* non-NULL if we have a one-expression function */
 
@@ -542,9 +541,6 @@ static SpnHashMap *parse_function(SpnParser *p)
 		return NULL;
 	}
 
-	declargsval.type = SPN_TYPE_ARRAY;
-	declargsval.v.o = declargs;
-
 	/* Parse function body */
 	arrow = accept_token_string(p, "->");
 	if (arrow) {
@@ -561,12 +557,12 @@ static SpnHashMap *parse_function(SpnParser *p)
 	/* this "function" is not the (now-nonexistent) "function"
 	 * keyword, but the node type of the function definition AST.
 	 */
-	ast = ast_new("function", token->location);
+	ast = ast_new(p, "function", token->location);
 
-	ast_set_property(ast, "declargs", &declargsval);
-	ast_set_child_xfer(ast, "body", body);
+	spn_ast_set_declargs(ast, declargs);
+	ast_set_child(ast, SPN_AST_BODY, body);
 
-	spn_value_release(&declargsval);
+	spn_object_release(declargs);
 
 	return ast;
 }
@@ -576,7 +572,7 @@ static SpnHashMap *parse_function(SpnParser *p)
  * The 'where' argument is a brief description of the production that
  * we are currently parsing (e. g. "if statement" or "function body").
  */
-static SpnHashMap *parse_block_expecting(SpnParser *p, const char *where)
+static SpnAst *parse_block_expecting(SpnParser *p, const char *where)
 {
 	const void *args[1];
 
@@ -589,43 +585,41 @@ static SpnHashMap *parse_block_expecting(SpnParser *p, const char *where)
 	return NULL;
 }
 
-static SpnHashMap *parse_block(SpnParser *p)
+static SpnAst *parse_block(SpnParser *p)
 {
-	SpnHashMap *node;
+	SpnAst *node;
 	SpnToken *rbrace;
 	SpnToken *lbrace = accept_token_string(p, "{");
 	assert(lbrace != NULL);
 
-	node = ast_new("block", lbrace->location);
+	node = ast_new(p, "block", lbrace->location);
 
 	/* spin around while there are tokens or the block has ended */
 	while (!((rbrace = accept_token_string(p, "}")) || is_at_eof(p))) {
-		SpnHashMap *stmt = parse_stmt(p, 0);
+		SpnAst *stmt = parse_stmt(p, 0);
 
 		if (stmt == NULL) {
-			spn_object_release(node);
 			return NULL;
 		}
 
-		ast_push_child_xfer(node, stmt);
+		ast_push_child(p, node, stmt);
 	}
 
 	/* blocks must end with a closing right-brace */
 	if (rbrace == NULL) {
 		parser_error(p, "expecting '}' at end of block", NULL);
-		spn_object_release(node);
 		return NULL;
 	}
 
 	return node;
 }
 
-static SpnHashMap *parse_expr(SpnParser *p)
+static SpnAst *parse_expr(SpnParser *p)
 {
 	return parse_assignment(p);
 }
 
-static SpnHashMap *parse_assignment(SpnParser *p)
+static SpnAst *parse_assignment(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "=",   "assign" },
@@ -645,15 +639,15 @@ static SpnHashMap *parse_assignment(SpnParser *p)
 	return parse_binexpr_rightassoc(p, tokens, COUNT(tokens), parse_concat);
 }
 
-static SpnHashMap *parse_concat(SpnParser *p)
+static SpnAst *parse_concat(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = { { "..", "concat" } };
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_condexpr);
 }
 
-static SpnHashMap *parse_condexpr(SpnParser *p)
+static SpnAst *parse_condexpr(SpnParser *p)
 {
-	SpnHashMap *cond, *br_true, *br_false, *node;
+	SpnAst *cond, *br_true, *br_false, *node;
 	SpnToken *qmark;
 
 	cond = parse_logical_or(p);
@@ -668,30 +662,25 @@ static SpnHashMap *parse_condexpr(SpnParser *p)
 
 	br_true = parse_expr(p);
 	if (br_true == NULL) {
-		spn_object_release(cond);
 		return NULL;
 	}
 
 	if (accept_token_string(p, ":") == NULL) {
 		/* error, expected ':' */
 		parser_error(p, "expected ':' in conditional expression", NULL);
-		spn_object_release(cond);
-		spn_object_release(br_true);
 		return NULL;
 	}
 
 	br_false = parse_condexpr(p);
 	if (br_false == NULL) {
-		spn_object_release(cond);
-		spn_object_release(br_true);
 		return NULL;
 	}
 
-	node = ast_new("condexpr", qmark->location);
+	node = ast_new(p, "condexpr", qmark->location);
 
-	ast_set_child_xfer(node, "cond", cond);
-	ast_set_child_xfer(node, "true", br_true);
-	ast_set_child_xfer(node, "false", br_false);
+	ast_set_child(node, SPN_AST_COND, cond);
+	ast_set_child(node, SPN_AST_TRUE, br_true);
+	ast_set_child(node, SPN_AST_FALSE, br_false);
 
 	return node;
 }
@@ -699,7 +688,7 @@ static SpnHashMap *parse_condexpr(SpnParser *p)
 /* Functions to parse binary mathematical expressions
  * in ascending order of precedence.
  */
-static SpnHashMap *parse_logical_or(SpnParser *p)
+static SpnAst *parse_logical_or(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "or", "or" },
@@ -709,7 +698,7 @@ static SpnHashMap *parse_logical_or(SpnParser *p)
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_logical_and);
 }
 
-static SpnHashMap *parse_logical_and(SpnParser *p)
+static SpnAst *parse_logical_and(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "and", "and" },
@@ -719,7 +708,7 @@ static SpnHashMap *parse_logical_and(SpnParser *p)
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_comparison);
 }
 
-static SpnHashMap *parse_comparison(SpnParser *p)
+static SpnAst *parse_comparison(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "==", "==" },
@@ -733,25 +722,25 @@ static SpnHashMap *parse_comparison(SpnParser *p)
 	return parse_binexpr_noassoc(p, tokens, COUNT(tokens), parse_bitwise_or);
 }
 
-static SpnHashMap *parse_bitwise_or(SpnParser *p)
+static SpnAst *parse_bitwise_or(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = { { "|", "bit_or" } };
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_bitwise_xor);
 }
 
-static SpnHashMap *parse_bitwise_xor(SpnParser *p)
+static SpnAst *parse_bitwise_xor(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = { { "^", "bit_xor" } };
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_bitwise_and);
 }
 
-static SpnHashMap *parse_bitwise_and(SpnParser *p)
+static SpnAst *parse_bitwise_and(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = { { "&", "bit_and" } };
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_shift);
 }
 
-static SpnHashMap *parse_shift(SpnParser *p)
+static SpnAst *parse_shift(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "<<", "<<" },
@@ -761,7 +750,7 @@ static SpnHashMap *parse_shift(SpnParser *p)
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_additive);
 }
 
-static SpnHashMap *parse_additive(SpnParser *p)
+static SpnAst *parse_additive(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "+", "+" },
@@ -771,7 +760,7 @@ static SpnHashMap *parse_additive(SpnParser *p)
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_multiplicative);
 }
 
-static SpnHashMap *parse_multiplicative(SpnParser *p)
+static SpnAst *parse_multiplicative(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "*", "*"   },
@@ -782,7 +771,7 @@ static SpnHashMap *parse_multiplicative(SpnParser *p)
 	return parse_binexpr_leftassoc(p, tokens, COUNT(tokens), parse_prefix);
 }
 
-static SpnHashMap *parse_prefix(SpnParser *p)
+static SpnAst *parse_prefix(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "++",     "pre_inc"  },
@@ -795,7 +784,7 @@ static SpnHashMap *parse_prefix(SpnParser *p)
 		{ "typeof", "typeof"   }
 	};
 
-	SpnHashMap *child, *ast;
+	SpnAst *child, *ast;
 	size_t index;
 	SpnToken *op = accept_multi(p, tokens, COUNT(tokens), &index);
 
@@ -809,51 +798,46 @@ static SpnHashMap *parse_prefix(SpnParser *p)
 		return NULL;
 	}
 
-	ast = ast_new(tokens[index].node, op->location);
-	ast_set_child_xfer(ast, "right", child);
+	ast = ast_new(p, tokens[index].node, op->location);
+	ast_set_child(ast, SPN_AST_RIGHT, child);
 
 	return ast;
 }
 
 /* Helper functions for 'parse_postfix()'.
  * They return an error code: 0 on success, non-0 on error.
- * Upon encountering an error, they clean up after themselves:
- * they free 'ast' and 'tmp'.
  *
  * 'ast' is the last parsed node; it will become a child of 'tmp'.
  * 'tmp' represents the node currently being parsed.
  */
 
-static int parse_postfix_incdec(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
+static int parse_postfix_incdec(SpnParser *p, SpnAst *ast, SpnAst *tmp)
 {
-	ast_set_child_xfer(tmp, "left", ast);
+	ast_set_child(tmp, SPN_AST_LEFT, ast);
 	return 0;
 }
 
-static int parse_subscript(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
+static int parse_subscript(SpnParser *p, SpnAst *ast, SpnAst *tmp)
 {
 	/* Array or hashmap indexing */
-	SpnHashMap *expr = parse_expr(p);
+	SpnAst *expr = parse_expr(p);
 	if (expr == NULL) { /* error  */
-		spn_object_release(ast);
-		spn_object_release(tmp);
 		return -1;
 	}
 
-	ast_set_child_xfer(tmp, "object", ast);
-	ast_set_child_xfer(tmp, "index", expr);
+	ast_set_child(tmp, SPN_AST_OBJECT, ast);
+	ast_set_child(tmp, SPN_AST_INDEX, expr);
 
 	if (accept_token_string(p, "]") == NULL) {
 		/* error: expected closing bracket */
 		parser_error(p, "expected ']' after index in array subscript", NULL);
-		spn_object_release(tmp);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int parse_memberof(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
+static int parse_memberof(SpnParser *p, SpnAst *ast, SpnAst *tmp)
 {
 	/* Property accessor, dot notation */
 	SpnToken *ident;
@@ -862,48 +846,43 @@ static int parse_memberof(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
 	if ((ident = accept_token_type(p, SPN_TOKEN_WORD)) == NULL) {
 		/* error: expected identifier as member */
 		parser_error(p, "expecting property name after '.' operator", NULL);
-		spn_object_release(ast);
-		spn_object_release(tmp);
 		return -1;
 	}
 
 	/* do not check for reserved words explicitly
 	 * -- they are allowed in property names.
 	 */
-	ast_set_child_xfer(tmp, "object", ast);
+	ast_set_child(tmp, SPN_AST_OBJECT, ast);
 
-	namestring = makestring(ident->value);
-	ast_set_property(tmp, "name", &namestring);
+	namestring = token_to_name(p, ident);
+	spn_ast_set_name(tmp, &namestring);
 	spn_value_release(&namestring);
 
 	return 0;
 }
 
-static int parse_call(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
+static int parse_call(SpnParser *p, SpnAst *ast, SpnAst *tmp)
 {
 	/* Function call */
-	ast_set_child_xfer(tmp, "func", ast);
+	ast_set_child(tmp, SPN_AST_FUNC, ast);
 
 	while (!accept_token_string(p, ")")) {
-		SpnHashMap *param = parse_expr(p);
+		SpnAst *param = parse_expr(p);
 
 		if (param == NULL) {
-			spn_object_release(tmp); /* this frees 'ast' too */
 			return -1;
 		}
 
-		ast_push_child_xfer(tmp, param);
+		ast_push_child(p, tmp, param);
 
 		/* comma ',' or closing parenthesis ')' must follow */
 		if (accept_token_string(p, ",")) {
 			if (is_at_token(p, ")")) {
 				parser_error(p, "trailing comma after last function argument", NULL);
-				spn_object_release(tmp);
 				return -1;
 			}
 		} else if (!is_at_token(p, ")")) {
 			parser_error(p, "expecting ',' or ')' after function argument", NULL);
-			spn_object_release(tmp); /* this frees ast and param */
 			return -1;
 		}
 	}
@@ -911,30 +890,28 @@ static int parse_call(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
 	return 0;
 }
 
-static int parse_sugared_subscript(SpnParser *p, SpnHashMap *ast, SpnHashMap *tmp)
+static int parse_sugared_subscript(SpnParser *p, SpnAst *ast, SpnAst *tmp)
 {
 	/* syntactic sugar for raw indexing with string literal */
 	SpnToken *ident;
-	SpnHashMap *index;
+	SpnAst *index;
 
 	if ((ident = accept_token_type(p, SPN_TOKEN_WORD)) == NULL) {
 		/* error: expected identifier as member */
 		parser_error(p, "expecting member name after '::' operator", NULL);
-		spn_object_release(ast);
-		spn_object_release(tmp);
 		return -1;
 	}
 
 	/* build index which is a string literal */
-	index = ident_to_string(ident);
+	index = ident_to_string(p, ident);
 
-	ast_set_child_xfer(tmp, "object", ast);
-	ast_set_child_xfer(tmp, "index", index);
+	ast_set_child(tmp, SPN_AST_OBJECT, ast);
+	ast_set_child(tmp, SPN_AST_INDEX, index);
 
 	return 0;
 }
 
-static SpnHashMap *parse_postfix(SpnParser *p)
+static SpnAst *parse_postfix(SpnParser *p)
 {
 	static const TokenAndNode tokens[] = {
 		{ "++", "post_inc",  parse_postfix_incdec    },
@@ -948,17 +925,17 @@ static SpnHashMap *parse_postfix(SpnParser *p)
 	size_t index;
 	SpnToken *op;
 
-	SpnHashMap *ast = parse_term(p);
+	SpnAst *ast = parse_term(p);
 	if (ast == NULL) { /* error */
 		return NULL;
 	}
 
 	/* iteration instead of left recursion - we want to terminate */
 	while ((op = accept_multi(p, tokens, COUNT(tokens), &index)) != NULL) {
-		SpnHashMap *tmp = ast_new(tokens[index].node, op->location);
+		SpnAst *tmp = ast_new(p, tokens[index].node, op->location);
 
-		/* we can just return NULL since the parser functions
-		 * clean up after themselves if they find an error.
+		/* we can just return NULL since the nodes
+		 * are owned by the arena of the parser.
 		 */
 		if (tokens[index].fn(p, ast, tmp) != 0) {
 			return NULL;
@@ -971,20 +948,19 @@ static SpnHashMap *parse_postfix(SpnParser *p)
 	return ast;
 }
 
-static SpnHashMap *parse_term(SpnParser *p)
+static SpnAst *parse_term(SpnParser *p)
 {
 	SpnToken *token;
 
 	/* Parenthesized expression */
 	if (accept_token_string(p, "(")) {
-		SpnHashMap *ast = parse_expr(p);
+		SpnAst *ast = parse_expr(p);
 		if (ast == NULL) {
 			return NULL;
 		}
 
 		if (accept_token_string(p, ")") == NULL) {
 			parser_error(p, "expecting ')' after parenthesized expression", NULL);
-			spn_object_release(ast);
 			return NULL;
 		}
 
@@ -1008,25 +984,25 @@ static SpnHashMap *parse_term(SpnParser *p)
 
 	/* '$': argv, the argument vector */
 	if ((token = accept_token_string(p, "$")) != NULL) {
-		return ast_new("argv", token->location);
+		return ast_new(p, "argv", token->location);
 	}
 
 	/* literal nil */
 	if ((token = accept_token_string(p, "nil"))  != NULL
 	 || (token = accept_token_string(p, "null")) != NULL) {
-		return ast_new("literal", token->location); /* 'value' is nil by default */
+		return ast_new(p, "literal", token->location); /* 'value' is nil by default */
 	}
 
 	/* Boolean literals */
 	if ((token = accept_token_string(p, "true")) != NULL) {
-		SpnHashMap *ast = ast_new("literal", token->location);
-		ast_set_property(ast, "value", &spn_trueval);
+		SpnAst *ast = ast_new(p, "literal", token->location);
+		spn_ast_set_value(ast, &spn_trueval);
 		return ast;
 	}
 
 	if ((token = accept_token_string(p, "false")) != NULL) {
-		SpnHashMap *ast = ast_new("literal", token->location);
-		ast_set_property(ast, "value", &spn_falseval);
+		SpnAst *ast = ast_new(p, "literal", token->location);
+		spn_ast_set_value(ast, &spn_falseval);
 		return ast;
 	}
 
@@ -1036,19 +1012,17 @@ static SpnHashMap *parse_term(SpnParser *p)
 	 * since this 'jolly joker' call catches *all* word-like tokens.
 	 */
 	if ((token = accept_token_type(p, SPN_TOKEN_WORD)) != NULL) {
-		SpnHashMap *ast;
+		SpnAst *ast;
 		SpnValue name;
 
-		if (spn_token_is_reserved(token->value)) {
-			const void *args[1];
-			args[0] = token->value;
-			parser_error(p, "'%s' is a keyword and cannot be a variable name", args);
+		if (is_reserved(token)) {
+			token_error(p, "'%s' is a keyword and cannot be a variable name", token);
 			return NULL;
 		}
 
-		ast = ast_new("ident", token->location);
-		name = makestring(token->value);
-		ast_set_property(ast, "name", &name);
+		ast = ast_new(p, "ident", token->location);
+		name = token_to_name(p, token);
+		spn_ast_set_name(ast, &name);
 		spn_value_release(&name);
 
 		return ast;
@@ -1059,8 +1033,8 @@ static SpnHashMap *parse_term(SpnParser *p)
 	 || (token = accept_token_type(p, SPN_TOKEN_CHAR)) != NULL) {
 		long n = spn_token_to_integer(token);
 		SpnValue val = makeint(n);
-		SpnHashMap *ast = ast_new("literal", token->location);
-		ast_set_property(ast, "value", &val);
+		SpnAst *ast = ast_new(p, "literal", token->location);
+		spn_ast_set_value(ast, &val);
 		return ast;
 	}
 
@@ -1068,8 +1042,8 @@ static SpnHashMap *parse_term(SpnParser *p)
 	if ((token = accept_token_type(p, SPN_TOKEN_FLOAT)) != NULL) {
 		double x = strtod(token->value, NULL);
 		SpnValue val = makefloat(x);
-		SpnHashMap *ast = ast_new("literal", token->location);
-		ast_set_property(ast, "value", &val);
+		SpnAst *ast = ast_new(p, "literal", token->location);
+		spn_ast_set_value(ast, &val);
 		return ast;
 	}
 
@@ -1078,8 +1052,8 @@ static SpnHashMap *parse_term(SpnParser *p)
 		size_t len;
 		char *unescaped = spn_unescape_string_literal(token->value, &len);
 		SpnValue val = spn_makestring_nocopy_len(unescaped, len, 1);
-		SpnHashMap *ast = ast_new("literal", token->location);
-		ast_set_property(ast, "value", &val);
+		SpnAst *ast = ast_new(p, "literal", token->location);
+		spn_ast_set_value(ast, &val);
 		spn_value_release(&val);
 		return ast;
 	}
@@ -1090,39 +1064,35 @@ static SpnHashMap *parse_term(SpnParser *p)
 	if (is_at_eof(p)) {
 		parser_error(p, "unexpected end of input", NULL);
 	} else {
-		const void *args[1];
-		args[0] = p->tokens[p->cursor].value;
-		parser_error(p, "unexpected '%s'", args);
+		token_error(p, "unexpected '%s'", &p->tokens[p->cursor]);
 	}
 
 	return NULL;
 }
 
-static SpnHashMap *parse_array_literal(SpnParser *p)
+static SpnAst *parse_array_literal(SpnParser *p)
 {
-	SpnHashMap *ast;
+	SpnAst *ast;
 	SpnToken *lbracket = accept_token_string(p, "[");
 	assert(lbracket != NULL);
 
-	ast = ast_new("array", lbracket->location);
+	ast = ast_new(p, "array", lbracket->location);
 
 	/* 'while we are not at ]' is enough for the condition, since a
 	 * premature end-of-input condition would be catched by parse_expr().
 	 */
 	while (!accept_token_string(p, "]")) {
 		/* parse value */
-		SpnHashMap *expr = parse_expr(p);
+		SpnAst *expr = parse_expr(p);
 		if (expr == NULL) {
-			spn_object_release(ast);
 			return NULL;
 		}
 
-		ast_push_child_xfer(ast, expr);
+		ast_push_child(p, ast, expr);
 
 		/* comma ',' or closing bracket ']' must follow */
 		if (accept_token_string(p, ",") == NULL && !is_at_token(p, "]")) {
 			parser_error(p, "expecting ',' or ']' after array element", NULL);
-			spn_object_release(ast);
 			return NULL;
 		}
 	}
@@ -1130,37 +1100,28 @@ static SpnHashMap *parse_array_literal(SpnParser *p)
 	return ast;
 }
 
-static void set_object_member_name_if_function(SpnHashMap *key, SpnHashMap *val)
+static void set_object_member_name_if_function(SpnAst *key, SpnAst *val)
 {
-	/* first, check if the key is a string literal */
-	const char *keytype;
-	SpnValue keyval;
-	SpnValue keytype_val = spn_hashmap_get_strkey(key, "type");
-
-	assert(isstring(&keytype_val));
-	keytype = stringvalue(&keytype_val)->cstr;
-
 	/* if key is not a literal, it can't be a string literal */
-	if (strcmp(keytype, "literal") != 0) {
+	if (strcmp(key->type, "literal") != 0) {
 		return;
 	}
 
 	/* if the value of the literal is not a string,
 	 * then the value is not a string literal either
 	 */
-	keyval = spn_hashmap_get_strkey(key, "value");
-	if (!isstring(&keyval)) {
+	if (!isstring(&key->value)) {
 		return;
 	}
 
 	/* but if it is a string literal, _and_ the value
 	 * is a function literal, then lets set its name.
 	 */
-	set_name_if_is_function(val, keyval);
+	set_name_if_is_function(val, key->value);
 }
 
 /* parse a key in a hashmap literal */
-static SpnHashMap *parse_hashmap_key(SpnParser *p)
+static SpnAst *parse_hashmap_key(SpnParser *p)
 {
 	/* first, check if it's a single identifier;
 	 * if so, transform it into a string literal.
@@ -1171,51 +1132,46 @@ static SpnHashMap *parse_hashmap_key(SpnParser *p)
 	if (ident && colon
 	 && ident->type == SPN_TOKEN_WORD
 	 && colon->type == SPN_TOKEN_PUNCT
-	 && strcmp(colon->value, ":") == 0) {
+	 && spn_token_equals(colon, ":")) {
 		/* skip identifier */
 		accept_token_type(p, SPN_TOKEN_WORD);
 
 		/* extract identifier into string literal */
-		return ident_to_string(ident);
+		return ident_to_string(p, ident);
 	}
 
 	/* otherwise, fall back to parsing a generic expression */
 	return parse_expr(p);
 }
 
-static SpnHashMap *parse_hashmap_literal(SpnParser *p)
+static SpnAst *parse_hashmap_literal(SpnParser *p)
 {
-	SpnHashMap *ast;
+	SpnAst *ast;
 	SpnToken *lbrace = accept_token_string(p, "{");
 
 	assert(lbrace != NULL);
 
-	ast = ast_new("hashmap", lbrace->location);
+	ast = ast_new(p, "hashmap", lbrace->location);
 
 	while (!accept_token_string(p, "}")) {
-		SpnHashMap *key, *val, *pair;
+		SpnAst *key, *val, *pair;
 		SpnToken *colon;
 
 		/* parse key */
 		key = parse_hashmap_key(p);
 		if (key == NULL) {
-			spn_object_release(ast);
 			return NULL;
 		}
 
 		/* expect key-value delimiter */
 		if ((colon = accept_token_string(p, ":")) == NULL) {
 			parser_error(p, "expecting ':' between hashmap key and value", NULL);
-			spn_object_release(key);
-			spn_object_release(ast);
 			return NULL;
 		}
 
 		/* parse value */
 		val = parse_expr(p);
 		if (val == NULL) {
-			spn_object_release(key);
-			spn_object_release(ast);
 			return NULL;
 		}
 
@@ -1223,15 +1179,14 @@ static SpnHashMap *parse_hashmap_literal(SpnParser *p)
 		set_object_member_name_if_function(key, val);
 
 		/* construct key-value pair */
-		pair = ast_new("kvpair", colon->location);
-		ast_set_child_xfer(pair, "key", key);
-		ast_set_child_xfer(pair, "value", val);
-		ast_push_child_xfer(ast, pair);
+		pair = ast_new(p, "kvpair", colon->location);
+		ast_set_child(pair, SPN_AST_KEY, key);
+		ast_set_child(pair, SPN_AST_VALUE, val);
+		ast_push_child(p, ast, pair);
 
 		/* comma ',' or closing brace '}' must follow */
 		if (accept_token_string(p, ",") == NULL && !is_at_token(p, "}")) {
 			parser_error(p, "expecting ',' or '}' after key-value pair", NULL);
-			spn_object_release(ast); /* this frees ast and param */
 			return NULL;
 		}
 	}
@@ -1250,14 +1205,12 @@ static SpnArray *parse_decl_args(SpnParser *p)
 
 static void emit_param_name_reserved_error(SpnParser *p, SpnToken *argname)
 {
-	const void *args[1];
-	args[0] = argname->value;
-	parser_error(p, "'%s' is a keyword and cannot be a parameter name", args);
+	token_error(p, "'%s' is a keyword and cannot be a parameter name", argname);
 }
 
-static void push_param_name(SpnArray *array, SpnToken *argname)
+static void push_param_name(SpnParser *p, SpnArray *array, SpnToken *argname)
 {
-	SpnValue argname_val = makestring(argname->value);
+	SpnValue argname_val = token_to_name(p, argname);
 	spn_array_push(array, &argname_val);
 	spn_value_release(&argname_val);
 }
@@ -1273,13 +1226,13 @@ static SpnArray *parse_decl_args_oldstyle(SpnParser *p)
 	accept_token_string(p, "(");
 
 	while ((param_name = accept_token_type(p, SPN_TOKEN_WORD)) != NULL) {
-		if (spn_token_is_reserved(param_name->value)) {
+		if (is_reserved(param_name)) {
 			emit_param_name_reserved_error(p, param_name);
 			spn_object_release(array);
 			return NULL;
 		}
 
-		push_param_name(array, param_name);
+		push_param_name(p, array, param_name);
 
 		/* comma ',' or closing parenthesis ')' must follow */
 		comma = accept_token_string(p, ",");
@@ -1311,27 +1264,27 @@ static SpnArray *parse_decl_args_newstyle(SpnParser *p)
 	SpnToken *argname;
 
 	while ((argname = accept_token_type(p, SPN_TOKEN_WORD)) != NULL) {
-		if (spn_token_is_reserved(argname->value)) {
+		if (is_reserved(argname)) {
 			emit_param_name_reserved_error(p, argname);
 			spn_object_release(array);
 			return NULL;
 		}
 
-		push_param_name(array, argname);
+		push_param_name(p, array, argname);
 	}
 
 	return array;
 }
 
-static SpnHashMap *parse_binexpr_rightassoc(
+static SpnAst *parse_binexpr_rightassoc(
 	SpnParser *p,
 	const TokenAndNode tokens[],
 	size_t n,
-	SpnHashMap *(*subexpr)(SpnParser *)
+	SpnAst *(*subexpr)(SpnParser *)
 )
 {
 	size_t index;
-	SpnHashMap *left, *right, *node;
+	SpnAst *left, *right, *node;
 	SpnToken *op;
 
 	left = subexpr(p);
@@ -1348,45 +1301,43 @@ static SpnHashMap *parse_binexpr_rightassoc(
 	right = parse_binexpr_rightassoc(p, tokens, n, subexpr);
 
 	if (right == NULL) { /* error */
-		spn_object_release(left);
 		return NULL;
 	}
 
-	node = ast_new(tokens[index].node, op->location);
-	ast_set_child_xfer(node, "left", left);
-	ast_set_child_xfer(node, "right", right);
+	node = ast_new(p, tokens[index].node, op->location);
+	ast_set_child(node, SPN_AST_LEFT, left);
+	ast_set_child(node, SPN_AST_RIGHT, right);
 
 	return node;
 }
 
-static SpnHashMap *parse_binexpr_leftassoc(
+static SpnAst *parse_binexpr_leftassoc(
 	SpnParser *p,
 	const TokenAndNode tokens[],
 	size_t n,
-	SpnHashMap *(*subexpr)(SpnParser *)
+	SpnAst *(*subexpr)(SpnParser *)
 )
 {
 	size_t index;
 	SpnToken *op;
 
-	SpnHashMap *ast = subexpr(p);
+	SpnAst *ast = subexpr(p);
 	if (ast == NULL) { /* error */
 		return NULL;
 	}
 
 	/* iteration instead of left recursion (which wouldn't terminate) */
 	while ((op = accept_multi(p, tokens, n, &index)) != NULL) {
-		SpnHashMap *tmp;
-		SpnHashMap *right = subexpr(p);
+		SpnAst *tmp;
+		SpnAst *right = subexpr(p);
 
 		if (right == NULL) {
-			spn_object_release(ast);
 			return NULL;
 		}
 
-		tmp = ast_new(tokens[index].node, op->location);
-		ast_set_child_xfer(tmp, "left", ast);
-		ast_set_child_xfer(tmp, "right", right);
+		tmp = ast_new(p, tokens[index].node, op->location);
+		ast_set_child(tmp, SPN_AST_LEFT, ast);
+		ast_set_child(tmp, SPN_AST_RIGHT, right);
 
 		ast = tmp;
 	}
@@ -1394,16 +1345,16 @@ static SpnHashMap *parse_binexpr_leftassoc(
 	return ast;
 }
 
-static SpnHashMap *parse_binexpr_noassoc(
+static SpnAst *parse_binexpr_noassoc(
 	SpnParser *p,
 	const TokenAndNode tokens[],
 	size_t n,
-	SpnHashMap *(*subexpr)(SpnParser *)
+	SpnAst *(*subexpr)(SpnParser *)
 )
 {
 	size_t index;
 	SpnToken *op;
-	SpnHashMap *left, *right, *top;
+	SpnAst *left, *right, *top;
 
 	left = subexpr(p);
 	if (left == NULL) { /* error */
@@ -1417,13 +1368,12 @@ static SpnHashMap *parse_binexpr_noassoc(
 
 	right = subexpr(p);
 	if (right == NULL) { /* error */
-		spn_object_release(left);
 		return NULL;
 	}
 
-	top = ast_new(tokens[index].node, op->location);
-	ast_set_child_xfer(top, "left", left);
-	ast_set_child_xfer(top, "right", right);
+	top = ast_new(p, tokens[index].node, op->location);
+	ast_set_child(top, SPN_AST_LEFT, left);
+	ast_set_child(top, SPN_AST_RIGHT, right);
 
 	return top;
 }
@@ -1432,9 +1382,9 @@ static SpnHashMap *parse_binexpr_noassoc(
  * Statements *
  **************/
 
-static SpnHashMap *parse_if(SpnParser *p)
+static SpnAst *parse_if(SpnParser *p)
 {
-	SpnHashMap *cond, *br_then, *br_else, *ast;
+	SpnAst *cond, *br_then, *br_else, *ast;
 
 	/* skip 'if' */
 	SpnToken *token = accept_token_string(p, "if");
@@ -1447,7 +1397,6 @@ static SpnHashMap *parse_if(SpnParser *p)
 
 	br_then = parse_block_expecting(p, "if statement");
 	if (br_then == NULL) {
-		spn_object_release(cond);
 		return NULL;
 	}
 
@@ -1466,33 +1415,29 @@ static SpnHashMap *parse_if(SpnParser *p)
 			br_else = parse_if(p);
 		} else {
 			parser_error(p, "expecting block or 'if' in 'else' branch", NULL);
-			spn_object_release(cond);
-			spn_object_release(br_then);
 			return NULL;
 		}
 
 		if (br_else == NULL) { /* error while parsing 'else' clause */
-			spn_object_release(cond);
-			spn_object_release(br_then);
 			return NULL;
 		}
 	}
 
-	ast = ast_new("if", token->location);
+	ast = ast_new(p, "if", token->location);
 
-	ast_set_child_xfer(ast, "cond", cond);
-	ast_set_child_xfer(ast, "then", br_then);
+	ast_set_child(ast, SPN_AST_COND, cond);
+	ast_set_child(ast, SPN_AST_THEN, br_then);
 
 	if (br_else) {
-		ast_set_child_xfer(ast, "else", br_else);
+		ast_set_child(ast, SPN_AST_ELSE, br_else);
 	}
 
 	return ast;
 }
 
-static SpnHashMap *parse_while(SpnParser *p)
+static SpnAst *parse_while(SpnParser *p)
 {
-	SpnHashMap *cond, *body, *ast;
+	SpnAst *cond, *body, *ast;
 
 	/* skip 'while' */
 	SpnToken *token = accept_token_string(p, "while");
@@ -1505,19 +1450,18 @@ static SpnHashMap *parse_while(SpnParser *p)
 
 	body = parse_block_expecting(p, "body of while loop");
 	if (body == NULL) {
-		spn_object_release(cond);
 		return NULL;
 	}
 
-	ast = ast_new("while", token->location);
-	ast_set_child_xfer(ast, "cond", cond);
-	ast_set_child_xfer(ast, "body", body);
+	ast = ast_new(p, "while", token->location);
+	ast_set_child(ast, SPN_AST_COND, cond);
+	ast_set_child(ast, SPN_AST_BODY, body);
 	return ast;
 }
 
-static SpnHashMap *parse_do(SpnParser *p)
+static SpnAst *parse_do(SpnParser *p)
 {
-	SpnHashMap *cond, *body, *ast;
+	SpnAst *cond, *body, *ast;
 
 	/* skip 'do' */
 	SpnToken *token = accept_token_string(p, "do");
@@ -1531,39 +1475,35 @@ static SpnHashMap *parse_do(SpnParser *p)
 	/* expect "while expr;" */
 	if (accept_token_string(p, "while") == NULL) {
 		parser_error(p, "expecting 'while' after body of do-while loop", NULL);
-		spn_object_release(body);
 		return NULL;
 	}
 
 	cond = parse_expr(p);
 	if (cond == NULL) {
-		spn_object_release(body);
 		return NULL;
 	}
 
 	if (accept_token_string(p, ";") == NULL) {
 		parser_error(p, "expecting ';' after condition of do-while loop", NULL);
-		spn_object_release(body);
-		spn_object_release(cond);
 		return NULL;
 	}
 
-	ast = ast_new("do", token->location);
-	ast_set_child_xfer(ast, "cond", cond);
-	ast_set_child_xfer(ast, "body", body);
+	ast = ast_new(p, "do", token->location);
+	ast_set_child(ast, SPN_AST_COND, cond);
+	ast_set_child(ast, SPN_AST_BODY, body);
 	return ast;
 }
 
-static SpnHashMap *parse_for(SpnParser *p)
+static SpnAst *parse_for(SpnParser *p)
 {
-	SpnHashMap *ast, *cond, *incr, *body;
+	SpnAst *ast, *cond, *incr, *body;
 	int parens = 0;
 
 	/* skip 'for' */
 	SpnToken *token = accept_token_string(p, "for");
 	assert(token != NULL);
 
-	ast = ast_new("for", token->location);
+	ast = ast_new(p, "for", token->location);
 
 	if (accept_token_string(p, "(")) {
 		parens = 1;
@@ -1571,71 +1511,63 @@ static SpnHashMap *parse_for(SpnParser *p)
 
 	/* the initialization may be either an expression or a declaration */
 	if (is_at_token(p, "var") || is_at_token(p, "let")) {
-		SpnHashMap *init = parse_vardecl(p);
+		SpnAst *init = parse_vardecl(p);
 
 		if (init == NULL) {
-			spn_object_release(ast);
 			return NULL;
 		}
 
-		ast_set_child_xfer(ast, "init", init);
+		ast_set_child(ast, SPN_AST_INIT, init);
 	} else {
-		SpnHashMap *init = parse_expr(p);
+		SpnAst *init = parse_expr(p);
 
 		if (init == NULL) {
-			spn_object_release(ast);
 			return NULL;
 		}
 
-		ast_set_child_xfer(ast, "init", init);
+		ast_set_child(ast, SPN_AST_INIT, init);
 
 		if (accept_token_string(p, ";") == NULL) {
 			parser_error(p, "expecting ';' after initialization of for loop", NULL);
-			spn_object_release(ast);
 			return NULL;
 		}
 	}
 
 	cond = parse_expr(p);
 	if (cond == NULL) {
-		spn_object_release(ast);
 		return NULL;
 	}
 
-	ast_set_child_xfer(ast, "cond", cond);
+	ast_set_child(ast, SPN_AST_COND, cond);
 
 	if (accept_token_string(p, ";") == NULL) {
 		parser_error(p, "expecting ';' after condition of for loop", NULL);
-		spn_object_release(ast);
 		return NULL;
 	}
 
 	incr = parse_expr(p);
 	if (incr == NULL) {
-		spn_object_release(ast);
 		return NULL;
 	}
 
-	ast_set_child_xfer(ast, "increment", incr);
+	ast_set_child(ast, SPN_AST_INCREMENT, incr);
 
 	if (parens && accept_token_string(p, ")") == NULL) {
 		parser_error(p, "expecting ')' after for loop header", NULL);
-		spn_object_release(ast);
 		return NULL;
 	}
 
 	body = parse_block_expecting(p, "body of for loop");
 	if (body == NULL) {
-		spn_object_release(ast);
 		return NULL;
 	}
 
-	ast_set_child_xfer(ast, "body", body);
+	ast_set_child(ast, SPN_AST_BODY, body);
 
 	return ast;
 }
 
-static SpnHashMap *parse_break(SpnParser *p)
+static SpnAst *parse_break(SpnParser *p)
 {
 	/* skip 'break' */
 	SpnToken *token = accept_token_string(p, "break");
@@ -1644,10 +1576,10 @@ static SpnHashMap *parse_break(SpnParser *p)
 	/* eat semicolon, if any */
 	accept_token_string(p, ";");
 
-	return ast_new("break", token->location);
+	return ast_new(p, "break", token->location);
 }
 
-static SpnHashMap *parse_continue(SpnParser *p)
+static SpnAst *parse_continue(SpnParser *p)
 {
 	/* skip 'continue' */
 	SpnToken *token = accept_token_string(p, "continue");
@@ -1656,19 +1588,19 @@ static SpnHashMap *parse_continue(SpnParser *p)
 	/* eat semicolon if any */
 	accept_token_string(p, ";");
 
-	return ast_new("continue", token->location);
+	return ast_new(p, "continue", token->location);
 }
 
-static SpnHashMap *parse_return(SpnParser *p)
+static SpnAst *parse_return(SpnParser *p)
 {
-	SpnHashMap *expr, *ast;
+	SpnAst *expr, *ast;
 
 	/* skip 'return' */
 	SpnToken *token = accept_token_string(p, "return");
 	assert(token != NULL);
 
 	if (accept_token_string(p, ";")) {
-		return ast_new("return", token->location); /* return without value */
+		return ast_new(p, "return", token->location); /* return without value */
 	}
 
 	expr = parse_expr(p);
@@ -1678,53 +1610,48 @@ static SpnHashMap *parse_return(SpnParser *p)
 
 	if (accept_token_string(p, ";") == NULL) {
 		parser_error(p, "expecting ';' after expression in return statement", NULL);
-		spn_object_release(expr);
 		return NULL;
 	}
 
-	ast = ast_new("return", token->location);
-	ast_set_child_xfer(ast, "expr", expr);
+	ast = ast_new(p, "return", token->location);
+	ast_set_child(ast, SPN_AST_EXPR, expr);
 	return ast;
 }
 
 /* this builds a link list of comma-separated variable declarations */
-static SpnHashMap *parse_vardecl(SpnParser *p)
+static SpnAst *parse_vardecl(SpnParser *p)
 {
 	/* 'ast' is the head of the list */
-	SpnHashMap *ast;
+	SpnAst *ast;
 
 	/* skip "var" or "let" keyword */
 	int is_at_var = is_at_token(p, "var");
 	SpnToken *var = accept_token_string(p, is_at_var ? "var" : "let");
 	assert(var != NULL);
 
-	ast = ast_new("vardecl", var->location);
+	ast = ast_new(p, "vardecl", var->location);
 
 	do {
 		/* 'expr' is the optional initializer expression
 		 * 'child' is the node that actually contains the identifier
 		 * and the initialization expression.
 		 */
-		SpnHashMap *expr = NULL, *child;
+		SpnAst *expr = NULL, *child;
 		SpnToken *ident = accept_token_type(p, SPN_TOKEN_WORD);
 		SpnValue identval;
 
 		if (ident == NULL) {
 			parser_error(p, "expected identifier in variable declaration", NULL);
-			spn_object_release(ast);
 			return NULL;
 		}
 
 		/* reserved keywords can't be used as variable or function names */
-		if (spn_token_is_reserved(ident->value)) {
-			const void *args[1];
-			args[0] = ident->value;
-			parser_error(p, "'%s' is a keyword and cannot be a variable name", args);
-			spn_object_release(ast);
+		if (is_reserved(ident)) {
+			token_error(p, "'%s' is a keyword and cannot be a variable name", ident);
 			return NULL;
 		}
 
-		identval = makestring(ident->value);
+		identval = token_to_name(p, ident);
 
 		/* the initializer expression is optional */
 		if (accept_token_string(p, "=")) {
@@ -1732,7 +1659,6 @@ static SpnHashMap *parse_vardecl(SpnParser *p)
 
 			if (expr == NULL) {
 				spn_value_release(&identval);
-				spn_object_release(ast);
 				return NULL;
 			}
 
@@ -1743,83 +1669,75 @@ static SpnHashMap *parse_vardecl(SpnParser *p)
 		}
 
 		/* set up single variable declaration node... */
-		child = ast_new("variable", ident->location);
-		ast_set_property(child, "name", &identval);
+		child = ast_new(p, "variable", ident->location);
+		spn_ast_set_name(child, &identval);
 
 		spn_value_release(&identval);
 
 		if (expr) {
-			ast_set_child_xfer(child, "init", expr);
+			ast_set_child(child, SPN_AST_INIT, expr);
 		}
 
 		/* ...and add it to the parent */
-		ast_push_child_xfer(ast, child);
+		ast_push_child(p, ast, child);
 	} while (accept_token_string(p, ","));
 
 	if (accept_token_string(p, ";") == NULL) {
 		parser_error(p, "expected ';' after variable declaration", NULL);
-		spn_object_release(ast);
 		return NULL;
 	}
 
 	return ast;
 }
 
-static SpnHashMap *parse_extern(SpnParser *p)
+static SpnAst *parse_extern(SpnParser *p)
 {
-	SpnHashMap *ast;
+	SpnAst *ast;
 
 	/* skip "extern" keyword */
 	SpnToken *token = accept_token_string(p, "extern");
 	assert(token != NULL);
 
-	ast = ast_new("constdecl", token->location);
+	ast = ast_new(p, "constdecl", token->location);
 
 	do {
-		SpnHashMap *expr, *child;
+		SpnAst *expr, *child;
 		SpnValue identval;
 		SpnToken *ident = accept_token_type(p, SPN_TOKEN_WORD);
 
 		if (ident == NULL) {
 			parser_error(p, "expected identifier in extern declaration", NULL);
-			spn_object_release(ast);
 			return NULL;
 		}
 
-		if (spn_token_is_reserved(ident->value)) {
-			const void *args[1];
-			args[0] = ident->value;
-			parser_error(p, "'%s' is a keyword and cannot be the name of a global", args);
-			spn_object_release(ast);
+		if (is_reserved(ident)) {
+			token_error(p, "'%s' is a keyword and cannot be the name of a global", ident);
 			return NULL;
 		}
 
 		if (accept_token_string(p, "=") == NULL) {
 			parser_error(p, "expected '=' after name of extern declaration", NULL);
-			spn_object_release(ast);
 			return NULL;
 		}
 
 		expr = parse_expr(p);
 		if (expr == NULL) {
-			spn_object_release(ast);
 			return NULL;
 		}
 
-		identval = makestring(ident->value);
-		child = ast_new("constant", ident->location);
+		identval = token_to_name(p, ident);
+		child = ast_new(p, "constant", ident->location);
 
 		set_name_if_is_function(expr, identval);
-		ast_set_property(child, "name", &identval);
-		ast_set_child_xfer(child, "init", expr);
-		ast_push_child_xfer(ast, child);
+		spn_ast_set_name(child, &identval);
+		ast_set_child(child, SPN_AST_INIT, expr);
+		ast_push_child(p, ast, child);
 
 		spn_value_release(&identval);
 	} while (accept_token_string(p, ","));
 
 	if (accept_token_string(p, ";") == NULL) {
 		parser_error(p, "expected ';' after global initialization", NULL);
-		spn_object_release(ast);
 		return NULL;
 	}
 
@@ -1827,11 +1745,10 @@ static SpnHashMap *parse_extern(SpnParser *p)
 }
 
 /* function statement */
-static SpnHashMap *parse_fnstmt(SpnParser *p)
+static SpnAst *parse_fnstmt(SpnParser *p)
 {
-	SpnHashMap *fnexpr, *body, *ast, *var;
+	SpnAst *fnexpr, *body, *ast, *var;
 	SpnArray *declargs;
-	SpnValue declargsval;
 	SpnToken *token = accept_token_string(p, "fn");
 	SpnToken *name = accept_token_type(p, SPN_TOKEN_WORD);
 	SpnValue nameval;
@@ -1845,10 +1762,8 @@ static SpnHashMap *parse_fnstmt(SpnParser *p)
 	}
 
 	/* make sure it's not a reserved keyword */
-	if (spn_token_is_reserved(name->value)) {
-		const void *args[1];
-		args[0] = name->value;
-		parser_error(p, "keyword '%s' cannot be used as a function name", args);
+	if (is_reserved(name)) {
+		token_error(p, "keyword '%s' cannot be used as a function name", name);
 		return NULL;
 	}
 
@@ -1858,9 +1773,6 @@ static SpnHashMap *parse_fnstmt(SpnParser *p)
 		return NULL;
 	}
 
-	declargsval.type = SPN_TYPE_ARRAY;
-	declargsval.v.o = declargs;
-
 	/* parse function body */
 	body = parse_block_expecting(p, "function body");
 
@@ -1869,54 +1781,53 @@ static SpnHashMap *parse_fnstmt(SpnParser *p)
 		return NULL;
 	}
 
-	nameval = makestring(name->value);
+	nameval = token_to_name(p, name);
 
 	/* build function expression */
-	fnexpr = ast_new("function", token->location);
+	fnexpr = ast_new(p, "function", token->location);
 
-	ast_set_property(fnexpr, "declargs", &declargsval);
-	ast_set_property(fnexpr, "name", &nameval);
-	ast_set_child_xfer(fnexpr, "body", body);
+	spn_ast_set_declargs(fnexpr, declargs);
+	spn_ast_set_name(fnexpr, &nameval);
+	ast_set_child(fnexpr, SPN_AST_BODY, body);
 
 	/* variable name is the same as the name of the function */
-	var = ast_new("variable", name->location);
-	ast_set_property(var, "name", &nameval);
+	var = ast_new(p, "variable", name->location);
+	spn_ast_set_name(var, &nameval);
 
 	/* relinquish ownership of values */
-	spn_value_release(&declargsval);
+	spn_object_release(declargs);
 	spn_value_release(&nameval);
 
 	/* initializer of the variable is the function expression */
-	ast_set_child_xfer(var, "init", fnexpr);
+	ast_set_child(var, SPN_AST_INIT, fnexpr);
 
 	/* the declaration statement has only one child (variable) */
-	ast = ast_new("vardecl", token->location);
-	ast_push_child_xfer(ast, var);
+	ast = ast_new(p, "vardecl", token->location);
+	ast_push_child(p, ast, var);
 
 	return ast;
 }
 
-static SpnHashMap *parse_expr_stmt(SpnParser *p)
+static SpnAst *parse_expr_stmt(SpnParser *p)
 {
-	SpnHashMap *ast = parse_expr(p);
+	SpnAst *ast = parse_expr(p);
 	if (ast == NULL) {
 		return NULL;
 	}
 
 	if (accept_token_string(p, ";") == NULL) {
 		parser_error(p, "expected ';' after expression", NULL);
-		spn_object_release(ast);
 		return NULL;
 	}
 
 	return ast;
 }
 
-static SpnHashMap *parse_empty(SpnParser *p)
+static SpnAst *parse_empty(SpnParser *p)
 {
 	/* skip semicolon */
 	SpnToken *semicolon = accept_token_string(p, ";");
 	assert(semicolon != NULL);
 
-	return ast_new("empty", semicolon->location);
+	return ast_new(p, "empty", semicolon->location);
 }
@@ -15,18 +15,23 @@
 #include "api.h"
 #include "lex.h"
 #include "hashmap.h"
+#include "ast.h"
+#include "str.h"
 
 /* a parser object takes a string (Sparkling source code) and parses it
- * to an abstract syntax tree (nodes composed of SpnHashMap objects).
+ * to an abstract syntax tree (native nodes, see ast.h, which can be
+ * converted to SpnHashMap objects).
  */
 
 typedef struct SpnParser {
-	SpnLexer lexer;     /* private */
-	SpnToken *tokens;   /* private */
-	size_t num_toks;    /* private */
-	size_t cursor;      /* private */
-	int error;          /* private */
-	char *errmsg;       /* public: the last error message */
+	SpnLexer lexer;       /* private */
+	SpnToken *tokens;     /* private */
+	size_t num_toks;      /* private */
+	size_t cursor;        /* private */
+	int error;            /* private */
+	SpnAstArena arena;    /* private */
+	SpnInternTable names; /* private */
+	char *errmsg;         /* public: the last error message */
 } SpnParser;
 
 
@@ -43,6 +48,13 @@ SPN_API SpnHashMap *spn_parser_parse(SpnParser *p, const char *src);
  */
 SPN_API SpnHashMap *spn_parser_parse_expression(SpnParser *p, const char *src);
 
+/* the same as the two functions above, but they return the native AST.
+ * It is owned by the parser and it is valid until the next call to
+ * any of the parsing functions, or until the parser is freed.
+ */
+SPN_API SpnAst *spn_parser_parse_ast(SpnParser *p, const char *src);
+SPN_API SpnAst *spn_parser_parse_expression_ast(SpnParser *p, const char *src);
+
 SPN_API SpnSourceLocation spn_parser_get_error_location(SpnParser *p);
 
 #endif /* SPN_PARSER_H */
@@ -0,0 +1,522 @@
+/*
+ * pool.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Size-class pool allocator for objects and small buffers
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+
+#if USE_THREADS
+#include <pthread.h>
+#endif /* USE_THREADS */
+
+#include "pool.h"
+#include "private.h"
+
+
+#define POOL_NCLASSES  (SPN_POOL_MAXSIZE / SPN_POOL_GRANULE)
+#define POOL_SLABSIZE  (16 * 1024)
+
+/* a free block is linked into the free list of its size class.
+ * The other members only enforce maximal alignment.
+ */
+typedef union PoolBlock {
+	union PoolBlock *next;
+	long l;
+	double d;
+	void *p;
+} PoolBlock;
+
+/* slabs are kept in a list so that they remain reachable; they are
+ * never returned to the system, but their blocks are recycled.
+ * The first granule of each slab is reserved for this header, so
+ * blocks keep the (16-byte) alignment of the slab returned by malloc().
+ */
+typedef struct PoolSlab {
+	struct PoolSlab *next;
+} PoolSlab;
+
+/* the statistics of classes with a UID less than this are kept in an
+ * array indexed by UID; this covers the classes of the Sparkling core
+ */
+#define POOL_NCORESTATS 16
+
+/* 'nlive' is the number of blocks allocated minus the number of blocks
+ * freed through this pool. Blocks may be freed into a pool other than the
+ * one which allocated them, so the count of a pool may well wrap around.
+ * The same goes for the heap statistics of objects. The statistics of
+ * classes with greater UIDs are kept in 'userstats', in no particular
+ * order. There are usually only a few such classes. 'allocator' is NULL
+ * if the pool carves blocks out of its own slabs.
+ */
+typedef struct Pool {
+	PoolBlock *freelist[POOL_NCLASSES];
+	PoolSlab *slabs;
+	const SpnAllocator *allocator;
+	size_t nlive;
+	SpnHeapStat corestats[POOL_NCORESTATS];
+	SpnHeapStat *userstats;
+	size_t nuserstats;
+	size_t capuserstats;
+} Pool;
+
+/* the pool of every thread without an arena. It also adopts the memory
+ * of freed arenas, and it's protected by 'shared_lock'.
+ */
+static Pool shared_pool;
+
+static void *shared_alloc(void *ud, size_t size);
+static void shared_dealloc(void *ud, void *ptr, size_t size);
+
+const SpnAllocator spn_pool_builtin = {
+	shared_alloc,
+	shared_dealloc,
+	NULL
+};
+
+#if USE_THREADS
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Arenas are found via thread-specific data. Until the first arena is
+ * created, every allocation goes to the shared pool without asking.
+ */
+static int threaded = 0;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void create_arena_key(void)
+{
+	if (pthread_key_create(&arena_key, NULL) != 0) {
+		spn_die("cannot create the thread-specific key of pool arenas");
+	}
+
+	threaded = 1;
+}
+
+#else /* USE_THREADS */
+
+static Pool *cur_arena = NULL;
+
+#endif /* USE_THREADS */
+
+/* returns the current arena, or locks and returns the shared pool */
+static Pool *acquire_pool(void)
+{
+#if USE_THREADS
+	if (threaded) {
+		Pool *pool = pthread_getspecific(arena_key);
+		if (pool != NULL) {
+			return pool;
+		}
+	}
+
+	pthread_mutex_lock(&shared_lock);
+	return &shared_pool;
+#else /* USE_THREADS */
+	return cur_arena != NULL ? cur_arena : &shared_pool;
+#endif /* USE_THREADS */
+}
+
+static void release_pool(Pool *pool)
+{
+#if USE_THREADS
+	if (pool == &shared_pool) {
+		pthread_mutex_unlock(&shared_lock);
+	}
+#endif /* USE_THREADS */
+}
+
+#if USE_POOL_ALLOCATOR
+
+/* carves a new slab into blocks of size class 'cls' */
+static int refill(Pool *pool, size_t cls)
+{
+	size_t blksz = (cls + 1) * SPN_POOL_GRANULE;
+	size_t nblocks = (POOL_SLABSIZE - SPN_POOL_GRANULE) / blksz;
+	char *base;
+	size_t i;
+
+	PoolSlab *slab = malloc(POOL_SLABSIZE);
+	if (slab == NULL) {
+		return -1;
+	}
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	/* thread blocks in address order */
+	base = (char *)(slab) + SPN_POOL_GRANULE;
+	for (i = nblocks; i > 0; i--) {
+		PoolBlock *blk = (PoolBlock *)(base + (i - 1) * blksz);
+		blk->next = pool->freelist[cls];
+		pool->freelist[cls] = blk;
+	}
+
+	return 0;
+}
+
+static void *builtin_alloc(Pool *pool, size_t size)
+{
+	PoolBlock *blk;
+	size_t cls;
+
+	if (size > SPN_POOL_MAXSIZE) {
+		return malloc(size);
+	}
+
+	cls = size > 0 ? (size - 1) / SPN_POOL_GRANULE : 0;
+
+	if (pool->freelist[cls] == NULL && refill(pool, cls) != 0) {
+		return NULL;
+	}
+
+	blk = pool->freelist[cls];
+	pool->freelist[cls] = blk->next;
+	return blk;
+}
+
+static void builtin_dealloc(Pool *pool, void *ptr, size_t size)
+{
+	PoolBlock *blk = ptr;
+	size_t cls;
+
+	if (size > SPN_POOL_MAXSIZE) {
+		free(ptr);
+		return;
+	}
+
+	cls = size > 0 ? (size - 1) / SPN_POOL_GRANULE : 0;
+	blk->next = pool->freelist[cls];
+	pool->freelist[cls] = blk;
+}
+
+#else /* USE_POOL_ALLOCATOR */
+
+static void *builtin_alloc(Pool *pool, size_t size)
+{
+	return malloc(size > 0 ? size : 1);
+}
+
+static void builtin_dealloc(Pool *pool, void *ptr, size_t size)
+{
+	free(ptr);
+}
+
+#endif /* USE_POOL_ALLOCATOR */
+
+static void *shared_alloc(void *ud, size_t size)
+{
+	void *ptr;
+
+#if USE_THREADS
+	pthread_mutex_lock(&shared_lock);
+#endif /* USE_THREADS */
+
+	ptr = builtin_alloc(&shared_pool, size);
+
+#if USE_THREADS
+	pthread_mutex_unlock(&shared_lock);
+#endif /* USE_THREADS */
+
+	return ptr;
+}
+
+static void shared_dealloc(void *ud, void *ptr, size_t size)
+{
+#if USE_THREADS
+	pthread_mutex_lock(&shared_lock);
+#endif /* USE_THREADS */
+
+	builtin_dealloc(&shared_pool, ptr, size);
+
+#if USE_THREADS
+	pthread_mutex_unlock(&shared_lock);
+#endif /* USE_THREADS */
+}
+
+static void *pool_alloc(Pool *pool, size_t size)
+{
+	/* call the built-in allocator directly so that it can be inlined */
+	void *ptr = pool->allocator == NULL
+	          ? builtin_alloc(pool, size)
+	          : pool->allocator->alloc(pool->allocator->ud, size);
+
+	if (ptr == NULL) {
+		unsigned long uln = size;
+		release_pool(pool);
+		spn_die("pool allocation of %lu bytes failed", uln);
+	}
+
+	pool->nlive++;
+	return ptr;
+}
+
+static void pool_free(Pool *pool, void *ptr, size_t size)
+{
+	pool->nlive--;
+
+	if (pool->allocator == NULL) {
+		builtin_dealloc(pool, ptr, size);
+	} else {
+		pool->allocator->dealloc(pool->allocator->ud, ptr, size);
+	}
+}
+
+void *spn_pool_alloc(size_t size)
+{
+	Pool *pool = acquire_pool();
+	void *ptr = pool_alloc(pool, size);
+	release_pool(pool);
+	return ptr;
+}
+
+void spn_pool_free(void *ptr, size_t size)
+{
+	Pool *pool;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	pool = acquire_pool();
+	pool_free(pool, ptr, size);
+	release_pool(pool);
+}
+
+/* Heap statistics
+ * ---------------
+ */
+static SpnHeapStat *class_stat(Pool *pool, unsigned long uid)
+{
+	SpnHeapStat *stat;
+	size_t i;
+
+	if (uid < POOL_NCORESTATS) {
+		return &pool->corestats[uid];
+	}
+
+	for (i = 0; i < pool->nuserstats; i++) {
+		if (pool->userstats[i].UID == uid) {
+			return &pool->userstats[i];
+		}
+	}
+
+	if (pool->nuserstats >= pool->capuserstats) {
+		pool->capuserstats = pool->capuserstats ? 2 * pool->capuserstats : 8;
+		pool->userstats = spn_realloc(pool->userstats, pool->capuserstats * sizeof pool->userstats[0]);
+	}
+
+	stat = &pool->userstats[pool->nuserstats++];
+	stat->UID = uid;
+	stat->nobjs = 0;
+	stat->nbytes = 0;
+	stat->nallocs = 0;
+
+	return stat;
+}
+
+void *spn_pool_allocobj(unsigned long uid, size_t size)
+{
+	Pool *pool = acquire_pool();
+	SpnHeapStat *stat = class_stat(pool, uid);
+	void *ptr;
+
+	stat->nobjs++;
+	stat->nbytes += size;
+	stat->nallocs++;
+
+	ptr = pool_alloc(pool, size);
+	release_pool(pool);
+	return ptr;
+}
+
+void spn_pool_freeobj(void *ptr, unsigned long uid, size_t size)
+{
+	Pool *pool = acquire_pool();
+	SpnHeapStat *stat = class_stat(pool, uid);
+
+	stat->nobjs--;
+	stat->nbytes -= size;
+
+	pool_free(pool, ptr, size);
+	release_pool(pool);
+}
+
+static int compare_stats(const void *lp, const void *rp)
+{
+	const SpnHeapStat *lhs = lp, *rhs = rp;
+	return lhs->UID < rhs->UID ? -1 : lhs->UID > rhs->UID;
+}
+
+/* locks the shared pool if 'arena' is NULL */
+static Pool *lock_arena(SpnPoolArena *arena)
+{
+	if (arena != NULL) {
+		return (Pool *)(arena);
+	}
+
+#if USE_THREADS
+	pthread_mutex_lock(&shared_lock);
+#endif /* USE_THREADS */
+
+	return &shared_pool;
+}
+
+SpnHeapStat *spn_pool_heapstats(SpnPoolArena *arena, size_t *n)
+{
+	Pool *pool = lock_arena(arena);
+	SpnHeapStat *buf = spn_malloc((POOL_NCORESTATS + pool->nuserstats) * sizeof buf[0]);
+	size_t i, nuser, nstats = 0;
+
+	for (i = 0; i < POOL_NCORESTATS; i++) {
+		if (pool->corestats[i].nallocs != 0 || pool->corestats[i].nobjs != 0) {
+			buf[nstats] = pool->corestats[i];
+			buf[nstats].UID = i;
+			nstats++;
+		}
+	}
+
+	nuser = nstats;
+
+	for (i = 0; i < pool->nuserstats; i++) {
+		if (pool->userstats[i].nallocs != 0 || pool->userstats[i].nobjs != 0) {
+			buf[nstats++] = pool->userstats[i];
+		}
+	}
+
+	release_pool(pool);
+
+	qsort(buf + nuser, nstats - nuser, sizeof buf[0], compare_stats);
+
+	*n = nstats;
+	return buf;
+}
+
+size_t spn_pool_nlive(SpnPoolArena *arena)
+{
+	Pool *pool = lock_arena(arena);
+	size_t nlive = pool->nlive;
+	release_pool(pool);
+	return nlive;
+}
+
+/* Arenas
+ * ------
+ */
+SpnPoolArena *spn_pool_newarena(const SpnAllocator *allocator)
+{
+	Pool *arena = spn_malloc(sizeof *arena);
+	size_t i;
+
+	for (i = 0; i < POOL_NCLASSES; i++) {
+		arena->freelist[i] = NULL;
+	}
+
+	arena->slabs = NULL;
+	arena->allocator = allocator != &spn_pool_builtin ? allocator : NULL;
+	arena->nlive = 0;
+
+	for (i = 0; i < POOL_NCORESTATS; i++) {
+		arena->corestats[i].UID = i;
+		arena->corestats[i].nobjs = 0;
+		arena->corestats[i].nbytes = 0;
+		arena->corestats[i].nallocs = 0;
+	}
+
+	arena->userstats = NULL;
+	arena->nuserstats = 0;
+	arena->capuserstats = 0;
+
+	return (SpnPoolArena *)(arena);
+}
+
+const SpnAllocator *spn_pool_allocator(SpnPoolArena *arena)
+{
+	Pool *pool = (Pool *)(arena);
+	return pool->allocator != NULL ? pool->allocator : &spn_pool_builtin;
+}
+
+void spn_pool_setarena(SpnPoolArena *arena)
+{
+#if USE_THREADS
+	if (arena == NULL && !threaded) {
+		return;
+	}
+
+	pthread_once(&arena_key_once, create_arena_key);
+	pthread_setspecific(arena_key, arena);
+#else /* USE_THREADS */
+	cur_arena = (Pool *)(arena);
+#endif /* USE_THREADS */
+}
+
+SpnPoolArena *spn_pool_getarena(void)
+{
+#if USE_THREADS
+	return threaded ? pthread_getspecific(arena_key) : NULL;
+#else /* USE_THREADS */
+	return (SpnPoolArena *)(cur_arena);
+#endif /* USE_THREADS */
+}
+
+void spn_pool_freearena(SpnPoolArena *arena)
+{
+	Pool *pool = (Pool *)(arena);
+	size_t i;
+
+	if (spn_pool_getarena() == arena) {
+		spn_pool_setarena(NULL);
+	}
+
+	lock_arena(NULL);
+
+	/* the slabs and blocks of the arena may still be in use (by objects
+	 * which outlived it), so they are adopted by the shared pool
+	 */
+	for (i = 0; i < POOL_NCLASSES; i++) {
+		PoolBlock *tail = pool->freelist[i];
+
+		if (tail == NULL) {
+			continue;
+		}
+
+		while (tail->next != NULL) {
+			tail = tail->next;
+		}
+
+		tail->next = shared_pool.freelist[i];
+		shared_pool.freelist[i] = pool->freelist[i];
+	}
+
+	while (pool->slabs != NULL) {
+		PoolSlab *slab = pool->slabs;
+		pool->slabs = slab->next;
+		slab->next = shared_pool.slabs;
+		shared_pool.slabs = slab;
+	}
+
+	shared_pool.nlive += pool->nlive;
+
+	for (i = 0; i < POOL_NCORESTATS; i++) {
+		shared_pool.corestats[i].nobjs += pool->corestats[i].nobjs;
+		shared_pool.corestats[i].nbytes += pool->corestats[i].nbytes;
+		shared_pool.corestats[i].nallocs += pool->corestats[i].nallocs;
+	}
+
+	for (i = 0; i < pool->nuserstats; i++) {
+		SpnHeapStat *stat = class_stat(&shared_pool, pool->userstats[i].UID);
+		stat->nobjs += pool->userstats[i].nobjs;
+		stat->nbytes += pool->userstats[i].nbytes;
+		stat->nallocs += pool->userstats[i].nallocs;
+	}
+
+	release_pool(&shared_pool);
+
+	free(pool->userstats);
+	free(pool);
+}
@@ -0,0 +1,117 @@
+/*
+ * pool.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Size-class pool allocator for objects and small buffers
+ */
+
+#ifndef SPN_POOL_H
+#define SPN_POOL_H
+
+#include <stddef.h>
+
+#include "api.h"
+
+/* An allocator hook. Every context has a pool arena of its own (see
+ * below), which obtains object instances (see spn_object_new()) and the
+ * buffers of strings created by copying from its allocator. 'alloc' must
+ * return a block of at least 'size' bytes that is suitably aligned for any
+ * type, or NULL if it is out of memory. 'dealloc' is always called with
+ * the same size that was passed to the corresponding 'alloc' call. 'ud' is
+ * passed to both functions verbatim.
+ */
+typedef struct SpnAllocator {
+	void *(*alloc)(void *ud, size_t size);
+	void (*dealloc)(void *ud, void *ptr, size_t size);
+	void *ud;
+} SpnAllocator;
+
+/* The built-in allocator. If the library was built with USE_POOL_ALLOCATOR
+ * (the default), blocks of up to SPN_POOL_MAXSIZE bytes are carved out of
+ * larger slabs and recycled through per-size-class free lists of the arena;
+ * bigger blocks are passed on to malloc(). Otherwise, it just wraps malloc().
+ * Calling its functions directly allocates from the shared pool (see below).
+ */
+SPN_API const SpnAllocator spn_pool_builtin;
+
+/* size classes are multiples of SPN_POOL_GRANULE bytes */
+#define SPN_POOL_GRANULE 16
+#define SPN_POOL_MAXSIZE 256
+
+/* Arenas. An arena is a set of free lists along with the allocator they
+ * get their memory from, and the statistics of the objects allocated from
+ * it. Each thread has a current arena, which is set by spn_pool_setarena();
+ * a context makes its own arena current on the thread that initializes it
+ * or runs code on it (see ctx.h). Arenas aren't thread-safe, so an arena
+ * must only be current on a single thread at a time. Threads without an
+ * arena use the shared pool, which is protected by a lock.
+ *
+ * Blocks can be freed while another arena is current than the one which
+ * allocated them; they are then put on the free lists of the current one.
+ * Arenas which use the built-in allocator can therefore exchange objects
+ * freely, but the blocks of a custom allocator must be freed while an arena
+ * with the same allocator is current. spn_pool_freearena() gives the memory
+ * of the arena to the shared pool, so the blocks of a custom allocator
+ * must not outlive their arena either.
+ *
+ * 'allocator' may be NULL, which means the built-in one.
+ */
+typedef struct SpnPoolArena SpnPoolArena;
+
+SPN_API SpnPoolArena *spn_pool_newarena(const SpnAllocator *allocator);
+SPN_API void spn_pool_freearena(SpnPoolArena *arena);
+SPN_API const SpnAllocator *spn_pool_allocator(SpnPoolArena *arena);
+
+/* sets or returns the current arena of the calling thread (NULL if it
+ * uses the shared pool)
+ */
+SPN_API void spn_pool_setarena(SpnPoolArena *arena);
+SPN_API SpnPoolArena *spn_pool_getarena(void);
+
+/* allocates a block from the current arena.
+ * Never returns NULL: aborts via spn_die() if the allocator fails.
+ */
+SPN_API void *spn_pool_alloc(size_t size);
+
+/* returns a block to the current arena. 'size' must be the same
+ * as the one that was passed to spn_pool_alloc(). Passing NULL is a no-op.
+ */
+SPN_API void spn_pool_free(void *ptr, size_t size);
+
+/* number of blocks currently allocated from 'arena' (or from the shared
+ * pool if it's NULL). Blocks which have been freed into another arena are
+ * accounted for there, so the count of a single arena may well wrap around.
+ * The counts of an arena are added to those of the shared pool when it's
+ * freed.
+ */
+SPN_API size_t spn_pool_nlive(SpnPoolArena *arena);
+
+/* Heap statistics. Instances of classes are allocated and freed by
+ * spn_object_new() and spn_object_release() using these functions,
+ * which keep count of the live instances of each class (by UID), of
+ * their total size, and of the number of instances ever allocated. The
+ * size is that of the instances (i. e. 'instsz'), it doesn't include the
+ * buffers they own (e. g. the characters of strings or the elements of
+ * arrays).
+ */
+typedef struct SpnHeapStat {
+	unsigned long UID; /* UID of the class                 */
+	size_t nobjs;      /* number of live instances         */
+	size_t nbytes;     /* total size of these instances    */
+	size_t nallocs;    /* number of instances ever created */
+} SpnHeapStat;
+
+SPN_API void *spn_pool_allocobj(unsigned long uid, size_t size);
+SPN_API void spn_pool_freeobj(void *ptr, unsigned long uid, size_t size);
+
+/* returns the statistics of the classes which have had instances in
+ * 'arena' (or in the shared pool if it's NULL), in ascending order of
+ * their UIDs, and sets '*n' to their number. The array must be free()'d
+ * by the caller. Like with spn_pool_nlive(), the objects are accounted
+ * for in the arena that was current when they were allocated or freed.
+ */
+SPN_API SpnHeapStat *spn_pool_heapstats(SpnPoolArena *arena, size_t *n);
+
+#endif /* SPN_POOL_H */
@@ -100,6 +100,7 @@ static const SpnClass SymbolStub_class = {
 	symstub_equal,
 	NULL,
 	symstub_hash,
+	NULL,
 	NULL
 };
 
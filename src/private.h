@@ -41,6 +41,7 @@
 #define typeflag(t)     spn_typeflag(t)
 #define valtype(val)    spn_valtype(val)
 #define valflag(val)    spn_valflag(val)
+#define fulltype(val)   spn_fulltype(val)
 
 #define notnil(val)         spn_notnil(val)
 #define isint(val)          spn_isint(val)
@@ -58,6 +59,8 @@
 #define arrayvalue(val)     spn_arrayvalue(val)
 #define hashmapvalue(val)   spn_hashmapvalue(val)
 #define funcvalue(val)      spn_funcvalue(val)
+#define typedarrayvalue(val) spn_typedarrayvalue(val)
+#define coroutinevalue(val) spn_coroutinevalue(val)
 
 #define makebool(b)             spn_makebool(b)
 #define makeint(i)              spn_makeint(i)
@@ -67,6 +70,7 @@
 #define makenativefunc(n, f)    spn_makenativefunc((n), (f))
 #define makeweakuserinfo(p)     spn_makeweakuserinfo(p)
 #define makestrguserinfo(o)     spn_makestrguserinfo(o)
+#define makeobject(t, o)        spn_makeobject((t), (o))
 #define makeclosure(p)          spn_makeclosure(p)
 
 /* invokes spn_string_new(s) */
@@ -144,7 +148,7 @@ SPN_API SpnValue make_symstub(const char *name);
 SPN_API int is_symstub(const SpnValue *val);
 
 /* yields the symbol stub object of an SpnValue */
-#define symstubvalue(val) ((SymbolStub *)((val)->v.o))
+#define symstubvalue(val) ((SymbolStub *)(objvalue(val)))
 
 /* Dynamic loading support */
 
@@ -0,0 +1,437 @@
+/*
+ * prof.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Profiler for the virtual machine
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif /* _WIN32 */
+
+#include "prof.h"
+#include "str.h"
+#include "debug.h"
+#include "private.h"
+
+
+typedef struct SpnProfFunc {
+	SpnString *label;     /* name and location of the function */
+	unsigned long calls;
+	double incl;          /* seconds, including callees        */
+	double excl;          /* seconds, excluding callees        */
+	int active;           /* activations on the shadow stack   */
+} SpnProfFunc;
+
+typedef struct SpnProfCall {
+	size_t func;          /* index into 'funcs'                */
+	double start;
+	double children;      /* time spent in callees             */
+} SpnProfCall;
+
+/* must be in the same order as the members of 'enum spn_vm_ins' */
+static const char *const opcode_names[] = {
+	"CALL", "RET", "JMP", "JZE", "JNZ",
+	"EQ", "NE", "LT", "LE", "GT", "GE",
+	"ADD", "SUB", "MUL", "DIV", "MOD", "NEG", "INC", "DEC",
+	"AND", "OR", "XOR", "SHL", "SHR", "BITNOT", "LOGNOT",
+	"TYPEOF", "CONCAT", "LDCONST", "LDSYM", "MOV", "ARGV",
+	"NEWARR", "NEWHASH", "IDX_GET", "IDX_SET", "ARR_PUSH",
+	"FUNCTION", "GLBVAL", "CLOSURE", "LDUPVAL",
+	"METHOD", "PROPGET", "PROPSET",
+	"EQ_II", "NE_II", "LT_II", "LE_II", "GT_II", "GE_II",
+	"ADD_II", "SUB_II", "MUL_II", "DIV_II", "INC_I", "DEC_I",
+	"LDGLB", "CONCAT_ALL", "CMPJZE", "CMPJNZ", "CALLMETHOD",
+	"TAILCALL"
+};
+
+/* fails to compile if an instruction is added without a name */
+typedef char opcode_names_complete[COUNT(opcode_names) == SPN_PROF_NOPCODES ? 1 : -1];
+
+volatile sig_atomic_t spn_prof_ticks = 0;
+
+static double prof_now(void)
+{
+#ifdef _WIN32
+	return clock() * 1.0 / CLOCKS_PER_SEC;
+#else /* _WIN32 */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif /* _WIN32 */
+}
+
+void spn_profile_init(SpnProfile *prof, int flags)
+{
+	prof->flags = flags;
+	prof->interval = SPN_PROF_INTERVAL;
+	prof->nsamples = 0;
+	memset(prof->ophist, 0, sizeof prof->ophist);
+
+	prof->funcs = NULL;
+	prof->nfuncs = 0;
+	prof->capfuncs = 0;
+	prof->funcidx = spn_hashmap_new();
+
+	prof->calls = NULL;
+	prof->ncalls = 0;
+	prof->capcalls = 0;
+
+	prof->stacks = spn_hashmap_new();
+}
+
+void spn_profile_free(SpnProfile *prof)
+{
+	size_t i;
+
+	for (i = 0; i < prof->nfuncs; i++) {
+		spn_object_release(prof->funcs[i].label);
+	}
+
+	free(prof->funcs);
+	free(prof->calls);
+	spn_object_release(prof->funcidx);
+	spn_object_release(prof->stacks);
+}
+
+/* Labels
+ * ------
+ *
+ * Script functions are labelled with their name and source location,
+ * e. g. "fib (fib.spn:3)", if debug info is available. Native functions
+ * and programs without debug info only go by their name.
+ */
+static void append_label(SpnStringBuilder *bld, SpnFunction *fn, ptrdiff_t addr)
+{
+	spn_strbuilder_append(bld, fn->name, strlen(fn->name));
+
+	if (!fn->native && fn->env->debug_info != NULL && addr >= 0) {
+		SpnHashMap *debug_info = fn->env->debug_info;
+		SpnSourceLocation loc = spn_dbg_get_raw_source_location(debug_info, addr);
+		const char *fname = spn_dbg_get_filename(debug_info);
+		char linebuf[32];
+
+		if (loc.line > 0) {
+			sprintf(linebuf, ":%u)", loc.line);
+			spn_strbuilder_append(bld, " (", 2);
+			spn_strbuilder_append(bld, fname, strlen(fname));
+			spn_strbuilder_append(bld, linebuf, strlen(linebuf));
+		}
+	}
+}
+
+/* Call counts and times
+ * ---------------------
+ *
+ * Functions are identified by their bytecode, so that all closures
+ * created from the same function are accounted for together. Native
+ * functions don't have any, so their function object is used instead.
+ */
+static size_t function_index(SpnProfile *prof, SpnFunction *fn)
+{
+	SpnValue key = makeweakuserinfo(fn->native ? (void *)(fn) : (void *)(fn->repr.bc));
+	SpnValue idx = spn_hashmap_get(prof->funcidx, &key);
+	SpnStringBuilder bld;
+	SpnProfFunc *stat;
+
+	if (isint(&idx)) {
+		return intvalue(&idx);
+	}
+
+	if (prof->nfuncs >= prof->capfuncs) {
+		prof->capfuncs = prof->capfuncs ? 2 * prof->capfuncs : 16;
+		prof->funcs = spn_realloc(prof->funcs, prof->capfuncs * sizeof prof->funcs[0]);
+	}
+
+	/* name the function by where it's defined, not by where it's
+	 * currently executing; top-level programs are named by the file
+	 */
+	spn_strbuilder_init(&bld, 0);
+
+	if (fn->topprg) {
+		append_label(&bld, fn, -1);
+
+		if (fn->debug_info != NULL) {
+			const char *fname = spn_dbg_get_filename(fn->debug_info);
+			spn_strbuilder_append(&bld, " (", 2);
+			spn_strbuilder_append(&bld, fname, strlen(fname));
+			spn_strbuilder_append(&bld, ")", 1);
+		}
+	} else {
+		append_label(&bld, fn, fn->native ? -1 : fn->repr.bc - fn->env->repr.bc);
+	}
+
+	stat = &prof->funcs[prof->nfuncs];
+	stat->label = spn_strbuilder_tostring(&bld);
+	stat->calls = 0;
+	stat->incl = 0.0;
+	stat->excl = 0.0;
+	stat->active = 0;
+
+	idx = makeint(prof->nfuncs);
+	spn_hashmap_set(prof->funcidx, &key, &idx);
+
+	return prof->nfuncs++;
+}
+
+void spn_profile_enter(SpnProfile *prof, SpnFunction *fn)
+{
+	SpnProfCall *call;
+	size_t idx = function_index(prof, fn);
+
+	if (prof->ncalls >= prof->capcalls) {
+		prof->capcalls = prof->capcalls ? 2 * prof->capcalls : 64;
+		prof->calls = spn_realloc(prof->calls, prof->capcalls * sizeof prof->calls[0]);
+	}
+
+	prof->funcs[idx].calls++;
+	prof->funcs[idx].active++;
+
+	call = &prof->calls[prof->ncalls++];
+	call->func = idx;
+	call->children = 0.0;
+
+	/* read the clock last, so that the bookkeeping isn't measured */
+	call->start = prof_now();
+}
+
+void spn_profile_leave(SpnProfile *prof)
+{
+	double elapsed;
+	SpnProfCall *call;
+	SpnProfFunc *stat;
+
+	/* the profile may have been attached while frames were active */
+	if (prof->ncalls == 0) {
+		return;
+	}
+
+	call = &prof->calls[--prof->ncalls];
+	stat = &prof->funcs[call->func];
+	elapsed = prof_now() - call->start;
+
+	stat->excl += elapsed - call->children;
+
+	/* of recursive calls, only count the outermost one as inclusive */
+	if (--stat->active == 0) {
+		stat->incl += elapsed;
+	}
+
+	if (prof->ncalls > 0) {
+		prof->calls[prof->ncalls - 1].children += elapsed;
+	}
+}
+
+void spn_profile_reenter(SpnProfile *prof, SpnFunction *fn)
+{
+	spn_profile_enter(prof, fn);
+	prof->funcs[prof->calls[prof->ncalls - 1].func].calls--;
+}
+
+/* Sampling
+ * --------
+ *
+ * The timer only sets 'spn_prof_ticks'; the virtual machine checks it
+ * between instructions and calls spn_profile_add_sample(), since a call
+ * stack can't be walked safely from within a signal handler.
+ */
+#ifndef _WIN32
+
+static struct sigaction old_sigprof;
+
+static void sigprof_handler(int signo)
+{
+	spn_prof_ticks++;
+}
+
+void spn_profile_start(SpnProfile *prof)
+{
+	struct sigaction sa;
+	struct itimerval timer;
+
+	if ((prof->flags & SPN_PROF_SAMPLE) == 0) {
+		return;
+	}
+
+	spn_prof_ticks = 0;
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sigprof_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGPROF, &sa, &old_sigprof);
+
+	timer.it_interval.tv_sec = prof->interval / 1000000;
+	timer.it_interval.tv_usec = prof->interval % 1000000;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void spn_profile_stop(SpnProfile *prof)
+{
+	struct itimerval timer;
+
+	if ((prof->flags & SPN_PROF_SAMPLE) == 0) {
+		return;
+	}
+
+	memset(&timer, 0, sizeof timer);
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &old_sigprof, NULL);
+
+	spn_prof_ticks = 0;
+}
+
+#else /* _WIN32 */
+
+void spn_profile_start(SpnProfile *prof)
+{
+}
+
+void spn_profile_stop(SpnProfile *prof)
+{
+}
+
+#endif /* _WIN32 */
+
+void spn_profile_add_sample(SpnProfile *prof, SpnStackFrame *frames, size_t n, unsigned long weight)
+{
+	SpnStringBuilder bld;
+	SpnString *folded;
+	SpnValue key, count;
+	size_t i;
+
+	spn_strbuilder_init(&bld, 0);
+
+	/* outermost frame first */
+	for (i = n; i-- > 0; ) {
+		append_label(&bld, frames[i].function, frames[i].exc_address);
+
+		if (i > 0) {
+			spn_strbuilder_append(&bld, ";", 1);
+		}
+	}
+
+	folded = spn_strbuilder_tostring(&bld);
+	key = makeobject(SPN_TYPE_STRING, folded);
+	count = spn_hashmap_get(prof->stacks, &key);
+	count = makeint((isint(&count) ? intvalue(&count) : 0) + weight);
+
+	spn_hashmap_set(prof->stacks, &key, &count);
+	spn_value_release(&key);
+
+	prof->nsamples += weight;
+}
+
+/* Output
+ * ------
+ */
+void spn_profile_write_folded(SpnProfile *prof, FILE *f)
+{
+	size_t cursor = 0;
+	SpnValue key, count;
+
+	while ((cursor = spn_hashmap_next(prof->stacks, cursor, &key, &count)) != 0) {
+		fprintf(f, "%s %ld\n", stringvalue(&key)->cstr, intvalue(&count));
+	}
+}
+
+/* sorts functions by exclusive time, then by the number of calls */
+static int compare_funcs(const void *lp, const void *rp)
+{
+	const SpnProfFunc *lhs = *(const SpnProfFunc *const *)(lp);
+	const SpnProfFunc *rhs = *(const SpnProfFunc *const *)(rp);
+
+	if (lhs->excl != rhs->excl) {
+		return lhs->excl < rhs->excl ? +1 : -1;
+	}
+
+	if (lhs->calls != rhs->calls) {
+		return lhs->calls < rhs->calls ? +1 : -1;
+	}
+
+	return 0;
+}
+
+static void write_calls(SpnProfile *prof, FILE *f)
+{
+	SpnProfFunc **sorted;
+	size_t i;
+
+	sorted = spn_malloc(prof->nfuncs * sizeof sorted[0] + 1);
+
+	for (i = 0; i < prof->nfuncs; i++) {
+		sorted[i] = &prof->funcs[i];
+	}
+
+	qsort(sorted, prof->nfuncs, sizeof sorted[0], compare_funcs);
+
+	fprintf(f, "%12s %12s %12s  %s\n", "calls", "excl (ms)", "incl (ms)", "function");
+
+	for (i = 0; i < prof->nfuncs; i++) {
+		fprintf(
+			f,
+			"%12lu %12.3f %12.3f  %s\n",
+			sorted[i]->calls,
+			sorted[i]->excl * 1000.0,
+			sorted[i]->incl * 1000.0,
+			sorted[i]->label->cstr
+		);
+	}
+
+	free(sorted);
+}
+
+static void write_opcodes(SpnProfile *prof, FILE *f)
+{
+	unsigned long total = 0;
+	int i;
+
+	for (i = 0; i < SPN_PROF_NOPCODES; i++) {
+		total += prof->ophist[i];
+	}
+
+	fprintf(f, "%12s %8s  %s\n", "count", "%", "instruction");
+
+	for (i = 0; i < SPN_PROF_NOPCODES; i++) {
+		if (prof->ophist[i] > 0) {
+			fprintf(
+				f,
+				"%12lu %8.2f  %s\n",
+				prof->ophist[i],
+				prof->ophist[i] * 100.0 / total,
+				opcode_names[i]
+			);
+		}
+	}
+}
+
+void spn_profile_write_report(SpnProfile *prof, FILE *f)
+{
+	if (prof->flags & SPN_PROF_CALLS) {
+		write_calls(prof, f);
+	}
+
+	if (prof->flags & SPN_PROF_OPCODES) {
+		if (prof->flags & SPN_PROF_CALLS) {
+			fprintf(f, "\n");
+		}
+
+		write_opcodes(prof, f);
+	}
+
+	if (prof->flags & SPN_PROF_SAMPLE) {
+		if (prof->flags & (SPN_PROF_CALLS | SPN_PROF_OPCODES)) {
+			fprintf(f, "\n");
+		}
+
+		fprintf(f, "%lu samples\n", prof->nsamples);
+	}
+}
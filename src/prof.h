@@ -0,0 +1,103 @@
+/*
+ * prof.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Profiler for the virtual machine
+ */
+
+#ifndef SPN_PROF_H
+#define SPN_PROF_H
+
+#include <stdio.h>
+#include <signal.h>
+
+#include "api.h"
+#include "hashmap.h"
+#include "vm.h"
+
+/* A profile collects data about the execution of scripts while it is
+ * attached to a virtual machine using spn_vm_setprofile(). What it
+ * collects is determined by the combination of these flags:
+ *
+ * - SPN_PROF_CALLS counts the calls of each function and measures the
+ *   time spent in it, including (inclusive) or excluding (exclusive)
+ *   the functions it calls. This instruments every call and return.
+ * - SPN_PROF_OPCODES counts how many times each instruction is executed.
+ * - SPN_PROF_SAMPLE periodically samples the call stack of the virtual
+ *   machine. The samples are collected as "folded stacks", which can be
+ *   turned into a flame graph. This is done using a profiling timer, so
+ *   it is only available on POSIX systems, and only a single profile can
+ *   be sampling at a time (in the whole process).
+ *
+ * If the library was built without USE_PROFILER, then spn_vm_setprofile()
+ * is a no-op. Otherwise, a VM without a profile attached only pays for
+ * a never-taken branch on each call and return.
+ */
+enum spn_prof_flags {
+	SPN_PROF_CALLS   = 1 << 0,
+	SPN_PROF_OPCODES = 1 << 1,
+	SPN_PROF_SAMPLE  = 1 << 2
+};
+
+/* the default sampling interval, in microseconds */
+#define SPN_PROF_INTERVAL 1000
+
+#define SPN_PROF_NOPCODES (SPN_INS_TAILCALL + 1)
+
+typedef struct SpnProfile {
+	int flags;                   /* public, readonly                   */
+	long interval;               /* public, sampling interval in usecs */
+	unsigned long nsamples;      /* public, readonly                   */
+	unsigned long ophist[SPN_PROF_NOPCODES]; /* public, readonly       */
+	struct SpnProfFunc *funcs;   /* private: per-function statistics   */
+	size_t nfuncs;               /* private                            */
+	size_t capfuncs;             /* private                            */
+	SpnHashMap *funcidx;         /* private: function -> index         */
+	struct SpnProfCall *calls;   /* private: shadow call stack         */
+	size_t ncalls;               /* private                            */
+	size_t capcalls;             /* private                            */
+	SpnHashMap *stacks;          /* private: folded stack -> count     */
+} SpnProfile;
+
+SPN_API void spn_profile_init(SpnProfile *prof, int flags);
+SPN_API void spn_profile_free(SpnProfile *prof);
+
+/* writes the sampled stacks in the "folded" format of flame graph tools:
+ * one line per distinct stack, the semicolon-separated frames listed from
+ * the outermost one, followed by a space and the number of samples. Frames
+ * of script functions are labelled with the source location if the program
+ * was compiled with debug information.
+ */
+SPN_API void spn_profile_write_folded(SpnProfile *prof, FILE *f);
+
+/* writes a human-readable table of the call counts and times of functions
+ * and of the instruction histogram, whichever has been collected
+ */
+SPN_API void spn_profile_write_report(SpnProfile *prof, FILE *f);
+
+/* The rest of the API is used by the virtual machine. */
+
+/* nonzero while a sample is due; set by the profiling timer */
+extern volatile sig_atomic_t spn_prof_ticks;
+
+SPN_API void spn_profile_start(SpnProfile *prof);
+SPN_API void spn_profile_stop(SpnProfile *prof);
+
+/* a function is entered and left, respectively */
+SPN_API void spn_profile_enter(SpnProfile *prof, SpnFunction *fn);
+SPN_API void spn_profile_leave(SpnProfile *prof);
+
+/* like spn_profile_enter(), but for a frame that was left without
+ * returning, i. e. of a coroutine that is resumed; it isn't counted
+ * as another call
+ */
+SPN_API void spn_profile_reenter(SpnProfile *prof, SpnFunction *fn);
+
+/* 'frames' is a stack trace (see spn_vm_stacktrace()), the innermost
+ * frame first; 'weight' is the number of samples it accounts for
+ */
+SPN_API void spn_profile_add_sample(SpnProfile *prof, SpnStackFrame *frames, size_t n, unsigned long weight);
+
+#endif /* SPN_PROF_H */
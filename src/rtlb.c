@@ -21,6 +21,7 @@
 #include "str.h"
 #include "array.h"
 #include "hashmap.h"
+#include "typedarr.h"
 #include "ctx.h"
 #include "private.h"
 
@@ -30,6 +31,10 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else /* _WIN32 */
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #endif /* _WIN32 */
 
 /* definitions for maths library and others */
@@ -81,52 +86,55 @@ static void load_methods(SpnVMachine *vm, int typetag, const SpnExtFunc fns[], s
 	}
 }
 
-/***************
- * I/O library *
- ***************/
-
-static void rtlb_aux_getline(SpnValue *ret, FILE *f)
+/* Adds methods with a declared arity and flags to the class of a type. */
+static void load_methods_ex(SpnVMachine *vm, int typetag, const SpnExtFuncEx fns[], size_t n)
 {
-	int no_lf = 1;
-	size_t n = 0, alloc_size = 0x10;
-	char *buf = spn_malloc(alloc_size);
-
-	while (1) {
-		int ch = fgetc(f);
-
-		if (ch == EOF) {
-			break;
-		}
+	SpnHashMap *classdesc = get_class_for_typetag(vm, typetag);
 
-		if (ch == '\n') {
-			no_lf = 0;
-			break;
-		}
+	size_t i;
+	for (i = 0; i < n; i++) {
+		SpnValue method = spn_makenativefunc_ex(fns[i].name, fns[i].fn, fns[i].arity, fns[i].flags);
+		spn_hashmap_set_strkey(classdesc, fns[i].name, &method);
+		spn_value_release(&method);
+	}
+}
 
-		/* >=: make room for terminating NUL too */
-		if (++n >= alloc_size) {
-			alloc_size *= 2;
-			buf = spn_realloc(buf, alloc_size);
-		}
+/* Creates the class descriptor shared by all instances of the native class
+ * 'cls', i. e. of all strong user info values holding such an object, and
+ * adds methods to it. (see the member lookup of user info values in vm.c)
+ * Returns the descriptor, which is owned by the class table of 'vm'.
+ */
+static SpnHashMap *load_class_methods(SpnVMachine *vm, const SpnClass *cls, const SpnExtFunc fns[], size_t n)
+{
+	SpnHashMap *classes = spn_vm_getclasses(vm);
+	SpnValue classindex = makeweakuserinfo((void *)(cls));
+	SpnValue classval = makehashmap();
+	SpnHashMap *classdesc = hashmapvalue(&classval);
+	size_t i;
 
-		buf[n - 1] = ch;
+	for (i = 0; i < n; i++) {
+		SpnValue method = makenativefunc(fns[i].name, fns[i].fn);
+		spn_hashmap_set_strkey(classdesc, fns[i].name, &method);
+		spn_value_release(&method);
 	}
 
-	/* handle empty file */
-	if (n == 0 && no_lf) {
-		free(buf);
-		*ret = spn_nilval;
-	} else {
-		buf[n] = 0;
-		*ret = makestring_nocopy_len(buf, n, 1);
-	}
+	spn_hashmap_set(classes, &classindex, &classval);
+	spn_value_release(&classval);
+
+	return classdesc;
 }
 
+/***************
+ * I/O library *
+ ***************/
+
 /* The file handle class */
 typedef struct SpnFileHandle {
 	SpnObject base;
 	FILE *f; /* NULL pointer if file was closed */
 	int close; /* tells if 'f' should be fclose()'d by destructor */
+	char *linebuf; /* reused by 'getline()' and 'lines()' */
+	size_t linecap;
 } SpnFileHandle;
 
 static void fhandle_free(void *obj);
@@ -137,7 +145,8 @@ static const SpnClass spn_class_fhandle = {
 	NULL, /* pointer-wise identity */
 	NULL, /* <, > not applicable   */
 	NULL, /* hash = object address */
-	fhandle_free
+	fhandle_free,
+	NULL  /* not a container       */
 };
 
 static SpnFileHandle *fhandle_new(FILE *f, int should_close)
@@ -145,6 +154,8 @@ static SpnFileHandle *fhandle_new(FILE *f, int should_close)
 	SpnFileHandle *obj = spn_object_new(&spn_class_fhandle);
 	obj->f = f;
 	obj->close = should_close;
+	obj->linebuf = NULL;
+	obj->linecap = 0;
 	return obj;
 }
 
@@ -164,6 +175,59 @@ static void fhandle_free(void *obj)
 	if (hndl->close) {
 		fhandle_close(hndl);
 	}
+
+	free(hndl->linebuf);
+}
+
+/* Reads a line into the line buffer of the handle, which only ever
+ * grows, so reading a file line by line doesn't reallocate per line.
+ * Returns the length of the line without the line separator, or -1
+ * if end-of-file was encountered before anything could be read.
+ */
+static long fhandle_readline(SpnFileHandle *hndl)
+{
+#ifdef _WIN32
+	size_t n = 0;
+
+	while (1) {
+		int ch = getc(hndl->f);
+
+		if (ch == EOF) {
+			if (n == 0) {
+				return -1;
+			}
+
+			break;
+		}
+
+		if (ch == '\n') {
+			break;
+		}
+
+		/* >=: make room for terminating NUL too */
+		if (n + 1 >= hndl->linecap) {
+			hndl->linecap = hndl->linecap ? 2 * hndl->linecap : LINE_MAX;
+			hndl->linebuf = spn_realloc(hndl->linebuf, hndl->linecap);
+		}
+
+		hndl->linebuf[n++] = ch;
+	}
+
+	return n;
+#else /* _WIN32 */
+	/* getline() scans the stdio buffer instead of going char by char */
+	ssize_t n = getline(&hndl->linebuf, &hndl->linecap, hndl->f);
+
+	if (n < 0) {
+		return -1;
+	}
+
+	if (n > 0 && hndl->linebuf[n - 1] == '\n') {
+		n--;
+	}
+
+	return n;
+#endif /* _WIN32 */
 }
 
 /* The key with which the file handle user info object
@@ -355,6 +419,7 @@ static int rtlb_printf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 static int rtlb_getline(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	SpnFileHandle *hndl;
+	long n;
 
 	if (argc != 1) {
 		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
@@ -377,7 +442,172 @@ static int rtlb_getline(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -4;
 	}
 
-	rtlb_aux_getline(ret, hndl->f);
+	/* at end-of-file, implicitly return nil */
+	n = fhandle_readline(hndl);
+	if (n >= 0) {
+		*ret = makestring_len(hndl->linebuf, n);
+	}
+
+	return 0;
+}
+
+/* calls the callback with each line and its (zero-based) index until
+ * end-of-file or until the callback returns false
+ */
+static int rtlb_flines(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnFileHandle *hndl;
+	SpnFunction *callback;
+	long n, i;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
+		return -1;
+	}
+
+	if (!ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be a file object", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -2;
+	}
+
+	hndl = fhandle_from_hashmap(&argv[0]);
+	callback = funcvalue(&argv[1]);
+
+	if (hndl == NULL) {
+		spn_ctx_runtime_error(ctx, "file object contains no valid handle", NULL);
+		return -3;
+	}
+
+	for (i = 0; ; i++) {
+		int err;
+		SpnValue cbret;
+		SpnValue args[2]; /* line and index */
+
+		/* the callback may close the file */
+		if (hndl->f == NULL) {
+			spn_ctx_runtime_error(ctx, "file object is closed", NULL);
+			return -4;
+		}
+
+		n = fhandle_readline(hndl);
+		if (n < 0) {
+			break;
+		}
+
+		args[0] = makestring_len(hndl->linebuf, n);
+		args[1] = makeint(i);
+
+		err = spn_ctx_callfunc(ctx, callback, &cbret, COUNT(args), args);
+		spn_value_release(&args[0]);
+
+		if (err != 0) {
+			return -5;
+		}
+
+		/* the callback must return a Boolean or nothing */
+		if (isbool(&cbret)) {
+			if (boolvalue(&cbret) == 0) {
+				break;
+			}
+		} else if (notnil(&cbret)) {
+			spn_value_release(&cbret);
+			spn_ctx_runtime_error(ctx, "callback function must return boolean or nil", NULL);
+			return -6;
+		}
+	}
+
+	return 0;
+}
+
+/* Calls the callback with consecutive chunks of 'size' bytes (the last
+ * one may be shorter) until end-of-file or until it returns false.
+ * Each chunk is read directly into the buffer of its string.
+ */
+static int rtlb_fchunks(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnFileHandle *hndl;
+	SpnFunction *callback;
+	long size;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "exactly three arguments are required", NULL);
+		return -1;
+	}
+
+	if (!ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be a file object", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1]) || intvalue(&argv[1]) <= 0) {
+		spn_ctx_runtime_error(ctx, "chunk size must be a positive integer", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be a function", NULL);
+		return -2;
+	}
+
+	hndl = fhandle_from_hashmap(&argv[0]);
+	size = intvalue(&argv[1]);
+	callback = funcvalue(&argv[2]);
+
+	if (hndl == NULL) {
+		spn_ctx_runtime_error(ctx, "file object contains no valid handle", NULL);
+		return -3;
+	}
+
+	while (1) {
+		int err;
+		size_t n;
+		char *buf;
+		SpnValue cbret, chunk;
+
+		if (hndl->f == NULL) {
+			spn_ctx_runtime_error(ctx, "file object is closed", NULL);
+			return -4;
+		}
+
+		buf = spn_malloc(size + 1);
+		n = fread(buf, 1, size, hndl->f);
+
+		if (n == 0) {
+			free(buf);
+			break;
+		}
+
+		/* don't keep the slack of the last chunk around */
+		if (n < (size_t)(size)) {
+			buf = spn_realloc(buf, n + 1);
+		}
+
+		buf[n] = 0;
+		chunk = makestring_nocopy_len(buf, n, 1);
+
+		err = spn_ctx_callfunc(ctx, callback, &cbret, 1, &chunk);
+		spn_value_release(&chunk);
+
+		if (err != 0) {
+			return -5;
+		}
+
+		if (isbool(&cbret)) {
+			if (boolvalue(&cbret) == 0) {
+				break;
+			}
+		} else if (notnil(&cbret)) {
+			spn_value_release(&cbret);
+			spn_ctx_runtime_error(ctx, "callback function must return boolean or nil", NULL);
+			return -6;
+		}
+	}
+
 	return 0;
 }
 
@@ -428,11 +658,85 @@ static int rtlb_fread(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
+#ifndef _WIN32
+
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* the minimum guaranteed by POSIX */
+#endif
+
+/* Writes all the strings in 'strs' using as few 'writev()' calls as
+ * possible (one, unless there are more than IOV_MAX strings or the
+ * write is interrupted). The stream is flushed first, so that buffered
+ * output still precedes the strings. Returns 0 on success.
+ */
+static int write_strings(FILE *f, SpnString **strs, size_t n)
+{
+	struct iovec *iov;
+	size_t i, first = 0;
+	int fd;
+
+	if (fflush(f) != 0) {
+		return -1;
+	}
+
+	fd = fileno(f);
+	iov = spn_malloc(n * sizeof iov[0]);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = strs[i]->cstr;
+		iov[i].iov_len = strs[i]->len;
+	}
+
+	while (first < n) {
+		size_t count = n - first < IOV_MAX ? n - first : IOV_MAX;
+		ssize_t written = writev(fd, &iov[first], count);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			free(iov);
+			return -1;
+		}
+
+		/* skip what has been written, then resume a partial write */
+		while (first < n && (size_t)(written) >= iov[first].iov_len) {
+			written -= iov[first].iov_len;
+			first++;
+		}
+
+		if (first < n) {
+			iov[first].iov_base = (char *)(iov[first].iov_base) + written;
+			iov[first].iov_len -= written;
+		}
+	}
+
+	free(iov);
+	return 0;
+}
+
+#else /* _WIN32 */
+
+static int write_strings(FILE *f, SpnString **strs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (strs[i]->len > 0 && fwrite(strs[i]->cstr, strs[i]->len, 1, f) != 1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#endif /* _WIN32 */
+
 static int rtlb_fwrite(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	int success;
 	SpnFileHandle *hndl;
-	SpnString *str;
 
 	if (argc != 2) {
 		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
@@ -444,13 +748,12 @@ static int rtlb_fwrite(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -2;
 	}
 
-	if (!isstring(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a string", NULL);
+	if (!isstring(&argv[1]) && !isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a string or an array of strings", NULL);
 		return -2;
 	}
 
 	hndl = fhandle_from_hashmap(&argv[0]);
-	str = stringvalue(&argv[1]);
 
 	if (hndl == NULL) {
 		spn_ctx_runtime_error(ctx, "file object contains no valid handle", NULL);
@@ -462,7 +765,37 @@ static int rtlb_fwrite(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -4;
 	}
 
-	success = fwrite(str->cstr, str->len, 1, hndl->f) == 1;
+	if (isstring(&argv[1])) {
+		SpnString *str = stringvalue(&argv[1]);
+		success = fwrite(str->cstr, str->len, 1, hndl->f) == 1;
+	} else {
+		SpnArray *arr = arrayvalue(&argv[1]);
+		size_t i, n = spn_array_count(arr);
+		SpnString **strs;
+
+		if (n == 0) {
+			*ret = spn_trueval;
+			return 0;
+		}
+
+		strs = spn_malloc(n * sizeof strs[0]);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+
+			if (!isstring(&elem)) {
+				free(strs);
+				spn_ctx_runtime_error(ctx, "array must only contain strings", NULL);
+				return -5;
+			}
+
+			strs[i] = stringvalue(&elem);
+		}
+
+		success = write_strings(hndl->f, strs, n) == 0;
+		free(strs);
+	}
+
 	*ret = makebool(success);
 
 	return 0;
@@ -679,7 +1012,12 @@ static int rtlb_tmpfile(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
-static int rtlb_readfile(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* files at least this large are mapped into memory by 'readfile()'
+ * instead of being copied into a buffer
+ */
+#define READFILE_MAP_THRESHOLD (256 * 1024)
+
+static int rtlb_readfile(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	const char *fname;
 	char *buf;
@@ -711,6 +1049,19 @@ static int rtlb_readfile(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	fseek(f, 0, SEEK_END);
 	size = ftell(f);
 
+#if USE_MMAP
+	if (size >= READFILE_MAP_THRESHOLD) {
+		size_t mapsize;
+		buf = spn_map_text_file(fname, &mapsize);
+
+		if (buf != NULL) {
+			fclose(f);
+			*ret = makeobject(SPN_TYPE_STRING, spn_string_new_mapped(buf, mapsize));
+			return 0;
+		}
+	}
+#endif /* USE_MMAP */
+
 	fseek(f, 0, SEEK_SET);
 	buf = spn_malloc(size + 1);
 
@@ -748,6 +1099,8 @@ static void loadlib_io(SpnVMachine *vm)
 	static const SpnExtFunc M[] = {
 		{ "close",    rtlb_fclose   },
 		{ "getline",  rtlb_getline  },
+		{ "lines",    rtlb_flines   },
+		{ "chunks",   rtlb_fchunks  },
 		{ "printf",   rtlb_printf   },
 		{ "read",     rtlb_fread    },
 		{ "write",    rtlb_fwrite   },
@@ -977,8 +1330,7 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	arr = spn_array_new();
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = arr;
+	*ret = makeobject(SPN_TYPE_ARRAY, arr);
 
 	s = haystack->cstr;
 	t = strstr(s, needle->cstr);
@@ -1009,8 +1361,8 @@ static int rtlb_split(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 static int rtlb_repeat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	char *buf;
-	size_t i, len, n;
+	SpnStringBuilder bld;
+	size_t i, n;
 	SpnString *str;
 
 	if (argc != 2) {
@@ -1035,17 +1387,19 @@ static int rtlb_repeat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	str = stringvalue(&argv[0]);
 	n = intvalue(&argv[1]);
-	len = str->len * n;
 
-	buf = spn_malloc(len + 1);
+	if (str->len > 0 && n > ((size_t)(-1) - 1) / str->len) {
+		spn_ctx_runtime_error(ctx, "resulting string would be too long", NULL);
+		return -4;
+	}
+
+	spn_strbuilder_init(&bld, str->len * n);
 
 	for (i = 0; i < n; i++) {
-		memcpy(buf + i * str->len, str->cstr, str->len);
+		spn_strbuilder_append(&bld, str->cstr, str->len);
 	}
 
-	buf[len] = 0;
-
-	*ret = makestring_nocopy_len(buf, len, 1);
+	*ret = makeobject(SPN_TYPE_STRING, spn_strbuilder_tostring(&bld));
 
 	return 0;
 }
@@ -1114,8 +1468,7 @@ static int rtlb_format(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	res = spn_string_format_obj(fmt, argc - 1, &argv[1], &errmsg);
 
 	if (res != NULL) {
-		ret->type = SPN_TYPE_STRING;
-		ret->v.o = res;
+		*ret = makeobject(SPN_TYPE_STRING, res);
 	} else {
 		const void *args[1];
 		args[0] = errmsg;
@@ -1127,6 +1480,195 @@ static int rtlb_format(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
+/* The string builder class */
+typedef struct SpnStrBuilderObj {
+	SpnObject base;
+	SpnStringBuilder bld;
+} SpnStrBuilderObj;
+
+static void strbuilder_free(void *obj);
+
+static const SpnClass spn_class_strbuilder = {
+	sizeof(SpnStrBuilderObj),
+	SPN_CLASS_UID_STRINGBUILDER,
+	NULL, /* pointer-wise identity */
+	NULL, /* <, > not applicable   */
+	NULL, /* hash = object address */
+	strbuilder_free,
+	NULL  /* not a container       */
+};
+
+static void strbuilder_free(void *obj)
+{
+	SpnStrBuilderObj *sb = obj;
+	spn_strbuilder_free(&sb->bld);
+}
+
+static SpnStringBuilder *rtlb_aux_strbuilder_arg(SpnValue *val)
+{
+	if (isstrguserinfo(val) && spn_object_member_of_class(objvalue(val), &spn_class_strbuilder)) {
+		SpnStrBuilderObj *sb = objvalue(val);
+		return &sb->bld;
+	}
+
+	return NULL;
+}
+
+static int rtlb_strbuilder(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStrBuilderObj *sb;
+	long capacity = 0;
+
+	if (argc > 1) {
+		spn_ctx_runtime_error(ctx, "expecting at most one argument", NULL);
+		return -1;
+	}
+
+	if (argc == 1) {
+		if (!isint(&argv[0]) || intvalue(&argv[0]) < 0) {
+			spn_ctx_runtime_error(ctx, "capacity must be a non-negative integer", NULL);
+			return -2;
+		}
+
+		capacity = intvalue(&argv[0]);
+	}
+
+	sb = spn_object_new(&spn_class_strbuilder);
+	spn_strbuilder_init(&sb->bld, capacity);
+
+	*ret = makestrguserinfo(sb);
+	return 0;
+}
+
+/* appends any number of strings */
+static int rtlb_sb_append(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *bld;
+	size_t len = 0;
+	int i;
+
+	if (argc < 1 || (bld = rtlb_aux_strbuilder_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a string builder", NULL);
+		return -1;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (!isstring(&argv[i])) {
+			const void *args[1];
+			args[0] = spn_type_name(fulltype(&argv[i]));
+			spn_ctx_runtime_error(ctx, "cannot append value of type %s", args);
+			return -2;
+		}
+
+		len += stringvalue(&argv[i])->len;
+	}
+
+	spn_strbuilder_reserve(bld, len);
+
+	for (i = 1; i < argc; i++) {
+		SpnString *str = stringvalue(&argv[i]);
+		spn_strbuilder_append(bld, str->cstr, str->len);
+	}
+
+	return 0;
+}
+
+static int rtlb_sb_appendf(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *bld;
+	char *errmsg;
+
+	if (argc < 1 || (bld = rtlb_aux_strbuilder_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a string builder", NULL);
+		return -1;
+	}
+
+	if (argc < 2 || !isstring(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a format string", NULL);
+		return -2;
+	}
+
+	if (spn_strbuilder_appendf(bld, stringvalue(&argv[1]), argc - 2, &argv[2], &errmsg) != 0) {
+		const void *args[1];
+		args[0] = errmsg;
+		spn_ctx_runtime_error(ctx, "error in format string: %s", args);
+		free(errmsg);
+		return -3;
+	}
+
+	return 0;
+}
+
+/* the builder is empty afterwards; its buffer now belongs to the string */
+static int rtlb_sb_tostring(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *bld;
+
+	if (argc != 1 || (bld = rtlb_aux_strbuilder_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a string builder", NULL);
+		return -1;
+	}
+
+	*ret = makeobject(SPN_TYPE_STRING, spn_strbuilder_tostring(bld));
+	return 0;
+}
+
+static int rtlb_sb_clear(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *bld;
+
+	if (argc != 1 || (bld = rtlb_aux_strbuilder_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a string builder", NULL);
+		return -1;
+	}
+
+	/* keep the buffer, it will probably be filled again */
+	bld->len = 0;
+	return 0;
+}
+
+/* getter of the "length" property */
+static int rtlb_sb_length(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnStringBuilder *bld;
+
+	if (argc < 1 || (bld = rtlb_aux_strbuilder_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a string builder", NULL);
+		return -1;
+	}
+
+	*ret = makeint(bld->len);
+	return 0;
+}
+
+static void loadlib_strbuilder(SpnVMachine *vm)
+{
+	/* Free functions */
+	static const SpnExtFunc F[] = {
+		{ "StringBuilder", rtlb_strbuilder }
+	};
+
+	/* Methods */
+	static const SpnExtFunc M[] = {
+		{ "append",   rtlb_sb_append   },
+		{ "appendf",  rtlb_sb_appendf  },
+		{ "tostring", rtlb_sb_tostring },
+		{ "clear",    rtlb_sb_clear    }
+	};
+
+	SpnHashMap *classdesc = load_class_methods(vm, &spn_class_strbuilder, M, COUNT(M));
+	SpnValue accessors = makehashmap();
+	SpnValue getter = makenativefunc("length", rtlb_sb_length);
+
+	spn_hashmap_set_strkey(hashmapvalue(&accessors), "get", &getter);
+	spn_hashmap_set_strkey(classdesc, "length", &accessors);
+
+	spn_value_release(&getter);
+	spn_value_release(&accessors);
+
+	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
+}
+
 static void loadlib_string(SpnVMachine *vm)
 {
 	/* Methods */
@@ -1149,105 +1691,68 @@ static void loadlib_string(SpnVMachine *vm)
  * Array library *
  *****************/
 
-/* The following functions realize an optimized in-place quicksort.
- * Most of this has been transliterated from Wikipedia's
- * pseudo-code at https://en.wikipedia.org/wiki/Quicksort
+/* Sorting itself is done by spn_array_sort(); these functions only
+ * adapt the comparator (or the '<' operator) to it.
  */
-static void rtlb_aux_swap(SpnArray *a, int i, int j)
-{
-	SpnValue x = spn_array_get(a, i);
-	SpnValue y = spn_array_get(a, j);
-
-	spn_value_retain(&x);
-	spn_array_set(a, i, &y);
-	spn_array_set(a, j, &x);
-	spn_value_release(&x);
-}
+typedef struct SortComparator {
+	SpnContext *ctx;
+	SpnFunction *comp;
+} SortComparator;
 
-static int rtlb_aux_partition(SpnArray *a, int left, int right,
-	SpnFunction *comp, SpnContext *ctx, int *error)
+static int rtlb_aux_sort_less(void *ud, const SpnValue *lhs, const SpnValue *rhs)
 {
-	int store_idx = left;
-	int pivot_idx = left + (right - left) / 2;
-	int i;
-
-	SpnValue pivot = spn_array_get(a, pivot_idx);
-
-	rtlb_aux_swap(a, pivot_idx, right);
-
-	for (i = left; i < right; i++) {
-		int lessthan;
-		SpnValue ith_elem = spn_array_get(a, i);
-
-		/* compare pivot to i-th element */
-		if (comp != NULL) {
-			SpnValue ret;
-			SpnValue argv[2];
-			argv[0] = ith_elem;
-			argv[1] = pivot;
-
-			if (spn_ctx_callfunc(ctx, comp, &ret, 2, argv) != 0) {
-				*error = 1;
-				return 0;
-			}
-
-			if (!isbool(&ret)) {
-				spn_ctx_runtime_error(ctx, "comparator function must return a Boolean", NULL);
-				spn_value_release(&ret);
-				*error = 1;
-				return 0;
-			}
-
-			lessthan = boolvalue(&ret);
-		} else {
-			if (!spn_values_comparable(&ith_elem, &pivot)) {
-				const void *args[2];
-				args[0] = spn_type_name(ith_elem.type);
-				args[1] = spn_type_name(pivot.type);
-
-				spn_ctx_runtime_error(
-					ctx,
-					"attempt to sort uncomparable values"
-					" of type %s and %s",
-					args
-				);
-
-				*error = 1;
-				return 0;
-			}
+	SortComparator *sc = ud;
+	SpnValue ret;
+	SpnValue argv[2];
+	argv[0] = *lhs;
+	argv[1] = *rhs;
 
-			lessthan = spn_value_compare(&ith_elem, &pivot) < 0;
-		}
+	if (spn_ctx_callfunc(sc->ctx, sc->comp, &ret, 2, argv) != 0) {
+		return -1;
+	}
 
-		if (lessthan) {
-			rtlb_aux_swap(a, i, store_idx++);
-		}
+	if (!isbool(&ret)) {
+		spn_ctx_runtime_error(sc->ctx, "comparator function must return a Boolean", NULL);
+		spn_value_release(&ret);
+		return -1;
 	}
 
-	rtlb_aux_swap(a, store_idx, right);
-	return store_idx;
+	return boolvalue(&ret);
 }
 
-static int rtlb_aux_qsort(SpnArray *a, int left, int right, SpnFunction *comp, SpnContext *ctx)
+/* without a comparator, the elements must be mutually comparable.
+ * This is checked before sorting, so that an error doesn't leave
+ * the array half-sorted.
+ */
+static int rtlb_aux_check_comparable(SpnArray *a, SpnContext *ctx)
 {
-	int pivot_index;
-	int error = 0;
+	size_t n = spn_array_count(a);
+	SpnValue first;
+	size_t i;
 
-	if (left >= right) {
+	if (n < 2) {
 		return 0;
 	}
 
-	pivot_index = rtlb_aux_partition(a, left, right, comp, ctx, &error);
-	if (error) {
-		return -1;
-	}
+	first = spn_array_get(a, 0);
 
-	if (rtlb_aux_qsort(a, left, pivot_index - 1, comp, ctx) != 0) {
-		return -1;
-	}
+	for (i = 0; i < n; i++) {
+		SpnValue ith_elem = spn_array_get(a, i);
 
-	if (rtlb_aux_qsort(a, pivot_index + 1, right, comp, ctx) != 0) {
-		return -1;
+		if (!spn_values_comparable(&ith_elem, &first)) {
+			const void *args[2];
+			args[0] = spn_type_name(fulltype(&ith_elem));
+			args[1] = spn_type_name(fulltype(&first));
+
+			spn_ctx_runtime_error(
+				ctx,
+				"attempt to sort uncomparable values"
+				" of type %s and %s",
+				args
+			);
+
+			return -1;
+		}
 	}
 
 	return 0;
@@ -1256,7 +1761,7 @@ static int rtlb_aux_qsort(SpnArray *a, int left, int right, SpnFunction *comp, S
 static int rtlb_sort(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	SpnArray *array;
-	SpnFunction *comparator = NULL;
+	SortComparator comparator;
 
 	if (argc < 1 || argc > 2) {
 		spn_ctx_runtime_error(ctx, "one or two arguments are required", NULL);
@@ -1276,16 +1781,23 @@ static int rtlb_sort(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 			return -3;
 		}
 
-		comparator = funcvalue(&argv[1]);
+		comparator.ctx = ctx;
+		comparator.comp = funcvalue(&argv[1]);
+
+		return spn_array_sort(array, rtlb_aux_sort_less, &comparator);
+	}
+
+	if (rtlb_aux_check_comparable(array, ctx) != 0) {
+		return -1;
 	}
 
-	return rtlb_aux_qsort(array, 0, spn_array_count(array) - 1, comparator, ctx);
+	return spn_array_sort(array, NULL, NULL);
 }
 
 static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	size_t n, i, len = 0;
-	char *buf = NULL;
+	SpnStringBuilder bld;
 	SpnArray *arr;
 	SpnString *delim;
 
@@ -1309,52 +1821,38 @@ static int rtlb_join(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	delim = stringvalue(&argv[1]);
 
+	/* compute the length of the result first, so that
+	 * the buffer only needs to be allocated once
+	 */
 	for (i = 0; i < n; i++) {
-		size_t addlen;
-		SpnString *str;
 		SpnValue val = spn_array_get(arr, i);
 
 		if (!isstring(&val)) {
-			free(buf);
 			spn_ctx_runtime_error(ctx, "array must contain strings only", NULL);
 			return -3;
 		}
 
-		/* XXX: this should really be solved using
-		 * exponential buffer expansion. Maybe in alpha 2...
-		 */
+		len += stringvalue(&val)->len;
+	}
+
+	if (n > 0) {
+		len += (n - 1) * delim->len;
+	}
 
-		str = stringvalue(&val);
-		addlen = i > 0 ? delim->len + str->len : str->len;
+	spn_strbuilder_init(&bld, len);
 
-		buf = spn_realloc(buf, len + addlen + 1);
+	for (i = 0; i < n; i++) {
+		SpnValue val = spn_array_get(arr, i);
+		SpnString *str = stringvalue(&val);
 
 		if (i > 0) {
-			memcpy(buf + len, delim->cstr, delim->len);
-			memcpy(buf + len + delim->len, str->cstr, str->len);
-		} else {
-			memcpy(buf + len, str->cstr, str->len);
+			spn_strbuilder_append(&bld, delim->cstr, delim->len);
 		}
 
-		len += addlen;
+		spn_strbuilder_append(&bld, str->cstr, str->len);
 	}
 
-	if (i > 0) {
-		/* this may catch one error or two */
-		assert(buf != NULL);
-
-		/* add NUL terminator */
-		buf[len] = 0;
-		*ret = makestring_nocopy_len(buf, len, 1);
-	} else {
-		assert(buf == NULL);
-
-		/* if there were no items to concatenate, return empty string
-		 * (this is necessary because 'buf' is now NULL,
-		 * and we definitely don't want this to segfault)
-		 */
-		*ret = makestring_nocopy_len("", 0, 0);
-	}
+	*ret = makeobject(SPN_TYPE_STRING, spn_strbuilder_tostring(&bld));
 
 	return 0;
 }
@@ -1524,8 +2022,7 @@ static int rtlb_array_filter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		}
 	}
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = filt;
+	*ret = makeobject(SPN_TYPE_ARRAY, filt);
 	return 0;
 }
 
@@ -1554,6 +2051,7 @@ static int rtlb_array_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	predicate = funcvalue(&argv[1]);
 	n = spn_array_count(orig);
 	mapped = spn_array_new();
+	spn_array_reserve(mapped, n);
 
 	for (i = 0; i < n; i++) {
 		SpnValue result;
@@ -1571,11 +2069,58 @@ static int rtlb_array_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		spn_value_release(&result);
 	}
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = mapped;
+	*ret = makeobject(SPN_TYPE_ARRAY, mapped);
+	return 0;
+}
+
+/* pmap() and pfilter(); the optional third argument is the maximal
+ * number of workers to use (see spn_ctx_pmap())
+ */
+static int array_parallel(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int filter)
+{
+	int nworkers = 0;
+
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting two or three arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be an array", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -3;
+	}
+
+	if (argc > 2) {
+		if (!isint(&argv[2])) {
+			spn_ctx_runtime_error(ctx, "number of workers must be an integer", NULL);
+			return -3;
+		}
+
+		nworkers = intvalue(&argv[2]);
+	}
+
+	if (spn_ctx_pmap(ctx, arrayvalue(&argv[0]), funcvalue(&argv[1]), filter, nworkers, ret) != 0) {
+		return -4;
+	}
+
 	return 0;
 }
 
+static int rtlb_array_pmap(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return array_parallel(ret, argc, argv, ctx, 0);
+}
+
+static int rtlb_array_pfilter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return array_parallel(ret, argc, argv, ctx, 1);
+}
+
 static int rtlb_push(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	SpnArray *arr;
@@ -1736,6 +2281,7 @@ static int rtlb_reverse(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	*ret = makearray();
 	result = arrayvalue(ret);
+	spn_array_reserve(result, n);
 
 	/* copy elements of 'arr' into 'result' in reverse order */
 	for (i = n; i > 0; i--) {
@@ -1929,8 +2475,8 @@ static int rtlb_aux_bsearch_compare(SpnValue vals[2], SpnFunction *predicate, Sp
 	}
 
 	/* if the values are not orderable, we're in trouble */
-	args[0] = spn_type_name(vals[0].type);
-	args[1] = spn_type_name(vals[1].type);
+	args[0] = spn_type_name(fulltype(&vals[0]));
+	args[1] = spn_type_name(fulltype(&vals[1]));
 	spn_ctx_runtime_error(ctx, "cannot compare values of type %s and %s", args);
 	return -3;
 }
@@ -2032,7 +2578,7 @@ static int rtlb_bsearch(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 static int rtlb_slice(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	SpnArray *arr, *result;
-	long i, idx, len, n;
+	long idx, len, n;
 
 	if (argc < 2 || argc > 3) {
 		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
@@ -2085,13 +2631,8 @@ static int rtlb_slice(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -7;
 	}
 
-	*ret = makearray();
-	result = arrayvalue(ret);
-
-	for (i = 0; i < len; i++) {
-		SpnValue tmp = spn_array_get(arr, idx + i);
-		spn_array_push(result, &tmp);
-	}
+	result = spn_array_slice(arr, idx, len);
+	*ret = makeobject(SPN_TYPE_ARRAY, result);
 
 	return 0;
 }
@@ -2211,34 +2752,39 @@ static int rtlb_erase(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 static int rtlb_concat(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
 	SpnArray *result;
+	size_t total = 0;
 	int i;
 
-	*ret = makearray();
-	result = arrayvalue(ret);
-
 	for (i = 0; i < argc; i++) {
-		SpnArray *arr;
-		size_t j, n;
-
 		if (!isarray(&argv[i])) {
 			const void *args[2];
 			int argidx = i + 1;
 			args[0] = &argidx;
-			args[1] = spn_type_name(argv[i].type);
+			args[1] = spn_type_name(fulltype(&argv[i]));
 			spn_ctx_runtime_error(ctx, "arguments must be arrays (arg %i was %s)", args);
-			spn_value_release(ret);
 			return -1;
 		}
 
-		arr = arrayvalue(&argv[i]);
-		n = spn_array_count(arr);
+		total += spn_array_count(arrayvalue(&argv[i]));
+	}
+
+	/* the elements of the first non-empty array are shared, the
+	 * others are copied, into a vector allocated only once
+	 */
+	result = spn_array_new();
+
+	for (i = 0; i < argc; i++) {
+		SpnArray *arr = arrayvalue(&argv[i]);
+		size_t n = spn_array_count(arr);
 
-		for (j = 0; j < n; j++) {
-			SpnValue tmp = spn_array_get(arr, j);
-			spn_array_push(result, &tmp);
+		if (n > 0 && n < total && spn_array_count(result) == 0) {
+			spn_array_reserve(result, total);
 		}
+
+		spn_array_inject(result, spn_array_count(result), arr);
 	}
 
+	*ret = makeobject(SPN_TYPE_ARRAY, result);
 	return 0;
 }
 
@@ -2316,19 +2862,26 @@ static void loadlib_array(SpnVMachine *vm)
 		{ "reduce",     rtlb_reduce        },
 		{ "filter",     rtlb_array_filter  },
 		{ "map",        rtlb_array_map     },
+		{ "pfilter",    rtlb_array_pfilter },
+		{ "pmap",       rtlb_array_pmap    },
 		{ "insert",     rtlb_insert        },
 		{ "inject",     rtlb_inject        },
 		{ "erase",      rtlb_erase         },
 		{ "concat",     rtlb_concat        },
-		{ "push",       rtlb_push          },
 		{ "pop",        rtlb_pop           },
 		{ "last",       rtlb_last          },
 		{ "swap",       rtlb_swap          },
 		{ "reverse",    rtlb_reverse       }
 	};
 
+	/* Leaf methods (see func.h) */
+	static const SpnExtFuncEx L[] = {
+		{ "push",       rtlb_push,       2, SPN_FUNC_LEAF }
+	};
+
 	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
 	load_methods(vm, SPN_TTAG_ARRAY, M, COUNT(M));
+	load_methods_ex(vm, SPN_TTAG_ARRAY, L, COUNT(L));
 }
 
 /*******************
@@ -2403,166 +2956,693 @@ static int rtlb_hashmap_map(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 			return -4;
 		}
 
-		spn_hashmap_set(result, &valkey[1], &tmp);
-		spn_value_release(&tmp);
+		spn_hashmap_set(result, &valkey[1], &tmp);
+		spn_value_release(&tmp);
+	}
+
+	*ret = makeobject(SPN_TYPE_HASHMAP, result);
+
+	return 0;
+}
+
+static int rtlb_hashmap_filter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t cursor = 0;
+	SpnHashMap *hm;
+	SpnHashMap *result;
+	SpnFunction *predicate;
+	SpnValue valkey[2];
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		return -1;
+	}
+
+	if (!ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be a hashmap", NULL);
+		return -2;
+	}
+
+	if (!isfunc(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
+		return -3;
+	}
+
+	result = spn_hashmap_new();
+	hm = hashmapvalue(&argv[0]);
+	predicate = funcvalue(&argv[1]);
+
+	while ((cursor = spn_hashmap_next(hm, cursor, &valkey[1], &valkey[0])) != 0) {
+		SpnValue tmp;
+		if (spn_ctx_callfunc(ctx, predicate, &tmp, COUNT(valkey), valkey) != 0) {
+			spn_object_release(result);
+			return -4;
+		}
+
+		if (!isbool(&tmp)) {
+			spn_object_release(result);
+			spn_value_release(&tmp);
+			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
+			return -5;
+		}
+
+		if (boolvalue(&tmp)) {
+			spn_hashmap_set(result, &valkey[1], &valkey[0]);
+		}
+	}
+
+	*ret = makeobject(SPN_TYPE_HASHMAP, result);
+
+	return 0;
+}
+
+/* if "getvals" is nonzero, this function will return an array composed
+ * of the values of the hashmap passed as its argument.
+ * Else, it will return an array of all the keys thereof.
+ */
+static int rtlb_aux_keyval(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int getvals)
+{
+	size_t it = 0;
+	SpnValue key, val;
+	SpnHashMap *hm;
+	SpnArray *result;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
+		return -1;
+	}
+
+	if (!ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "argument must be a hashmap", NULL);
+		return -2;
+	}
+
+	*ret = makearray();
+	result = arrayvalue(ret);
+	hm = hashmapvalue(&argv[0]);
+
+	while ((it = spn_hashmap_next(hm, it, &key, &val)) != 0) {
+		spn_array_push(result, getvals ? &val : &key);
+	}
+
+	return 0;
+}
+
+static int rtlb_keys(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+
+	return rtlb_aux_keyval(ret, argc, argv, ctx, 0);
+}
+
+static int rtlb_values(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+
+	return rtlb_aux_keyval(ret, argc, argv, ctx, 1);
+}
+
+static int rtlb_zip(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	size_t n, i;
+	SpnArray *keys, *vals;
+	SpnHashMap *result;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+		return -1;
+	}
+
+	if (!isarray(&argv[0]) || !isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "arguments must be arrays", NULL);
+		return -2;
+	}
+
+	*ret = makehashmap();
+	result = hashmapvalue(ret);
+	keys = arrayvalue(&argv[0]);
+	vals = arrayvalue(&argv[1]);
+
+	n = spn_array_count(keys);
+
+	if (spn_array_count(vals) != n) {
+		spn_ctx_runtime_error(ctx, "there must be exactly as many values as keys", NULL);
+		return -3;
+	}
+
+	for (i = 0; i < n; i++) {
+		SpnValue key = spn_array_get(keys, i);
+		SpnValue val = spn_array_get(vals, i);
+		spn_hashmap_set(result, &key, &val);
+	}
+
+	return 0;
+}
+
+static void loadlib_hashmap(SpnVMachine *vm)
+{
+	/* Free functions */
+	static const SpnExtFunc F[] = {
+		{ "zip",     rtlb_zip }
+	};
+
+	static const SpnExtFunc M[] = {
+		{ "foreach", rtlb_hashmap_foreach },
+		{ "map",     rtlb_hashmap_map     },
+		{ "filter",  rtlb_hashmap_filter  },
+		{ "keys",    rtlb_keys            },
+		{ "values",  rtlb_values          }
+	};
+
+	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
+	load_methods(vm, SPN_TTAG_HASHMAP, M, COUNT(M));
+}
+
+
+/***********************
+ * Typed array library *
+ ***********************/
+
+/* the name of the global hashmap that contains typed array methods */
+#define TYPEDARRAY_LIB_NAME "TypedArray"
+
+static SpnTypedArray *rtlb_aux_typedarray_arg(SpnValue *val)
+{
+	return spn_istypedarray(val) ? typedarrayvalue(val) : NULL;
+}
+
+/* creates a typed array from a size, an array of numbers,
+ * another typed array or (for byte buffers) a string
+ */
+static int rtlb_aux_new_typedarray(SpnValue *ret, int argc, SpnValue *argv, SpnContext *ctx, enum spn_typedarray_kind kind)
+{
+	SpnTypedArray *ta;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
+	}
+
+	if (isint(&argv[0])) {
+		long n = intvalue(&argv[0]);
+
+		if (n < 0) {
+			const void *args[1];
+			args[0] = &n;
+			spn_ctx_runtime_error(ctx, "size was negative (%d)", args);
+			return -2;
+		}
+
+		ta = spn_typedarray_new(kind, n);
+	} else if (isarray(&argv[0])) {
+		SpnArray *arr = arrayvalue(&argv[0]);
+		size_t i, n = spn_array_count(arr);
+
+		ta = spn_typedarray_new(kind, n);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(arr, i);
+
+			if (spn_typedarray_set(ta, i, &elem) != 0) {
+				const void *args[3];
+				long idx = i;
+				args[0] = &idx;
+				args[1] = spn_type_name(fulltype(&elem));
+				args[2] = spn_typedarray_kindname(kind);
+				spn_ctx_runtime_error(ctx, "element %d of type %s can't be stored in %s", args);
+				spn_object_release(ta);
+				return -3;
+			}
+		}
+	} else if (isstring(&argv[0]) && kind == SPN_TARR_BYTE) {
+		SpnString *str = stringvalue(&argv[0]);
+		ta = spn_typedarray_new(kind, str->len);
+		memcpy(spn_typedarray_data(ta), str->cstr, str->len);
+	} else if (spn_istypedarray(&argv[0])) {
+		SpnTypedArray *src = typedarrayvalue(&argv[0]);
+		size_t i, n = spn_typedarray_count(src);
+
+		ta = spn_typedarray_new(kind, n);
+
+		for (i = 0; i < n; i++) {
+			SpnValue elem = spn_typedarray_get(src, i);
+
+			if (spn_typedarray_set(ta, i, &elem) != 0) {
+				const void *args[2];
+				long idx = i;
+				args[0] = &idx;
+				args[1] = spn_typedarray_kindname(kind);
+				spn_ctx_runtime_error(ctx, "element %d can't be stored in %s", args);
+				spn_object_release(ta);
+				return -3;
+			}
+		}
+	} else {
+		spn_ctx_runtime_error(ctx, "argument must be a size, an array or a typed array", NULL);
+		return -2;
+	}
+
+	*ret = makestrguserinfo(ta);
+	return 0;
+}
+
+static int rtlb_int64array(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_new_typedarray(ret, argc, argv, ctx, SPN_TARR_INT64);
+}
+
+static int rtlb_float64array(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_new_typedarray(ret, argc, argv, ctx, SPN_TARR_FLOAT64);
+}
+
+static int rtlb_bytebuffer(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	return rtlb_aux_new_typedarray(ret, argc, argv, ctx, SPN_TARR_BYTE);
+}
+
+static int rtlb_istypedarray(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
+	}
+
+	*ret = makebool(spn_istypedarray(&argv[0]));
+	return 0;
+}
+
+static int rtlb_tarr_fill(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnTypedArray *ta;
+	size_t i, n;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
+		return -1;
+	}
+
+	ta = rtlb_aux_typedarray_arg(&argv[0]);
+	if (ta == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a typed array", NULL);
+		return -2;
+	}
+
+	n = spn_typedarray_count(ta);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	/* store the first element generically, so that the value is
+	 * validated, then replicate it with a type-specific loop
+	 */
+	if (spn_typedarray_set(ta, 0, &argv[1]) != 0) {
+		const void *args[2];
+		args[0] = spn_type_name(fulltype(&argv[1]));
+		args[1] = spn_typedarray_kindname(spn_typedarray_kind(ta));
+		spn_ctx_runtime_error(ctx, "cannot store value of type %s in %s", args);
+		return -3;
+	}
+
+	switch (spn_typedarray_kind(ta)) {
+	case SPN_TARR_INT64: {
+		long *p = spn_typedarray_data(ta);
+		for (i = 1; i < n; i++) {
+			p[i] = p[0];
+		}
+		break;
+	}
+	case SPN_TARR_FLOAT64: {
+		double *p = spn_typedarray_data(ta);
+		for (i = 1; i < n; i++) {
+			p[i] = p[0];
+		}
+		break;
+	}
+	case SPN_TARR_BYTE: {
+		unsigned char *p = spn_typedarray_data(ta);
+		memset(p, p[0], n);
+		break;
+	}
+	default:
+		SHANT_BE_REACHED();
+	}
+
+	return 0;
+}
+
+/* copy(dst, src [, offset]): copies all elements of 'src' (an array or a
+ * typed array) into 'dst', starting at index 'offset' (0 by default).
+ * Typed arrays of the same kind are copied with memmove(), so 'src' and
+ * 'dst' may be overlapping views of the same storage.
+ */
+static int rtlb_tarr_copy(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnTypedArray *dst, *src;
+	long offset = 0, n, length;
+	long i;
+
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	dst = rtlb_aux_typedarray_arg(&argv[0]);
+	if (dst == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a typed array", NULL);
+		return -2;
+	}
+
+	src = rtlb_aux_typedarray_arg(&argv[1]);
+	if (src == NULL && !isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an array or a typed array", NULL);
+		return -3;
+	}
+
+	if (argc == 3) {
+		if (!isint(&argv[2])) {
+			spn_ctx_runtime_error(ctx, "third argument must be an integer offset", NULL);
+			return -4;
+		}
+
+		offset = intvalue(&argv[2]);
+	}
+
+	n = src != NULL ? spn_typedarray_count(src) : spn_array_count(arrayvalue(&argv[1]));
+	length = spn_typedarray_count(dst);
+
+	if (offset < 0 || offset > length || n > length - offset) {
+		const void *args[3];
+		long end = offset + n;
+		args[0] = &offset;
+		args[1] = &end;
+		args[2] = &length;
+		spn_ctx_runtime_error(ctx, "range [%d, %d) out of bounds for typed array of size %d", args);
+		return -5;
+	}
+
+	if (src != NULL && spn_typedarray_kind(src) == spn_typedarray_kind(dst)) {
+		size_t elemsize = spn_typedarray_elemsize(spn_typedarray_kind(dst));
+		char *dstp = spn_typedarray_data(dst);
+		memmove(dstp + offset * elemsize, spn_typedarray_data(src), n * elemsize);
+		return 0;
+	}
+
+	/* Different kinds of storage. Since they can't alias,
+	 * the elements can be converted one by one.
+	 */
+	for (i = 0; i < n; i++) {
+		SpnValue elem = src != NULL ? spn_typedarray_get(src, i) : spn_array_get(arrayvalue(&argv[1]), i);
+
+		if (spn_typedarray_set(dst, offset + i, &elem) != 0) {
+			const void *args[3];
+			args[0] = &i;
+			args[1] = spn_type_name(fulltype(&elem));
+			args[2] = spn_typedarray_kindname(spn_typedarray_kind(dst));
+			spn_ctx_runtime_error(ctx, "element %d of type %s can't be stored in %s", args);
+			return -6;
+		}
+	}
+
+	return 0;
+}
+
+/* slice(ta, idx [, len]): like Array.slice(), but returns a view
+ * which shares its elements with 'ta' instead of copying them
+ */
+static int rtlb_tarr_slice(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnTypedArray *ta;
+	long idx, len, n;
+
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	ta = rtlb_aux_typedarray_arg(&argv[0]);
+	if (ta == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a typed array", NULL);
+		return -2;
+	}
+
+	if (!isint(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be an integer index", NULL);
+		return -3;
+	}
+
+	if (argc >= 3 && !isint(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "third argument must be an integer length", NULL);
+		return -4;
+	}
+
+	n = spn_typedarray_count(ta);
+	idx = intvalue(&argv[1]);
+	len = argc < 3 ? n - idx : intvalue(&argv[2]);
+
+	if (idx < 0 || idx > n || len < 0 || len > n - idx) {
+		const void *args[3];
+		long end = idx + len;
+		args[0] = &idx;
+		args[1] = &end;
+		args[2] = &n;
+		spn_ctx_runtime_error(ctx, "range [%d, %d) out of bounds for typed array of size %d", args);
+		return -5;
+	}
+
+	*ret = makestrguserinfo(spn_typedarray_slice(ta, idx, idx + len));
+	return 0;
+}
+
+/* makes a copy that doesn't share storage with the original */
+static int rtlb_tarr_clone(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnTypedArray *ta, *copy;
+	enum spn_typedarray_kind kind;
+	size_t n;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
+	}
+
+	ta = rtlb_aux_typedarray_arg(&argv[0]);
+	if (ta == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a typed array", NULL);
+		return -2;
+	}
+
+	kind = spn_typedarray_kind(ta);
+	n = spn_typedarray_count(ta);
+	copy = spn_typedarray_new(kind, n);
+	memcpy(spn_typedarray_data(copy), spn_typedarray_data(ta), n * spn_typedarray_elemsize(kind));
+
+	*ret = makestrguserinfo(copy);
+	return 0;
+}
+
+static int rtlb_tarr_toarray(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnTypedArray *ta;
+	SpnArray *arr;
+	size_t i, n;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
+	}
+
+	ta = rtlb_aux_typedarray_arg(&argv[0]);
+	if (ta == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a typed array", NULL);
+		return -2;
+	}
+
+	n = spn_typedarray_count(ta);
+	*ret = makearray();
+	arr = arrayvalue(ret);
+
+	for (i = 0; i < n; i++) {
+		SpnValue elem = spn_typedarray_get(ta, i);
+		spn_array_push(arr, &elem);
+	}
+
+	return 0;
+}
+
+/* the contents of a byte buffer as a string */
+static int rtlb_tarr_tostring(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnTypedArray *ta;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
 	}
 
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = result;
+	ta = rtlb_aux_typedarray_arg(&argv[0]);
+	if (ta == NULL || spn_typedarray_kind(ta) != SPN_TARR_BYTE) {
+		spn_ctx_runtime_error(ctx, "argument must be a byte buffer", NULL);
+		return -2;
+	}
 
+	*ret = makestring_len(spn_typedarray_data(ta), spn_typedarray_count(ta));
 	return 0;
 }
 
-static int rtlb_hashmap_filter(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_tarr_kind(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t cursor = 0;
-	SpnHashMap *hm;
-	SpnHashMap *result;
-	SpnFunction *predicate;
-	SpnValue valkey[2];
+	SpnTypedArray *ta;
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
 		return -1;
 	}
 
-	if (!ishashmap(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "first argument must be a hashmap", NULL);
+	ta = rtlb_aux_typedarray_arg(&argv[0]);
+	if (ta == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a typed array", NULL);
 		return -2;
 	}
 
-	if (!isfunc(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "second argument must be a function", NULL);
-		return -3;
-	}
+	*ret = makestring_nocopy(spn_typedarray_kindname(spn_typedarray_kind(ta)));
+	return 0;
+}
 
-	result = spn_hashmap_new();
-	hm = hashmapvalue(&argv[0]);
-	predicate = funcvalue(&argv[1]);
+/* the class descriptor of typed arrays is also exported as a global */
+static void loadlib_typedarray(SpnVMachine *vm)
+{
+	/* Free functions */
+	static const SpnExtFunc F[] = {
+		{ "Int64Array",   rtlb_int64array   },
+		{ "Float64Array", rtlb_float64array },
+		{ "ByteBuffer",   rtlb_bytebuffer   },
+		{ "istypedarray", rtlb_istypedarray }
+	};
 
-	while ((cursor = spn_hashmap_next(hm, cursor, &valkey[1], &valkey[0])) != 0) {
-		SpnValue tmp;
-		if (spn_ctx_callfunc(ctx, predicate, &tmp, COUNT(valkey), valkey) != 0) {
-			spn_object_release(result);
-			return -4;
-		}
+	/* Methods */
+	static const SpnExtFunc M[] = {
+		{ "fill",     rtlb_tarr_fill     },
+		{ "copy",     rtlb_tarr_copy     },
+		{ "slice",    rtlb_tarr_slice    },
+		{ "clone",    rtlb_tarr_clone    },
+		{ "toarray",  rtlb_tarr_toarray  },
+		{ "tostring", rtlb_tarr_tostring },
+		{ "kind",     rtlb_tarr_kind     }
+	};
 
-		if (!isbool(&tmp)) {
-			spn_object_release(result);
-			spn_value_release(&tmp);
-			spn_ctx_runtime_error(ctx, "predicate must return a Boolean", NULL);
-			return -5;
-		}
+	SpnHashMap *classdesc = load_class_methods(vm, spn_typedarray_class(), M, COUNT(M));
+	SpnExtValue C[1];
 
-		if (boolvalue(&tmp)) {
-			spn_hashmap_set(result, &valkey[1], &valkey[0]);
-		}
-	}
+	C[0].name = TYPEDARRAY_LIB_NAME;
+	C[0].value = makeobject(SPN_TYPE_HASHMAP, classdesc);
 
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = result;
+	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
+	spn_vm_addlib_values(vm, NULL, C, COUNT(C));
+}
 
-	return 0;
+
+/**************
+ * Coroutines *
+ **************/
+
+static SpnCoroutine *rtlb_aux_coroutine_arg(SpnValue *val)
+{
+	return spn_iscoroutine(val) ? coroutinevalue(val) : NULL;
 }
 
-/* if "getvals" is nonzero, this function will return an array composed
- * of the values of the hashmap passed as its argument.
- * Else, it will return an array of all the keys thereof.
- */
-static int rtlb_aux_keyval(SpnValue *ret, int argc, SpnValue *argv, void *ctx, int getvals)
+static int rtlb_coroutine(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t it = 0;
-	SpnValue key, val;
-	SpnHashMap *hm;
-	SpnArray *result;
+	SpnFunction *fn;
 
-	if (argc != 1) {
-		spn_ctx_runtime_error(ctx, "expecting one argument", NULL);
+	if (argc != 1 || !isfunc(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "argument must be a function", NULL);
 		return -1;
 	}
 
-	if (!ishashmap(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "argument must be a hashmap", NULL);
-		return -2;
-	}
-
-	*ret = makearray();
-	result = arrayvalue(ret);
-	hm = hashmapvalue(&argv[0]);
+	fn = funcvalue(&argv[0]);
 
-	while ((it = spn_hashmap_next(hm, it, &key, &val)) != 0) {
-		spn_array_push(result, getvals ? &val : &key);
+	if (fn->native) {
+		spn_ctx_runtime_error(ctx, "the body of a coroutine can't be a native function", NULL);
+		return -2;
 	}
 
+	*ret = makestrguserinfo(spn_coroutine_new(fn));
 	return 0;
 }
 
-static int rtlb_keys(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+/* the value passed to the next resume() is the return value */
+static int rtlb_yield(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
+	if (argc > 1) {
+		spn_ctx_runtime_error(ctx, "expecting at most one argument", NULL);
+		return -1;
+	}
 
-	return rtlb_aux_keyval(ret, argc, argv, ctx, 0);
+	return spn_ctx_yield(ctx, argc > 0 ? &argv[0] : &spn_nilval);
 }
 
-static int rtlb_values(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_iscoroutine(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
+	}
 
-	return rtlb_aux_keyval(ret, argc, argv, ctx, 1);
+	*ret = makebool(spn_iscoroutine(&argv[0]));
+	return 0;
 }
 
-static int rtlb_zip(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int rtlb_co_resume(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 {
-	size_t n, i;
-	SpnArray *keys, *vals;
-	SpnHashMap *result;
+	SpnCoroutine *co;
 
-	if (argc != 2) {
-		spn_ctx_runtime_error(ctx, "expecting two arguments", NULL);
+	if (argc < 1 || (co = rtlb_aux_coroutine_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a coroutine", NULL);
 		return -1;
 	}
 
-	if (!isarray(&argv[0]) || !isarray(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "arguments must be arrays", NULL);
-		return -2;
-	}
-
-	*ret = makehashmap();
-	result = hashmapvalue(ret);
-	keys = arrayvalue(&argv[0]);
-	vals = arrayvalue(&argv[1]);
-
-	n = spn_array_count(keys);
+	return spn_ctx_resume(ctx, co, ret, argc - 1, &argv[1]);
+}
 
-	if (spn_array_count(vals) != n) {
-		spn_ctx_runtime_error(ctx, "there must be exactly as many values as keys", NULL);
-		return -3;
-	}
+/* getter of the "status" property */
+static int rtlb_co_status(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	SpnCoroutine *co;
 
-	for (i = 0; i < n; i++) {
-		SpnValue key = spn_array_get(keys, i);
-		SpnValue val = spn_array_get(vals, i);
-		spn_hashmap_set(result, &key, &val);
+	if (argc < 1 || (co = rtlb_aux_coroutine_arg(&argv[0])) == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a coroutine", NULL);
+		return -1;
 	}
 
+	*ret = makestring_nocopy(spn_coroutine_statusname(spn_coroutine_status(co)));
 	return 0;
 }
 
-static void loadlib_hashmap(SpnVMachine *vm)
+static void loadlib_coroutine(SpnVMachine *vm)
 {
 	/* Free functions */
 	static const SpnExtFunc F[] = {
-		{ "zip",     rtlb_zip }
+		{ "Coroutine",   rtlb_coroutine   },
+		{ "yield",       rtlb_yield       },
+		{ "iscoroutine", rtlb_iscoroutine }
 	};
 
+	/* Methods */
 	static const SpnExtFunc M[] = {
-		{ "foreach", rtlb_hashmap_foreach },
-		{ "map",     rtlb_hashmap_map     },
-		{ "filter",  rtlb_hashmap_filter  },
-		{ "keys",    rtlb_keys            },
-		{ "values",  rtlb_values          }
+		{ "resume", rtlb_co_resume }
 	};
 
+	SpnHashMap *classdesc = load_class_methods(vm, spn_coroutine_class(), M, COUNT(M));
+	SpnValue accessors = makehashmap();
+	SpnValue getter = makenativefunc("status", rtlb_co_status);
+
+	spn_hashmap_set_strkey(hashmapvalue(&accessors), "get", &getter);
+	spn_hashmap_set_strkey(classdesc, "status", &accessors);
+
+	spn_value_release(&getter);
+	spn_value_release(&accessors);
+
 	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
-	load_methods(vm, SPN_TTAG_HASHMAP, M, COUNT(M));
 }
 
 
@@ -2970,9 +4050,9 @@ static int rtlb_abs(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	*ret = argv[0]; /* don't need to retain a number */
 
 	if (isfloat(ret)) {
-		ret->v.f = fabs(ret->v.f);
-	} else if (ret->v.i < 0) {
-		ret->v.i = -ret->v.i;
+		*ret = makefloat(fabs(floatvalue(ret)));
+	} else if (intvalue(ret) < 0) {
+		*ret = makeint(-intvalue(ret));
 	}
 
 	return 0;
@@ -3196,8 +4276,7 @@ static int rtlb_range(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -1; /* silence "used uninitialized" warning */
 	}
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = range;
+	*ret = makeobject(SPN_TYPE_ARRAY, range);
 
 	return 0;
 }
@@ -3294,6 +4373,170 @@ static int rtlb_binom(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	return 0;
 }
 
+/* Vector helpers for Float64Array. They are written as plain loops over
+ * the packed elements, with no aliasing between loads and stores within
+ * an iteration, so that the compiler can vectorize them.
+ */
+static double *rtlb_aux_float64_arg(SpnValue *val, size_t *n)
+{
+	SpnTypedArray *ta;
+
+	if (!spn_istypedarray(val)) {
+		return NULL;
+	}
+
+	ta = typedarrayvalue(val);
+
+	if (spn_typedarray_kind(ta) != SPN_TARR_FLOAT64) {
+		return NULL;
+	}
+
+	*n = spn_typedarray_count(ta);
+	return spn_typedarray_data(ta);
+}
+
+/* sum of all elements. Four independent partial sums break the
+ * dependency chain between consecutive additions.
+ */
+static int rtlb_vsum(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+	double *x;
+	size_t i, n = 0;
+
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "exactly one argument is required", NULL);
+		return -1;
+	}
+
+	x = rtlb_aux_float64_arg(&argv[0], &n);
+	if (x == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a Float64Array", NULL);
+		return -2;
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += x[i + 0];
+		s1 += x[i + 1];
+		s2 += x[i + 2];
+		s3 += x[i + 3];
+	}
+
+	for (; i < n; i++) {
+		s0 += x[i];
+	}
+
+	*ret = makefloat((s0 + s1) + (s2 + s3));
+	return 0;
+}
+
+static int rtlb_vdot(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+	double *x, *y;
+	size_t i, n = 0, m = 0;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
+		return -1;
+	}
+
+	x = rtlb_aux_float64_arg(&argv[0], &n);
+	y = rtlb_aux_float64_arg(&argv[1], &m);
+
+	if (x == NULL || y == NULL) {
+		spn_ctx_runtime_error(ctx, "arguments must be Float64Arrays", NULL);
+		return -2;
+	}
+
+	if (n != m) {
+		spn_ctx_runtime_error(ctx, "arguments must be of the same length", NULL);
+		return -3;
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += x[i + 0] * y[i + 0];
+		s1 += x[i + 1] * y[i + 1];
+		s2 += x[i + 2] * y[i + 2];
+		s3 += x[i + 3] * y[i + 3];
+	}
+
+	for (; i < n; i++) {
+		s0 += x[i] * y[i];
+	}
+
+	*ret = makefloat((s0 + s1) + (s2 + s3));
+	return 0;
+}
+
+/* x[i] *= k, in place */
+static int rtlb_vscale(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	double *x, k;
+	size_t i, n = 0;
+
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "exactly two arguments are required", NULL);
+		return -1;
+	}
+
+	x = rtlb_aux_float64_arg(&argv[0], &n);
+	if (x == NULL) {
+		spn_ctx_runtime_error(ctx, "first argument must be a Float64Array", NULL);
+		return -2;
+	}
+
+	if (!isnum(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "second argument must be a number", NULL);
+		return -3;
+	}
+
+	k = spn_floatvalue_f(&argv[1]);
+
+	for (i = 0; i < n; i++) {
+		x[i] *= k;
+	}
+
+	return 0;
+}
+
+/* y[i] += a * x[i], in place ("a times x plus y") */
+static int rtlb_vaxpy(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	double a, *x, *y;
+	size_t i, n = 0, m = 0;
+
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "exactly three arguments are required", NULL);
+		return -1;
+	}
+
+	if (!isnum(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "first argument must be a number", NULL);
+		return -2;
+	}
+
+	a = spn_floatvalue_f(&argv[0]);
+	x = rtlb_aux_float64_arg(&argv[1], &n);
+	y = rtlb_aux_float64_arg(&argv[2], &m);
+
+	if (x == NULL || y == NULL) {
+		spn_ctx_runtime_error(ctx, "second and third arguments must be Float64Arrays", NULL);
+		return -3;
+	}
+
+	if (n != m) {
+		spn_ctx_runtime_error(ctx, "arguments must be of the same length", NULL);
+		return -4;
+	}
+
+	for (i = 0; i < n; i++) {
+		y[i] += a * x[i];
+	}
+
+	return 0;
+}
+
 /*******************
  * Complex library *
  *******************/
@@ -3597,45 +4840,18 @@ static void loadlib_math(SpnVMachine *vm)
 {
 	/* Free functions */
 	static const SpnExtFunc F[] = {
-		{ "abs",       rtlb_abs         },
 		{ "min",       rtlb_min         },
 		{ "max",       rtlb_max         },
 		{ "range",     rtlb_range       },
-		{ "floor",     rtlb_floor       },
-		{ "ceil",      rtlb_ceil        },
-		{ "round",     rtlb_round       },
-		{ "sgn",       rtlb_sgn         },
 		{ "hypot",     rtlb_hypot       },
-		{ "sqrt",      rtlb_sqrt        },
-		{ "cbrt",      rtlb_cbrt        },
-		{ "pow",       rtlb_pow         },
-		{ "exp",       rtlb_exp         },
-		{ "exp2",      rtlb_exp2        },
-		{ "exp10",     rtlb_exp10       },
-		{ "log",       rtlb_log         },
-		{ "log2",      rtlb_log2        },
-		{ "log10",     rtlb_log10       },
-		{ "sin",       rtlb_sin         },
-		{ "cos",       rtlb_cos         },
-		{ "tan",       rtlb_tan         },
-		{ "sinh",      rtlb_sinh        },
-		{ "cosh",      rtlb_cosh        },
-		{ "tanh",      rtlb_tanh        },
-		{ "asin",      rtlb_asin        },
-		{ "acos",      rtlb_acos        },
-		{ "atan",      rtlb_atan        },
-		{ "atan2",     rtlb_atan2       },
-		{ "deg2rad",   rtlb_deg2rad     },
-		{ "rad2deg",   rtlb_rad2deg     },
 		{ "random",    rtlb_random      },
 		{ "seed",      rtlb_seed        },
-		{ "isfin",     rtlb_isfin       },
-		{ "isinf",     rtlb_isinf       },
-		{ "isnan",     rtlb_isnan       },
-		{ "isfloat",   rtlb_isfloat     },
-		{ "isint",     rtlb_isint       },
 		{ "fact",      rtlb_fact        },
 		{ "binom",     rtlb_binom       },
+		{ "vsum",      rtlb_vsum        },
+		{ "vdot",      rtlb_vdot        },
+		{ "vscale",    rtlb_vscale      },
+		{ "vaxpy",     rtlb_vaxpy       },
 		{ "cplx_add",  rtlb_cplx_add    }, /* TODO: add square root, power and logarithm */
 		{ "cplx_sub",  rtlb_cplx_sub    },
 		{ "cplx_mul",  rtlb_cplx_mul    },
@@ -3649,6 +4865,41 @@ static void loadlib_math(SpnVMachine *vm)
 		{ "pol2can",   rtlb_pol2can     }
 	};
 
+	/* Leaf functions (see func.h) */
+	static const SpnExtFuncEx L[] = {
+		{ "abs",      rtlb_abs,        1, SPN_FUNC_LEAF },
+		{ "floor",    rtlb_floor,      1, SPN_FUNC_LEAF },
+		{ "ceil",     rtlb_ceil,       1, SPN_FUNC_LEAF },
+		{ "round",    rtlb_round,      1, SPN_FUNC_LEAF },
+		{ "sgn",      rtlb_sgn,        1, SPN_FUNC_LEAF },
+		{ "sqrt",     rtlb_sqrt,       1, SPN_FUNC_LEAF },
+		{ "cbrt",     rtlb_cbrt,       1, SPN_FUNC_LEAF },
+		{ "pow",      rtlb_pow,        2, SPN_FUNC_LEAF },
+		{ "exp",      rtlb_exp,        1, SPN_FUNC_LEAF },
+		{ "exp2",     rtlb_exp2,       1, SPN_FUNC_LEAF },
+		{ "exp10",    rtlb_exp10,      1, SPN_FUNC_LEAF },
+		{ "log",      rtlb_log,        1, SPN_FUNC_LEAF },
+		{ "log2",     rtlb_log2,       1, SPN_FUNC_LEAF },
+		{ "log10",    rtlb_log10,      1, SPN_FUNC_LEAF },
+		{ "sin",      rtlb_sin,        1, SPN_FUNC_LEAF },
+		{ "cos",      rtlb_cos,        1, SPN_FUNC_LEAF },
+		{ "tan",      rtlb_tan,        1, SPN_FUNC_LEAF },
+		{ "sinh",     rtlb_sinh,       1, SPN_FUNC_LEAF },
+		{ "cosh",     rtlb_cosh,       1, SPN_FUNC_LEAF },
+		{ "tanh",     rtlb_tanh,       1, SPN_FUNC_LEAF },
+		{ "asin",     rtlb_asin,       1, SPN_FUNC_LEAF },
+		{ "acos",     rtlb_acos,       1, SPN_FUNC_LEAF },
+		{ "atan",     rtlb_atan,       1, SPN_FUNC_LEAF },
+		{ "atan2",    rtlb_atan2,      2, SPN_FUNC_LEAF },
+		{ "deg2rad",  rtlb_deg2rad,    1, SPN_FUNC_LEAF },
+		{ "rad2deg",  rtlb_rad2deg,    1, SPN_FUNC_LEAF },
+		{ "isfin",    rtlb_isfin,      1, SPN_FUNC_LEAF },
+		{ "isinf",    rtlb_isinf,      1, SPN_FUNC_LEAF },
+		{ "isnan",    rtlb_isnan,      1, SPN_FUNC_LEAF },
+		{ "isfloat",  rtlb_isfloat,    1, SPN_FUNC_LEAF },
+		{ "isint",    rtlb_isint,      1, SPN_FUNC_LEAF }
+	};
+
 	/* Constants */
 	SpnExtValue C[6];
 
@@ -3671,6 +4922,7 @@ static void loadlib_math(SpnVMachine *vm)
 	C[5].value = makefloat(0.0 / 0.0);
 
 	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
+	spn_vm_addlib_cfuncs_ex(vm, NULL, L, COUNT(L));
 	spn_vm_addlib_values(vm, NULL, C, COUNT(C));
 }
 
@@ -3910,8 +5162,7 @@ static int rtlb_aux_gettm(SpnValue *ret, int argc, SpnValue *argv, SpnContext *c
 	spn_hashmap_set_strkey(hm, "isdst", &val);
 
 	/* return the array */
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = hm;
+	*ret = makeobject(SPN_TYPE_HASHMAP, hm);
 
 	return 0;
 }
@@ -4071,8 +5322,7 @@ static int rtlb_aux_parse(SpnValue *ret, int argc, SpnValue *argv, void *ctx, in
 		return -1;
 	}
 
-	ret->type = SPN_TYPE_HASHMAP;
-	ret->v.o = ast;
+	*ret = makeobject(SPN_TYPE_HASHMAP, ast);
 	return 0;
 }
 
@@ -4110,8 +5360,7 @@ static int rtlb_compilestr(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 	}
 
 	/* return function, make it owning */
-	ret->type = SPN_TYPE_FUNC;
-	ret->v.o = fn;
+	*ret = makeobject(SPN_TYPE_FUNC, fn);
 	spn_value_retain(ret);
 
 	return 0;
@@ -4133,7 +5382,7 @@ static int rtlb_require(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	fname = stringvalue(&argv[0]);
 
-	if (spn_ctx_execsrcfile(ctx, fname->cstr, ret) != 0) {
+	if (spn_ctx_require(ctx, fname->cstr, ret) != 0) {
 		parser_or_compiler_error_to_runtime(ctx);
 		return -1;
 	}
@@ -4164,8 +5413,7 @@ static int rtlb_exprtofn(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -3;
 	}
 
-	ret->type = SPN_TYPE_FUNC;
-	ret->v.o = fn;
+	*ret = makeobject(SPN_TYPE_FUNC, fn);
 	spn_value_retain(ret);
 
 	return 0;
@@ -4212,8 +5460,10 @@ static int rtlb_compileast(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 		return -3;
 	}
 
-	ret->type = SPN_TYPE_FUNC;
-	ret->v.o = fn;
+	/* return function, make it owning */
+	*ret = makeobject(SPN_TYPE_FUNC, fn);
+	spn_value_retain(ret);
+
 	return 0;
 }
 
@@ -4400,8 +5650,68 @@ static int rtlb_backtrace(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
 
 	free(bt);
 
-	ret->type = SPN_TYPE_ARRAY;
-	ret->v.o = fnames;
+	*ret = makeobject(SPN_TYPE_ARRAY, fnames);
+	return 0;
+}
+
+/* frees garbage reference cycles, returns the number of objects freed */
+static int rtlb_gc(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	*ret = makeint(spn_ctx_gc(ctx));
+	return 0;
+}
+
+/* maps the names (or, for classes of extensions, the UIDs) of classes
+ * to the number of their live instances, to the size of those, and to
+ * the number of instances allocated so far
+ */
+static int rtlb_heapstats(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	static const char *const classnames[] = {
+		NULL,
+		"string",
+		"array",
+		"hashmap",
+		"function",
+		"filehandle",
+		"symtabentry",
+		"symbolstub",
+		"linetable",
+		"typedarray",
+		"stringbuilder",
+		"coroutine",
+		"arraystore"
+	};
+
+	size_t n, i;
+	SpnHeapStat *stats = spn_ctx_heapstats(ctx, &n);
+	SpnHashMap *hm = spn_hashmap_new();
+
+	for (i = 0; i < n; i++) {
+		SpnValue key, entry;
+		SpnValue nobjs = makeint(stats[i].nobjs);
+		SpnValue nbytes = makeint(stats[i].nbytes);
+		SpnValue nallocs = makeint(stats[i].nallocs);
+
+		if (stats[i].UID < COUNT(classnames) && classnames[stats[i].UID] != NULL) {
+			key = makestring_nocopy(classnames[stats[i].UID]);
+		} else {
+			key = makeint(stats[i].UID);
+		}
+
+		entry = makehashmap();
+		spn_hashmap_set_strkey(hashmapvalue(&entry), "objects", &nobjs);
+		spn_hashmap_set_strkey(hashmapvalue(&entry), "bytes", &nbytes);
+		spn_hashmap_set_strkey(hashmapvalue(&entry), "allocs", &nallocs);
+
+		spn_hashmap_set(hm, &key, &entry);
+		spn_value_release(&key);
+		spn_value_release(&entry);
+	}
+
+	free(stats);
+
+	*ret = makeobject(SPN_TYPE_HASHMAP, hm);
 	return 0;
 }
 
@@ -4477,12 +5787,18 @@ static void loadlib_sysutil(SpnVMachine *vm)
 		{ "compilestr", rtlb_compilestr },
 		{ "exprtofn",   rtlb_exprtofn   },
 		{ "compileast", rtlb_compileast },
-		{ "toint",      rtlb_toint      },
-		{ "tofloat",    rtlb_tofloat    },
-		{ "tonumber",   rtlb_tonumber   },
 		{ "require",    rtlb_require    },
 		{ "dynld",      rtlb_dynld      },
 		{ "backtrace",  rtlb_backtrace  },
+		{ "gc",         rtlb_gc         },
+		{ "heapstats",  rtlb_heapstats  },
+	};
+
+	/* Leaf functions (see func.h) */
+	static const SpnExtFuncEx L[] = {
+		{ "toint",      rtlb_toint,      2, SPN_FUNC_LEAF },
+		{ "tofloat",    rtlb_tofloat,    1, SPN_FUNC_LEAF },
+		{ "tonumber",   rtlb_tonumber,   2, SPN_FUNC_LEAF }
 	};
 
 	/* Methods */
@@ -4513,6 +5829,7 @@ static void loadlib_sysutil(SpnVMachine *vm)
 	C[3].value = spn_hashmap_get(classes, &funcindex);
 
 	spn_vm_addlib_cfuncs(vm, NULL, F, COUNT(F));
+	spn_vm_addlib_cfuncs_ex(vm, NULL, L, COUNT(L));
 	spn_vm_addlib_values(vm, NULL, C, COUNT(C));
 	load_methods(vm, SPN_TTAG_FUNC, M, COUNT(M));
 }
@@ -4521,8 +5838,8 @@ static void loadlib_sysutil(SpnVMachine *vm)
 /* By default, only strings, arrays hashmaps and functions are considered
  * "object-like", while nil, booleans and numbers are not.
  * (Frankly, why would you ever call a method on a boolean?)
- * User info values can only have their methods and properties defined
- * instance-wise.
+ * User info values have their methods and properties defined either
+ * instance-wise or, for objects, per class (see load_class_methods()).
  */
 static void init_stdlib_classes(SpnVMachine *vm)
 {
@@ -4559,8 +5876,11 @@ void spn_load_native_stdlib(SpnVMachine *vm)
 
 	loadlib_io(vm);
 	loadlib_string(vm);
+	loadlib_strbuilder(vm);
 	loadlib_array(vm);
 	loadlib_hashmap(vm);
+	loadlib_typedarray(vm);
+	loadlib_coroutine(vm);
 	loadlib_math(vm);
 	loadlib_sysutil(vm);
 }
@@ -15,8 +15,13 @@
 #include <math.h>
 #include <stdarg.h>
 
+#if USE_THREADS
+#include <pthread.h>
+#endif /* USE_THREADS */
+
 #include "str.h"
 #include "private.h"
+#include "pool.h"
 
 
 static int compare_strings(void *lhs, void *rhs);
@@ -30,15 +35,37 @@ static const SpnClass spn_class_string = {
 	equal_strings,
 	compare_strings,
 	hash_string,
-	free_string
+	free_string,
+	NULL
+};
+
+/* values of the 'dealloc' member. Buffers of strings created by copying
+ * come from the object pool; those passed in by the user are free()'d,
+ * and file mappings are unmapped.
+ */
+enum {
+	STR_DEALLOC_NONE,
+	STR_DEALLOC_FREE,
+	STR_DEALLOC_POOL,
+	STR_DEALLOC_UNMAP
 };
 
 static void free_string(void *obj)
 {
 	SpnString *str = obj;
 
-	if (str->dealloc) {
+	switch (str->dealloc) {
+	case STR_DEALLOC_FREE:
 		free(str->cstr);
+		break;
+	case STR_DEALLOC_POOL:
+		spn_pool_free(str->cstr, str->len + 1);
+		break;
+	case STR_DEALLOC_UNMAP:
+		spn_unmap_file(str->cstr, str->len);
+		break;
+	default:
+		break;
 	}
 }
 
@@ -62,7 +89,14 @@ static int compare_strings(void *lp, void *rp)
 
 static int equal_strings(void *lp, void *rp)
 {
-	return compare_strings(lp, rp) == 0;
+	SpnString *lhs = lp, *rhs = rp;
+
+	/* canonical strings of the same intern table are equal iff identical */
+	if (lhs->internid != 0 && lhs->internid == rhs->internid) {
+		return lhs == rhs;
+	}
+
+	return lhs->len == rhs->len && memcmp(lhs->cstr, rhs->cstr, lhs->len) == 0;
 }
 
 /* Helper function for the constructors.
@@ -74,6 +108,7 @@ static void init_string(SpnString *strobj, const char *cstr, size_t len, int dea
 	strobj->len = len;
 	strobj->dealloc = dealloc;
 	strobj->ishashed = 0;
+	strobj->internid = 0;
 }
 
 /* since strings are immutable, it's enough to generate the hash on-demand,
@@ -104,79 +139,287 @@ SpnString *spn_string_new_nocopy(const char *cstr, int dealloc)
 
 SpnString *spn_string_new_len(const char *cstr, size_t len)
 {
-	char *buf = spn_malloc(len + 1);
+	char *buf = spn_pool_alloc(len + 1);
+	SpnString *strobj = spn_object_new(&spn_class_string);
+
 	memcpy(buf, cstr, len); /* so that strings can hold binary data */
 	buf[len] = 0;
 
-	return spn_string_new_nocopy_len(buf, len, 1);
+	init_string(strobj, buf, len, STR_DEALLOC_POOL);
+	return strobj;
 }
 
 SpnString *spn_string_new_nocopy_len(const char *cstr, size_t len, int dealloc)
 {
 	SpnString *strobj = spn_object_new(&spn_class_string);
-	init_string(strobj, cstr, len, dealloc);
+	init_string(strobj, cstr, len, dealloc ? STR_DEALLOC_FREE : STR_DEALLOC_NONE);
+	return strobj;
+}
+
+SpnString *spn_string_new_mapped(char *cstr, size_t len)
+{
+	SpnString *strobj = spn_object_new(&spn_class_string);
+	init_string(strobj, cstr, len, STR_DEALLOC_UNMAP);
 	return strobj;
 }
 
 SpnString spn_string_emplace_nonretained_for_hashmap(const char *cstr)
 {
-	SpnString strobj = { { &spn_class_string, UINT_MAX } };
+	SpnString strobj;
+
+	/* the object is never retained or released, nor seen by the collector */
+	memset(&strobj, 0, sizeof strobj);
+	strobj.base.isa = &spn_class_string;
+	strobj.base.refcnt = UINT_MAX;
+	strobj.base.gcinfo = 0;
 
 	/* Initialize object with the actual C string.
 	 * The buffer doesn't need to be deallocated.
 	 */
-	init_string(&strobj, cstr, strlen(cstr), 0);
+	init_string(&strobj, cstr, strlen(cstr), STR_DEALLOC_NONE);
 	return strobj;
 }
 
 SpnString *spn_string_concat(SpnString *lhs, SpnString *rhs)
 {
 	size_t len = lhs->len + rhs->len;
-	char *buf = spn_malloc(len + 1);
+	char *buf = spn_pool_alloc(len + 1);
+	SpnString *strobj = spn_object_new(&spn_class_string);
 
 	memcpy(buf, lhs->cstr, lhs->len);
 	memcpy(buf + lhs->len, rhs->cstr, rhs->len);
 	buf[len] = 0;
 
-	return spn_string_new_nocopy_len(buf, len, 1);
+	init_string(strobj, buf, len, STR_DEALLOC_POOL);
+	return strobj;
 }
 
-/*********************************************
- * Creating printf()-style formatted strings *
- *********************************************/
+SpnString *spn_string_concat_all(SpnString *strs[], size_t n)
+{
+	size_t len = 0, i;
+	char *buf, *p;
+	SpnString *strobj;
 
-struct string_builder {
-	size_t len;
-	size_t allocsz;
-	char *buf;
-};
+	for (i = 0; i < n; i++) {
+		len += strs[i]->len;
+	}
+
+	buf = spn_pool_alloc(len + 1);
+	strobj = spn_object_new(&spn_class_string);
+
+	p = buf;
+	for (i = 0; i < n; i++) {
+		memcpy(p, strs[i]->cstr, strs[i]->len);
+		p += strs[i]->len;
+	}
+
+	*p = 0;
+
+	init_string(strobj, buf, len, STR_DEALLOC_POOL);
+	return strobj;
+}
+
+/* String interning */
+
+/* IDs of intern tables; 0 means "not interned". Contexts may be
+ * initialized on several threads at once, hence the lock.
+ */
+static unsigned long next_internid = 1;
+
+#if USE_THREADS
+static pthread_mutex_t internid_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* USE_THREADS */
+
+/* a table is swept when it grows past this many strings */
+#define INTERN_MINSWEEP 256
+
+void spn_interntab_init(SpnInternTable *tab)
+{
+	tab->strings = spn_hashmap_new();
+	tab->sweepat = INTERN_MINSWEEP;
+
+#if USE_THREADS
+	pthread_mutex_lock(&internid_lock);
+#endif /* USE_THREADS */
 
-static void init_builder(struct string_builder *bld)
+	tab->id = next_internid++;
+
+#if USE_THREADS
+	pthread_mutex_unlock(&internid_lock);
+#endif /* USE_THREADS */
+}
+
+void spn_interntab_free(SpnInternTable *tab)
+{
+	spn_object_release(tab->strings);
+	tab->strings = NULL;
+}
+
+size_t spn_interntab_sweep(SpnInternTable *tab)
+{
+	SpnString **unused;
+	SpnValue key, val;
+	size_t cursor = 0, n = 0, i;
+	size_t count = spn_hashmap_count(tab->strings);
+
+	if (count == 0) {
+		return 0;
+	}
+
+	/* the table holds two references to each one of its strings (as a
+	 * key and as a value), so those with no more are unused. They can't
+	 * be deleted while the table is being enumerated, though.
+	 */
+	unused = spn_malloc(count * sizeof unused[0]);
+
+	while ((cursor = spn_hashmap_next(tab->strings, cursor, &key, &val)) != 0) {
+		if (stringvalue(&key)->base.refcnt == 2) {
+			unused[n++] = stringvalue(&key);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		key = makeobject(SPN_TYPE_STRING, unused[i]);
+
+		/* keep the key alive until the deletion is over */
+		spn_object_retain(unused[i]);
+		spn_hashmap_delete(tab->strings, &key);
+		spn_object_release(unused[i]);
+	}
+
+	free(unused);
+	return n;
+}
+
+SpnString *spn_string_intern(SpnInternTable *tab, const char *cstr, size_t len)
+{
+	SpnString key;
+	SpnValue keyval, canonval;
+	SpnString *canon;
+
+	/* look up the contents without allocating a new string */
+	memset(&key, 0, sizeof key);
+	key.base.isa = &spn_class_string;
+	key.base.refcnt = UINT_MAX;
+	key.base.gcinfo = 0;
+	init_string(&key, cstr, len, STR_DEALLOC_NONE);
+	keyval = makeobject(SPN_TYPE_STRING, &key);
+	canonval = spn_hashmap_get(tab->strings, &keyval);
+
+	if (isstring(&canonval)) {
+		canon = stringvalue(&canonval);
+		spn_object_retain(canon);
+		return canon;
+	}
+
+	/* Not found. Get rid of the strings nobody uses anymore first, if
+	 * there are many of them, so that the table only grows in proportion
+	 * to the number of strings in use.
+	 */
+	if (spn_hashmap_count(tab->strings) >= tab->sweepat) {
+		spn_interntab_sweep(tab);
+		tab->sweepat = 2 * spn_hashmap_count(tab->strings) + INTERN_MINSWEEP;
+	}
+
+	/* Make an owned copy, since 'cstr' may be a borrowed pointer
+	 * (e. g. into bytecode) which does not live as long as the table.
+	 * Inserting it computes and caches its hash.
+	 */
+	canon = spn_string_new_len(cstr, len);
+	canon->internid = tab->id;
+	canonval = makeobject(SPN_TYPE_STRING, canon);
+	spn_hashmap_set(tab->strings, &canonval, &canonval);
+
+	return canon;
+}
+
+/******************
+ * String builder *
+ ******************/
+
+void spn_strbuilder_init(SpnStringBuilder *bld, size_t capacity)
 {
 	bld->len = 0;
-	bld->allocsz = 0x10;
-	bld->buf = spn_malloc(bld->allocsz);
+	bld->allocsz = 0;
+	bld->buf = NULL;
+
+	if (capacity > 0) {
+		spn_strbuilder_reserve(bld, capacity);
+	}
+}
+
+void spn_strbuilder_free(SpnStringBuilder *bld)
+{
+	free(bld->buf);
+	spn_strbuilder_init(bld, 0);
 }
 
-static void expand_buffer(struct string_builder *bld, size_t extra)
+/* one extra byte is always kept for the NUL terminator,
+ * which spn_strbuilder_tostring() appends
+ */
+void spn_strbuilder_reserve(SpnStringBuilder *bld, size_t extra)
 {
-	if (bld->allocsz < bld->len + extra) {
-		while (bld->allocsz < bld->len + extra) {
-			bld->allocsz *= 2;
+	size_t required = bld->len + extra + 1;
+
+	if (bld->allocsz < required) {
+		size_t allocsz = bld->allocsz > 0 ? bld->allocsz : 0x10;
+
+		while (allocsz < required) {
+			allocsz *= 2;
+		}
+
+		/* there's no point in doubling if the caller knows the size */
+		if (bld->buf == NULL) {
+			allocsz = required;
 		}
 
-		bld->buf = spn_realloc(bld->buf, bld->allocsz);
+		bld->buf = spn_realloc(bld->buf, allocsz);
+		bld->allocsz = allocsz;
 	}
 }
 
-/* appends a literal string */
-static void append_string(struct string_builder *bld, const char *str, size_t len)
+void spn_strbuilder_append(SpnStringBuilder *bld, const char *str, size_t len)
 {
-	expand_buffer(bld, len);
+	spn_strbuilder_reserve(bld, len);
 	memcpy(bld->buf + bld->len, str, len);
 	bld->len += len;
 }
 
+/* NUL-terminates the buffer, and passes its ownership to the caller */
+static char *detach_buffer(SpnStringBuilder *bld, size_t *len)
+{
+	char *buf;
+
+	spn_strbuilder_reserve(bld, 0);
+	bld->buf[bld->len] = 0;
+
+	/* give back the memory if more than half of it is unused;
+	 * shrinking a block usually doesn't need to move it
+	 */
+	if (bld->allocsz > 2 * (bld->len + 1)) {
+		bld->buf = spn_realloc(bld->buf, bld->len + 1);
+	}
+
+	buf = bld->buf;
+
+	if (len != NULL) {
+		*len = bld->len;
+	}
+
+	spn_strbuilder_init(bld, 0);
+	return buf;
+}
+
+SpnString *spn_strbuilder_tostring(SpnStringBuilder *bld)
+{
+	size_t len;
+	char *buf = detach_buffer(bld, &len);
+	return spn_string_new_nocopy_len(buf, len, 1);
+}
+
+/*********************************************
+ * Creating printf()-style formatted strings *
+ *********************************************/
 
 /* an upper bound for number of characters required to print an integer:
  * number of bits, +1 for sign, +2 for base prefix
@@ -419,7 +662,7 @@ static void format_errmsg(char **msg, enum format_error_kind kind, int argidx, .
 
 /* returns zero on success, nonzero on error */
 static int append_format(
-	struct string_builder *bld,
+	SpnStringBuilder *bld,
 	const struct format_args *args,
 	void *argv,
 	int *argidx,
@@ -429,7 +672,7 @@ static int append_format(
 {
 	switch (args->spec) {
 	case '%':
-		append_string(bld, "%", 1);
+		spn_strbuilder_append(bld, "%", 1);
 		break;
 	case 's': {
 		const char *str;
@@ -446,7 +689,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TYPE_STRING,
-					val->type
+					fulltype(val)
 				);
 				return -1;
 			}
@@ -465,14 +708,14 @@ static int append_format(
 
 		if (args->width >= 0 && args->width > len) {
 			size_t pad = args->width - len;
-			expand_buffer(bld, pad);
+			spn_strbuilder_reserve(bld, pad);
 
 			while (pad-- > 0) {
 				bld->buf[bld->len++] = ' ';
 			}
 		}
 
-		append_string(bld, str, len);
+		spn_strbuilder_append(bld, str, len);
 		break;
 	}
 	case 'i':
@@ -498,7 +741,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_NUMBER,
-					val->type
+					fulltype(val)
 				);
 				return -1;
 			}
@@ -547,7 +790,7 @@ static int append_format(
 		begin = ulong2str(end, u, base, args->width, flags);
 
 		assert(buf <= begin);
-		append_string(bld, begin, end - begin);
+		spn_strbuilder_append(bld, begin, end - begin);
 		free(buf);
 
 		break;
@@ -566,7 +809,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_NUMBER,
-					val->type
+					fulltype(val)
 				);
 				return -1;
 			}
@@ -585,7 +828,7 @@ static int append_format(
 			len = args->width;
 		}
 
-		expand_buffer(bld, len);
+		spn_strbuilder_reserve(bld, len);
 
 		while (len-- > 1) {
 			bld->buf[bld->len++] = ' ';
@@ -628,7 +871,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_NUMBER,
-					val->type
+					fulltype(val)
 				);
 				return -1;
 			}
@@ -673,7 +916,7 @@ static int append_format(
 		fmtspec[i++] = args->spec;
 
 		written = sprintf(buf, fmtspec, width, prec, x);
-		append_string(bld, buf, written);
+		spn_strbuilder_append(bld, buf, written);
 
 		break;
 	}
@@ -691,7 +934,7 @@ static int append_format(
 					TYPE_MISMATCH,
 					*argidx,
 					SPN_TTAG_BOOL,
-					val->type
+					fulltype(val)
 				);
 				return -1;
 			}
@@ -710,14 +953,14 @@ static int append_format(
 
 		if (args->width >= 0 && args->width > len) {
 			size_t pad = args->width - len;
-			expand_buffer(bld, pad);
+			spn_strbuilder_reserve(bld, pad);
 
 			while (pad-- > 0) {
 				bld->buf[bld->len++] = ' ';
 			}
 		}
 
-		append_string(bld, str, len);
+		spn_strbuilder_append(bld, str, len);
 		break;
 	}
 	default:
@@ -735,28 +978,27 @@ static int append_format(
  * instead of a 'long'. It is used only for formatting error messages (since
  * Sparkling integers are all 'long's), but feel free to use it yourself.
  *
- * if 'errmsg' is not a NULL pointer, and an error occurred while creating the
- * format string, then on return, '*errmsg' will point to a string containing
- * a message that describes the error.
+ * The formatted string is appended to 'bld'. Returns zero on success. On
+ * error, nonzero is returned, 'bld' is left as it was, and if 'errmsg' is not
+ * a NULL pointer, then '*errmsg' will point to a string containing a message
+ * that describes the error.
  */
-static char *make_format_string(
+static int format_into(
+	SpnStringBuilder *bld,
 	const char *fmt,
-	size_t *len,
 	int argc,
 	void *argv,
 	int isval,
 	char **errmsg
 )
 {
-	struct string_builder bld;
+	size_t start = bld->len; /* for rolling back on error */
 	int argidx = 0;
 	const char *s = fmt;
 	const char *p = s;   /* points to the beginning of the next
 	                      * non-format part of the format string
 	                      */
 
-	init_builder(&bld);
-
 	while (*s) {
 		struct format_args args;
 
@@ -769,7 +1011,7 @@ static char *make_format_string(
 
 		/* append preceding non-format string chunk */
 		if (s > p) {
-			append_string(&bld, p, s - p);
+			spn_strbuilder_append(bld, p, s - p);
 		}
 
 		s++;
@@ -814,8 +1056,8 @@ static char *make_format_string(
 				/* check argc if the caller wants us to do so */
 				if (argc >= 0 && argidx >= argc) {
 					format_errmsg(errmsg, OUT_OF_ARGUMENTS, argidx);
-					free(bld.buf);
-					return NULL;
+					bld->len = start;
+					return -1;
 				}
 
 				/* width specifier must be an integer */
@@ -826,10 +1068,10 @@ static char *make_format_string(
 						TYPE_MISMATCH,
 						argidx,
 						SPN_TTAG_NUMBER,
-						widthptr->type
+						fulltype(widthptr)
 					);
-					free(bld.buf);
-					return NULL;
+					bld->len = start;
+					return -1;
 				}
 
 				if (isfloat(widthptr)) {
@@ -838,8 +1080,8 @@ static char *make_format_string(
 						EXPECT_INTEGER,
 						argidx
 					);
-					free(bld.buf);
-					return NULL;
+					bld->len = start;
+					return -1;
 				}
 
 				args.width = intvalue(widthptr);
@@ -867,8 +1109,8 @@ static char *make_format_string(
 					/* check argc if the caller wants us to do so */
 					if (argc >= 0 && argidx >= argc) {
 						format_errmsg(errmsg, OUT_OF_ARGUMENTS, argidx);
-						free(bld.buf);
-						return NULL;
+						bld->len = start;
+						return -1;
 					}
 
 					/* precision must be an integer too */
@@ -880,10 +1122,10 @@ static char *make_format_string(
 							TYPE_MISMATCH,
 							argidx,
 							SPN_TTAG_NUMBER,
-							precptr->type
+							fulltype(precptr)
 						);
-						free(bld.buf);
-						return NULL;
+						bld->len = start;
+						return -1;
 					}
 
 					if (isfloat(precptr)) {
@@ -892,8 +1134,8 @@ static char *make_format_string(
 				 			EXPECT_INTEGER,
 				 			argidx
 				 		);
-						free(bld.buf);
-						return NULL;
+						bld->len = start;
+						return -1;
 					}
 
 					args.precision = intvalue(precptr);
@@ -912,14 +1154,14 @@ static char *make_format_string(
 		 */
 		if (argc >= 0 && argidx >= argc && args.spec != '%') {
 			format_errmsg(errmsg, OUT_OF_ARGUMENTS, argidx);
-			free(bld.buf);
-			return NULL;
+			bld->len = start;
+			return -1;
 		}
 
 		/* append parsed format string */
-		if (append_format(&bld, &args, argv, &argidx, isval, errmsg) != 0) {
-			free(bld.buf);
-			return NULL;
+		if (append_format(bld, &args, argv, &argidx, isval, errmsg) != 0) {
+			bld->len = start;
+			return -1;
 		}
 
 		/* update non-format chunk base pointer */
@@ -930,40 +1172,62 @@ static char *make_format_string(
 	 * then just append the last non-format (literal) string chunk
 	 */
 	if (s > p) {
-		append_string(&bld, p, s - p);
+		spn_strbuilder_append(bld, p, s - p);
 	}
 
-	/* append terminating NUL byte */
-	expand_buffer(&bld, 1);
-	bld.buf[bld.len] = 0;
+	return 0;
+}
+
+char *spn_string_format_cstr(const char *fmt, size_t *len, const void **argv)
+{
+	SpnStringBuilder bld;
+
+	spn_strbuilder_init(&bld, strlen(fmt));
+	format_into(&bld, fmt, -1, argv, 0, NULL);
+	return detach_buffer(&bld, len);
+}
 
-	if (len != NULL) {
-		*len = bld.len;
+/* An estimate of the length of the formatted string, so that the buffer
+ * is usually allocated only once: string arguments are counted with their
+ * actual length, other arguments with the length of a typical number.
+ */
+static size_t estimate_format_length(SpnString *fmt, int argc, SpnValue *argv)
+{
+	size_t len = fmt->len;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		len += isstring(&argv[i]) ? stringvalue(&argv[i])->len : 24;
 	}
 
-	return bld.buf;
+	return len;
 }
 
-char *spn_string_format_cstr(const char *fmt, size_t *len, const void **argv)
+int spn_strbuilder_appendf(SpnStringBuilder *bld, SpnString *fmt, int argc, SpnValue *argv, char **errmsg)
 {
-	return make_format_string(fmt, len, -1, argv, 0, NULL);
+	spn_strbuilder_reserve(bld, estimate_format_length(fmt, argc, argv));
+	return format_into(bld, fmt->cstr, argc, argv, 1, errmsg);
 }
 
 SpnString *spn_string_format_obj(SpnString *fmt, int argc, SpnValue *argv, char **errmsg)
 {
-	size_t len;
-	char *buf = make_format_string(fmt->cstr, &len, argc, argv, 1, errmsg);
-	return buf ? spn_string_new_nocopy_len(buf, len, 1) : NULL;
+	SpnStringBuilder bld;
+
+	spn_strbuilder_init(&bld, estimate_format_length(fmt, argc, argv));
+
+	if (format_into(&bld, fmt->cstr, argc, argv, 1, errmsg) != 0) {
+		spn_strbuilder_free(&bld);
+		return NULL;
+	}
+
+	return spn_strbuilder_tostring(&bld);
 }
 
 /* convenience value constructors */
 
 static SpnValue string_to_val(SpnString *str)
 {
-	SpnValue ret;
-	ret.type = SPN_TYPE_STRING;
-	ret.v.o = str;
-	return ret;
+	return makeobject(SPN_TYPE_STRING, str);
 }
 
 SpnValue spn_makestring(const char *s)
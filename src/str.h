@@ -14,6 +14,7 @@
 #include <stddef.h>
 
 #include "api.h"
+#include "hashmap.h"
 
 typedef struct SpnString {
 	SpnObject     base;     /* private          */
@@ -22,6 +23,7 @@ typedef struct SpnString {
 	int           dealloc;  /* private          */
 	int           ishashed; /* private          */
 	unsigned long hash;     /* private          */
+	unsigned long internid; /* private          */
 } SpnString;
 
 /* these create an SpnString object. "nocopy" versions don't copy the
@@ -34,6 +36,11 @@ SPN_API	SpnString *spn_string_new_nocopy(const char *cstr, int dealloc);
 SPN_API	SpnString *spn_string_new_len(const char *cstr, size_t len);
 SPN_API	SpnString *spn_string_new_nocopy_len(const char *cstr, size_t len, int dealloc);
 
+/* takes ownership of a buffer returned by spn_map_text_file().
+ * The mapping is released when the string is deallocated.
+ */
+SPN_API	SpnString *spn_string_new_mapped(char *cstr, size_t len);
+
 /*************** WARNING ***************
  *
  * This constructor only exists so that 'spn_hashmap_get_strkey()'
@@ -57,6 +64,11 @@ SPN_API SpnString spn_string_emplace_nonretained_for_hashmap(const char *cstr);
  */
 SPN_API SpnString *spn_string_concat(SpnString *lhs, SpnString *rhs);
 
+/* concatenates 'n' strings in one step. The original strings aren't
+ * modified either.
+ */
+SPN_API SpnString *spn_string_concat_all(SpnString *strs[], size_t n);
+
 /* The following functions create a formatted string.
  * The format specifiers are documented in doc/stdlib.md.
  */
@@ -91,12 +103,79 @@ SPN_API SpnString *spn_string_format_obj(
 	char **errmsg       /* error description           */
 );
 
+/* String builder
+ * Accumulates a string in a growable buffer. It can live on the stack or
+ * inside another object; don't touch its members other than 'len'.
+ * 'capacity' is the expected length of the result: if it's known in
+ * advance, the buffer is allocated only once.
+ */
+typedef struct SpnStringBuilder {
+	char  *buf;       /* private                        */
+	size_t len;       /* number of bytes appended so far */
+	size_t allocsz;   /* private                        */
+} SpnStringBuilder;
+
+SPN_API void spn_strbuilder_init(SpnStringBuilder *bld, size_t capacity);
+SPN_API void spn_strbuilder_free(SpnStringBuilder *bld);
+
+/* makes room for at least 'extra' more bytes */
+SPN_API void spn_strbuilder_reserve(SpnStringBuilder *bld, size_t extra);
+SPN_API void spn_strbuilder_append(SpnStringBuilder *bld, const char *str, size_t len);
+
+/* appends a formatted string, see spn_string_format_obj(). On error, the
+ * builder is not modified, and a nonzero value is returned.
+ */
+SPN_API int spn_strbuilder_appendf(
+	SpnStringBuilder *bld,
+	SpnString *fmt,
+	int argc,
+	SpnValue *argv,
+	char **errmsg
+);
+
+/* hands the buffer over to a new string object without copying it,
+ * then empties the builder, which can then be reused
+ */
+SPN_API SpnString *spn_strbuilder_tostring(SpnStringBuilder *bld);
+
+/* String interning
+ * An intern table maps the contents of strings to a single canonical string
+ * object. Canonical strings are marked with the unique ID of their table,
+ * and they always carry a precomputed hash, so two distinct strings of the
+ * same table are known to differ without comparing their bytes, and hash
+ * map lookups with canonical keys usually succeed by a pointer comparison.
+ * IDs of tables are never reused. The table keeps its strings alive until
+ * they are swept: strings which are no longer referenced from outside the
+ * table are dropped automatically whenever the number of strings in it
+ * has doubled since the last sweep, so its size stays proportional to the
+ * number of canonical strings in use.
+ */
+typedef struct SpnInternTable {
+	SpnHashMap   *strings;  /* private */
+	unsigned long id;       /* private */
+	size_t        sweepat;  /* private */
+} SpnInternTable;
+
+SPN_API void spn_interntab_init(SpnInternTable *tab);
+SPN_API void spn_interntab_free(SpnInternTable *tab);
+
+/* drops the strings which are only referenced by the table right away,
+ * and returns their number
+ */
+SPN_API size_t spn_interntab_sweep(SpnInternTable *tab);
+
+/* returns the canonical string with the given contents (of length 'len'),
+ * creating an owned copy of the buffer if it is not yet in the table.
+ * The returned string is retained, it must be released by the caller.
+ */
+SPN_API SpnString *spn_string_intern(SpnInternTable *tab, const char *cstr, size_t len);
+
 /* convenience value constructors and an accessor */
 SPN_API SpnValue spn_makestring(const char *s);
 SPN_API SpnValue spn_makestring_len(const char *s, size_t len);
 SPN_API SpnValue spn_makestring_nocopy(const char *s);
 SPN_API SpnValue spn_makestring_nocopy_len(const char *s, size_t len, int dealloc);
 
-#define spn_stringvalue(val) ((SpnString *)((val)->v.o))
+#define spn_stringvalue(val) ((SpnString *)(spn_objvalue(val)))
 
 #endif /* SPN_STR_H */
@@ -0,0 +1,195 @@
+/*
+ * typedarr.c
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Typed arrays: packed, fixed-size buffers of numbers
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "typedarr.h"
+#include "private.h"
+
+
+struct SpnTypedArray {
+	SpnObject base;
+	enum spn_typedarray_kind kind;
+	void *data;              /* first element                         */
+	size_t count;            /* number of elements                    */
+	SpnTypedArray *owner;    /* typed array owning 'data', or NULL if
+	                          * this one owns it (i. e. it's no view)
+	                          */
+};
+
+static void free_typedarray(void *obj);
+
+static const SpnClass spn_class_typedarray = {
+	sizeof(SpnTypedArray),
+	SPN_CLASS_UID_TYPEDARRAY,
+	NULL, /* pointer-wise identity */
+	NULL, /* <, > not applicable   */
+	NULL, /* hash = object address */
+	free_typedarray,
+	NULL  /* not a container       */
+};
+
+const SpnClass *spn_typedarray_class(void)
+{
+	return &spn_class_typedarray;
+}
+
+SpnTypedArray *spn_typedarray_new(enum spn_typedarray_kind kind, size_t count)
+{
+	SpnTypedArray *ta = spn_object_new(&spn_class_typedarray);
+	size_t size = count * spn_typedarray_elemsize(kind);
+
+	ta->kind = kind;
+	ta->count = count;
+	ta->owner = NULL;
+
+	/* calloc() does not guarantee that all-bits-zero is 0.0, and
+	 * malloc(0) may return NULL, hence the explicit initialization
+	 */
+	ta->data = spn_malloc(size > 0 ? size : 1);
+
+	if (kind == SPN_TARR_FLOAT64) {
+		double *p = ta->data;
+		size_t i;
+
+		for (i = 0; i < count; i++) {
+			p[i] = 0.0;
+		}
+	} else {
+		memset(ta->data, 0, size);
+	}
+
+	return ta;
+}
+
+SpnTypedArray *spn_typedarray_slice(SpnTypedArray *ta, size_t begin, size_t end)
+{
+	SpnTypedArray *view;
+
+	assert(begin <= end && end <= ta->count);
+
+	view = spn_object_new(&spn_class_typedarray);
+	view->kind = ta->kind;
+	view->data = (char *)(ta->data) + begin * spn_typedarray_elemsize(ta->kind);
+	view->count = end - begin;
+
+	/* views of views refer to the original storage directly */
+	view->owner = ta->owner != NULL ? ta->owner : ta;
+	spn_object_retain(view->owner);
+
+	return view;
+}
+
+static void free_typedarray(void *obj)
+{
+	SpnTypedArray *ta = obj;
+
+	if (ta->owner != NULL) {
+		spn_object_release(ta->owner);
+	} else {
+		free(ta->data);
+	}
+}
+
+enum spn_typedarray_kind spn_typedarray_kind(SpnTypedArray *ta)
+{
+	return ta->kind;
+}
+
+size_t spn_typedarray_count(SpnTypedArray *ta)
+{
+	return ta->count;
+}
+
+void *spn_typedarray_data(SpnTypedArray *ta)
+{
+	return ta->data;
+}
+
+size_t spn_typedarray_elemsize(enum spn_typedarray_kind kind)
+{
+	switch (kind) {
+	case SPN_TARR_INT64:   return sizeof(long);
+	case SPN_TARR_FLOAT64: return sizeof(double);
+	case SPN_TARR_BYTE:    return sizeof(unsigned char);
+	default:               SHANT_BE_REACHED();
+	}
+
+	return 0;
+}
+
+const char *spn_typedarray_kindname(enum spn_typedarray_kind kind)
+{
+	switch (kind) {
+	case SPN_TARR_INT64:   return "Int64Array";
+	case SPN_TARR_FLOAT64: return "Float64Array";
+	case SPN_TARR_BYTE:    return "ByteBuffer";
+	default:               SHANT_BE_REACHED();
+	}
+
+	return NULL;
+}
+
+SpnValue spn_typedarray_get(SpnTypedArray *ta, size_t index)
+{
+	assert(index < ta->count);
+
+	switch (ta->kind) {
+	case SPN_TARR_INT64:   return makeint(((long *)(ta->data))[index]);
+	case SPN_TARR_FLOAT64: return makefloat(((double *)(ta->data))[index]);
+	case SPN_TARR_BYTE:    return makeint(((unsigned char *)(ta->data))[index]);
+	default:               SHANT_BE_REACHED();
+	}
+
+	return spn_nilval;
+}
+
+int spn_typedarray_set(SpnTypedArray *ta, size_t index, const SpnValue *val)
+{
+	assert(index < ta->count);
+
+	switch (ta->kind) {
+	case SPN_TARR_INT64:
+		if (!isint(val)) {
+			return -1;
+		}
+
+		((long *)(ta->data))[index] = intvalue(val);
+		return 0;
+	case SPN_TARR_FLOAT64:
+		if (isfloat(val)) {
+			((double *)(ta->data))[index] = floatvalue(val);
+		} else if (isint(val)) {
+			((double *)(ta->data))[index] = intvalue(val);
+		} else {
+			return -1;
+		}
+
+		return 0;
+	case SPN_TARR_BYTE:
+		if (!isint(val) || intvalue(val) < 0 || intvalue(val) > 255) {
+			return -1;
+		}
+
+		((unsigned char *)(ta->data))[index] = intvalue(val);
+		return 0;
+	default:
+		SHANT_BE_REACHED();
+	}
+
+	return -1;
+}
+
+int spn_istypedarray(const SpnValue *val)
+{
+	return isstrguserinfo(val)
+	    && spn_object_member_of_class(objvalue(val), &spn_class_typedarray);
+}
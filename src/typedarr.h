@@ -0,0 +1,71 @@
+/*
+ * typedarr.h
+ * Sparkling, a lightweight C-style scripting language
+ *
+ * Licensed under the 2-clause BSD License
+ *
+ * Typed arrays: packed, fixed-size buffers of numbers
+ */
+
+#ifndef SPN_TYPEDARR_H
+#define SPN_TYPEDARR_H
+
+#include <stddef.h>
+
+#include "api.h"
+
+
+/* Unlike an SpnArray, which stores a complete SpnValue per element,
+ * a typed array stores raw C numbers contiguously. Its size is fixed
+ * at creation. To scripts, typed arrays are strong user info values;
+ * the virtual machine supports subscripting them and their "length"
+ * property natively.
+ *
+ * Slices are views: they share the storage of the typed array they
+ * were taken from, and they keep it alive.
+ */
+
+typedef struct SpnTypedArray SpnTypedArray;
+
+enum spn_typedarray_kind {
+	SPN_TARR_INT64,    /* elements are 'long', the C type of integers  */
+	SPN_TARR_FLOAT64,  /* elements are 'double'                        */
+	SPN_TARR_BYTE      /* elements are 'unsigned char', 0...255        */
+};
+
+/* the class of typed arrays, see also spn_vm_getclasses() */
+SPN_API const SpnClass *spn_typedarray_class(void);
+
+/* creates a zero-filled typed array of 'count' elements */
+SPN_API SpnTypedArray *spn_typedarray_new(enum spn_typedarray_kind kind, size_t count);
+
+/* returns a view of the elements in the range [begin, end) */
+SPN_API SpnTypedArray *spn_typedarray_slice(SpnTypedArray *ta, size_t begin, size_t end);
+
+SPN_API enum spn_typedarray_kind spn_typedarray_kind(SpnTypedArray *ta);
+SPN_API size_t spn_typedarray_count(SpnTypedArray *ta);
+
+/* raw element storage, to be cast to 'long *', 'double *' or
+ * 'unsigned char *' according to the kind of the typed array
+ */
+SPN_API void *spn_typedarray_data(SpnTypedArray *ta);
+
+/* size of one element, and a human-readable name ("Int64Array", etc.) */
+SPN_API size_t spn_typedarray_elemsize(enum spn_typedarray_kind kind);
+SPN_API const char *spn_typedarray_kindname(enum spn_typedarray_kind kind);
+
+/* element access. 'index' must be less than spn_typedarray_count().
+ * The setter returns nonzero, and leaves the element unchanged, if the
+ * value can't be stored: integer arrays only accept integers, byte
+ * buffers only accept integers in the range [0, 255], and float arrays
+ * accept any number.
+ */
+SPN_API SpnValue spn_typedarray_get(SpnTypedArray *ta, size_t index);
+SPN_API int spn_typedarray_set(SpnTypedArray *ta, size_t index, const SpnValue *val);
+
+/* nonzero if 'val' is a strong user info value holding a typed array */
+SPN_API int spn_istypedarray(const SpnValue *val);
+
+#define spn_typedarrayvalue(val) ((SpnTypedArray *)(spn_objvalue(val)))
+
+#endif /* SPN_TYPEDARR_H */
@@ -16,6 +16,9 @@
 #include "vm.h"
 #include "str.h"
 #include "func.h"
+#include "typedarr.h"
+#include "prof.h"
+#include "gc.h"
 #include "private.h"
 
 /* stack management macros
@@ -78,28 +81,67 @@ typedef struct TFrame {
 	int          decl_argc;  /* declaration argument count          */
 	int          extra_argc; /* number of extra args, if any (or 0) */
 	int          real_argc;  /* number of call args                 */
+	int          owncallee;  /* 'callee' is retained (tail call)    */
 	spn_uword   *retaddr;    /* return address (points to bytecode) */
-	ptrdiff_t    retidx;     /* pointer into the caller's frame     */
+	SpnValue    *retptr;     /* register in the caller's frame      */
 	SpnFunction *callee;     /* the called function itself          */
 	SpnArray    *argv;       /* lazily loaded argument vector       */
 } TFrame;
 
+/* A global slot caches the value of a global symbol. It is referred to
+ * by index from SPN_INS_LDGLB instructions. 'value' is a weak copy of
+ * the value in the global symbol table, and it's only valid as long as
+ * the slots are in sync with the table (see 'glbversion' below).
+ */
+typedef struct GlobalSlot {
+	SpnValue name;  /* strong */
+	SpnValue value; /* weak   */
+} GlobalSlot;
+
 /* see http://stackoverflow.com/q/18310789/ */
 typedef union TSlot {
 	TFrame h;
 	SpnValue v;
 } TSlot;
 
+/* The stack is a list of segments, so growing it never moves the frames
+ * which are already on it, and pointers into them remain valid. A frame
+ * never straddles two segments: if it doesn't fit in the rest of the
+ * current one, it's pushed at the beginning of the next segment. 'below'
+ * is the stack pointer of the previous segment at that point, i. e. that
+ * of the caller of the first frame in the segment. When a segment becomes
+ * empty, it's kept for the next push, so that calls and returns around
+ * a boundary don't allocate and free it over and over again.
+ */
+typedef struct StackSegment {
+	struct StackSegment *prev;
+	struct StackSegment *next;
+	TSlot *below;
+	TSlot *base;
+	TSlot *limit;
+} StackSegment;
+
+/* in slots; frames that are bigger get a segment of their own */
+#define SEGMENT_SLOTS 1024
+
 struct SpnVMachine {
-	TSlot      *stack;      /* base of the stack            */
+	StackSegment *seg;      /* current segment of the stack */
 	TSlot      *sp;         /* stack pointer                */
-	size_t      stackallsz; /* stack alloc size in frames   */
 
 	ptrdiff_t   exc_addr;   /* address of last exception    */
 
 	SpnHashMap *glbsymtab;  /* global symbol table          */
 	SpnHashMap *classes;    /* class descriptors            */
 
+	GlobalSlot *glbslots;   /* slots of referenced globals  */
+	size_t      nglbslots;  /* number of global slots       */
+	size_t      glbslotcap; /* allocation size of the above */
+	SpnHashMap *glbslotidx; /* name -> index of slot        */
+	unsigned long glbversion; /* glbsymtab version in sync  */
+	int         fixedslots; /* don't allocate new slots     */
+
+	SpnInternTable *interntab; /* canonical strings or NULL */
+
 	SpnValue    supername;  /* the string "super"           */
 	SpnValue    getname;    /* the string "get"             */
 	SpnValue    setname;    /* the string "set"             */
@@ -107,6 +149,38 @@ struct SpnVMachine {
 	char       *errmsg;     /* last (runtime) error message */
 	int         haserror;   /* whether an error occurred    */
 	void       *ctx;        /* context info, use at will    */
+
+	SpnProfile *prof;       /* attached profile, or NULL    */
+	SpnGC      *gc;         /* cycle collector, or NULL     */
+
+	SpnCoroutine *co;       /* running coroutine, or NULL   */
+	int         depth;      /* number of active dispatch loops (and native calls from C) */
+	int         yielding;   /* spn_vm_yield() was called    */
+
+	/* frames of the coroutines which the last error unwound, innermost
+	 * first; they are freed along with the coroutines' stacks, so the
+	 * stack trace is captured before that (see spn_vm_stacktrace())
+	 */
+	SpnStackFrame *cotrace;
+	size_t      ncotrace;
+};
+
+/* A coroutine owns a stack, which is swapped with that of the VM while
+ * the coroutine runs. Once it has been resumed, 'ip' is where it continues,
+ * and 'retptr' is the register in which the yield it's suspended in returns
+ * the next value passed to it.
+ */
+struct SpnCoroutine {
+	SpnObject    base;
+	SpnFunction *fn;         /* the body of the coroutine            */
+	StackSegment *seg;       /* its own stack, or that of its        */
+	TSlot       *sp;         /* resumer while it's running           */
+	spn_uword   *ip;         /* NULL if not yet started              */
+	SpnValue    *retptr;
+	SpnValue     transfer;   /* the value being yielded              */
+	int          depth;      /* vm->depth of its dispatch loop       */
+	enum spn_coroutine_status status;
+	SpnCoroutine *resumer;   /* coroutine which resumed it, or NULL  */
 };
 
 /* this is the structure used by 'push_and_copy_args()' */
@@ -116,8 +190,8 @@ struct args_copy_descriptor {
 		struct {
 			spn_uword *ip;
 			spn_uword *retaddr;
-			ptrdiff_t calleroff;
-			ptrdiff_t retidx;
+			TSlot *callersp;
+			SpnValue *retptr;
 		} script_env;
 		struct {
 			SpnValue *argv;
@@ -132,15 +206,20 @@ static void push_and_copy_args(
 	int argc
 );
 
+static void push_tail_frame(SpnVMachine *vm, SpnFunction *fn, spn_uword *ip, int argc);
+
 
 static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *ret);
 
 /* this only releases the values stored in the stack frames */
 static void free_frames(SpnVMachine *vm);
+static void free_cotrace(SpnVMachine *vm);
 
 /* stack manipulation */
-static size_t stacksize(SpnVMachine *vm);
-static void expand_stack(SpnVMachine *vm, size_t nregs);
+static void push_segment(SpnVMachine *vm, int nslots);
+static void free_stack(StackSegment *seg);
+static int stack_empty(StackSegment *seg, TSlot *sp);
+static TSlot *frame_below(StackSegment **seg, TSlot *sp);
 
 static void push_frame(
 	SpnVMachine *vm,
@@ -149,10 +228,11 @@ static void push_frame(
 	int extra_argc,
 	int real_argc,
 	spn_uword *retaddr,
-	ptrdiff_t retidx,
+	SpnValue *retptr,
 	SpnFunction *callee
 );
 static void pop_frame(SpnVMachine *vm);
+static void release_frame(TSlot *sp);
 
 /* this function helps including native functions' names in the stack trace */
 static void push_native_pseudoframe(SpnVMachine *vm, SpnFunction *callee, spn_uword *retaddr);
@@ -160,7 +240,7 @@ static void push_native_pseudoframe(SpnVMachine *vm, SpnFunction *callee, spn_uw
 /* reads/creates the local symbol table of 'program' if necessary,
  * then stores it back into the function object.
  */
-static void read_local_symtab(SpnFunction *program);
+static void read_local_symtab(SpnVMachine *vm, SpnFunction *program);
 
 /* accessing function arguments */
 static SpnValue *nth_call_arg(TSlot *sp, spn_uword *ip, int idx);
@@ -174,7 +254,16 @@ static long bitwise_op(const SpnValue *lhs, const SpnValue *rhs, int op);
 /* ...and a weak dynamic linker */
 static int resolve_symbol(SpnVMachine *vm, spn_uword *ip, SpnValue *symp);
 
-/* array, hashmap, string indexing validation */
+/* global slots */
+static void sync_global_slots(SpnVMachine *vm);
+static size_t get_global_slot(SpnVMachine *vm, const char *name);
+static void set_global(SpnVMachine *vm, const char *name, const SpnValue *val);
+
+/* string interning */
+static SpnValue make_interned_string(SpnVMachine *vm, const char *cstr, size_t len);
+static SpnValue make_global_name(SpnVMachine *vm, const char *name);
+
+/* array, hashmap, string and typed array indexing validation */
 static int indexing_array_check(
 	SpnVMachine *vm,
 	spn_uword *ip,
@@ -184,6 +273,7 @@ static int indexing_array_check(
 );
 static int indexing_string_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vstr, SpnValue *vidx);
 static int indexing_hashmap_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vidx);
+static int indexing_typedarray_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vta, SpnValue *vidx);
 
 /* return value:
  * non-zero if the property is a special built-in and it was processed successfully,
@@ -191,21 +281,31 @@ static int indexing_hashmap_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vidx
  */
 static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nameval);
 
-static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, SpnValue *name);
+/* member lookup; 'cache' is the inline cache of the instruction, or NULL */
+static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, SpnValue *name, SpnMemberCache *cache);
+static SpnMemberCache *get_member_cache(SpnFunction *env, spn_uword idx);
 
 /* type information, reflection */
 static SpnValue typeof_value(SpnValue *val);
 
+#if USE_PROFILER
+/* profiler hooks */
+static void profile_instruction(SpnVMachine *vm, enum spn_vm_ins opcode, spn_uword *ip);
+static void profile_pop_frame(SpnVMachine *vm, TFrame *hdr);
+static void profile_switch_coroutine(SpnVMachine *vm, int entering);
+#endif /* USE_PROFILER */
+
 /* generating a runtime error (message) */
 static void runtime_error(SpnVMachine *vm, spn_uword *ip, const char *fmt, const void *args[]);
+static void native_call_error(SpnVMachine *vm, SpnFunction *fn, int err);
+static void concat_all_error(SpnVMachine *vm, spn_uword *operands, int n);
 
 SpnVMachine *spn_vm_new(void)
 {
 	SpnVMachine *vm = spn_malloc(sizeof(*vm));
 
-	/* initialize stack */
-	vm->stackallsz = 0;
-	vm->stack = NULL;
+	/* initialize stack; the first segment is allocated on demand */
+	vm->seg = NULL;
 	vm->sp = NULL;
 
 	/* address of instruction that threw an exception.
@@ -217,46 +317,88 @@ SpnVMachine *spn_vm_new(void)
 	vm->glbsymtab = spn_hashmap_new();
 	vm->classes   = spn_hashmap_new();
 
-	vm->supername = makestring_nocopy("super");
-	vm->getname   = makestring_nocopy("get");
-	vm->setname   = makestring_nocopy("set");
+	/* no globals are referenced through slots yet */
+	vm->glbslots   = NULL;
+	vm->nglbslots  = 0;
+	vm->glbslotcap = 0;
+	vm->glbslotidx = spn_hashmap_new();
+	vm->glbversion = spn_hashmap_version(vm->glbsymtab);
+	vm->fixedslots = 0;
+
+	/* string constants, names of globals and of special members
+	 * are interned by default
+	 */
+	vm->interntab = spn_malloc(sizeof *vm->interntab);
+	spn_interntab_init(vm->interntab);
+
+	vm->supername = make_interned_string(vm, "super", 5);
+	vm->getname   = make_interned_string(vm, "get", 3);
+	vm->setname   = make_interned_string(vm, "set", 3);
 
 	/* set up error reporting and context info */
 	vm->errmsg = NULL;
 	vm->haserror = 0;
 	vm->ctx = NULL;
 
+	vm->prof = NULL;
+	vm->gc = NULL;
+
+	/* the main program is not running in a coroutine */
+	vm->co = NULL;
+	vm->depth = 0;
+	vm->yielding = 0;
+
+	vm->cotrace = NULL;
+	vm->ncotrace = 0;
+
 	return vm;
 }
 
 void spn_vm_free(SpnVMachine *vm)
 {
+	size_t i;
+
+	/* stop the sampling timer, if any */
+	spn_vm_setprofile(vm, NULL);
+
 	/* free the stack */
 	free_frames(vm);
-	free(vm->stack);
+	free_stack(vm->seg);
+	free_cotrace(vm);
 
 	/* free the global symbol table and all class descirptors */
 	spn_object_release(vm->glbsymtab);
 	spn_object_release(vm->classes);
 
+	/* free global slots */
+	for (i = 0; i < vm->nglbslots; i++) {
+		spn_value_release(&vm->glbslots[i].name);
+	}
+
+	free(vm->glbslots);
+	spn_object_release(vm->glbslotidx);
+
 	/* free special string indices */
 	spn_value_release(&vm->supername);
 	spn_value_release(&vm->getname);
 	spn_value_release(&vm->setname);
 
+	/* free the intern table */
+	spn_vm_setinterning(vm, 0);
+
 	/* free the error message buffer */
 	free(vm->errmsg);
 
 	free(vm);
 }
 
-static ptrdiff_t return_address_from_stack_ptr(TSlot *sp)
+static ptrdiff_t return_address_from_stack_ptr(StackSegment *seg, TSlot *sp)
 {
 	TFrame *frmhdr = &sp[IDX_FRMHDR].h;
 
 	if (frmhdr->retaddr != NULL) {
 		/* get stack frame info of caller (previous stack frame) */
-		TSlot *caller_sp = sp - frmhdr->size;
+		TSlot *caller_sp = frame_below(&seg, sp);
 		TFrame *caller_frmhdr = &caller_sp[IDX_FRMHDR].h;
 
 		/* return the offset into the bytecode of the top-level
@@ -272,22 +414,23 @@ static ptrdiff_t return_address_from_stack_ptr(TSlot *sp)
 
 SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 {
-	size_t i = 0;
+	size_t i = vm->ncotrace;
 	SpnStackFrame *buf;
 
+	StackSegment *seg = vm->seg;
 	TSlot *sp = vm->sp;
 
-	/* handle uninitialized stack */
-	if (sp == NULL) {
+	/* handle uninitialized or empty stack */
+	if (stack_empty(vm->seg, vm->sp) && vm->ncotrace == 0) {
 		*size = 0;
 		return NULL;
 	}
 
 	/* count frames */
-	while (sp > vm->stack) {
-		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
-		i++;
-		sp -= frmhdr->size;
+	if (!stack_empty(vm->seg, vm->sp)) {
+		for (; sp != NULL; sp = frame_below(&seg, sp)) {
+			i++;
+		}
 	}
 
 	/* allocate buffer */
@@ -295,15 +438,20 @@ SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 
 	*size = i;
 
-	i = 0;
-	sp = vm->sp;
+	/* the frames of the coroutines an error has unwound come first */
+	for (i = 0; i < vm->ncotrace; i++) {
+		buf[i] = vm->cotrace[i];
+	}
+
+	seg = vm->seg;
+	sp = stack_empty(vm->seg, vm->sp) ? NULL : vm->sp;
 
-	while (sp > vm->stack) {
+	while (sp != NULL) {
 		TFrame *frmhdr = &sp[IDX_FRMHDR].h;
 		SpnStackFrame *frame = &buf[i];
 
 		frame->function = frmhdr->callee;
-		frame->return_address = return_address_from_stack_ptr(sp);
+		frame->return_address = return_address_from_stack_ptr(seg, sp);
 		frame->sp = sp;
 
 		/* see the comment before the declaration of SpnStackFrame
@@ -316,7 +464,7 @@ SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size)
 			frame->exc_address = spn_vm_exception_addr(vm);
 		}
 
-		sp -= frmhdr->size;
+		sp = frame_below(&seg, sp);
 		i++;
 	}
 
@@ -348,11 +496,44 @@ SpnHashMap *spn_vm_getclasses(SpnVMachine *vm)
 
 static void free_frames(SpnVMachine *vm)
 {
-	if (vm->stack != NULL) {
-		while (vm->sp > vm->stack) {
-			pop_frame(vm);
-		}
+	while (!stack_empty(vm->seg, vm->sp)) {
+		pop_frame(vm);
+	}
+}
+
+/* Appends the frames of the running coroutine, which raised an error, to
+ * the trace of unwound frames. They can't be inspected with
+ * spn_vm_get_register() anymore, so their 'sp' is NULL, and the functions
+ * are retained, since freeing the frames may release the last reference.
+ */
+static void capture_cotrace(SpnVMachine *vm)
+{
+	size_t i, n;
+	SpnStackFrame *frames = spn_vm_stacktrace(vm, &n);
+
+	/* spn_vm_stacktrace() has already copied the previous ones */
+	free(vm->cotrace);
+	vm->cotrace = frames;
+
+	for (i = vm->ncotrace; i < n; i++) {
+		spn_object_retain(frames[i].function);
+		frames[i].sp = NULL;
 	}
+
+	vm->ncotrace = n;
+}
+
+static void free_cotrace(SpnVMachine *vm)
+{
+	size_t i;
+
+	for (i = 0; i < vm->ncotrace; i++) {
+		spn_object_release(vm->cotrace[i].function);
+	}
+
+	free(vm->cotrace);
+	vm->cotrace = NULL;
+	vm->ncotrace = 0;
 }
 
 static void clean_vm_if_needed(SpnVMachine *vm)
@@ -364,6 +545,7 @@ static void clean_vm_if_needed(SpnVMachine *vm)
 		 * functions to be able to unwind the stack.
 		 */
 		free_frames(vm);
+		free_cotrace(vm);
 
 		/* clear the "there was an error" flag */
 		vm->haserror = 0;
@@ -381,6 +563,7 @@ int spn_vm_callfunc(
 	struct args_copy_descriptor desc;
 	spn_uword *fnhdr;
 	spn_uword *entry;
+	int status;
 
 	/* if this is the first call after the execution of a program
 	 * in which an error occurred, unwind the stack automagically
@@ -399,12 +582,12 @@ int spn_vm_callfunc(
 		 */
 		push_native_pseudoframe(vm, fn, NULL);
 
+		vm->depth++;
 		err = fn->repr.fn(&tmpret, argc, argv, vm->ctx);
+		vm->depth--;
+
 		if (err != 0) {
-			const void *args[2];
-			args[0] = fn->name;
-			args[1] = &err;
-			spn_vm_seterrmsg(vm, "error in function '%s' (code: %i)", args);
+			native_call_error(vm, fn, err);
 		} else {
 			if (retval != NULL) {
 				*retval = tmpret;
@@ -423,7 +606,7 @@ int spn_vm_callfunc(
 	 * If so, read the local symbol table (if necessary).
 	 */
 	if (fn->topprg) {
-		read_local_symtab(fn);
+		read_local_symtab(vm, fn);
 	}
 
 	/* compute entry point */
@@ -437,76 +620,325 @@ int spn_vm_callfunc(
 	push_and_copy_args(vm, fn, &desc, argc);
 
 	/* recurse, because it's convenient */
-	return dispatch_loop(vm, entry, retval);
+	vm->depth++;
+	status = dispatch_loop(vm, entry, retval);
+	vm->depth--;
+
+	return status;
 }
 
-void spn_vm_addlib_cfuncs(SpnVMachine *vm, const char *libname, const SpnExtFunc fns[], size_t n)
+/* Coroutines */
+static void coroutine_free(void *obj);
+
+static const SpnClass spn_class_coroutine = {
+	sizeof(SpnCoroutine),
+	SPN_CLASS_UID_COROUTINE,
+	NULL, /* pointer-wise identity */
+	NULL, /* <, > not applicable   */
+	NULL, /* hash = object address */
+	coroutine_free,
+	NULL  /* stack isn't traversed */
+};
+
+const SpnClass *spn_coroutine_class(void)
 {
-	SpnHashMap *storage;
-	size_t i;
+	return &spn_class_coroutine;
+}
 
-	/* a NULL libname means that the functions will be global */
-	if (libname != NULL) {
-		SpnValue libval = spn_hashmap_get_strkey(vm->glbsymtab, libname);
+SpnCoroutine *spn_coroutine_new(SpnFunction *fn)
+{
+	SpnCoroutine *co = spn_object_new(&spn_class_coroutine);
 
-		if (notnil(&libval) && !ishashmap(&libval)) {
-			spn_die(
-				"global '%s' already exists but is not a hashmap (%s)",
-				libname,
-				spn_type_name(valtype(&libval))
-			);
-		}
+	assert(fn->native == 0);
+
+	spn_object_retain(fn);
+	co->fn = fn;
+
+	co->seg = NULL;
+	co->sp = NULL;
+
+	co->ip = NULL;
+	co->retptr = NULL;
+	co->transfer = spn_nilval;
+	co->depth = 0;
+	co->status = SPN_COROUTINE_SUSPENDED;
+	co->resumer = NULL;
+
+	return co;
+}
+
+/* a coroutine can only be freed while it's suspended or dead, so the
+ * frames are on its own stack, and they aren't known to the profiler
+ */
+static void coroutine_free(void *obj)
+{
+	SpnCoroutine *co = obj;
+	StackSegment *seg = co->seg;
+	TSlot *sp = stack_empty(co->seg, co->sp) ? NULL : co->sp;
+
+	while (sp != NULL) {
+		TSlot *below = frame_below(&seg, sp);
+		release_frame(sp);
+		sp = below;
+	}
+
+	free_stack(co->seg);
+
+	spn_object_release(co->fn);
+	spn_value_release(&co->transfer);
+}
+
+enum spn_coroutine_status spn_coroutine_status(SpnCoroutine *co)
+{
+	return co->status;
+}
+
+const char *spn_coroutine_statusname(enum spn_coroutine_status status)
+{
+	static const char *const names[] = {
+		"suspended",
+		"running",
+		"waiting",
+		"dead"
+	};
+
+	return names[status];
+}
+
+int spn_iscoroutine(const SpnValue *val)
+{
+	return isstrguserinfo(val)
+	    && spn_object_member_of_class(objvalue(val), &spn_class_coroutine);
+}
+
+/* exchanges the stack of the VM with the one stored in the coroutine */
+static void swap_stacks(SpnVMachine *vm, SpnCoroutine *co)
+{
+	StackSegment *seg = vm->seg;
+	TSlot *sp = vm->sp;
+
+	vm->seg = co->seg;
+	vm->sp = co->sp;
+
+	co->seg = seg;
+	co->sp = sp;
+}
 
-		/* if library does not exist it must be created */
-		if (isnil(&libval)) {
-			libval = makehashmap();
-			spn_hashmap_set_strkey(vm->glbsymtab, libname, &libval);
-			spn_value_release(&libval); /* still alive, was retained */
+int spn_vm_resume(
+	SpnVMachine *vm,
+	SpnCoroutine *co,
+	SpnValue *retval,
+	int argc,
+	SpnValue *argv
+)
+{
+	SpnValue result = spn_nilval;
+	spn_uword *ip;
+	int status;
+
+	clean_vm_if_needed(vm);
+
+	if (co->status != SPN_COROUTINE_SUSPENDED) {
+		const void *args[1];
+		args[0] = spn_coroutine_statusname(co->status);
+		runtime_error(vm, NULL, "cannot resume %s coroutine", args);
+		return -1;
+	}
+
+	/* the coroutine must not be freed while it's running,
+	 * even if it drops the last reference to itself
+	 */
+	spn_object_retain(co);
+
+	swap_stacks(vm, co);
+
+	if (vm->co != NULL) {
+		vm->co->status = SPN_COROUTINE_WAITING;
+	}
+
+	co->resumer = vm->co;
+	co->status = SPN_COROUTINE_RUNNING;
+	co->depth = ++vm->depth;
+	vm->co = co;
+
+	if (co->ip == NULL) {
+		/* first resumption: call the function, as spn_vm_callfunc() does */
+		struct args_copy_descriptor desc;
+
+		if (co->fn->topprg) {
+			read_local_symtab(vm, co->fn);
 		}
 
-		storage = hashmapvalue(&libval);
+		desc.caller_is_native = 1;
+		desc.env.native_env.argv = argv;
+		push_and_copy_args(vm, co->fn, &desc, argc);
+
+		ip = co->fn->repr.bc + SPN_FUNCHDR_LEN;
 	} else {
-		storage = vm->glbsymtab;
+		/* the pending yield returns the value passed in */
+		SpnValue *dst = co->retptr;
+		SpnValue val = argc > 0 ? argv[0] : spn_nilval;
+
+		spn_value_retain(&val);
+		spn_value_release(dst);
+		*dst = val;
+
+#if USE_PROFILER
+		profile_switch_coroutine(vm, 1);
+#endif /* USE_PROFILER */
+
+		ip = co->ip;
 	}
 
-	for (i = 0; i < n; i++) {
-		SpnValue val = makenativefunc(fns[i].name, fns[i].fn);
-		spn_hashmap_set_strkey(storage, fns[i].name, &val);
-		spn_value_release(&val);
+	status = dispatch_loop(vm, ip, &result);
+
+	vm->co = co->resumer;
+	vm->depth--;
+	co->resumer = NULL;
+
+	if (vm->co != NULL) {
+		vm->co->status = SPN_COROUTINE_RUNNING;
+	}
+
+	if (status != 0) {
+		/* there's no way to continue after an error, and the frames
+		 * of the coroutine are freed right away, but they are kept in
+		 * the stack trace, above the call to the function which resumed it
+		 */
+		vm->yielding = 0;
+		spn_value_release(&co->transfer);
+		co->transfer = spn_nilval;
+
+		capture_cotrace(vm);
+		free_frames(vm);
+		co->status = SPN_COROUTINE_DEAD;
+	} else if (co->status == SPN_COROUTINE_SUSPENDED) {
+		/* the coroutine yielded */
+		result = co->transfer;
+		co->transfer = spn_nilval;
+
+#if USE_PROFILER
+		profile_switch_coroutine(vm, 0);
+#endif /* USE_PROFILER */
+	} else {
+		/* the function returned */
+		co->status = SPN_COROUTINE_DEAD;
+	}
+
+	/* a dead coroutine doesn't need its stack anymore */
+	if (co->status == SPN_COROUTINE_DEAD) {
+		free_stack(vm->seg);
+		vm->seg = NULL;
+		vm->sp = NULL;
+	}
+
+	swap_stacks(vm, co);
+
+	if (retval != NULL) {
+		*retval = result;
+	} else {
+		spn_value_release(&result);
 	}
+
+	spn_object_release(co);
+	return status;
 }
 
-void spn_vm_addlib_values(SpnVMachine *vm, const char *libname, const SpnExtValue vals[], size_t n)
+int spn_vm_yield(SpnVMachine *vm, const SpnValue *val)
 {
-	SpnHashMap *storage;
-	size_t i;
+	SpnCoroutine *co = vm->co;
 
-	/* a NULL libname means that the functions will be global */
-	if (libname != NULL) {
-		SpnValue libval = spn_hashmap_get_strkey(vm->glbsymtab, libname);
+	if (co == NULL) {
+		runtime_error(vm, NULL, "cannot yield outside of a coroutine", NULL);
+		return -1;
+	}
 
-		if (notnil(&libval) && !ishashmap(&libval)) {
-			spn_die(
-				"global '%s' already exists but is not a hashmap (%s)",
-				libname,
-				spn_type_name(valtype(&libval))
-			);
-		}
+	/* the dispatch loop of the coroutine must be the innermost one */
+	if (co->depth != vm->depth) {
+		runtime_error(vm, NULL, "cannot yield across a native function call", NULL);
+		return -1;
+	}
 
-		/* if library does not exist it must be created */
-		if (isnil(&libval)) {
-			libval = makehashmap();
-			spn_hashmap_set_strkey(vm->glbsymtab, libname, &libval);
-			spn_value_release(&libval); /* still alive, was retained */
-		}
+	spn_value_retain(val);
+	spn_value_release(&co->transfer);
+	co->transfer = *val;
 
-		storage = hashmapvalue(&libval);
+	vm->yielding = 1;
+	return 0;
+}
+
+/* returns the hashmap into which the members of library 'libname' are
+ * stored, creating the library if necessary. A NULL libname means that
+ * they will be global.
+ */
+static SpnHashMap *get_lib_storage(SpnVMachine *vm, const char *libname)
+{
+	SpnValue libval;
+
+	if (libname == NULL) {
+		return vm->glbsymtab;
+	}
+
+	libval = spn_hashmap_get_strkey(vm->glbsymtab, libname);
+
+	if (notnil(&libval) && !ishashmap(&libval)) {
+		spn_die(
+			"global '%s' already exists but is not a hashmap (%s)",
+			libname,
+			spn_type_name(valtype(&libval))
+		);
+	}
+
+	/* if library does not exist it must be created */
+	if (isnil(&libval)) {
+		libval = makehashmap();
+		set_global(vm, libname, &libval);
+		spn_value_release(&libval); /* still alive, was retained */
+	}
+
+	return hashmapvalue(&libval);
+}
+
+static void add_lib_member(SpnVMachine *vm, SpnHashMap *storage, const char *name, const SpnValue *val)
+{
+	if (storage == vm->glbsymtab) {
+		set_global(vm, name, val);
 	} else {
-		storage = vm->glbsymtab;
+		spn_hashmap_set_strkey(storage, name, val);
+	}
+}
+
+void spn_vm_addlib_cfuncs(SpnVMachine *vm, const char *libname, const SpnExtFunc fns[], size_t n)
+{
+	SpnHashMap *storage = get_lib_storage(vm, libname);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		SpnValue val = makenativefunc(fns[i].name, fns[i].fn);
+		add_lib_member(vm, storage, fns[i].name, &val);
+		spn_value_release(&val);
 	}
+}
+
+void spn_vm_addlib_cfuncs_ex(SpnVMachine *vm, const char *libname, const SpnExtFuncEx fns[], size_t n)
+{
+	SpnHashMap *storage = get_lib_storage(vm, libname);
+	size_t i;
 
 	for (i = 0; i < n; i++) {
-		spn_hashmap_set_strkey(storage, vals[i].name, &vals[i].value);
+		SpnValue val = spn_makenativefunc_ex(fns[i].name, fns[i].fn, fns[i].arity, fns[i].flags);
+		add_lib_member(vm, storage, fns[i].name, &val);
+		spn_value_release(&val);
+	}
+}
+
+void spn_vm_addlib_values(SpnVMachine *vm, const char *libname, const SpnExtValue vals[], size_t n)
+{
+	SpnHashMap *storage = get_lib_storage(vm, libname);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		add_lib_member(vm, storage, vals[i].name, &vals[i].value);
 	}
 }
 
@@ -540,6 +972,39 @@ static void runtime_error(SpnVMachine *vm, spn_uword *ip, const char *fmt, const
 	vm->haserror = 1;
 }
 
+/* 'operands' are the operand words of an SPN_INS_CONCAT_ALL instruction,
+ * at least one of which is not a string. The error is reported at the one
+ * with the lowest rank, so that it points to the concatenation which would
+ * have failed first if the chain hadn't been flattened.
+ */
+static void concat_all_error(SpnVMachine *vm, spn_uword *operands, int n)
+{
+	spn_uword *failed = NULL;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		SpnValue *val = VALPTR(vm->sp, OPCODE(operands[i]));
+
+		if (!isstring(val)
+		 && (failed == NULL || OPLONG(operands[i]) < OPLONG(*failed))) {
+			failed = &operands[i];
+		}
+	}
+
+	runtime_error(vm, failed, "concatenation of non-string values", NULL);
+}
+
+/* sets the error message of a native function which returned 'err',
+ * unless it has already reported an error of its own
+ */
+static void native_call_error(SpnVMachine *vm, SpnFunction *fn, int err)
+{
+	const void *args[2];
+	args[0] = fn->name;
+	args[1] = &err;
+	spn_vm_seterrmsg(vm, "error in function '%s' (code: %i)", args);
+}
+
 const char *spn_vm_geterrmsg(SpnVMachine *vm)
 {
 	return vm->errmsg;
@@ -550,6 +1015,104 @@ void spn_vm_seterrmsg(SpnVMachine *vm, const char *fmt, const void *args[])
 	runtime_error(vm, NULL, fmt, args);
 }
 
+void spn_vm_setprofile(SpnVMachine *vm, SpnProfile *prof)
+{
+#if USE_PROFILER
+	if (vm->prof != NULL) {
+		spn_profile_stop(vm->prof);
+	}
+
+	vm->prof = prof;
+
+	if (prof != NULL) {
+		spn_profile_start(prof);
+	}
+#endif /* USE_PROFILER */
+}
+
+SpnProfile *spn_vm_getprofile(SpnVMachine *vm)
+{
+	return vm->prof;
+}
+
+void spn_vm_setgc(SpnVMachine *vm, SpnGC *gc)
+{
+	vm->gc = gc;
+}
+
+/* makes the first 'src->nglbslots' global slots of 'dst' refer to
+ * the same globals as the slots of 'src' do, if they don't already
+ */
+static int mirror_global_slots(SpnVMachine *dst, SpnVMachine *src)
+{
+	size_t i;
+
+	if (dst->nglbslots > src->nglbslots) {
+		return -1;
+	}
+
+	for (i = 0; i < dst->nglbslots; i++) {
+		if (!spn_value_equal(&dst->glbslots[i].name, &src->glbslots[i].name)) {
+			return -1;
+		}
+	}
+
+	if (dst->glbversion != spn_hashmap_version(dst->glbsymtab)) {
+		sync_global_slots(dst);
+	}
+
+	dst->fixedslots = 0;
+
+	for (i = dst->nglbslots; i < src->nglbslots; i++) {
+		const char *name = stringvalue(&src->glbslots[i].name)->cstr;
+
+		if (get_global_slot(dst, name) != i) {
+			break;
+		}
+	}
+
+	dst->fixedslots = 1;
+	return i < src->nglbslots ? -1 : 0;
+}
+
+SpnFunction *spn_vm_import_program(SpnVMachine *dst, SpnVMachine *src, SpnFunction *program)
+{
+	SpnFunction *copy;
+	spn_uword *bc;
+	size_t i, n;
+
+	assert(program->topprg && program->readsymtab);
+
+	/* every global that the program refers to gets a slot now, so
+	 * that 'dst' has slots for them once it has mirrored 'src'
+	 */
+	if (src->glbversion != spn_hashmap_version(src->glbsymtab)) {
+		sync_global_slots(src);
+	}
+
+	n = spn_array_count(program->symtab);
+
+	for (i = 0; i < n; i++) {
+		SpnValue sym = spn_array_get(program->symtab, i);
+
+		if (is_symstub(&sym)) {
+			get_global_slot(src, symstubvalue(&sym)->name);
+		}
+	}
+
+	if (mirror_global_slots(dst, src) != 0) {
+		return NULL;
+	}
+
+	bc = spn_malloc(program->nwords * sizeof bc[0]);
+	memcpy(bc, program->repr.bc, program->nwords * sizeof bc[0]);
+
+	copy = spn_func_new_topprg(program->name, bc, program->nwords, NULL);
+	read_local_symtab(dst, copy);
+
+	return copy;
+}
+
 void *spn_vm_getcontext(SpnVMachine *vm)
 {
 	return vm->ctx;
@@ -560,30 +1123,84 @@ void spn_vm_setcontext(SpnVMachine *vm, void *ctx)
 	vm->ctx = ctx;
 }
 
-/* because 'NULL - NULL' is UB */
-static size_t stacksize(SpnVMachine *vm)
+static void free_segment(StackSegment *seg)
 {
-	return vm->stackallsz != 0 ? vm->sp - vm->stack : 0;
+	free(seg->base);
+	free(seg);
 }
 
-static void expand_stack(SpnVMachine *vm, size_t nregs)
+/* frees all segments of the stack that 'seg' is part of */
+static void free_stack(StackSegment *seg)
 {
-	size_t oldsize = stacksize(vm);
-	size_t newsize = oldsize + nregs;
+	if (seg == NULL) {
+		return;
+	}
+
+	while (seg->prev != NULL) {
+		seg = seg->prev;
+	}
 
-	if (vm->stackallsz == 0) {
-		vm->stackallsz = 8;
-		/* or however many; something greater than 0 so the << works */
+	while (seg != NULL) {
+		StackSegment *next = seg->next;
+		free_segment(seg);
+		seg = next;
 	}
+}
 
-	while (vm->stackallsz < newsize) {
-		vm->stackallsz *= 2;
+/* makes room for a frame of 'nslots' slots in the next segment */
+static void push_segment(SpnVMachine *vm, int nslots)
+{
+	StackSegment *seg = vm->seg != NULL ? vm->seg->next : NULL;
+
+	/* a cached segment that is too small is useless */
+	if (seg != NULL && seg->limit - seg->base < nslots) {
+		free_segment(seg);
+		seg = NULL;
 	}
 
-	vm->stack = spn_realloc(vm->stack, vm->stackallsz * sizeof vm->stack[0]);
+	if (seg == NULL) {
+		size_t size = nslots > SEGMENT_SLOTS ? nslots : SEGMENT_SLOTS;
+
+		seg = spn_malloc(sizeof *seg);
+		seg->base = spn_malloc(size * sizeof seg->base[0]);
+		seg->limit = seg->base + size;
+		seg->prev = vm->seg;
+		seg->next = NULL;
+
+		if (vm->seg != NULL) {
+			vm->seg->next = seg;
+		}
+	}
+
+	seg->below = vm->sp;
+
+	vm->seg = seg;
+	vm->sp = seg->base;
+}
+
+static int stack_empty(StackSegment *seg, TSlot *sp)
+{
+	return seg == NULL || (sp == seg->base && seg->prev == NULL);
+}
+
+/* returns the stack pointer of the frame below the one at 'sp'
+ * (or NULL if there's none), and updates '*seg' accordingly
+ */
+static TSlot *frame_below(StackSegment **seg, TSlot *sp)
+{
+	TSlot *below = sp - sp[IDX_FRMHDR].h.size;
+
+	if (below == (*seg)->base) {
+		below = (*seg)->below;
+		*seg = (*seg)->prev;
+
+		/* a big frame may have been the first one on an empty stack */
+		if (*seg != NULL && below == (*seg)->base) {
+			return NULL;
+		}
+	}
 
-	/* re-initialize stack pointer because we realloc()'d the stack */
-	vm->sp = vm->stack + oldsize;
+	return below;
 }
 
 /* nregs is the logical size (without the activation record header)
@@ -596,7 +1213,7 @@ static void push_frame(
 	int extra_argc,
 	int real_argc,
 	spn_uword *retaddr,
-	ptrdiff_t retidx,
+	SpnValue *retptr,
 	SpnFunction *callee
 )
 {
@@ -612,10 +1229,9 @@ static void push_frame(
 	 */
 	assert(extra_argc >= 0);
 
-	/* reallocate stack if necessary */
-	if (vm->stackallsz == 0					/* empty stack	*/
-	 || vm->stackallsz < stacksize(vm) + real_nregs) {	/* too small	*/
-		expand_stack(vm, real_nregs);
+	/* continue in the next segment if the frame doesn't fit */
+	if (vm->seg == NULL || vm->seg->limit - vm->sp < real_nregs) {
+		push_segment(vm, real_nregs);
 	}
 
 	/* adjust stack pointer */
@@ -632,14 +1248,21 @@ static void push_frame(
 	vm->sp[IDX_FRMHDR].h.extra_argc = extra_argc;
 	vm->sp[IDX_FRMHDR].h.real_argc = real_argc;
 	vm->sp[IDX_FRMHDR].h.retaddr = retaddr; /* if NULL, return to C-land */
-	vm->sp[IDX_FRMHDR].h.retidx = retidx; /* if >= 0, return _directly_ to VM stack */
+	vm->sp[IDX_FRMHDR].h.retptr = retptr; /* if not NULL, return _directly_ to VM stack */
 	vm->sp[IDX_FRMHDR].h.callee = callee;
+	vm->sp[IDX_FRMHDR].h.owncallee = 0;
 	vm->sp[IDX_FRMHDR].h.argv = NULL;
+
+#if USE_PROFILER
+	if (vm->prof != NULL && vm->prof->flags & SPN_PROF_CALLS) {
+		spn_profile_enter(vm->prof, callee);
+	}
+#endif /* USE_PROFILER */
 }
 
 static void push_native_pseudoframe(SpnVMachine *vm, SpnFunction *callee, spn_uword *retaddr)
 {
-	push_frame(vm, 0, 0, 0, 0, retaddr, -1, callee);
+	push_frame(vm, 0, 0, 0, 0, retaddr, NULL, callee);
 }
 
 static void pop_frame(SpnVMachine *vm)
@@ -652,10 +1275,43 @@ static void pop_frame(SpnVMachine *vm)
 	TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
 	int nregs = hdr->size;
 
-	/* release registers */
+#if USE_PROFILER
+	if (vm->prof != NULL) {
+		profile_pop_frame(vm, hdr);
+	}
+#endif /* USE_PROFILER */
+
+	release_frame(vm->sp);
+
+	/* adjust stack pointer */
+	vm->sp -= nregs;
+
+	/* go back to the previous segment if this one became empty,
+	 * but keep it for the next push (and only that one)
+	 */
+	if (vm->sp == vm->seg->base && vm->seg->prev != NULL) {
+		StackSegment *seg = vm->seg;
+
+		if (seg->next != NULL) {
+			free_segment(seg->next);
+			seg->next = NULL;
+		}
+
+		vm->sp = seg->below;
+		vm->seg = seg->prev;
+	}
+}
+
+/* releases the registers and the argument vector of the frame at 'sp' */
+static void release_frame(TSlot *sp)
+{
+	TFrame *hdr = &sp[IDX_FRMHDR].h;
+	int nregs = hdr->size;
 	int i;
+
+	/* release registers */
 	for (i = -nregs; i < -EXTRA_SLOTS; i++) {
-		spn_value_release(&vm->sp[i].v);
+		spn_value_release(&sp[i].v);
 	}
 
 	/* release argv, if any */
@@ -663,8 +1319,10 @@ static void pop_frame(SpnVMachine *vm)
 		spn_object_release(hdr->argv);
 	}
 
-	/* adjust stack pointer */
-	vm->sp -= nregs;
+	/* release the callee of a tail call, see SPN_INS_TAILCALL */
+	if (hdr->owncallee) {
+		spn_object_release(hdr->callee);
+	}
 }
 
 /* retrieve a pointer to the register denoted by the 'idx'th octet
@@ -741,7 +1399,7 @@ static void push_and_copy_args(
 		extra_argc,
 		argc,
 		desc->caller_is_native ? NULL : desc->env.script_env.retaddr,
-		desc->caller_is_native ?   -1 : desc->env.script_env.retidx,
+		desc->caller_is_native ? NULL : desc->env.script_env.retptr,
 		fn
 	);
 
@@ -767,7 +1425,7 @@ static void push_and_copy_args(
 			SpnValue *argv = desc->env.native_env.argv;
 			src = &argv[i];
 		} else {
-			TSlot *caller = vm->stack + desc->env.script_env.calleroff;
+			TSlot *caller = desc->env.script_env.callersp;
 			spn_uword *ip = desc->env.script_env.ip;
 			src = nth_call_arg(caller, ip, i);
 		}
@@ -786,7 +1444,7 @@ static void push_and_copy_args(
 			SpnValue *argv = desc->env.native_env.argv;
 			src = &argv[i];
 		} else {
-			TSlot *caller = vm->stack + desc->env.script_env.calleroff;
+			TSlot *caller = desc->env.script_env.callersp;
 			spn_uword *ip = desc->env.script_env.ip;
 			src = nth_call_arg(caller, ip, i);
 		}
@@ -796,27 +1454,285 @@ static void push_and_copy_args(
 	}
 }
 
+/* helper for tail calls: the frame of the caller (the current one) is
+ * replaced by that of 'fn', which returns directly to where the caller
+ * would have returned. 'ip' points to the argument indices of the call.
+ */
+static void push_tail_frame(SpnVMachine *vm, SpnFunction *fn, spn_uword *ip, int argc)
+{
+	TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
+	spn_uword *retaddr = hdr->retaddr;
+	SpnValue *retptr = hdr->retptr;
+	struct args_copy_descriptor desc;
+	SpnValue *argv;
+	int i;
+
+	#define MAX_AUTO_ARGC 16
+	SpnValue auto_argv[MAX_AUTO_ARGC];
+
+	if (argc > MAX_AUTO_ARGC) {
+		argv = spn_malloc(argc * sizeof argv[0]);
+	} else {
+		argv = auto_argv;
+	}
+
+	/* the arguments and the callee itself may only be referenced
+	 * by registers of the frame that is about to be popped
+	 */
+	for (i = 0; i < argc; i++) {
+		argv[i] = *nth_call_arg(vm->sp, ip, i);
+		spn_value_retain(&argv[i]);
+	}
+
+	spn_object_retain(fn);
+
+	pop_frame(vm);
+
+	desc.caller_is_native = 1;
+	desc.env.native_env.argv = argv;
+	push_and_copy_args(vm, fn, &desc, argc);
+
+	/* the new frame owns the reference to 'fn' taken above */
+	hdr = &vm->sp[IDX_FRMHDR].h;
+	hdr->retaddr = retaddr;
+	hdr->retptr = retptr;
+	hdr->owncallee = 1;
+
+	for (i = 0; i < argc; i++) {
+		spn_value_release(&argv[i]);
+	}
+
+	if (argc > MAX_AUTO_ARGC) {
+		free(argv);
+	}
+
+	#undef MAX_AUTO_ARGC
+}
+
+/* Instruction dispatch. By default, the body of the interpreter loop is
+ * a plain C89 'switch' statement. If USE_THREADED_DISPATCH is set and the
+ * compiler supports labels as values (GCC and Clang do), then each handler
+ * ends with its own indirect jump through a table of label addresses
+ * ("threaded code"), which gives the branch predictor one jump site per
+ * instruction instead of one shared site for the whole loop.
+ *
+ * VM_CASE() introduces the handler of an instruction, VM_NEXT() finishes
+ * it and proceeds to the next one, VM_ILLEGAL introduces the handler of
+ * unknown opcodes. The entries of 'dispatch_table' in dispatch_loop()
+ * must be kept in the same order as the members of 'enum spn_vm_ins'.
+ *
+ * If a profile which counts instructions or samples the stack is attached,
+ * then threaded code jumps through a table in which every entry points to
+ * the profiler hook, which then jumps to the actual handler. So, with no
+ * such profile, this costs nothing; the 'switch' needs a test per
+ * instruction unless the library is built without USE_PROFILER.
+ */
+#if USE_THREADED_DISPATCH && defined(__GNUC__)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+#if VM_THREADED
+#define VM_FETCH()	do {					\
+			ins = *ip++;					\
+			opcode = OPCODE(ins);				\
+			goto *(opcode < COUNT(dispatch_table)		\
+				? optable[opcode]			\
+				: &&lbl_illegal_instruction);		\
+		} while (0)
+#define VM_CASE(op)	case op: lbl_##op
+#define VM_NEXT()	VM_FETCH()
+#define VM_ILLEGAL	default: lbl_illegal_instruction
+#elif USE_PROFILER
+#define VM_FETCH()	do {					\
+			ins = *ip++;					\
+			opcode = OPCODE(ins);				\
+			if (profiling) {				\
+				profile_instruction(vm, opcode, ip);	\
+			}						\
+		} while (0)
+#define VM_CASE(op)	case op
+#define VM_NEXT()	break
+#define VM_ILLEGAL	default
+#else
+#define VM_FETCH()	do {					\
+			ins = *ip++;					\
+			opcode = OPCODE(ins);				\
+		} while (0)
+#define VM_CASE(op)	case op
+#define VM_NEXT()	break
+#define VM_ILLEGAL	default
+#endif
+
+/* Rewrites the opcode of the instruction being executed (the one
+ * immediately preceding 'ip'), keeping its operands intact. This is
+ * used for quickening; see Remark (XI) in vm.h.
+ */
+#define REWRITE_OPCODE(ip, op) ((ip)[-1] = ((ip)[-1] & ~(spn_uword)0xff) | (op))
+
+/* Converts the current (quickened) instruction back into its generic
+ * form, then makes the virtual machine execute it once again.
+ */
+#define VM_DEQUICKEN(op)	do {		\
+			REWRITE_OPCODE(ip, op);		\
+			ip--;				\
+		} while (0)
+
+/* Body of a quickened instruction operating on two integers. If any of
+ * them is *not* an integer, or if 'guard' holds, the instruction falls
+ * back to the generic version 'generic'. The result is only ever an
+ * integer or a Boolean, so the destination register only needs to be
+ * released if it holds an object.
+ */
+#define VM_QUICK_INT_BINOP(generic, mkres, op, guard) {			\
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));		\
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));		\
+			SpnValue *c = VALPTR(vm->sp, OPC(ins));		\
+			long x, y;					\
+									\
+			if (!isint(b) || !isint(c) || (guard)) {	\
+				VM_DEQUICKEN(generic);			\
+				VM_NEXT();				\
+			}						\
+									\
+			x = intvalue(b);				\
+			y = intvalue(c);				\
+									\
+			if (isobject(a)) {				\
+				spn_value_release(a);			\
+			}						\
+									\
+			*a = mkres(x op y);				\
+			VM_NEXT();					\
+		}
+
+/* labels as values are a GNU extension; the warnings about it would only
+ * drown real diagnostics when compiling with '-pedantic'
+ */
+#if VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
 static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 {
+	spn_uword ins;
+	enum spn_vm_ins opcode;
+
+	/* leaf functions are called without a frame, which would hide
+	 * them from the profiler, so they get one while it's attached
+	 */
+	int leafcalls = vm->prof == NULL;
+
+#if VM_THREADED
+	static const void *const dispatch_table[] = {
+		&&lbl_SPN_INS_CALL,
+		&&lbl_SPN_INS_RET,
+		&&lbl_SPN_INS_JMP,
+		&&lbl_SPN_INS_JZE,
+		&&lbl_SPN_INS_JNZ,
+		&&lbl_SPN_INS_EQ,
+		&&lbl_SPN_INS_NE,
+		&&lbl_SPN_INS_LT,
+		&&lbl_SPN_INS_LE,
+		&&lbl_SPN_INS_GT,
+		&&lbl_SPN_INS_GE,
+		&&lbl_SPN_INS_ADD,
+		&&lbl_SPN_INS_SUB,
+		&&lbl_SPN_INS_MUL,
+		&&lbl_SPN_INS_DIV,
+		&&lbl_SPN_INS_MOD,
+		&&lbl_SPN_INS_NEG,
+		&&lbl_SPN_INS_INC,
+		&&lbl_SPN_INS_DEC,
+		&&lbl_SPN_INS_AND,
+		&&lbl_SPN_INS_OR,
+		&&lbl_SPN_INS_XOR,
+		&&lbl_SPN_INS_SHL,
+		&&lbl_SPN_INS_SHR,
+		&&lbl_SPN_INS_BITNOT,
+		&&lbl_SPN_INS_LOGNOT,
+		&&lbl_SPN_INS_TYPEOF,
+		&&lbl_SPN_INS_CONCAT,
+		&&lbl_SPN_INS_LDCONST,
+		&&lbl_SPN_INS_LDSYM,
+		&&lbl_SPN_INS_MOV,
+		&&lbl_SPN_INS_ARGV,
+		&&lbl_SPN_INS_NEWARR,
+		&&lbl_SPN_INS_NEWHASH,
+		&&lbl_SPN_INS_IDX_GET,
+		&&lbl_SPN_INS_IDX_SET,
+		&&lbl_SPN_INS_ARR_PUSH,
+		&&lbl_SPN_INS_FUNCTION,
+		&&lbl_SPN_INS_GLBVAL,
+		&&lbl_SPN_INS_CLOSURE,
+		&&lbl_SPN_INS_LDUPVAL,
+		&&lbl_SPN_INS_METHOD,
+		&&lbl_SPN_INS_PROPGET,
+		&&lbl_SPN_INS_PROPSET,
+		&&lbl_SPN_INS_EQ_II,
+		&&lbl_SPN_INS_NE_II,
+		&&lbl_SPN_INS_LT_II,
+		&&lbl_SPN_INS_LE_II,
+		&&lbl_SPN_INS_GT_II,
+		&&lbl_SPN_INS_GE_II,
+		&&lbl_SPN_INS_ADD_II,
+		&&lbl_SPN_INS_SUB_II,
+		&&lbl_SPN_INS_MUL_II,
+		&&lbl_SPN_INS_DIV_II,
+		&&lbl_SPN_INS_INC_I,
+		&&lbl_SPN_INS_DEC_I,
+		&&lbl_SPN_INS_LDGLB,
+		&&lbl_SPN_INS_CONCAT_ALL,
+		&&lbl_SPN_INS_CMPJZE,
+		&&lbl_SPN_INS_CMPJNZ,
+		&&lbl_SPN_INS_CALLMETHOD,
+		&&lbl_SPN_INS_TAILCALL
+	};
+
+	const void *const *optable = dispatch_table;
+#endif
+
+#if USE_PROFILER
+	int profiling = vm->prof != NULL && vm->prof->flags & (SPN_PROF_OPCODES | SPN_PROF_SAMPLE);
+
+#if VM_THREADED
+	const void *profiled_table[COUNT(dispatch_table)];
+
+	if (profiling) {
+		size_t i;
+
+		for (i = 0; i < COUNT(profiled_table); i++) {
+			profiled_table[i] = &&lbl_profile_instruction;
+		}
+
+		optable = profiled_table;
+	}
+#endif
+#endif /* USE_PROFILER */
+
 	while (1) {
-		spn_uword ins = *ip++;
-		enum spn_vm_ins opcode = OPCODE(ins);
+		/* in threaded mode, this is where the first instruction is
+		 * dispatched from; control never returns here afterwards.
+		 */
+		VM_FETCH();
 
 		switch (opcode) {
-		case SPN_INS_CALL: {
+		VM_CASE(SPN_INS_CALL):
+		VM_CASE(SPN_INS_TAILCALL):
+		call_function: {
 			/* XXX: the return value of a call to a Sparkling
-			 * function is stored in stack[header->retidx] and has
+			 * function is stored in *header->retptr and has
 			 * a reference count of one. Here, it MUST NOT be
 			 * retained, only its contents should be copied to the
 			 * destination register.
 			 *
-			 * offsets insetad of pointers are used here because
-			 * a function call (in particular, push_frame()) may
-			 * 'realloc()' the stack, thus rendering saved pointers
-			 * invalid.
+			 * Since the stack is segmented, a function call
+			 * (in particular, push_frame()) never moves the
+			 * frames below it, so this pointer remains valid.
 			 */
-			TSlot *retslot = SLOTPTR(vm->sp, OPA(ins));
-			ptrdiff_t retidx = retslot - vm->stack;
+			SpnValue *retptr = VALPTR(vm->sp, OPA(ins));
 
 			TSlot *funcslot = SLOTPTR(vm->sp, OPB(ins));
 			SpnValue func = funcslot->v; /* copy the value struct */
@@ -830,10 +1746,19 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 */
 			int narggroups = ROUNDUP(argc, SPN_WORD_OCTETS);
 
+#if USE_CYCLE_COLLECTOR
+			/* calls are safe points of the cycle collector: every
+			 * live object is referenced from a register here
+			 */
+			if (vm->gc != NULL && vm->gc->pending) {
+				spn_gc_step(vm->gc, SPN_GC_BUDGET);
+			}
+#endif /* USE_CYCLE_COLLECTOR */
+
 			/* check if value is really a function */
 			if (!isfunc(&func)) {
 				const void *args[1];
-				args[0] = spn_type_name(func.type);
+				args[0] = spn_type_name(fulltype(&func));
 				runtime_error(
 					vm,
 					ip - 1,
@@ -845,7 +1770,42 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			fnobj = funcvalue(&func);
 
-			if (fnobj->native) { /* native function */
+			if (fnobj->leaf && argc == fnobj->arity && leafcalls) {
+				/* leaf native function (see func.h): neither a
+				 * pseudo-frame nor a temporary return value is
+				 * needed, since it can't observe the VM's stack.
+				 */
+				int i, err;
+				SpnValue argv[SPN_LEAF_MAX_ARGC];
+				SpnValue oldret = *retptr;
+
+				for (i = 0; i < argc; i++) {
+					argv[i] = *nth_call_arg(vm->sp, ip, i);
+				}
+
+				/* the old value of the destination register is
+				 * only released after the call, because it may
+				 * be one of the arguments.
+				 */
+				*retptr = spn_nilval;
+				err = fnobj->repr.fn(retptr, argc, argv, vm->ctx);
+
+				if (err != 0) {
+					/* the return value may have been clobbered
+					 * (see below); the pseudo-frame is pushed
+					 * now so that it shows up in the stack trace.
+					 */
+					*retptr = oldret;
+					push_native_pseudoframe(vm, fnobj, ip + narggroups);
+					native_call_error(vm, fnobj, err);
+					return err;
+				}
+
+				assert(vm->haserror == 0);
+
+				spn_value_release(&oldret);
+				ip += narggroups;
+			} else if (fnobj->native) { /* native function */
 				int i, err;
 				spn_uword *retaddr = ip + narggroups;
 				SpnValue tmpret = spn_nilval;
@@ -902,10 +1862,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * custom error message; if so, use it.
 				 */
 				if (err != 0) {
-					const void *args[2];
-					args[0] = fnobj->name;
-					args[1] = &err;
-					spn_vm_seterrmsg(vm, "error in function '%s' (code: %i)", args);
+					native_call_error(vm, fnobj, err);
 					return err;
 				}
 
@@ -927,8 +1884,8 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * 'clean_vm_if_needed()' before the next function call)
 				 * would then attempt to double-free it.
 				 */
-				spn_value_release(&vm->stack[retidx].v);
-				vm->stack[retidx].v = tmpret;
+				spn_value_release(retptr);
+				*retptr = tmpret;
 
 				/* pop pseudo-frame */
 				pop_frame(vm);
@@ -938,6 +1895,32 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * can accomodate 'argc' octets)
 				 */
 				ip += narggroups;
+
+				/* suspend the coroutine if the callee has
+				 * yielded; resuming it continues from here
+				 */
+				if (vm->yielding) {
+					vm->yielding = 0;
+					vm->co->ip = ip;
+					vm->co->retptr = retptr;
+					vm->co->status = SPN_COROUTINE_SUSPENDED;
+					return 0;
+				}
+			} else if (opcode == SPN_INS_TAILCALL) {
+				/* Sparkling function, called in tail position:
+				 * its frame replaces the current one. Native
+				 * functions are called as if by SPN_INS_CALL,
+				 * because the compiler emits a RET after this
+				 * instruction anyway (see Remark (XVI)).
+				 */
+				spn_uword *entry = fnobj->repr.bc + SPN_FUNCHDR_LEN;
+
+				if (fnobj->topprg) {
+					read_local_symtab(vm, fnobj);
+				}
+
+				push_tail_frame(vm, fnobj, ip, argc);
+				ip = entry;
 			} else {
 				/* Sparkling function
 				 * The return address is the address of the
@@ -947,22 +1930,21 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				spn_uword *retaddr = ip + narggroups;
 				spn_uword *fnhdr = fnobj->repr.bc;
 				spn_uword *entry = fnhdr + SPN_FUNCHDR_LEN;
-				ptrdiff_t calleroff = vm->sp - vm->stack;
 				struct args_copy_descriptor desc;
 
 				/* if function designates top-level program,
 				 * then parse its local symbol table
 				 */
 				if (fnobj->topprg) {
-					read_local_symtab(fnobj);
+					read_local_symtab(vm, fnobj);
 				}
 
 				/* set up environment for push_and_copy_args */
 				desc.caller_is_native = 0; /* we, the caller, are a Sparkling function */
 				desc.env.script_env.ip = ip;
 				desc.env.script_env.retaddr = retaddr;
-				desc.env.script_env.calleroff = calleroff;
-				desc.env.script_env.retidx = retidx;
+				desc.env.script_env.callersp = vm->sp;
+				desc.env.script_env.retptr = retptr;
 
 				/* push the frame of the callee, and
 				 * copy over its arguments
@@ -976,10 +1958,11 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				ip = entry;
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_RET: {
+		VM_CASE(SPN_INS_RET): {
 			TFrame *callee = &vm->sp[IDX_FRMHDR].h;
+			spn_uword *retaddr = callee->retaddr;
 
 			/* storing the return value is done in two steps
 			 * because we need to ensure that if the return
@@ -994,10 +1977,10 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			SpnValue *res = VALPTR(vm->sp, OPA(ins));
 
 			/* check return info consistency */
-			assert(callee->retidx <  0 && callee->retaddr == NULL
-			    || callee->retidx >= 0 && callee->retaddr != NULL);
+			assert(callee->retptr == NULL && retaddr == NULL
+			    || callee->retptr != NULL && retaddr != NULL);
 
-			if (callee->retidx < 0) {
+			if (callee->retptr == NULL) {
 				/* return to C-land */
 				if (retvalptr != NULL) {
 					spn_value_retain(res);
@@ -1005,13 +1988,15 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				}
 			} else {
 				/* return to Sparkling-land */
-				SpnValue *retptr = &vm->stack[callee->retidx].v;
+				SpnValue *retptr = callee->retptr;
 				spn_value_retain(res);
 				spn_value_release(retptr);
 				*retptr = *res;
 			}
 
-			/* pop the callee's frame (the current one) */
+			/* pop the callee's frame (the current one);
+			 * 'callee' must not be used after this
+			 */
 			pop_frame(vm);
 
 			/* check the return address. If it's NULL, then
@@ -1020,15 +2005,15 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * In addition, of course, the top stack frame
 			 * needs to be popped.
 			 */
-			if (callee->retaddr == NULL) {
+			if (retaddr == NULL) {
 				return 0;
 			} else {
-				ip = callee->retaddr;
+				ip = retaddr;
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_JMP: {
+		VM_CASE(SPN_INS_JMP): {
 			/* ip has already passed by the opcode, it now
 			 * points to the beginning of the jump offset, so
 			 * store the offset and skip it
@@ -1039,10 +2024,10 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 */
 			spn_sword offset = *ip++;
 			ip += offset;
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_JZE:
-		case SPN_INS_JNZ: {
+		VM_CASE(SPN_INS_JZE):
+		VM_CASE(SPN_INS_JNZ): {
 			SpnValue *reg = VALPTR(vm->sp, OPA(ins));
 
 			/* XXX: if offset is supposed to be negative, the
@@ -1067,11 +2052,62 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				ip += offset;
 			}
 
-			break;
+			VM_NEXT();
+
+		}
+		VM_CASE(SPN_INS_CMPJZE):
+		VM_CASE(SPN_INS_CMPJNZ): {
+			int relop = OPA(ins);
+			SpnValue *b = VALPTR(vm->sp, OPB(ins));
+			SpnValue *c = VALPTR(vm->sp, OPC(ins));
+			spn_sword offset = *ip++;
+			int res;
 
+			if (isint(b) && isint(c)) {
+				/* fast path, like that of the quickened comparisons */
+				long x = intvalue(b);
+				long y = intvalue(c);
+
+				switch (relop) {
+				case SPN_INS_EQ: res = x == y; break;
+				case SPN_INS_NE: res = x != y; break;
+				case SPN_INS_LT: res = x <  y; break;
+				case SPN_INS_LE: res = x <= y; break;
+				case SPN_INS_GT: res = x >  y; break;
+				default:         res = x >= y; break;
+				}
+			} else if (relop == SPN_INS_EQ) {
+				res = spn_value_equal(b, c);
+			} else if (relop == SPN_INS_NE) {
+				res = spn_value_noteq(b, c);
+			} else {
+				if (!spn_values_comparable(b, c)) {
+					const void *args[2];
+					args[0] = spn_type_name(fulltype(b));
+					args[1] = spn_type_name(fulltype(c));
+
+					runtime_error(
+						vm,
+						ip - 2,
+						"ordered comparison of uncomparable values"
+						" of type %s and %s",
+						args
+					);
+
+					return -1;
+				}
+
+				res = cmp2bool(spn_value_compare(b, c), relop);
+			}
+
+			if (res == (opcode == SPN_INS_CMPJNZ)) {
+				ip += offset;
+			}
+
+			VM_NEXT();
 		}
-		case SPN_INS_EQ:
-		case SPN_INS_NE: {
+		VM_CASE(SPN_INS_EQ):
+		VM_CASE(SPN_INS_NE): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1085,16 +2121,20 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			        ? spn_value_equal(b, c)
 			        : spn_value_noteq(b, c);
 
+			if (isint(b) && isint(c)) {
+				REWRITE_OPCODE(ip, opcode - SPN_INS_EQ + SPN_INS_EQ_II);
+			}
+
 			/* clean and update destination register */
 			spn_value_release(a);
 			*a = makebool(res);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_LT:
-		case SPN_INS_LE:
-		case SPN_INS_GT:
-		case SPN_INS_GE: {
+		VM_CASE(SPN_INS_LT):
+		VM_CASE(SPN_INS_LE):
+		VM_CASE(SPN_INS_GT):
+		VM_CASE(SPN_INS_GE): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1103,8 +2143,8 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			if (!spn_values_comparable(b, c)) {
 				const void *args[2];
-				args[0] = spn_type_name(b->type);
-				args[1] = spn_type_name(c->type);
+				args[0] = spn_type_name(fulltype(b));
+				args[1] = spn_type_name(fulltype(c));
 
 				runtime_error(
 					vm,
@@ -1118,15 +2158,20 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			}
 
 			cmpres = spn_value_compare(b, c);
+
+			if (isint(b) && isint(c)) {
+				REWRITE_OPCODE(ip, opcode - SPN_INS_EQ + SPN_INS_EQ_II);
+			}
+
 			spn_value_release(a);
 			*a = makebool(cmp2bool(cmpres, opcode));
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_ADD:
-		case SPN_INS_SUB:
-		case SPN_INS_MUL:
-		case SPN_INS_DIV: {
+		VM_CASE(SPN_INS_ADD):
+		VM_CASE(SPN_INS_SUB):
+		VM_CASE(SPN_INS_MUL):
+		VM_CASE(SPN_INS_DIV): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1147,13 +2192,17 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			/* compute result */
 			res = arith_op(b, c, opcode);
 
+			if (isint(b) && isint(c)) {
+				REWRITE_OPCODE(ip, opcode - SPN_INS_EQ + SPN_INS_EQ_II);
+			}
+
 			/* clean and update destination register */
 			spn_value_release(a);
 			*a = res;
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_MOD: {
+		VM_CASE(SPN_INS_MOD): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1174,9 +2223,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(a);
 			*a = makeint(res);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_NEG: {
+		VM_CASE(SPN_INS_NEG): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1195,10 +2244,10 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				*a = makeint(res);
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_INC:
-		case SPN_INS_DEC: {
+		VM_CASE(SPN_INS_INC):
+		VM_CASE(SPN_INS_DEC): {
 			SpnValue *val = VALPTR(vm->sp, OPA(ins));
 
 			if (!isnum(val)) {
@@ -1208,25 +2257,27 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			if (isfloat(val)) {
 				if (opcode == SPN_INS_INC) {
-					val->v.f++;
+					*val = makefloat(floatvalue(val) + 1);
 				} else {
-					val->v.f--;
+					*val = makefloat(floatvalue(val) - 1);
 				}
 			} else {
 				if (opcode == SPN_INS_INC) {
-					val->v.i++;
+					*val = makeint(intvalue(val) + 1);
 				} else {
-					val->v.i--;
+					*val = makeint(intvalue(val) - 1);
 				}
+
+				REWRITE_OPCODE(ip, opcode - SPN_INS_INC + SPN_INS_INC_I);
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_AND:
-		case SPN_INS_OR:
-		case SPN_INS_XOR:
-		case SPN_INS_SHL:
-		case SPN_INS_SHR: {
+		VM_CASE(SPN_INS_AND):
+		VM_CASE(SPN_INS_OR):
+		VM_CASE(SPN_INS_XOR):
+		VM_CASE(SPN_INS_SHL):
+		VM_CASE(SPN_INS_SHR): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1241,9 +2292,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(a);
 			*a = makeint(res);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_BITNOT: {
+		VM_CASE(SPN_INS_BITNOT): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			long res;
@@ -1257,9 +2308,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(a);
 			*a = makeint(res);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_LOGNOT: {
+		VM_CASE(SPN_INS_LOGNOT): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			int res;
@@ -1273,9 +2324,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(a);
 			*a = makebool(res);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_TYPEOF: {
+		VM_CASE(SPN_INS_TYPEOF): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1283,9 +2334,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(a);
 			*a = res;
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_CONCAT: {
+		VM_CASE(SPN_INS_CONCAT): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1299,12 +2350,39 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			res = spn_string_concat(stringvalue(b), stringvalue(c));
 
 			spn_value_release(a);
-			a->type = SPN_TYPE_STRING;
-			a->v.o = res;
+			*a = makeobject(SPN_TYPE_STRING, res);
 
-			break;
+			VM_NEXT();
+		}
+		VM_CASE(SPN_INS_CONCAT_ALL): {
+			SpnValue *a = VALPTR(vm->sp, OPA(ins));
+			int n = OPB(ins);
+			SpnString *parts[MAX_REG_FRAME];
+			SpnString *res;
+			int i;
+
+			for (i = 0; i < n; i++) {
+				SpnValue *val = VALPTR(vm->sp, OPCODE(ip[i]));
+
+				if (!isstring(val)) {
+					concat_all_error(vm, ip, n);
+					return -1;
+				}
+
+				parts[i] = stringvalue(val);
+			}
+
+			/* skip operand words */
+			ip += n;
+
+			res = spn_string_concat_all(parts, n);
+
+			spn_value_release(a);
+			*a = makeobject(SPN_TYPE_STRING, res);
+
+			VM_NEXT();
 		}
-		case SPN_INS_LDCONST: {
+		VM_CASE(SPN_INS_LDCONST): {
 			/* the first argument is the destination register */
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 
@@ -1344,9 +2422,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				SHANT_BE_REACHED();
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_LDSYM: {
+		VM_CASE(SPN_INS_LDSYM): {
 			/* operand A is the destination; operand B (16 bits)
 			 * is the index of the symbol in the local symbol table
 			 */
@@ -1359,16 +2437,32 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			assert(notnil(&sym)); /* must not be nil */
 
 			/* if the symbol is an unresolved reference
-			 * to a global, then attempt to resolve it
-			 * (it need not be of type function.)
-			 * Then, cache it in the local symbol table.
+			 * to a global, then look up or allocate its
+			 * global slot, and rewrite this instruction
+			 * so that it loads the global from the slot
+			 * directly (see Remark (XIII) in vm.h).
+			 * If the slot index doesn't fit in operand B,
+			 * then fall back to resolving it by name.
 			 */
 			if (is_symstub(&sym)) {
+				SymbolStub *stub = symstubvalue(&sym);
+				size_t slotidx;
+
+				if (vm->glbversion != spn_hashmap_version(vm->glbsymtab)) {
+					sync_global_slots(vm);
+				}
+
+				slotidx = get_global_slot(vm, stub->name);
+
+				if (slotidx <= 0xffff) {
+					ip[-1] = SPN_MKINS_MID(SPN_INS_LDGLB, OPA(ins), slotidx);
+					ip--;
+					VM_NEXT();
+				}
+
 				if (resolve_symbol(vm, ip - 1, &sym) != 0) {
 					return -1;
 				}
-
-				spn_array_set(symtab, symidx, &sym);
 			}
 
 			/* set the new - now surely resolved - value */
@@ -1376,9 +2470,44 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(dst);
 			*dst = sym;
 
-			break;
+			VM_NEXT();
+		}
+		VM_CASE(SPN_INS_LDGLB): {
+			/* operand A is the destination; operand B (16 bits)
+			 * is the index of the global slot
+			 */
+			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
+			GlobalSlot *slot;
+
+			/* the global symbol table has been modified behind
+			 * our back (e. g. by the host), so refresh the slots
+			 */
+			if (vm->glbversion != spn_hashmap_version(vm->glbsymtab)) {
+				sync_global_slots(vm);
+			}
+
+			assert(OPMID(ins) < vm->nglbslots);
+			slot = &vm->glbslots[OPMID(ins)];
+
+			if (isnil(&slot->value)) {
+				const void *args[1];
+				args[0] = stringvalue(&slot->name)->cstr;
+				runtime_error(
+					vm,
+					ip - 1,
+					"global '%s' does not exist or it is nil",
+					args
+				);
+				return -1;
+			}
+
+			spn_value_retain(&slot->value);
+			spn_value_release(dst);
+			*dst = slot->value;
+
+			VM_NEXT();
 		}
-		case SPN_INS_MOV: {
+		VM_CASE(SPN_INS_MOV): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1393,9 +2522,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(a);
 			*a = *b;
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_ARGV: {
+		VM_CASE(SPN_INS_ARGV): {
 			TFrame *hdr = &vm->sp[IDX_FRMHDR].h;
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 
@@ -1424,25 +2553,24 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * by the strong 'hdr->argv' pointer.
 			 */
 			spn_value_release(a);
-			a->type = SPN_TYPE_ARRAY;
-			a->v.o = hdr->argv;
+			*a = makeobject(SPN_TYPE_ARRAY, hdr->argv);
 			spn_value_retain(a);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_NEWARR: {
+		VM_CASE(SPN_INS_NEWARR): {
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 			spn_value_release(dst);
 			*dst = makearray();
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_NEWHASH: {
+		VM_CASE(SPN_INS_NEWHASH): {
 			SpnValue *dst = VALPTR(vm->sp, OPA(ins));
 			spn_value_release(dst);
 			*dst = makehashmap();
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_IDX_GET: {
+		VM_CASE(SPN_INS_IDX_GET): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1478,16 +2606,27 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 				spn_value_release(a);
 				*a = makeint(ch);
+			} else if (spn_istypedarray(b)) {
+				SpnValue val;
+
+				if (indexing_typedarray_check(vm, ip - 1, b, c) != 0) {
+					return -1;
+				}
+
+				/* elements of typed arrays are never objects */
+				val = spn_typedarray_get(typedarrayvalue(b), intvalue(c));
+				spn_value_release(a);
+				*a = val;
 			} else {
 				const void *args[1];
-				args[0] = spn_type_name(b->type);
+				args[0] = spn_type_name(fulltype(b));
 				runtime_error(vm, ip - 1, "cannot subscript value of type %s", args);
 				return -1;
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_IDX_SET: {
+		VM_CASE(SPN_INS_IDX_SET): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 			SpnValue *c = VALPTR(vm->sp, OPC(ins));
@@ -1523,16 +2662,32 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 					assert(index == length);
 					spn_array_push(array, c);
 				}
+			} else if (spn_istypedarray(a)) {
+				SpnTypedArray *ta;
+
+				if (indexing_typedarray_check(vm, ip - 1, a, b) != 0) {
+					return -1;
+				}
+
+				ta = typedarrayvalue(a);
+
+				if (spn_typedarray_set(ta, intvalue(b), c) != 0) {
+					const void *args[2];
+					args[0] = spn_type_name(fulltype(c));
+					args[1] = spn_typedarray_kindname(spn_typedarray_kind(ta));
+					runtime_error(vm, ip - 1, "cannot store value of type %s in %s", args);
+					return -1;
+				}
 			} else {
 				const void *args[1];
-				args[0] = spn_type_name(a->type);
+				args[0] = spn_type_name(fulltype(a));
 				runtime_error(vm, ip - 1, "cannot index value of type %s", args);
 				return -1;
 			}
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_ARR_PUSH: {
+		VM_CASE(SPN_INS_ARR_PUSH): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins));
 			SpnValue *b = VALPTR(vm->sp, OPB(ins));
 
@@ -1540,9 +2695,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 
 			spn_array_push(arrayvalue(a), b);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_FUNCTION: {
+		VM_CASE(SPN_INS_FUNCTION): {
 			/* pointer to the symbol header, see the SPN_FUNCHDR_*
 			 * macros in vm.h.
 			 * save header position, fill in properties
@@ -1558,9 +2713,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			/* skip the function header and function body */
 			ip += SPN_FUNCHDR_LEN + bodylen;
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_GLBVAL: {
+		VM_CASE(SPN_INS_GLBVAL): {
 			/* instruction format is "mid": 8 bit operand A for the
 			 * register number from which to read the expression,
 			 * 16-bit operand B to store the length of the name
@@ -1597,10 +2752,10 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				return -1;
 			}
 
-			spn_hashmap_set_strkey(vm->glbsymtab, symname, src);
-			break;
+			set_global(vm, symname, src);
+			VM_NEXT();
 		}
-		case SPN_INS_CLOSURE: {
+		VM_CASE(SPN_INS_CLOSURE): {
 			int reg_index = OPA(ins);
 			int n_upvals = OPB(ins);
 			int i;
@@ -1620,7 +2775,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			assert(isfunc(prototype_val));
 			prototype = funcvalue(prototype_val);
 
-			closure = spn_func_new_closure(prototype);
+			closure = spn_func_new_closure(prototype, n_upvals);
 
 			/* replace the prototype in the register with the newly
 			 * created closure object early, so that if the closure
@@ -1633,8 +2788,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 * realloc()'ed, and consequently, pointers into the
 			 * stack frame are not invalidated.
 			 */
-			prototype_val->type = SPN_TYPE_FUNC; /* redundant */
-			prototype_val->v.o = closure;
+			*prototype_val = makeobject(SPN_TYPE_FUNC, closure); /* redundant */
 
 			for (i = 0; i < n_upvals; i++) {
 				spn_uword upval_desc = *ip++;
@@ -1642,23 +2796,21 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				int upval_index = OPA(upval_desc);
 
 				switch (upval_type) {
-				case SPN_UPVAL_LOCAL: {
+				case SPN_UPVAL_LOCAL:
 					/* upvalue is local variable of enclosing function */
-					SpnValue *upval = VALPTR(vm->sp, upval_index);
-					spn_array_push(closure->upvalues, upval);
+					closure->upvalues[i] = *VALPTR(vm->sp, upval_index);
 					break;
-				}
-				case SPN_UPVAL_OUTER: {
+				case SPN_UPVAL_OUTER:
 					/* upvalue is in the closure of enclosing function */
-					SpnValue upval;
-					assert(enclosing_fn->upvalues);
-					upval = spn_array_get(enclosing_fn->upvalues, upval_index);
-					spn_array_push(closure->upvalues, &upval);
+					assert(enclosing_fn->is_closure);
+					assert((size_t)upval_index < enclosing_fn->nupvals);
+					closure->upvalues[i] = enclosing_fn->upvalues[upval_index];
 					break;
-				}
 				default:
 					SHANT_BE_REACHED();
 				}
+
+				spn_value_retain(&closure->upvalues[i]);
 			}
 
 			/* relinquish ownership of the prototype function of
@@ -1666,9 +2818,9 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			 */
 			spn_object_release(prototype);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_LDUPVAL: {
+		VM_CASE(SPN_INS_LDUPVAL): {
 			int reg_index   = OPA(ins);
 			int upval_index = OPB(ins);
 
@@ -1680,50 +2832,70 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			spn_value_release(reg);
 
 			/* store upvalue into register and retain it */
-			*reg = spn_array_get(current_fn->upvalues, upval_index);
+			assert((size_t)upval_index < current_fn->nupvals);
+			*reg = current_fn->upvalues[upval_index];
 			spn_value_retain(reg);
 
-			break;
+			VM_NEXT();
 		}
-		case SPN_INS_METHOD: {
+		VM_CASE(SPN_INS_METHOD):
+		VM_CASE(SPN_INS_CALLMETHOD): {
 			SpnValue *a = VALPTR(vm->sp, OPA(ins)); /* result         */
 			SpnValue *b = VALPTR(vm->sp, OPB(ins)); /* object, 'self' */
 			SpnValue *c = VALPTR(vm->sp, OPC(ins)); /* method name    */
 			SpnValue tmp;
 			const void *args[1]; /* for error reporting */
 
+			SpnFunction *env = vm->sp[IDX_FRMHDR].h.callee->env;
+			SpnMemberCache *cache = get_member_cache(env, *ip++);
+
 			/* lookup_member returns true if 'pself' is a hashtable or
 			 * if it has a class. In this case, 'result' will contain
 			 * the value for 'name'. (it may not be a function, in
 			 * which case, INS_CALL will throw an error anyway.
 			 */
-			if (lookup_member(vm, &tmp, b, c)) {
+			if (lookup_member(vm, &tmp, b, c, cache)) {
 				spn_value_retain(&tmp);
 				spn_value_release(a);
 				*a = tmp;
-				break;
+
+				/* proceed to the call right away (Remark (XV)) */
+				if (opcode == SPN_INS_CALLMETHOD) {
+					ins = *ip++;
+					opcode = OPCODE(ins);
+					assert(opcode == SPN_INS_CALL || opcode == SPN_INS_TAILCALL);
+					goto call_function;
+				}
+
+				VM_NEXT();
 			}
 
-			args[0] = spn_type_name(b->type);
-			runtime_error(vm, ip - 1, "object of type %s has no class", args);
+			args[0] = spn_type_name(fulltype(b));
+			runtime_error(vm, ip - 2, "object of type %s has no class", args);
 			return -1;
 		}
-		case SPN_INS_PROPGET: {
+		VM_CASE(SPN_INS_PROPGET): {
 			SpnValue *result = VALPTR(vm->sp, OPA(ins));
 			SpnValue *pself  = VALPTR(vm->sp, OPB(ins));
 			SpnValue *prname = VALPTR(vm->sp, OPC(ins));
 
-			SpnValue accval, gval, tmp; /* accessors; getter; and temporary */
+			SpnValue accval, gval; /* accessors; and getter */
 			const void *args[2]; /* for error reporting */
+			int found;
+
+			SpnFunction *env = vm->sp[IDX_FRMHDR].h.callee->env;
+			SpnMemberCache *cache = get_member_cache(env, *ip++);
 
 			assert(isstring(prname));
 
 			/* if this is a special property, treat it as such */
 			if (get_builtin_property(result, pself, prname)) {
-				break;
+				VM_NEXT();
 			}
 
-			if (lookup_member(vm, &accval, pself, prname)) {
+			found = lookup_member(vm, &accval, pself, prname, cache);
+
+			if (found) {
 				if (ishashmap(&accval)) {
 					SpnHashMap *accessors = hashmapvalue(&accval);
 					gval = spn_hashmap_get(accessors, &vm->getname);
@@ -1745,32 +2917,33 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 						spn_value_release(result);
 						*result = grv;
 
-						break; /* break out if getter was called! */
+						VM_NEXT(); /* break out if getter was called! */
 					}
 				}
 			}
 
-			/* else if self is a hashmap, fall back to raw indexing getter.
+			/* else if self is a hashmap, fall back to raw indexing getter,
+			 * which is just the member found by the lookup above.
 			 * We can use the original pointers here, since if control
 			 * flow reached this point, that means that no getter has
 			 * been found, consequently no function could be called.
 			 */
-			if (ishashmap(pself) && lookup_member(vm, &tmp, pself, prname)) {
-				spn_value_retain(&tmp);
+			if (ishashmap(pself) && found) {
+				spn_value_retain(&accval);
 				spn_value_release(result);
-				*result = tmp;
-				break;
+				*result = accval;
+				VM_NEXT();
 			}
 
 			/* at this point, the value had neither a class nor an
 			 * appropriate getter function, and it's not a hashmap
 			 */
-			args[0] = spn_type_name(pself->type);
+			args[0] = spn_type_name(fulltype(pself));
 			args[1] = stringvalue(prname)->cstr;
-			runtime_error(vm, ip - 1, "value of type %s has no getter for property '%s'", args);
+			runtime_error(vm, ip - 2, "value of type %s has no getter for property '%s'", args);
 			return -1;
 		}
-		case SPN_INS_PROPSET: {
+		VM_CASE(SPN_INS_PROPSET): {
 			SpnValue *pself  = VALPTR(vm->sp, OPA(ins)); /* object, 'self' */
 			SpnValue *prname = VALPTR(vm->sp, OPB(ins)); /* property name  */
 			SpnValue *newval = VALPTR(vm->sp, OPC(ins)); /* new value      */
@@ -1778,9 +2951,12 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 			SpnValue accval, sval; /* hashmap of accessors; and setter */
 			const void *args[2]; /* for error reporting */
 
+			SpnFunction *env = vm->sp[IDX_FRMHDR].h.callee->env;
+			SpnMemberCache *cache = get_member_cache(env, *ip++);
+
 			assert(isstring(prname));
 
-			if (lookup_member(vm, &accval, pself, prname)) {
+			if (lookup_member(vm, &accval, pself, prname, cache)) {
 				if (ishashmap(&accval)) {
 					SpnHashMap *accessors = hashmapvalue(&accval);
 					sval = spn_hashmap_get(accessors, &vm->setname);
@@ -1798,7 +2974,7 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 							return -1;
 						}
 
-						break; /* nothing to do if setter was called successfully */
+						VM_NEXT(); /* nothing to do if setter was called successfully */
 					}
 				}
 			}
@@ -1809,16 +2985,65 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 				 * since the key is always a string (so not NaN or 'nil')
 				 */
 				spn_hashmap_set(hashmapvalue(pself), prname, newval);
-				break;
+				VM_NEXT();
 			}
 
 			/* if 'self' is not a hashmap, though, there's no more hope */
-			args[0] = spn_type_name(pself->type);
+			args[0] = spn_type_name(fulltype(pself));
 			args[1] = stringvalue(prname)->cstr;
-			runtime_error(vm, ip - 1, "value of type %s has no setter for property '%s'", args);
+			runtime_error(vm, ip - 2, "value of type %s has no setter for property '%s'", args);
 			return -1;
 		}
-		default: /* I am sorry for the indentation here. */
+		VM_CASE(SPN_INS_EQ_II):
+			VM_QUICK_INT_BINOP(SPN_INS_EQ, makebool, ==, 0)
+		VM_CASE(SPN_INS_NE_II):
+			VM_QUICK_INT_BINOP(SPN_INS_NE, makebool, !=, 0)
+		VM_CASE(SPN_INS_LT_II):
+			VM_QUICK_INT_BINOP(SPN_INS_LT, makebool, <, 0)
+		VM_CASE(SPN_INS_LE_II):
+			VM_QUICK_INT_BINOP(SPN_INS_LE, makebool, <=, 0)
+		VM_CASE(SPN_INS_GT_II):
+			VM_QUICK_INT_BINOP(SPN_INS_GT, makebool, >, 0)
+		VM_CASE(SPN_INS_GE_II):
+			VM_QUICK_INT_BINOP(SPN_INS_GE, makebool, >=, 0)
+		VM_CASE(SPN_INS_ADD_II):
+			VM_QUICK_INT_BINOP(SPN_INS_ADD, makeint, +, 0)
+		VM_CASE(SPN_INS_SUB_II):
+			VM_QUICK_INT_BINOP(SPN_INS_SUB, makeint, -, 0)
+		VM_CASE(SPN_INS_MUL_II):
+			VM_QUICK_INT_BINOP(SPN_INS_MUL, makeint, *, 0)
+		VM_CASE(SPN_INS_DIV_II):
+			/* let the generic instruction report division by zero */
+			VM_QUICK_INT_BINOP(SPN_INS_DIV, makeint, /, intvalue(c) == 0)
+		VM_CASE(SPN_INS_INC_I): {
+			SpnValue *val = VALPTR(vm->sp, OPA(ins));
+
+			if (!isint(val)) {
+				VM_DEQUICKEN(SPN_INS_INC);
+				VM_NEXT();
+			}
+
+			*val = makeint(intvalue(val) + 1);
+			VM_NEXT();
+		}
+		VM_CASE(SPN_INS_DEC_I): {
+			SpnValue *val = VALPTR(vm->sp, OPA(ins));
+
+			if (!isint(val)) {
+				VM_DEQUICKEN(SPN_INS_DEC);
+				VM_NEXT();
+			}
+
+			*val = makeint(intvalue(val) - 1);
+			VM_NEXT();
+		}
+#if USE_PROFILER && VM_THREADED
+		/* not an instruction; all entries of 'profiled_table' lead here */
+		lbl_profile_instruction:
+			profile_instruction(vm, opcode, ip);
+			goto *dispatch_table[opcode];
+#endif
+		VM_ILLEGAL: /* I am sorry for the indentation here. */
 			{
 				unsigned long lopcode = opcode;
 				const void *args[1];
@@ -1830,7 +3055,115 @@ static int dispatch_loop(SpnVMachine *vm, spn_uword *ip, SpnValue *retvalptr)
 	}
 }
 
-static void read_local_symtab(SpnFunction *program)
+#if VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+#if USE_PROFILER
+
+/* 'ip' points to the instruction being executed if the innermost frame
+ * belongs to a script function, and it is NULL if it's a native one
+ */
+static void take_sample(SpnVMachine *vm, spn_uword *ip)
+{
+	size_t n;
+	SpnStackFrame *frames;
+	unsigned long weight = spn_prof_ticks;
+
+	spn_prof_ticks = 0;
+	frames = spn_vm_stacktrace(vm, &n);
+
+	if (n > 0) {
+		if (ip != NULL) {
+			frames[0].exc_address = ip - frames[0].function->env->repr.bc;
+		}
+
+		spn_profile_add_sample(vm->prof, frames, n, weight);
+	}
+
+	free(frames);
+}
+
+/* called after fetching each instruction; 'ip' points past it */
+static void profile_instruction(SpnVMachine *vm, enum spn_vm_ins opcode, spn_uword *ip)
+{
+	SpnProfile *prof = vm->prof;
+
+	if (prof->flags & SPN_PROF_OPCODES && opcode < SPN_PROF_NOPCODES) {
+		prof->ophist[opcode]++;
+	}
+
+	if (spn_prof_ticks != 0 && prof->flags & SPN_PROF_SAMPLE) {
+		take_sample(vm, ip - 1);
+	}
+}
+
+static void profile_pop_frame(SpnVMachine *vm, TFrame *hdr)
+{
+	SpnProfile *prof = vm->prof;
+
+	/* time spent in native code is only noticed when it returns */
+	if (hdr->callee->native && spn_prof_ticks != 0 && prof->flags & SPN_PROF_SAMPLE) {
+		take_sample(vm, NULL);
+	}
+
+	if (prof->flags & SPN_PROF_CALLS) {
+		spn_profile_leave(prof);
+	}
+}
+
+/* The shadow call stack of the profile only contains the frames of the
+ * running coroutine, so that the frames of the resumer are on top when
+ * control returns there. So when a coroutine yields, its frames are left,
+ * and when it's resumed, they are entered again, outermost first.
+ */
+static void profile_switch_coroutine(SpnVMachine *vm, int entering)
+{
+	SpnProfile *prof = vm->prof;
+	SpnFunction **callees;
+	size_t i, n = 0;
+	StackSegment *seg;
+	TSlot *sp;
+
+	if (prof == NULL || (prof->flags & SPN_PROF_CALLS) == 0) {
+		return;
+	}
+
+	if (stack_empty(vm->seg, vm->sp)) {
+		return;
+	}
+
+	for (seg = vm->seg, sp = vm->sp; sp != NULL; sp = frame_below(&seg, sp)) {
+		n++;
+	}
+
+	if (!entering) {
+		for (i = 0; i < n; i++) {
+			spn_profile_leave(prof);
+		}
+
+		return;
+	}
+
+	callees = spn_malloc(n * sizeof callees[0]);
+
+	seg = vm->seg;
+	i = 0;
+
+	for (sp = vm->sp; sp != NULL; sp = frame_below(&seg, sp)) {
+		callees[i++] = sp[IDX_FRMHDR].h.callee;
+	}
+
+	while (n > 0) {
+		spn_profile_reenter(prof, callees[--n]);
+	}
+
+	free(callees);
+}
+
+#endif /* USE_PROFILER */
+
+static void read_local_symtab(SpnVMachine *vm, SpnFunction *program)
 {
 	spn_uword *bc = program->repr.bc;
 
@@ -1879,7 +3212,12 @@ static void read_local_symtab(SpnFunction *program)
 			assert(len == reallen);
 #endif
 
-			strval = makestring_nocopy_len(cstr, len, 0);
+			if (vm->interntab != NULL) {
+				strval = make_interned_string(vm, cstr, len);
+			} else {
+				strval = makestring_nocopy_len(cstr, len, 0);
+			}
+
 			spn_array_push(program->symtab, &strval);
 			spn_value_release(&strval);
 
@@ -2024,6 +3362,120 @@ static long bitwise_op(const SpnValue *lhs, const SpnValue *rhs, int op)
 	return -1;
 }
 
+/* re-reads the value of every global slot from the global symbol table */
+static void sync_global_slots(SpnVMachine *vm)
+{
+	size_t i;
+
+	for (i = 0; i < vm->nglbslots; i++) {
+		GlobalSlot *slot = &vm->glbslots[i];
+		slot->value = spn_hashmap_get(vm->glbsymtab, &slot->name);
+	}
+
+	vm->glbversion = spn_hashmap_version(vm->glbsymtab);
+}
+
+/* returns the index of the slot of the global named 'name',
+ * allocating a new slot if the global hasn't been referenced yet
+ * (or (size_t)(-1) if it hasn't, and the VM can't allocate slots).
+ * The slots must be in sync with the global symbol table.
+ */
+static size_t get_global_slot(SpnVMachine *vm, const char *name)
+{
+	SpnValue nameval, idxval;
+	size_t idx;
+
+	assert(vm->glbversion == spn_hashmap_version(vm->glbsymtab));
+
+	idxval = spn_hashmap_get_strkey(vm->glbslotidx, name);
+	if (isint(&idxval)) {
+		return intvalue(&idxval);
+	}
+
+	/* the layout of the slots is dictated by another VM */
+	if (vm->fixedslots) {
+		return (size_t)(-1);
+	}
+
+	if (vm->nglbslots >= vm->glbslotcap) {
+		vm->glbslotcap = vm->glbslotcap ? vm->glbslotcap * 2 : 16;
+		vm->glbslots = spn_realloc(vm->glbslots, vm->glbslotcap * sizeof vm->glbslots[0]);
+	}
+
+	idx = vm->nglbslots++;
+	nameval = make_global_name(vm, name);
+
+	vm->glbslots[idx].name = nameval; /* transfer ownership */
+	vm->glbslots[idx].value = spn_hashmap_get(vm->glbsymtab, &nameval);
+
+	idxval = makeint(idx);
+	spn_hashmap_set(vm->glbslotidx, &nameval, &idxval);
+
+	return idx;
+}
+
+/* returns a strong reference to the canonical copy of a string */
+static SpnValue make_interned_string(SpnVMachine *vm, const char *cstr, size_t len)
+{
+	assert(vm->interntab != NULL);
+	return makeobject(SPN_TYPE_STRING, spn_string_intern(vm->interntab, cstr, len));
+}
+
+/* names of globals are interned so that lookups with the interned
+ * string constants of the program mostly end in a pointer comparison
+ */
+static SpnValue make_global_name(SpnVMachine *vm, const char *name)
+{
+	if (vm->interntab != NULL) {
+		return make_interned_string(vm, name, strlen(name));
+	}
+
+	return makestring(name);
+}
+
+void spn_vm_setinterning(SpnVMachine *vm, int enabled)
+{
+	if (enabled && vm->interntab == NULL) {
+		vm->interntab = spn_malloc(sizeof *vm->interntab);
+		spn_interntab_init(vm->interntab);
+	} else if (!enabled && vm->interntab != NULL) {
+		/* canonical strings which are still referenced keep their
+		 * (never reused) intern ID, so they remain valid
+		 */
+		spn_interntab_free(vm->interntab);
+		free(vm->interntab);
+		vm->interntab = NULL;
+	}
+}
+
+/* Every modification of the global symbol table made by the virtual
+ * machine goes through this function, so that the corresponding global
+ * slot, if any, is updated too. If the slots are already out of sync
+ * (because someone else has modified the symbol table), then they will
+ * be refreshed anyway upon the next load from a slot.
+ */
+static void set_global(SpnVMachine *vm, const char *name, const SpnValue *val)
+{
+	int in_sync = vm->glbversion == spn_hashmap_version(vm->glbsymtab);
+	SpnValue idxval;
+	SpnValue nameval = make_global_name(vm, name);
+
+	spn_hashmap_set(vm->glbsymtab, &nameval, val);
+	spn_value_release(&nameval);
+
+	if (!in_sync) {
+		return;
+	}
+
+	idxval = spn_hashmap_get_strkey(vm->glbslotidx, name);
+	if (isint(&idxval)) {
+		/* the global symbol table retained the value */
+		vm->glbslots[intvalue(&idxval)].value = *val;
+	}
+
+	vm->glbversion = spn_hashmap_version(vm->glbsymtab);
+}
+
 static int resolve_symbol(SpnVMachine *vm, spn_uword *ip, SpnValue *symp)
 {
 	SpnValue res;
@@ -2046,10 +3498,9 @@ static int resolve_symbol(SpnVMachine *vm, spn_uword *ip, SpnValue *symp)
 		return -1;
 	}
 
-	/* if the resolution succeeded, then we
-	 * cache the symbol into the appropriate
-	 * local symbol table so that we don't
-	 * need to resolve it anymore.
+	/* the resolution succeeded. This is only used for globals
+	 * which have no slot; the value is not cached, since the
+	 * global may be modified later.
 	 */
 	*symp = res;
 
@@ -2072,7 +3523,7 @@ static int indexing_array_check(
 
 	if (!isint(vidx)) {
 		const void *args[1];
-		args[0] = spn_type_name(vidx->type);
+		args[0] = spn_type_name(fulltype(vidx));
 		runtime_error(vm, ip, "indexing array with non-integer value of type %s", args);
 		return -1;
 	}
@@ -2103,7 +3554,7 @@ static int indexing_string_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vstr,
 
 	if (!isint(vidx)) {
 		const void *args[1];
-		args[0] = spn_type_name(vidx->type);
+		args[0] = spn_type_name(fulltype(vidx));
 		runtime_error(vm, ip, "indexing string with non-integer value of type %s", args);
 		return -1;
 	}
@@ -2123,6 +3574,41 @@ static int indexing_string_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vstr,
 	return 0;
 }
 
+/* unlike arrays, typed arrays have a fixed size, so they can't be
+ * extended by assigning to the element past the end
+ */
+static int indexing_typedarray_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vta, SpnValue *vidx)
+{
+	SpnTypedArray *ta;
+	long index, length;
+
+	assert(spn_istypedarray(vta));
+
+	ta = typedarrayvalue(vta);
+
+	if (!isint(vidx)) {
+		const void *args[2];
+		args[0] = spn_typedarray_kindname(spn_typedarray_kind(ta));
+		args[1] = spn_type_name(fulltype(vidx));
+		runtime_error(vm, ip, "indexing %s with non-integer value of type %s", args);
+		return -1;
+	}
+
+	index = intvalue(vidx);
+	length = spn_typedarray_count(ta);
+
+	if (index < 0 || index >= length) {
+		const void *args[3];
+		args[0] = &index;
+		args[1] = spn_typedarray_kindname(spn_typedarray_kind(ta));
+		args[2] = &length;
+		runtime_error(vm, ip, "index %d is out of bounds for %s of size %d", args);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int indexing_hashmap_check(SpnVMachine *vm, spn_uword *ip, SpnValue *vidx)
 {
 	/* NaN != NaN, so it can't be used as a key in a hashmap */
@@ -2188,6 +3674,16 @@ static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nam
 
 		break;
 	}
+	case SPN_TTAG_USERINFO: {
+		if (spn_istypedarray(pself) && strcmp(name, "length") == 0) {
+			size_t length = spn_typedarray_count(typedarrayvalue(pself));
+			spn_value_release(dstreg);
+			*dstreg = makeint(length);
+			return 1;
+		}
+
+		break;
+	}
 	default:
 		break;
 	}
@@ -2195,11 +3691,30 @@ static int get_builtin_property(SpnValue *dstreg, SpnValue *pself, SpnValue *nam
 	return 0;
 }
 
+/* records that hashmap 'hm' has been consulted during a member lookup.
+ * If the lookup needs to inspect more maps than what fits into a cache,
+ * then the trace is marked as invalid (its depth will be negative).
+ */
+static void trace_member_lookup(SpnMemberCache *trace, SpnHashMap *hm)
+{
+	if (trace == NULL || trace->depth < 0) {
+		return;
+	}
+
+	if (trace->depth < SPN_MEMBER_CACHE_DEPTH) {
+		trace->maps[trace->depth] = hm;
+		trace->versions[trace->depth] = spn_hashmap_version(hm);
+		trace->depth++;
+	} else {
+		trace->depth = -1;
+	}
+}
+
 /* this returns 1 if it was able to find the method.
  * 'root' is passed by-value so that it can safely
  * be overwritten while searching the object chain.
  */
-static int lookup_member_chained(SpnVMachine *vm, SpnValue *result, SpnValue root, SpnValue *name)
+static int lookup_member_chained(SpnVMachine *vm, SpnValue *result, SpnValue root, SpnValue *name, SpnMemberCache *trace)
 {
 	assert(ishashmap(&root));
 
@@ -2207,6 +3722,8 @@ static int lookup_member_chained(SpnVMachine *vm, SpnValue *result, SpnValue roo
 		SpnHashMap *roothm = hashmapvalue(&root);
 		SpnValue tmp = spn_hashmap_get(roothm, name);
 
+		trace_member_lookup(trace, roothm);
+
 		/* found something non-nil? return it! */
 		if (notnil(&tmp)) {
 			*result = tmp;
@@ -2221,7 +3738,11 @@ static int lookup_member_chained(SpnVMachine *vm, SpnValue *result, SpnValue roo
 	return 0;
 }
 
-static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, SpnValue *name)
+/* 'trace', if not NULL, is filled with the list of class descriptors
+ * that have been looked at. (The receiver itself, if it's a hashmap,
+ * is not included, since inline caching is per-class, not per-object.)
+ */
+static int lookup_member_uncached(SpnVMachine *vm, SpnValue *result, SpnValue *pself, SpnValue *name, SpnMemberCache *trace)
 {
 	SpnValue root; /* member lookup starts here */
 	int typetag = valtype(pself);
@@ -2230,13 +3751,54 @@ static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, Spn
 	assert(isstring(name));
 
 	switch (typetag) {
-	case SPN_TTAG_HASHMAP:
-		/* hashmap methods are looked up in the hashmap object itself */
-		root = *pself;
-		break;
+	case SPN_TTAG_HASHMAP: {
+		/* hashmap methods are looked up in the hashmap object itself,
+		 * then in its super object/class chain
+		 */
+		SpnHashMap *hm = hashmapvalue(pself);
+		SpnValue tmp = spn_hashmap_get(hm, name);
+
+		if (notnil(&tmp)) {
+			*result = tmp;
+			return 1;
+		}
+
+		root = spn_hashmap_get(hm, &vm->supername);
+
+		if (ishashmap(&root) && lookup_member_chained(vm, result, root, name, trace)) {
+			return 1;
+		}
+
+		/* method wasn't found in whole object/class chain; as a last
+		 * resort, try looking it up in the hashmap class. If hashmaps
+		 * have a class (this is normally the case), _and_ the class or
+		 * any of the superclasses thereof contains the method, then
+		 * return it. Else just fall through and return nil.
+		 */
+		root = spn_hashmap_get(vm->classes, &tagval);
+		trace_member_lookup(trace, vm->classes);
+
+		if (ishashmap(&root) && lookup_member_chained(vm, result, root, name, trace)) {
+			return 1;
+		}
+
+		/* method was not found at all, return nil */
+		*result = spn_nilval;
+		return 1;
+	}
 	case SPN_TTAG_USERINFO:
-		/* user info values have a per-instance class lookup mechanism */
+		/* user info values have a per-instance class lookup mechanism.
+		 * Objects without one fall back to the descriptor of their
+		 * class, keyed by a weak user info pointing to the SpnClass.
+		 */
 		root = spn_hashmap_get(vm->classes, pself);
+
+		if (!ishashmap(&root) && isobject(pself)) {
+			SpnObject *obj = objvalue(pself);
+			SpnValue isaval = makeweakuserinfo((void *)(obj->isa));
+			root = spn_hashmap_get(vm->classes, &isaval);
+		}
+
 		break;
 	default:
 		/* and other values share a per-type class descriptor */
@@ -2244,38 +3806,132 @@ static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, Spn
 		break;
 	}
 
+	trace_member_lookup(trace, vm->classes);
+
 	/* user info instance or primitive type has no class */
 	if (!ishashmap(&root)) {
 		return 0;
 	}
 
-	/* search chain of objects/classes for the method */
-	if (lookup_member_chained(vm, result, root, name)) {
+	/* search chain of classes for the method */
+	if (lookup_member_chained(vm, result, root, name, trace)) {
 		return 1;
 	}
 
-	/* method wasn't found in whole object/class chain; as a last resort,
-	 * and only if it is a hashmap, try looking it up in the hashmap class
+	/* method was not found at all, return nil */
+	*result = spn_nilval;
+	return 1;
+}
+
+/* Returns the inline cache that belongs to the member lookup instruction
+ * currently being executed in the program 'env'. 'idx' is the cache index
+ * stored after the instruction. The cache array grows on demand, so the
+ * returned pointer is only valid until another member lookup is performed.
+ */
+static SpnMemberCache *get_member_cache(SpnFunction *env, spn_uword idx)
+{
+	assert(env->topprg);
+
+	if (idx >= env->ncaches) {
+		size_t oldsize = env->ncaches;
+		size_t newsize = oldsize ? oldsize * 2 : 8;
+		size_t i;
+
+		while (newsize <= idx) {
+			newsize *= 2;
+		}
+
+		env->caches = spn_realloc(env->caches, newsize * sizeof env->caches[0]);
+
+		for (i = oldsize; i < newsize; i++) {
+			env->caches[i].depth = 0;
+		}
+
+		env->ncaches = newsize;
+	}
+
+	return &env->caches[idx];
+}
+
+static int lookup_member(SpnVMachine *vm, SpnValue *result, SpnValue *pself, SpnValue *name, SpnMemberCache *cache)
+{
+	SpnMemberCache trace;
+	int typetag = valtype(pself);
+	const void *entry = NULL;
+	int i;
+
+	if (cache == NULL) {
+		return lookup_member_uncached(vm, result, pself, name, NULL);
+	}
+
+	/* Determine where the cacheable part of the lookup starts. For
+	 * hashmaps, it's the super object, but only if the member is not
+	 * found in the object itself. For user info values, it's the very
+	 * value, since they have per-instance class descriptors.
 	 */
-	if (ishashmap(pself)) {
-		root = spn_hashmap_get(vm->classes, &tagval);
+	if (typetag == SPN_TTAG_HASHMAP) {
+		SpnHashMap *hm = hashmapvalue(pself);
+		SpnValue tmp = spn_hashmap_get(hm, name);
 
-		/* if hashmaps have a class (this is normally the case), _and_ the
-		 * class or any of the superclasses thereof contains the method,
-		 * then return it. Else just fall through and return nil.
-		 */
-		if (ishashmap(&root) && lookup_member_chained(vm, result, root, name)) {
+		if (notnil(&tmp)) {
+			*result = tmp;
 			return 1;
 		}
+
+		tmp = spn_hashmap_get(hm, &vm->supername);
+		entry = ishashmap(&tmp) ? hashmapvalue(&tmp) : NULL;
+	} else if (typetag == SPN_TTAG_USERINFO) {
+		entry = ptrvalue(pself);
 	}
 
-	/* method was not found at all, return nil */
-	*result = spn_nilval;
+	/* cache hit? */
+	if (cache->depth > 0
+	 && cache->typetag == typetag
+	 && cache->entry == entry
+	 && objvalue(&cache->name) == objvalue(name)) {
+		for (i = 0; i < cache->depth; i++) {
+			if (spn_hashmap_version(cache->maps[i]) != cache->versions[i]) {
+				break;
+			}
+		}
+
+		if (i == cache->depth) {
+			*result = cache->result;
+			return 1;
+		}
+	}
+
+	/* cache miss: do the lookup and trace it */
+	trace.depth = 0;
+
+	if (lookup_member_uncached(vm, result, pself, name, &trace) == 0) {
+		return 0;
+	}
+
+	/* if the lookup was too long to be cached, don't bother */
+	if (trace.depth <= 0) {
+		return 1;
+	}
+
+	/* update cache (retain new values first, then release old ones) */
+	for (i = 0; i < trace.depth; i++) {
+		spn_object_retain(trace.maps[i]);
+	}
+
+	spn_value_retain(name);
+	spn_member_cache_clear(cache);
+
+	trace.typetag = typetag;
+	trace.entry = entry;
+	trace.name = *name;
+	trace.result = *result;
+	*cache = trace;
+
 	return 1;
 }
 
 static SpnValue typeof_value(SpnValue *val)
 {
-	const char *type = spn_type_name(val->type);
+	const char *type = spn_type_name(fulltype(val));
 	return makestring_nocopy(type);
 }
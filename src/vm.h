@@ -35,6 +35,18 @@ typedef struct SpnExtFunc {
 	int (*fn)(SpnValue *, int, SpnValue *, void *);
 } SpnExtFunc;
 
+/* a native function with a declared arity ('arity' arguments, or -1 if it
+ * takes a variable number of them) and SPN_FUNC_* flags (see func.h).
+ * Declaring tiny, frequently called functions as leaves (SPN_FUNC_LEAF)
+ * makes calling them considerably cheaper.
+ */
+typedef struct SpnExtFuncEx {
+	const char *name;
+	int (*fn)(SpnValue *, int, SpnValue *, void *);
+	int arity;
+	unsigned flags;
+} SpnExtFuncEx;
+
 /* A generic global object. This can hold any SpnValue, not just functions. */
 typedef struct SpnExtValue {
 	const char *name;
@@ -80,7 +92,9 @@ typedef struct SpnVMachine SpnVMachine;
  * indication of whether the callee returns to C or Sparkling.)
  *
  * 'sp' is an opaque pointer that stores the stack pointer of
- * the frame. It is used by 'spn_vm_get_register()'.
+ * the frame. It is used by 'spn_vm_get_register()'. It is NULL for
+ * the frames of a coroutine which raised a runtime error, since the
+ * stack of the coroutine is freed right away.
  */
 typedef struct SpnStackFrame {
 	SpnFunction *function;
@@ -101,12 +115,115 @@ SPN_API int spn_vm_callfunc(
 	SpnValue *argv
 );
 
+/* A coroutine runs a Sparkling function on a stack of its own, so that
+ * it can be suspended in the middle of it and later be continued where
+ * it left off. Since the dispatch loop keeps no state of a suspended
+ * coroutine on the C stack, any number of them can be alive at once.
+ * To scripts, coroutines are strong user info values.
+ *
+ * The first resumption calls the function with the arguments passed to
+ * spn_vm_resume(). After that, spn_vm_resume() returns when the coroutine
+ * yields (its return value is then the yielded value) or when the function
+ * returns (its return value is then that of the function, and the coroutine
+ * is dead). Subsequent resumptions make the pending yield return the first
+ * argument of spn_vm_resume(), or nil if there's none. It is an error to
+ * resume a coroutine that is dead or that is not suspended (because it's
+ * running, or it has resumed another coroutine itself). A runtime error
+ * in the coroutine kills it, and the error is reported by spn_vm_resume().
+ *
+ * spn_vm_yield() is called by native functions; a native function that
+ * called it should return 0 without setting a return value. That call
+ * then suspends the innermost running coroutine; the host can resume it
+ * from anywhere else later, e. g. when some I/O completed, passing in the
+ * value that the native function should appear to have returned. Yielding
+ * is only possible from a native function called directly by a Sparkling
+ * function of the coroutine, not through other native functions (e. g.
+ * through a callback of the stdlib's 'sort()').
+ */
+typedef struct SpnCoroutine SpnCoroutine;
+
+enum spn_coroutine_status {
+	SPN_COROUTINE_SUSPENDED, /* created or yielded            */
+	SPN_COROUTINE_RUNNING,   /* executing code right now      */
+	SPN_COROUTINE_WAITING,   /* resumed another coroutine     */
+	SPN_COROUTINE_DEAD       /* returned or raised an error   */
+};
+
+SPN_API const SpnClass *spn_coroutine_class(void);
+
+/* 'fn' must be a Sparkling (not a native) function */
+SPN_API SpnCoroutine *spn_coroutine_new(SpnFunction *fn);
+SPN_API enum spn_coroutine_status spn_coroutine_status(SpnCoroutine *co);
+
+/* "suspended", "running", "waiting" or "dead" */
+SPN_API const char *spn_coroutine_statusname(enum spn_coroutine_status status);
+
+/* nonzero if 'val' is a strong user info value holding a coroutine */
+SPN_API int spn_iscoroutine(const SpnValue *val);
+
+#define spn_coroutinevalue(val) ((SpnCoroutine *)(spn_objvalue(val)))
+
+SPN_API int spn_vm_resume(
+	SpnVMachine *vm,
+	SpnCoroutine *co,
+	SpnValue *retval,
+	int argc,
+	SpnValue *argv
+);
+
+/* returns nonzero, and sets an error message, if it's not possible to
+ * yield now. Otherwise, 'val' is retained until the coroutine yields.
+ */
+SPN_API int spn_vm_yield(SpnVMachine *vm, const SpnValue *val);
+
 /* These functions copy both the names of the values and the library name,
  * so 'libname' and 'fns[i].name' can be safely destroyed after the call.
  */
 SPN_API void  spn_vm_addlib_cfuncs(SpnVMachine *vm, const char *libname, const SpnExtFunc  fns[],  size_t n);
+SPN_API void  spn_vm_addlib_cfuncs_ex(SpnVMachine *vm, const char *libname, const SpnExtFuncEx fns[], size_t n);
 SPN_API void  spn_vm_addlib_values(SpnVMachine *vm, const char *libname, const SpnExtValue vals[], size_t n);
 
+/* enables or disables string interning. If it is enabled (the default),
+ * string constants of programs, names of globals and the names of special
+ * members ("super", "get", "set") are canonicalized through an intern table
+ * owned by the virtual machine (see 'SpnInternTable' in str.h), so that
+ * comparing and hashing them is mostly a pointer comparison. Strings
+ * which aren't used by any program or global anymore are periodically
+ * dropped from the table, the rest is released when interning is disabled
+ * or the VM is freed.
+ */
+SPN_API void  spn_vm_setinterning(SpnVMachine *vm, int enabled);
+
+/* attaches a profile (see prof.h) to the virtual machine, which then
+ * collects data into it until another one (or NULL) is attached. The
+ * profile is not owned by the VM; it must be detached before it's freed.
+ */
+struct SpnProfile;
+
+SPN_API void  spn_vm_setprofile(SpnVMachine *vm, struct SpnProfile *prof);
+SPN_API struct SpnProfile *spn_vm_getprofile(SpnVMachine *vm);
+
+/* sets the cycle collector (see gc.h) that the virtual machine runs steps
+ * of, whenever enough possible roots have been buffered in it. It's NULL
+ * by default, in which case the VM leaves collection to the host.
+ */
+struct SpnGC;
+
+SPN_API void  spn_vm_setgc(SpnVMachine *vm, struct SpnGC *gc);
+
+/* Programs can't be shared between virtual machines, since the VM rewrites
+ * their bytecode (see Remark (XIII) below) and caches lookups in them.
+ * This function returns a copy of 'program', which 'src' must have already
+ * run, that can be run by 'dst' instead. The bytecode of the copy refers
+ * to globals through the same slots as that of the original, so the global
+ * slots of 'dst' are laid out like those of 'src', and from then on 'dst'
+ * doesn't allocate slots on its own anymore (globals it has no slot for
+ * are looked up by name). Returns NULL if this is not possible because
+ * 'dst' has already allocated slots differently. The copy has no debug
+ * information. Used by worker pools (see spn_ctx_pmap() in ctx.h).
+ */
+SPN_API SpnFunction *spn_vm_import_program(SpnVMachine *dst, SpnVMachine *src, SpnFunction *program);
+
 /* get and set context info (arbitrarily usable pointer) */
 SPN_API void *spn_vm_getcontext(SpnVMachine *vm);
 SPN_API void  spn_vm_setcontext(SpnVMachine *vm, void *ctx);
@@ -119,12 +236,14 @@ SPN_API const char *spn_vm_geterrmsg(SpnVMachine *vm);
 SPN_API void        spn_vm_seterrmsg(SpnVMachine *vm, const char *fmt, const void *args[]);
 
 /* returns an array of stack frame descriptors forming a symbolicated stack trace.
- * Return value must be free()'d when you're done with it.
+ * Return value must be free()'d when you're done with it. After a runtime
+ * error in a coroutine, the trace starts with the frames of the coroutine,
+ * followed by the call to the function which resumed it.
  */
 SPN_API SpnStackFrame *spn_vm_stacktrace(SpnVMachine *vm, size_t *size);
 
 /* returns the value of the register at index 'index' within
- * the stack frame represented by 'frame'.
+ * the stack frame represented by 'frame', whose 'sp' must not be NULL.
  */
 SPN_API SpnValue spn_vm_get_register(SpnStackFrame *frame, size_t index);
 
@@ -300,7 +419,30 @@ enum spn_vm_ins {
 	SPN_INS_LDUPVAL,  /* a = upvalues[b];                     */
 	SPN_INS_METHOD,   /* a = classes[b][c] (VIII)             */
 	SPN_INS_PROPGET,  /* a = classes[b].getter(b, c) (IX)     */
-	SPN_INS_PROPSET   /* classes[a].setter(a, b, c) (X)       */
+	SPN_INS_PROPSET,  /* classes[a].setter(a, b, c) (X)       */
+
+	/* quickened instructions (XI) */
+	SPN_INS_EQ_II,    /* a = b == c, integers only            */
+	SPN_INS_NE_II,    /* a = b != c, integers only            */
+	SPN_INS_LT_II,    /* a = b < c, integers only             */
+	SPN_INS_LE_II,    /* a = b <= c, integers only            */
+	SPN_INS_GT_II,    /* a = b > c, integers only             */
+	SPN_INS_GE_II,    /* a = b >= c, integers only            */
+	SPN_INS_ADD_II,   /* a = b + c, integers only             */
+	SPN_INS_SUB_II,   /* a = b - c, integers only             */
+	SPN_INS_MUL_II,   /* a = b * c, integers only             */
+	SPN_INS_DIV_II,   /* a = b / c, integers only             */
+	SPN_INS_INC_I,    /* ++a, integer only                    */
+	SPN_INS_DEC_I,    /* --a, integer only                    */
+	SPN_INS_LDGLB,    /* a = global slot[b] (XIII)            */
+	SPN_INS_CONCAT_ALL, /* a = concatenation of b values (XIV) */
+
+	/* superinstructions (XV) */
+	SPN_INS_CMPJZE,   /* jump unless b <a> c                  */
+	SPN_INS_CMPJNZ,   /* jump if b <a> c                      */
+	SPN_INS_CALLMETHOD, /* METHOD fused with the CALL after it */
+
+	SPN_INS_TAILCALL  /* a = b(...) in tail position (XVI)    */
 };
 
 /* Remarks:
@@ -376,7 +518,10 @@ enum spn_vm_ins {
  * The instruction reads the unbound function value from the specified
  * register, creates a closure function object from it, sets its upvalues,
  * then replaces the contents of the register (the original function object)
- * with the newly created closure.
+ * with the newly created closure. Upvalues are captured by value when the
+ * closure is created (captured variables cannot be assigned to from within
+ * the closure), so the i-th descriptor simply determines the i-th slot of
+ * the closure's fixed-size upvalue array, which SPN_INS_LDUPVAL indexes.
  *
  * (VIII): SPN_INS_METHOD looks up a method by name 'c' in the class
  * descriptor of object 'b'. The object may be an array (most commonly),
@@ -387,6 +532,74 @@ enum spn_vm_ins {
  *
  * (X): SPN_INS_PROPSET calls the property setter method of object 'a',
  * passing in the index/name 'b' and its new value 'c'.
+ *
+ * (XI): quickened instructions are never emitted by the compiler. When
+ * one of the generic comparison, arithmetic, increment or decrement
+ * instructions finds that all of its operands are integers, the virtual
+ * machine rewrites it in place to the corresponding specialized form,
+ * which skips the type dispatch of the generic one. If a specialized
+ * instruction later encounters an operand which is not an integer, it
+ * reverts itself to the generic form and is then re-executed as such.
+ * They are laid out in the same order as their generic counterparts
+ * (EQ...DIV, then INC and DEC), so that they can be converted into each
+ * other by simple arithmetic on the opcode.
+ *
+ * (XII): SPN_INS_METHOD, SPN_INS_PROPGET and SPN_INS_PROPSET are followed
+ * by one more 'spn_uword', the index of the inline cache of the instruction
+ * within the containing top-level program (see 'SpnMemberCache' in func.h).
+ * The cache remembers the result of the last member lookup along with the
+ * class descriptors (hashmaps) consulted while performing it, and their
+ * version numbers. The lookup is only repeated if the class of the receiver
+ * or the name of the member is different, or if any of those hashmaps
+ * (including the class table returned by spn_vm_getclasses() and the
+ * maps forming a 'super' chain) has been modified since.
+ *
+ * (XIII): SPN_INS_LDGLB is not emitted by the compiler either. When an
+ * SPN_INS_LDSYM instruction first loads a reference to a global, it looks
+ * up (or allocates) the global slot of the symbol in the virtual machine,
+ * then it rewrites itself into an SPN_INS_LDGLB instruction with the index
+ * of the slot in its (16-bit) operand B. The slots are updated whenever the
+ * virtual machine modifies a global (SPN_INS_GLBVAL, spn_vm_addlib_cfuncs(),
+ * spn_vm_addlib_values()), so that redefined globals, e. g. hot-swapped
+ * library functions, are seen immediately by already running code. If the
+ * table returned by spn_vm_getglobals() is modified directly, then all slots
+ * are re-read from it before the next load.
+ *
+ * (XIV): SPN_INS_CONCAT_ALL is emitted for chains of concatenations with
+ * more than two operands. Arguments: a: destination; b: number of operands.
+ * Each of the following 'b' words describes an operand: the low octet is
+ * its register index, the other bits are the rank of the concatenation in
+ * the source which the operand belongs to (as in SPN_MKINS_LONG()). If some
+ * operands aren't strings, the error is reported at the word of the one
+ * with the lowest rank, which the debug info maps to that concatenation.
+ * The length of the result is computed first, so it is allocated and
+ * filled in in one step.
+ *
+ * (XV): superinstructions are emitted by the compiler when optimizing
+ * (see 'enum spn_opt_level' in compiler.h) in place of common sequences
+ * of instructions, saving dispatches and intermediate registers.
+ *
+ * SPN_INS_CMPJZE and SPN_INS_CMPJNZ compare registers 'b' and 'c' using
+ * the comparison operator 'a', which is the opcode of the equivalent
+ * generic comparison instruction (one of SPN_INS_EQ...SPN_INS_GE). They
+ * are followed by a jump offset, just like SPN_INS_JZE and SPN_INS_JNZ
+ * are, and they jump if the comparison is false or true, respectively.
+ * The result of the comparison is not stored in any register.
+ *
+ * SPN_INS_CALLMETHOD has the same operands as SPN_INS_METHOD, including
+ * the inline cache index. It is always immediately followed by a complete
+ * SPN_INS_CALL (or SPN_INS_TAILCALL) instruction which calls the method
+ * just looked up; that is executed without going through the dispatch of
+ * the interpreter loop.
+ *
+ * (XVI): SPN_INS_TAILCALL has the same format as SPN_INS_CALL. The compiler
+ * emits it for 'return f(...)' when optimizing, and it is always followed
+ * by an SPN_INS_RET of its destination register 'a'. If the callee is a
+ * Sparkling function, then the frame of the caller is popped before that
+ * of the callee is pushed, and the callee returns directly to the caller's
+ * caller, so the RET is never executed; a chain of tail calls thus runs in
+ * constant stack space. Such a caller doesn't appear in stack traces. If
+ * the callee is a native function, it is called just like by SPN_INS_CALL.
  */
 
 #endif /* SPN_VM_H */